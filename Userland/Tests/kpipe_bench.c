@@ -0,0 +1,771 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Benchmark of the kernel record pipeline in userspace.
+ *
+ * trfs/trfs_ops.c, trfs_msgq.c and tr_fs.c are built unchanged against the
+ * kshim layer in Tests/kshim. Producer threads call the trfs_log_ops
+ * callbacks the way the VFS hooks do (open, writes, reads, close and a
+ * mkdir/unlink now and then) while the writer kthread drains the message
+ * queue into a tfile in /tmp. Once the producers are done the queue is
+ * drained and the segment closed in the order of an unmount. With -R the
+ * records go to a flight recorder ring of that many MB instead, which is
+ * dumped to the tfile at the end. -L sets the tracing level (count or
+ * sample:N) to time the hooks that only count. -q, -b and -B size the
+ * queue, the writer buffer and the writer batch like the tq_depth=,
+ * tbuf_size= and tbatch= mount options. -M remounts after that many ms
+ * the way mount -o remount does: the trace goes on in tfile.re with twice
+ * the queue and the buffer, and with -R the ring is turned off into it.
+ * -C, -N, -P and -W place the writer like tcpus=, tnice=, tprio= and twq.
+ * Writes go through a page cache of the lower file first, like they do
+ * under trfs, so that payloads beyond TRFS_WR_INLINE (-w) are taken by the
+ * writer from its pages. At the full level one write is first traced both
+ * ways, from the pages and inline: the two records must be the same byte
+ * for byte but for r_id, ts, addr and TRFS_WR_INEXACT, or the benchmark
+ * exits with 1.
+ *
+ * Reported are the ops, the records offered and the records in the footer
+ * of the tfile (the difference was lost in the queue), records/s, the kmalloc
+ * calls per record, for each mutex the acquisitions that had to wait
+ * and how long they waited, and last what trfs/pipeline in debugfs
+ * shows: the counters and histograms of the stages. The data records
+ * flood the queue and are shed first: a namespace record may not be lost
+ * more often than a file record, nor a file record more often than a
+ * data record. -T makes the file and namespace records wait that many ms
+ * for room like twait= does, then none of them may be lost at all. Either
+ * way the benchmark exits with 1 if they are.
+ *
+ *	$make bench
+ *	$./Tests/kpipe_bench [-t threads] [-n ops] [-w wsize] [-R mb]
+ *				[-L level] [-q depth] [-b bufsize]
+ *				[-B batch] [-M ms] [-C cpulist] [-N nice]
+ *				[-P prio] [-W] [-T ms] [-o tfile]
+ */
+
+#include "kshim/kshim.h"
+#include "../../trfs/tr_fs.h"
+#include "../../trfs/trfs_msgq.h"
+#include "../../trfs/trfs_ops.h"
+#include "../../trfs/trfs_stat.h"
+
+#define KPB_THREADS	4
+#define KPB_OPS		200000		/* callbacks per thread */
+#define KPB_WSIZE	64
+#define KPB_MAX_THREADS	256
+#define KPB_WRITES	4		/* writes per open file */
+#define KPB_MAX_WSIZE	(1 << 20)
+
+/** Global stucture for async writing, main.c has it in the module
+ */
+trfs_log_write tlw;
+
+trfs_mq_info_t *trfs_mq_get_node_by_id(trfsQid_t mqId);
+
+/** A producer thread, posing as a process with its own pid
+ */
+typedef struct kpb_thread_ {
+	pthread_t thread;
+	struct task_struct task;
+	int no;
+	unsigned long long nr_recs;
+	unsigned long long cpu_ns;	/* spent in the hooks and the loop */
+}kpb_thread;
+
+static struct trfs_log_driver *tld = NULL;
+static int nr_ops = KPB_OPS;
+static int wsize = KPB_WSIZE;
+
+/** Dumps the flight recorder to path the way IOCTL_TRFS_DUMP does
+ */
+static int kpb_dump(const char *path)
+{
+	int ret;
+	struct file *filp = NULL;
+
+	filp = filp_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+	ret = trfs_ring_dump(filp);
+	filp_close(filp, NULL);
+	return ret;
+}
+
+/** CPU time of the calling thread in ns
+ */
+static unsigned long long kpb_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/** Does what the lower write does: puts the count bytes of buf at *pos in
+ * the page cache and moves *pos past them
+ */
+static void kpb_lower_write(struct address_space *mapping, const char *buf,
+						size_t count, loff_t *pos)
+{
+	size_t n;
+	unsigned int off;
+	struct page *page = NULL;
+
+	while (count > 0) {
+		page = mapping->pages[*pos >> PAGE_SHIFT];
+		off = offset_in_page(*pos);
+		n = min_t(size_t, count, PAGE_SIZE-off);
+		memcpy(page->virt+off, buf, n);
+		buf += n;
+		count -= n;
+		*pos += n;
+	}
+}
+
+/** A page cache of nr_pages pages
+ */
+static int kpb_mapping_init(struct address_space *mapping, pgoff_t nr_pages)
+{
+	pgoff_t i;
+
+	mapping->nr_pages = 0;
+	mapping->pages = (struct page **)calloc(nr_pages,
+						sizeof(struct page *));
+	if (!mapping->pages)
+		return -ENOMEM;
+	for (i = 0; i < nr_pages; i++) {
+		mapping->pages[i] = kshim_page_alloc();
+		if (!mapping->pages[i])
+			return -ENOMEM;
+		mapping->nr_pages++;
+	}
+	return 0;
+}
+
+/** Drops the pages from the page cache, those the writer still holds
+ * are freed by it
+ */
+static void kpb_mapping_exit(struct address_space *mapping)
+{
+	pgoff_t i;
+
+	for (i = 0; i < mapping->nr_pages; i++)
+		put_page(mapping->pages[i]);
+	free(mapping->pages);
+}
+
+/** Calls the trace callbacks for nr_ops operations: each file is opened,
+ * written, read and closed, every 16th file is renamed, unlinked and a
+ * directory made for it, and every 256th the directory of the thread is
+ * renamed. Dentries are referenced like in the dcache, the
+ * last reference frees them.
+ */
+static void *kpb_producer(void *arg)
+{
+	kpb_thread *th = (kpb_thread *)arg;
+	int i = 0, f = 0, w;
+	char path[64];
+	char *buf = NULL;
+	loff_t pos = 0;
+	unsigned long long cpu_ns;
+	u64 t0, t1;
+	struct dentry *dir = NULL, *dentry = NULL, *new_dentry = NULL;
+	struct address_space mapping;
+	struct file file, lower_file;
+
+	kshim_current = &th->task;
+	buf = (char *)malloc(wsize);
+	snprintf(path, sizeof(path), "/kpipe/t%d", th->no);
+	dir = kshim_d_alloc(path);
+	if (!buf || !dir ||
+	    kpb_mapping_init(&mapping, KPB_WRITES*wsize/PAGE_SIZE+2) < 0)
+		return NULL;
+	memset(buf, 'a'+th->no%26, wsize);
+
+	memset(&lower_file, 0, sizeof(struct file));
+	lower_file.f_mapping = &mapping;
+	memset(&file, 0, sizeof(struct file));
+	file.f_flags = O_RDWR|O_CREAT;
+	file.f_mode = FMODE_READ|FMODE_WRITE;
+	file.f_lower = &lower_file;
+
+	cpu_ns = kpb_cpu_ns();
+	while (i < nr_ops) {
+		snprintf(path, sizeof(path), "/kpipe/t%d/f%d", th->no, f++);
+		dentry = kshim_d_alloc(path);
+		if (!dentry)
+			break;
+		dentry->d_parent = dir;
+		file.f_path.dentry = dentry;
+		pos = 0;
+
+		tld->ops->trace_open_op(tld, NULL, &file, 0);
+		for (w = 0; w < KPB_WRITES; w++) {
+			t0 = ktime_get_ns();
+			trfs_wr_begin(&lower_file);
+			kpb_lower_write(&mapping, buf, wsize, &pos);
+			trfs_wr_end(&lower_file);
+			t1 = ktime_get_ns();
+			trfs_stat_hist(TRFS_HI_LOWER_WRITE, t1-t0);
+			trfs_stat_add(TRFS_ST_LOWER_WRITES, 1);
+			trfs_stat_add(TRFS_ST_LOWER_BYTES, wsize);
+			tld->ops->trace_write_op(tld, &file, buf, wsize,
+								&pos, wsize);
+			trfs_stat_hist(TRFS_HI_WRITE_HOOK, ktime_get_ns()-t1);
+		}
+		tld->ops->trace_read_op(tld, &file, wsize, &pos, wsize);
+		tld->ops->trace_close_op(tld, NULL, &file, 0);
+		i += KPB_WRITES+3;
+		if (f%16 == 0) {
+			snprintf(path, sizeof(path), "/kpipe/t%d/f%d.r",
+								th->no, f);
+			new_dentry = kshim_d_alloc(path);
+			if (new_dentry) {
+				new_dentry->d_parent = dir;
+				tld->ops->trace_rename_op(tld, NULL, dentry,
+							NULL, new_dentry, 0);
+				dput(new_dentry);
+				i++;
+			}
+			tld->ops->trace_unlink_op(tld, NULL, dentry, 0);
+			tld->ops->trace_mkdir_op(tld, NULL, dentry, 0755, 0);
+			i += 2;
+		}
+		/* Like trfs_rename() before the directory is moved */
+		if (f%256 == 0)
+			trfs_log_rename_dir(dir);
+		dput(dentry);
+	}
+	th->cpu_ns = kpb_cpu_ns()-cpu_ns;
+	th->nr_recs = i;
+	kpb_mapping_exit(&mapping);
+	dput(dir);
+	free(buf);
+	return NULL;
+}
+
+/* The same write traced twice: its payload taken by the writer from the
+ * lower page cache, and copied by the hook from a lower file without
+ * pages. The two records must only differ in r_id, ts and addr. */
+#define KPB_CHECK_COUNT	(TRFS_WR_INLINE*2)
+
+static struct file kpb_chk_file[2], kpb_chk_lower[2];
+
+static void kpb_check_write(void)
+{
+	int i;
+	char buf[KPB_CHECK_COUNT];
+	loff_t pos;
+	struct task_struct task;
+	struct dentry *dentry = NULL;
+	struct address_space mapping[2];
+
+	memset(&task, 0, sizeof(struct task_struct));
+	task.pid = 999;
+	kshim_current = &task;
+	dentry = kshim_d_alloc("/kpipe/check");
+	if (!dentry || kpb_mapping_init(&mapping[0], 1) < 0)
+		return;
+	mapping[1].pages = NULL;
+	mapping[1].nr_pages = 0;
+	for (i = 0; i < KPB_CHECK_COUNT; i++)
+		buf[i] = 'A'+i%26;
+
+	for (i = 0; i < 2; i++) {
+		kpb_chk_lower[i].f_mapping = &mapping[i];
+		kpb_chk_file[i].f_flags = O_RDWR;
+		kpb_chk_file[i].f_mode = FMODE_READ|FMODE_WRITE;
+		kpb_chk_file[i].f_path.dentry = dentry;
+		kpb_chk_file[i].f_lower = &kpb_chk_lower[i];
+		pos = 0;
+		if (i == 0)
+			kpb_lower_write(&mapping[0], buf, sizeof(buf), &pos);
+		else
+			pos = sizeof(buf);
+		tld->ops->trace_write_op(tld, &kpb_chk_file[i], buf,
+					sizeof(buf), &pos, sizeof(buf));
+	}
+	kpb_mapping_exit(&mapping[0]);
+	dput(dentry);
+	kshim_current = NULL;
+}
+
+/** Finds the two records of kpb_check_write() in the tfile and compares
+ * them. Returns 1 if they differ.
+ */
+static int kpb_check_cmp(const char *path)
+{
+	int i, n = 0;
+	int ret = -EINVAL;
+	off_t off = 0;
+	unsigned short size, wflags;
+	uint64_t addr;
+	char hdr[sizeof(unsigned int)+sizeof(unsigned short)+1];
+	char *rec[2] = { NULL, NULL };
+	unsigned short rsize[2] = { 0, 0 };
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -errno;
+	while (n < 2 && pread(fd, hdr, sizeof(hdr), off) == sizeof(hdr)) {
+		memcpy(&size, hdr+sizeof(unsigned int), sizeof(size));
+		if (size < sizeof(hdr))
+			break;
+		if (hdr[sizeof(unsigned int)+sizeof(size)] == TRFS_OP_WRITE &&
+		    size >= offsetof(trfs_write_op, pathname)) {
+			char *r = (char *)malloc(size);
+
+			if (!r || pread(fd, r, size, off) != size) {
+				free(r);
+				break;
+			}
+			memcpy(&addr, r+offsetof(trfs_write_op, addr),
+							sizeof(addr));
+			for (i = 0; i < 2; i++)
+				if (addr == (uint64_t)(unsigned long)
+							&kpb_chk_file[i])
+					break;
+			if (i < 2 && !rec[i]) {
+				/* What may differ between the two */
+				memset(r, 0, sizeof(unsigned int));
+				memset(r+offsetof(trfs_write_op, ts), 0,
+							sizeof(uint64_t));
+				memset(r+offsetof(trfs_write_op, addr), 0,
+							sizeof(uint64_t));
+				/* A write to a file of the same hash
+				 * bucket marks it inexact until flushed */
+				memcpy(&wflags, r+offsetof(trfs_write_op,
+						wflags), sizeof(wflags));
+				wflags &= ~TRFS_WR_INEXACT;
+				memcpy(r+offsetof(trfs_write_op, wflags),
+						&wflags, sizeof(wflags));
+				rec[i] = r;
+				rsize[i] = size;
+				n++;
+			}
+			else
+				free(r);
+		}
+		off += size;
+	}
+	close(fd);
+	if (n == 2)
+		ret = rsize[0] != rsize[1] ||
+			memcmp(rec[0], rec[1], rsize[0]) != 0;
+	free(rec[0]);
+	free(rec[1]);
+	return ret;
+}
+
+/** Waits until the queue is empty and the writer asleep on it, or its
+ * work not running, so that the last record it took is in the page
+ */
+static void kpb_drain(void)
+{
+	int idle = 0;
+	trfs_mq_info_t *node = trfs_mq_get_node_by_id(TRFS_LOG_QID);
+
+	while (!idle) {
+		pthread_mutex_lock(&node->wq.m);
+		idle = node->attr.counter == 0 && (tlw.wq ||
+						node->wq.nr_sleeping > 0);
+		pthread_mutex_unlock(&node->wq.m);
+		if (idle && tlw.wq)
+			idle = !(kshim_delayed_work_busy(&tlw.work) &
+							WORK_BUSY_RUNNING);
+		if (!idle)
+			usleep(100);
+	}
+}
+
+/** Switches to re with twice the queue and the buffer, and off the ring
+ */
+static int kpb_remount(const char *re, int depth, int buf_size)
+{
+	int ret;
+	unsigned int what = TRFS_CONF_TFILE|TRFS_CONF_DEPTH|TRFS_CONF_BUF;
+	trfs_log_write t;
+
+	memset(&t, 0, sizeof(trfs_log_write));
+	t.tfile_name = kasprintf(GFP_KERNEL, "%s", re);
+	t.q_depth = depth*2;
+	t.page_cap = buf_size*2;
+	if (tlw.ring)
+		what |= TRFS_CONF_RING;
+	ret = trfs_log_write_reconf(&t, what);
+	if (ret < 0)
+		kfree(t.tfile_name);
+	return ret;
+}
+
+/** Reads the footer back from the end of the tfile
+ */
+static int kpb_footer(const char *path, trfs_seg_ftr *ftr)
+{
+	int fd;
+	int ret = 0;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(trfs_seg_ftr) ||
+	    pread(fd, ftr, sizeof(trfs_seg_ftr), st.st_size-
+			sizeof(trfs_seg_ftr)) != sizeof(trfs_seg_ftr) ||
+	    ftr->r_type != TRFS_REC_SEG_FTR || ftr->magic != TRFS_TRACE_MAGIC)
+		ret = -EINVAL;
+	close(fd);
+	return ret;
+}
+
+static void kpb_lock(const char *name, struct mutex *lock)
+{
+	printf("  %-10s %12llu locks %12llu waited (%5.2f%%) %10.3f ms\n",
+		name, lock->nr_lock, lock->nr_contended,
+		lock->nr_lock ? 100.0*lock->nr_contended/lock->nr_lock : 0.0,
+		lock->wait_ns/1e6);
+}
+
+/** Parses a cpulist like 0-1,6 the way cpulist_parse() does
+ */
+static int kpb_cpulist(const char *list, struct cpumask *cpus)
+{
+	int a, b, n;
+
+	cpumask_clear(cpus);
+	while (*list) {
+		if (sscanf(list, "%d%n", &a, &n) != 1 || a < 0)
+			return -EINVAL;
+		list += n;
+		b = a;
+		if (*list == '-' &&
+		    (sscanf(list+1, "%d%n", &b, &n) != 1 || b < a))
+			return -EINVAL;
+		if (*list == '-')
+			list += n+1;
+		if (b >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; a <= b; a++)
+			CPU_SET(a, &cpus->bits);
+		if (*list == ',')
+			list++;
+		else if (*list)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static void kpb_usage(void)
+{
+	printf("Usage: kpipe_bench [-t threads] [-n ops] [-w wsize] [-R mb] \
+[-L count|sample:N]\n\t\t[-q depth] [-b bufsize] [-B batch] [-M ms] \
+[-C cpulist] [-N nice]\n\t\t[-P prio] [-W] [-T ms] [-o tfile]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int choice;
+	int ret = 0;
+	int nr_threads = KPB_THREADS;
+	int ring_mb = 0;
+	int depth = TRFS_MQ_DEFAULT_MSGS;
+	int buf_size = TRFS_PAGE_SIZE;
+	int batch = TRFS_LOG_BATCH;
+	int remount_ms = 0;
+	int send_ms = 0;
+	int level = TRFS_LEVEL_FULL;
+	unsigned int sample = 0;
+	trfs_trigger trig;
+	char tfile[64];
+	char re[80];
+	const char *out = NULL;
+	long long start, produced, drained, dumped = 0;
+	long long remounted = 0;
+	unsigned long long nr_written = 0, bytes_written = 0;
+	unsigned long long nr_overwritten = 0;
+	unsigned long long trig_traced = 0;
+	unsigned long long nr_recs = 0;
+	unsigned long long cpu_ns = 0;
+	unsigned int nr_dropped[TRFS_MQ_NR_PRI];
+	double lost[TRFS_MQ_NR_PRI];
+	unsigned long nr_put;
+	char *cpulist = NULL;
+	trfs_sched sched;
+	kpb_thread *th = NULL;
+	trfs_log_write t;
+	trfs_seg_ftr ftr;
+	struct seq_file seq;
+	char *report = NULL;
+	size_t report_len = 0;
+	int chk;
+
+	memset(&sched, 0, sizeof(trfs_sched));
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "t:n:w:R:L:q:b:B:M:C:N:P:WT:o:"))
+								!= -1) {
+		switch (choice) {
+			case 't':
+				nr_threads = atoi(optarg);
+				break;
+			case 'n':
+				nr_ops = atoi(optarg);
+				break;
+			case 'w':
+				wsize = atoi(optarg);
+				break;
+			case 'L':
+				if (strcmp(optarg, "count") == 0)
+					level = TRFS_LEVEL_COUNT;
+				else if (strncmp(optarg, "sample:", 7) == 0) {
+					level = TRFS_LEVEL_SAMPLE;
+					sample = atoi(optarg+7);
+				}
+				break;
+			case 'R':
+				ring_mb = atoi(optarg);
+				break;
+			case 'q':
+				depth = atoi(optarg);
+				break;
+			case 'b':
+				buf_size = atoi(optarg);
+				break;
+			case 'B':
+				batch = atoi(optarg);
+				break;
+			case 'M':
+				remount_ms = atoi(optarg);
+				break;
+			case 'C':
+				cpulist = optarg;
+				if (kpb_cpulist(optarg, &sched.cpus) < 0) {
+					kpb_usage();
+					return -EINVAL;
+				}
+				break;
+			case 'N':
+				sched.nice = atoi(optarg);
+				break;
+			case 'P':
+				sched.rt_prio = atoi(optarg);
+				break;
+			case 'W':
+				sched.use_wq = 1;
+				break;
+			case 'T':
+				send_ms = atoi(optarg);
+				break;
+			case 'o':
+				out = optarg;
+				break;
+			default:
+				kpb_usage();
+				return -EINVAL;
+		}
+	}
+	if (nr_threads <= 0 || nr_threads > KPB_MAX_THREADS ||
+	    nr_ops <= 0 || wsize <= 0 || wsize > KPB_MAX_WSIZE ||
+	    ring_mb < 0 || depth < 8 || buf_size < TRFS_PAGE_SIZE ||
+	    batch <= 0 || remount_ms < 0 || send_ms < 0 ||
+	    send_ms > TRFS_MQ_SEND_MS || sched.nice < -20 ||
+	    sched.nice > 19 || sched.rt_prio < 0 ||
+	    sched.rt_prio >= MAX_RT_PRIO) {
+		kpb_usage();
+		return -EINVAL;
+	}
+	if (!out) {
+		snprintf(tfile, sizeof(tfile), "/tmp/kpipe_bench.%d.tfile",
+								getpid());
+		out = tfile;
+	}
+	snprintf(re, sizeof(re), "%s.re", out);
+
+	th = (kpb_thread *)calloc(nr_threads, sizeof(kpb_thread));
+	if (!th)
+		return -ENOMEM;
+
+	/* What the module does at mount */
+	memset(&t, 0, sizeof(trfs_log_write));
+	t.tfile_name = kasprintf(GFP_KERNEL, "%s", out);
+	t.ring_size = (size_t)ring_mb << 20;
+	t.page_cap = buf_size;
+	t.batch = batch;
+	t.q_depth = depth;
+	t.flush_ms = TRFS_MQ_FLUSH_MS;
+	t.send_ms = send_ms;
+	if (trfs_create_log_q(depth, TRFS_MQ_FLUSH_MS) < 0 ||
+	    trfs_stat_init() < 0 || trfs_log_write_init(&t) < 0) {
+		printf("Creating %s: Failed\n", out);
+		ret = -EIO;
+		goto out;
+	}
+	tld = trfs_log_driver_init();
+	memset(&trig, 0, sizeof(trfs_trigger));
+	if (tld && trfs_trigger_set(tld, level, sample, &trig) < 0) {
+		kpb_usage();
+		ret = -EINVAL;
+		goto out;
+	}
+	if (!tld || trfs_writer_start(&sched) < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (level == TRFS_LEVEL_FULL)
+		kpb_check_write();
+	start = kshim_now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		th[i].no = i;
+		th[i].task.pid = 1000+i;
+		pthread_create(&th[i].thread, NULL, kpb_producer, &th[i]);
+	}
+	if (remount_ms) {
+		usleep(remount_ms*1000);
+		remounted = kshim_now_ns();
+		if (kpb_remount(re, depth, buf_size) < 0)
+			printf("Remounting to %s: Failed\n", re);
+		remounted = kshim_now_ns()-remounted;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(th[i].thread, NULL);
+		nr_recs += th[i].nr_recs;
+		cpu_ns += th[i].cpu_ns;
+	}
+	produced = kshim_now_ns();
+
+	/* What the module does at unmount, then the writer is stopped */
+	kpb_drain();
+	drained = kshim_now_ns();
+	if (tlw.ring) {
+		nr_overwritten = tlw.ring->nr_lost;
+		if (kpb_dump(out) < 0) {
+			printf("Dumping the ring to %s: Failed\n", out);
+			ret = -EIO;
+			goto out;
+		}
+		dumped = kshim_now_ns();
+	}
+	trfs_writer_stop();
+	trfs_log_write_flush();
+	trfs_log_write_close();
+	for (i = 0; i < TRFS_MQ_NR_PRI; i++) {
+		nr_dropped[i] = trfs_mq_dropped(TRFS_LOG_QID, i);
+		nr_put = trfs_mq_class_puts(TRFS_LOG_QID, i);
+		lost[i] = nr_dropped[i] ?
+			(double)nr_dropped[i]/(nr_dropped[i]+nr_put) : 0;
+	}
+	/* Read like the debugfs file, while the queue is still there */
+	seq.fp = open_memstream(&report, &report_len);
+	if (seq.fp) {
+		trfs_stat_show(&seq, NULL);
+		fclose(seq.fp);
+	}
+	trfs_delete_log_q();
+	trfs_stat_exit();
+	trig_traced = atomic64_read(&tld->nr_traced);
+	trfs_log_driver_exit(tld);
+	tld = NULL;
+
+	/* Off the ring, the trace is only in the tfile of the remount */
+	if (!(remount_ms && ring_mb)) {
+		if (kpb_footer(out, &ftr) < 0) {
+			printf("Reading the footer of %s: Failed\n", out);
+			ret = -EINVAL;
+			goto out;
+		}
+		nr_written += ftr.nr_recs;
+		bytes_written += ftr.nr_bytes;
+	}
+	if (remount_ms) {
+		if (kpb_footer(re, &ftr) < 0) {
+			printf("Reading the footer of %s: Failed\n", re);
+			ret = -EINVAL;
+			goto out;
+		}
+		nr_written += ftr.nr_recs;
+		bytes_written += ftr.nr_bytes;
+	}
+
+	printf("threads %d, write size %d, level %s, queue %d, buffer %d, \
+batch %d\n", nr_threads, wsize,
+		level == TRFS_LEVEL_FULL ? "full" :
+		level == TRFS_LEVEL_COUNT ? "count" : "sampled",
+		depth, buf_size, batch);
+	printf("ops              %12llu  %10.0f/s\n", nr_recs,
+					nr_recs*1e9/(produced-start));
+	printf("records offered  %12llu\n", (unsigned long long)trig_traced);
+	printf("records written  %12llu  %10.0f/s  %.1f MB/s\n",
+		nr_written, nr_written*1e9/(drained-start),
+		bytes_written/1e6*1e9/(drained-start));
+	printf("records lost     %12llu\n", trig_traced-nr_written);
+	printf("  data/file/ns   %12u %u %u\n",
+		nr_dropped[TRFS_MQ_PRI_DATA], nr_dropped[TRFS_MQ_PRI_FILE],
+		nr_dropped[TRFS_MQ_PRI_NS]);
+	if (send_ms && (nr_dropped[TRFS_MQ_PRI_FILE] > 0 ||
+	    nr_dropped[TRFS_MQ_PRI_NS] > 0)) {
+		printf("  file or namespace records dropped  FAILED\n");
+		ret = 1;
+	} else if (lost[TRFS_MQ_PRI_NS] > lost[TRFS_MQ_PRI_FILE] ||
+		   lost[TRFS_MQ_PRI_FILE] > lost[TRFS_MQ_PRI_DATA]) {
+		printf("  file or namespace records dropped before data  \
+FAILED\n");
+		ret = 1;
+	}
+	/* The records of the check are in the first tfile */
+	if (level == TRFS_LEVEL_FULL && !ring_mb) {
+		chk = kpb_check_cmp(out);
+		printf("write records    %12s  inline and from the page cache\n",
+			chk == 0 ? "identical" : chk > 0 ? "differ" : "missing");
+		if (chk != 0) {
+			printf("  write records differ  FAILED\n");
+			ret = 1;
+		}
+	}
+	if (remount_ms)
+		printf("remount          %12.3f ms\n", remounted/1e6);
+	printf("writer           %12s  cpus %s, %s %d\n",
+		sched.use_wq ? "workqueue" : "kthread",
+		cpulist ? cpulist : "any", sched.rt_prio ? "fifo" : "nice",
+		sched.rt_prio ? sched.rt_prio : sched.nice);
+	if (ring_mb && !remount_ms)
+		printf("ring of %d MB     %12llu overwritten, dumped in %.3f ms\n",
+			ring_mb, nr_overwritten, (dumped-drained)/1e6);
+	printf("hooks            %12.0f ns per op, CPU of the callers\n",
+		(double)cpu_ns/nr_recs);
+	printf("kmalloc          %12llu  %.2f per record, %llu bytes\n",
+		kshim_stats.nr_kmalloc, (double)kshim_stats.nr_kmalloc/nr_recs,
+		kshim_stats.kmalloc_bytes);
+	printf("  __getname      %12llu\n", kshim_stats.nr_getname);
+	printf("  not freed      %12llu\n",
+		kshim_stats.nr_kmalloc-kshim_stats.nr_kfree);
+	printf("dget             %12llu  %llu not put\n", kshim_stats.nr_dget,
+		kshim_stats.nr_dget-kshim_stats.nr_dput);
+	printf("page refs        %12llu  %llu not put\n",
+		kshim_stats.nr_page_get,
+		kshim_stats.nr_page_get-kshim_stats.nr_page_put);
+	printf("vfs_write        %12llu  %llu bytes\n",
+		kshim_stats.nr_vfs_write, kshim_stats.vfs_write_bytes);
+	printf("wait queue       %12llu wake ups %12llu sleeps\n",
+		kshim_stats.nr_wakeups, kshim_stats.nr_sleeps);
+	printf("mutexes\n");
+	kpb_lock("q_lock", &tlw.q_lock);
+	kpb_lock("page_lock", &tlw.page_lock);
+	if (report)
+		printf("pipeline\n%s", report);
+out:
+	trfs_log_driver_exit(tld);
+	trfs_delete_log_q();
+	trfs_stat_exit();
+	free(report);
+	if (out == tfile) {
+		unlink(tfile);
+		unlink(re);
+	}
+	free(th);
+	return ret;
+}
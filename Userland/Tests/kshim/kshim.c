@@ -0,0 +1,672 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "kshim.h"
+
+#include <stdarg.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+kshim_stats_t kshim_stats;
+
+__thread struct task_struct *kshim_current = NULL;
+
+long long kshim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+uint64_t ktime_get_real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+void *kmalloc(size_t size, int flags)
+{
+	kshim_inc(kshim_stats.nr_kmalloc, 1);
+	kshim_inc(kshim_stats.kmalloc_bytes, size);
+	return malloc(size);
+}
+
+void *kzalloc(size_t size, int flags)
+{
+	void *p = kmalloc(size, flags);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+void kfree(const void *p)
+{
+	if (!p)
+		return;
+	kshim_inc(kshim_stats.nr_kfree, 1);
+	free((void *)p);
+}
+
+char *kasprintf(int flags, const char *fmt, ...)
+{
+	int len;
+	char *s = NULL;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	s = (char *)kmalloc(len+1, flags);
+	if (!s)
+		return NULL;
+	va_start(ap, fmt);
+	vsnprintf(s, len+1, fmt, ap);
+	va_end(ap);
+	return s;
+}
+
+void mutex_init(struct mutex *lock)
+{
+	memset(lock, 0, sizeof(struct mutex));
+	pthread_mutex_init(&lock->m, NULL);
+}
+
+/** Tries the mutex first so that only the acquisitions that had to wait
+ * are timed
+ */
+void mutex_lock(struct mutex *lock)
+{
+	long long start;
+
+	if (pthread_mutex_trylock(&lock->m) == 0) {
+		lock->nr_lock++;
+		return;
+	}
+	start = kshim_now_ns();
+	pthread_mutex_lock(&lock->m);
+	lock->nr_lock++;
+	lock->nr_contended++;
+	lock->wait_ns += kshim_now_ns()-start;
+}
+
+void mutex_unlock(struct mutex *lock)
+{
+	pthread_mutex_unlock(&lock->m);
+}
+
+void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->m, NULL);
+	pthread_cond_init(&wq->c, NULL);
+	wq->nr_sleeping = 0;
+}
+
+/** The waker takes the queue lock, so a waiter that has checked its
+ * condition under it can't miss the wake up
+ */
+void wake_up_interruptible(wait_queue_head_t *wq)
+{
+	kshim_inc(kshim_stats.nr_wakeups, 1);
+	pthread_mutex_lock(&wq->m);
+	pthread_cond_broadcast(&wq->c);
+	pthread_mutex_unlock(&wq->m);
+}
+
+/** Sleeps on the queue until woken up or until deadline_ns of
+ * kshim_now_ns(), 0 for no deadline. Called with the queue lock held.
+ */
+int kshim_wait(wait_queue_head_t *wq, long long deadline_ns)
+{
+	int ret;
+	long long left;
+	struct timespec ts;
+
+	kshim_inc(kshim_stats.nr_sleeps, 1);
+	wq->nr_sleeping++;
+	if (!deadline_ns) {
+		ret = pthread_cond_wait(&wq->c, &wq->m);
+		goto out;
+	}
+	left = deadline_ns-kshim_now_ns();
+	if (left <= 0) {
+		ret = ETIMEDOUT;
+		goto out;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	left += ts.tv_nsec;
+	ts.tv_sec += left/1000000000LL;
+	ts.tv_nsec = left%1000000000LL;
+	ret = pthread_cond_timedwait(&wq->c, &wq->m, &ts);
+out:
+	wq->nr_sleeping--;
+	return ret;
+}
+
+struct task_struct *kthread_create(int (*fn)(void *), void *data,
+						const char *namefmt, ...)
+{
+	va_list ap;
+	struct task_struct *t = NULL;
+
+	t = (struct task_struct *)calloc(1, sizeof(struct task_struct));
+	if (!t)
+		return ERR_PTR(-ENOMEM);
+	va_start(ap, namefmt);
+	vsnprintf(t->comm, sizeof(t->comm), namefmt, ap);
+	va_end(ap);
+	t->fn = fn;
+	t->data = data;
+	t->pid = getpid();
+	t->policy = SCHED_NORMAL;
+	return t;
+}
+
+/** Puts the running thread of t where t says, errors as -errno
+ */
+static int kshim_task_place(struct task_struct *t)
+{
+	int err;
+	struct sched_param param;
+
+	if (!cpumask_empty(&t->cpus)) {
+		err = pthread_setaffinity_np(t->thread, sizeof(cpu_set_t),
+							&t->cpus.bits);
+		if (err)
+			return -err;
+	}
+	param.sched_priority = t->rt_prio;
+	err = pthread_setschedparam(t->thread, t->policy, &param);
+	if (err)
+		return -err;
+	if (t->policy == SCHED_NORMAL &&
+	    setpriority(PRIO_PROCESS, t->tid, t->nice) < 0)
+		return -errno;
+	return 0;
+}
+
+static void *kshim_kthread(void *arg)
+{
+	int err;
+	struct task_struct *t = (struct task_struct *)arg;
+
+	kshim_current = t;
+	t->tid = syscall(SYS_gettid);
+	err = kshim_task_place(t);
+	if (err < 0)
+		printk("kshim: %d placing the thread\n", err);
+	t->ret = t->fn(t->data);
+	return NULL;
+}
+
+int wake_up_process(struct task_struct *t)
+{
+	t->started = pthread_create(&t->thread, NULL, kshim_kthread, t) == 0;
+	return t->started;
+}
+
+/** Waits for the thread function to return, nothing asks it to stop:
+ * the callers of the shim stop their threads through the message queue.
+ * A thread that was never woken up is only freed.
+ */
+int kthread_stop(struct task_struct *t)
+{
+	int ret = -EINTR;
+
+	if (t->started) {
+		pthread_join(t->thread, NULL);
+		ret = t->ret;
+	}
+	free(t);
+	return ret;
+}
+
+int cpumask_first(const struct cpumask *m)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &m->bits))
+			break;
+	return cpu;
+}
+
+static struct cpumask kshim_online;
+
+/** All the CPUs the process may run on */
+const struct cpumask *cpu_online_mask = &kshim_online;
+
+int cpumask_first_and(const struct cpumask *a, const struct cpumask *b)
+{
+	int cpu;
+
+	if (CPU_COUNT(&kshim_online.bits) == 0)
+		sched_getaffinity(0, sizeof(cpu_set_t), &kshim_online.bits);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &a->bits) && CPU_ISSET(cpu, &b->bits))
+			break;
+	return cpu;
+}
+
+int set_cpus_allowed_ptr(struct task_struct *t, const struct cpumask *m)
+{
+	t->cpus = *m;
+	return t->started ? kshim_task_place(t) : 0;
+}
+
+void set_user_nice(struct task_struct *t, long nice)
+{
+	t->nice = nice;
+	if (t->started)
+		kshim_task_place(t);
+}
+
+int sched_setscheduler_nocheck(struct task_struct *t, int policy,
+					const struct sched_param *param)
+{
+	t->policy = policy;
+	t->rt_prio = param->sched_priority;
+	return t->started ? kshim_task_place(t) : 0;
+}
+
+static void *kshim_worker(void *arg)
+{
+	cpu_set_t cpus;
+	long long now;
+	struct timespec ts;
+	struct delayed_work *w, *due;
+	struct workqueue_struct *wq = (struct workqueue_struct *)arg;
+
+	if (wq->flags & WQ_HIGHPRI)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), -20);
+	pthread_mutex_lock(&wq->m);
+	for (;;) {
+		due = NULL;
+		for (w = wq->works; w; w = w->next)
+			if (w->pending && (!due || w->due < due->due))
+				due = w;
+		if (!due && wq->stop)
+			break;
+		now = kshim_now_ns();
+		if (!due || due->due > now) {
+			if (!due) {
+				pthread_cond_wait(&wq->c, &wq->m);
+				continue;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += (due->due-now)/1000000000LL;
+			ts.tv_nsec += (due->due-now)%1000000000LL;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&wq->c, &wq->m, &ts);
+			continue;
+		}
+		due->pending = 0;
+		wq->running = due;
+		pthread_mutex_unlock(&wq->m);
+		if (due->cpu != WORK_CPU_UNBOUND) {
+			CPU_ZERO(&cpus);
+			CPU_SET(due->cpu, &cpus);
+			pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+									&cpus);
+		}
+		due->work.func(&due->work);
+		pthread_mutex_lock(&wq->m);
+		wq->running = NULL;
+		pthread_cond_broadcast(&wq->c);
+	}
+	pthread_mutex_unlock(&wq->m);
+	return NULL;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+							int max_active, ...)
+{
+	pthread_condattr_t attr;
+	struct workqueue_struct *wq;
+
+	wq = (struct workqueue_struct *)calloc(1,
+					sizeof(struct workqueue_struct));
+	if (!wq)
+		return NULL;
+	wq->flags = flags;
+	pthread_mutex_init(&wq->m, NULL);
+	/* The due times are of CLOCK_MONOTONIC */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wq->c, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&wq->thread, NULL, kshim_worker, wq) != 0) {
+		free(wq);
+		return NULL;
+	}
+	return wq;
+}
+
+/** Queues dwork on wq in delay jiffies, or sooner if mod and it was due
+ * later. Returns whether it was pending.
+ */
+static bool kshim_queue_work(int cpu, struct workqueue_struct *wq,
+		struct delayed_work *dwork, unsigned long delay, int mod)
+{
+	int pending;
+	long long due = kshim_now_ns()+delay*(1000000000LL/HZ);
+	struct delayed_work *w;
+
+	pthread_mutex_lock(&wq->m);
+	for (w = wq->works; w && w != dwork; w = w->next)
+		;
+	if (!w) {
+		dwork->next = wq->works;
+		wq->works = dwork;
+		dwork->pending = 0;
+	}
+	dwork->wq = wq;
+	pending = dwork->pending;
+	if (!pending || mod) {
+		dwork->due = due;
+		dwork->cpu = cpu;
+		dwork->pending = 1;
+		pthread_cond_broadcast(&wq->c);
+	}
+	pthread_mutex_unlock(&wq->m);
+	return pending;
+}
+
+bool queue_delayed_work_on(int cpu, struct workqueue_struct *wq,
+			struct delayed_work *dwork, unsigned long delay)
+{
+	return !kshim_queue_work(cpu, wq, dwork, delay, 0);
+}
+
+bool mod_delayed_work_on(int cpu, struct workqueue_struct *wq,
+			struct delayed_work *dwork, unsigned long delay)
+{
+	return kshim_queue_work(cpu, wq, dwork, delay, 1);
+}
+
+/** Runs a pending dwork at once and waits for it, or for the run going on
+ */
+bool flush_delayed_work(struct delayed_work *dwork)
+{
+	int busy;
+	struct workqueue_struct *wq = dwork->wq;
+
+	if (!wq)
+		return false;
+	pthread_mutex_lock(&wq->m);
+	busy = dwork->pending || wq->running == dwork;
+	if (dwork->pending) {
+		dwork->due = 0;
+		pthread_cond_broadcast(&wq->c);
+	}
+	while (dwork->pending || wq->running == dwork)
+		pthread_cond_wait(&wq->c, &wq->m);
+	pthread_mutex_unlock(&wq->m);
+	return busy;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+	int pending;
+	struct workqueue_struct *wq = dwork->wq;
+
+	if (!wq)
+		return false;
+	pthread_mutex_lock(&wq->m);
+	pending = dwork->pending;
+	dwork->pending = 0;
+	while (wq->running == dwork)
+		pthread_cond_wait(&wq->c, &wq->m);
+	pthread_mutex_unlock(&wq->m);
+	return pending;
+}
+
+unsigned int kshim_delayed_work_busy(struct delayed_work *dwork)
+{
+	unsigned int busy = 0;
+	struct workqueue_struct *wq = dwork->wq;
+
+	if (!wq)
+		return 0;
+	pthread_mutex_lock(&wq->m);
+	if (dwork->pending)
+		busy |= WORK_BUSY_PENDING;
+	if (wq->running == dwork)
+		busy |= WORK_BUSY_RUNNING;
+	pthread_mutex_unlock(&wq->m);
+	return busy;
+}
+
+/** Runs what is due and ends the worker, the works still pending later
+ * are dropped
+ */
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	struct delayed_work *w;
+
+	pthread_mutex_lock(&wq->m);
+	for (w = wq->works; w; w = w->next)
+		if (w->wq == wq && w->pending && w->due > kshim_now_ns())
+			w->pending = 0;
+	wq->stop = 1;
+	pthread_cond_broadcast(&wq->c);
+	pthread_mutex_unlock(&wq->m);
+	pthread_join(wq->thread, NULL);
+	for (w = wq->works; w; w = w->next)
+		if (w->wq == wq)
+			w->wq = NULL;
+	free(wq);
+}
+
+char *dentry_path_raw(struct dentry *dentry, char *buf, int buflen)
+{
+	int len = strlen(dentry->d_path);
+
+	if (len >= buflen)
+		return ERR_PTR(-ENAMETOOLONG);
+	memcpy(buf, dentry->d_path, len+1);
+	return buf;
+}
+
+struct dentry *dget(struct dentry *dentry)
+{
+	kshim_inc(kshim_stats.nr_dget, 1);
+	__atomic_add_fetch(&dentry->d_count, 1, __ATOMIC_RELAXED);
+	return dentry;
+}
+
+void dput(struct dentry *dentry)
+{
+	if (!dentry)
+		return;
+	kshim_inc(kshim_stats.nr_dput, 1);
+	if (__atomic_sub_fetch(&dentry->d_count, 1, __ATOMIC_ACQ_REL) == 0 &&
+	    dentry->d_alloced)
+		kfree(dentry);
+}
+
+bool is_subdir(struct dentry *new_dentry, struct dentry *old_dentry)
+{
+	while (new_dentry != old_dentry) {
+		if (IS_ROOT(new_dentry))
+			return false;
+		new_dentry = new_dentry->d_parent;
+	}
+	return true;
+}
+
+struct dentry *kshim_d_alloc(const char *path)
+{
+	int len = strlen(path);
+	char *p = NULL;
+	struct dentry *dentry = NULL;
+
+	dentry = (struct dentry *)kzalloc(sizeof(struct dentry)+len+1,
+								GFP_KERNEL);
+	if (!dentry)
+		return NULL;
+	p = (char *)(dentry+1);
+	memcpy(p, path, len+1);
+	spin_lock_init(&dentry->d_lock);
+	dentry->d_parent = dentry;
+	dentry->d_path = p;
+	dentry->d_name.name = (const unsigned char *)(strrchr(p, '/') ?
+						strrchr(p, '/')+1 : p);
+	dentry->d_name.len = strlen((const char *)dentry->d_name.name);
+	dentry->d_count = 1;
+	dentry->d_alloced = true;
+	kshim_inc(kshim_stats.nr_dget, 1);
+	return dentry;
+}
+
+struct page *kshim_page_alloc(void)
+{
+	struct page *page = NULL;
+
+	page = (struct page *)kmalloc(sizeof(struct page)+PAGE_SIZE,
+								GFP_KERNEL);
+	if (!page)
+		return NULL;
+	page->count = 1;
+	page->virt = (char *)(page+1);
+	kshim_inc(kshim_stats.nr_page_get, 1);
+	return page;
+}
+
+void put_page(struct page *page)
+{
+	kshim_inc(kshim_stats.nr_page_put, 1);
+	if (__atomic_sub_fetch(&page->count, 1, __ATOMIC_ACQ_REL) == 0)
+		kfree(page);
+}
+
+/** Takes references to the cached pages from start on, up to the first
+ * one that isn't
+ */
+unsigned find_get_pages_contig(struct address_space *mapping, pgoff_t start,
+			unsigned int nr_pages, struct page **pages)
+{
+	unsigned int i;
+	struct page *page = NULL;
+
+	for (i = 0; i < nr_pages && start+i < mapping->nr_pages; i++) {
+		page = mapping->pages[start+i];
+		if (!page)
+			break;
+		__atomic_add_fetch(&page->count, 1, __ATOMIC_RELAXED);
+		kshim_inc(kshim_stats.nr_page_get, 1);
+		pages[i] = page;
+	}
+	return i;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		size_t align, unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *cachep = NULL;
+
+	cachep = (struct kmem_cache *)calloc(1, sizeof(struct kmem_cache));
+	if (cachep)
+		cachep->size = size;
+	return cachep;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cachep)
+{
+	free(cachep);
+}
+
+struct file *filp_open(const char *name, int flags, umode_t mode)
+{
+	struct stat st;
+	struct file *filp = NULL;
+
+	filp = (struct file *)calloc(1, sizeof(struct file));
+	if (!filp)
+		return ERR_PTR(-ENOMEM);
+	filp->fd = open(name, flags, mode);
+	if (filp->fd < 0 || fstat(filp->fd, &st) < 0) {
+		int err = -errno;
+
+		if (filp->fd >= 0)
+			close(filp->fd);
+		free(filp);
+		return ERR_PTR(err);
+	}
+	filp->f_flags = flags;
+	filp->f_inode.i_mode = st.st_mode;
+	if ((flags & O_ACCMODE) != O_WRONLY)
+		filp->f_mode |= FMODE_READ;
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		filp->f_mode |= FMODE_WRITE;
+	return filp;
+}
+
+int filp_close(struct file *filp, void *id)
+{
+	int ret = close(filp->fd);
+
+	free(filp);
+	return ret < 0 ? -errno : 0;
+}
+
+ssize_t vfs_write(struct file *filp, const char *buf, size_t count,
+								loff_t *pos)
+{
+	ssize_t bytes = pwrite(filp->fd, buf, count, *pos);
+
+	if (bytes < 0)
+		return -errno;
+	*pos += bytes;
+	kshim_inc(kshim_stats.nr_vfs_write, 1);
+	kshim_inc(kshim_stats.vfs_write_bytes, bytes);
+	return bytes;
+}
+
+ssize_t vfs_writev(struct file *filp, const struct iovec *vec,
+					unsigned long vlen, loff_t *pos)
+{
+	ssize_t bytes = pwritev(filp->fd, vec, vlen, *pos);
+
+	if (bytes < 0)
+		return -errno;
+	*pos += bytes;
+	kshim_inc(kshim_stats.nr_vfs_write, 1);
+	kshim_inc(kshim_stats.vfs_write_bytes, bytes);
+	return bytes;
+}
+
+/* debugfs files are never opened here */
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+								void *data)
+{
+	return -ENODEV;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+								loff_t *ppos)
+{
+	return -ENODEV;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return -ENODEV;
+}
@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* kshim: just enough of the kernel API for trfs/tr_fs.c, trfs_msgq.c and
+ * trfs_ops.c to build as they are into a userspace program.
+ *
+ * The <linux/...> headers those sources ask for are found in this
+ * directory and all come down to this file. trfs.h is kept out by
+ * defining its guard, the sources only need the few types below from it.
+ * Allocations, mutexes and wait queues are counted in kshim_stats, the
+ * tfile is written with pwrite on a local file and kthreads are pthreads.
+ */
+
+#ifndef _KSHIM_H_
+#define _KSHIM_H_
+
+/* cpu_set_t and the pthread affinity calls */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* The kernel sources include trfs.h for the VFS, keep it out */
+#define _TRFS_H_
+
+typedef unsigned short umode_t;
+typedef unsigned int fmode_t;
+typedef int mm_segment_t;
+typedef uint64_t u64;
+
+#define GFP_KERNEL	0
+#define KERN_INFO	""
+#define KERN_DEFAULT	""
+#define KERN_ERR	""
+
+#define printk(...)	fprintf(stderr, __VA_ARGS__)
+#define pr_err(...)	fprintf(stderr, __VA_ARGS__)
+
+#define __user
+
+/** Counters of the shim, summed over all threads
+ */
+typedef struct kshim_stats_ {
+	unsigned long long nr_kmalloc;
+	unsigned long long nr_kfree;
+	unsigned long long kmalloc_bytes;
+	unsigned long long nr_getname;
+	unsigned long long nr_wakeups;
+	unsigned long long nr_sleeps;
+	unsigned long long nr_vfs_write;
+	unsigned long long vfs_write_bytes;
+	unsigned long long nr_dget;
+	unsigned long long nr_dput;
+	unsigned long long nr_page_get;
+	unsigned long long nr_page_put;
+}kshim_stats_t;
+
+extern kshim_stats_t kshim_stats;
+
+#define kshim_inc(v, n)	__atomic_add_fetch(&(v), (n), __ATOMIC_RELAXED)
+
+void *kmalloc(size_t size, int flags);
+void *kzalloc(size_t size, int flags);
+void kfree(const void *p);
+char *kasprintf(int flags, const char *fmt, ...)
+				__attribute__((format(printf, 2, 3)));
+
+/** A slab cache hands out kmalloc'd objects of its size
+ */
+struct kmem_cache {
+	size_t size;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+		size_t align, unsigned long flags, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cachep);
+
+#define kmem_cache_alloc(c, flags)	kmalloc((c)->size, flags)
+#define kmem_cache_free(c, p)		kfree(p)
+
+#define vmalloc(size)	kmalloc(size, GFP_KERNEL)
+#define vfree(p)	kfree(p)
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)	min((t)(a), (t)(b))
+#define swap(a, b)	do { typeof(a) __t = (a); (a) = (b); (b) = __t; } \
+								while (0)
+
+#define __getname()	(kshim_inc(kshim_stats.nr_getname, 1), \
+					(char *)kmalloc(PATH_MAX, GFP_KERNEL))
+#define __putname(p)	kfree(p)
+
+#define MAX_ERRNO	4095
+#define IS_ERR(p)	((unsigned long)(p) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(p)	((long)(p))
+#define ERR_PTR(e)	((void *)(long)(e))
+
+/** Mutex with contention accounting, the counters are updated with the
+ * mutex held
+ */
+struct mutex {
+	pthread_mutex_t m;
+	unsigned long long nr_lock;
+	unsigned long long nr_contended;
+	unsigned long long wait_ns;
+};
+
+void mutex_init(struct mutex *lock);
+void mutex_lock(struct mutex *lock);
+void mutex_unlock(struct mutex *lock);
+
+typedef struct {
+	pthread_spinlock_t s;
+}spinlock_t;
+
+#define spin_lock_init(l)	pthread_spin_init(&(l)->s, 0)
+#define spin_lock(l)		pthread_spin_lock(&(l)->s)
+#define spin_unlock(l)		pthread_spin_unlock(&(l)->s)
+
+typedef struct wait_queue_head {
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int nr_sleeping;	/* threads asleep on the queue */
+}wait_queue_head_t;
+
+void init_waitqueue_head(wait_queue_head_t *wq);
+void wake_up_interruptible(wait_queue_head_t *wq);
+int kshim_wait(wait_queue_head_t *wq, long long deadline_ns);
+long long kshim_now_ns(void);
+
+#define wait_event_interruptible(wq, cond) ({				\
+	pthread_mutex_lock(&(wq).m);					\
+	while (!(cond))							\
+		kshim_wait(&(wq), 0);					\
+	pthread_mutex_unlock(&(wq).m);					\
+	0; })
+
+#define wait_event_interruptible_timeout(wq, cond, timeout) ({		\
+	long __ret = 1;							\
+	long long __end = kshim_now_ns()+(timeout)*(1000000000LL/HZ);	\
+	pthread_mutex_lock(&(wq).m);					\
+	while (!(cond) && __ret)					\
+		if (kshim_wait(&(wq), __end) == ETIMEDOUT)		\
+			__ret = 0;					\
+	pthread_mutex_unlock(&(wq).m);					\
+	__ret; })
+
+#define HZ			1000
+#define jiffies			((unsigned long)(kshim_now_ns()/1000000))
+#define msecs_to_jiffies(ms)	((unsigned long)(ms))
+#define time_after_eq(a, b)	((long)((a)-(b)) >= 0)
+#define msleep(ms)		usleep((ms)*1000)
+
+uint64_t ktime_get_real_ns(void);
+
+typedef struct {
+	int counter;
+}atomic_t;
+
+#define ATOMIC_INIT(i)		{ (i) }
+
+#define atomic_inc_return(v)	__atomic_add_fetch(&(v)->counter, 1, \
+							__ATOMIC_SEQ_CST)
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_inc(v)		((void)__atomic_add_fetch(&(v)->counter, 1, \
+							__ATOMIC_SEQ_CST))
+#define atomic_dec(v)		((void)__atomic_sub_fetch(&(v)->counter, 1, \
+							__ATOMIC_SEQ_CST))
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, (i), \
+							__ATOMIC_SEQ_CST)
+#define atomic_xchg(v, i)	__atomic_exchange_n(&(v)->counter, (i), \
+							__ATOMIC_SEQ_CST)
+
+typedef struct {
+	long long counter;
+}atomic64_t;
+
+#define atomic64_inc(v)		__atomic_add_fetch(&(v)->counter, 1, \
+							__ATOMIC_RELAXED)
+#define atomic64_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+
+/** The multiplicative hash of <linux/hash.h>, to bits bits
+ */
+static inline unsigned int hash_ptr(const void *ptr, unsigned int bits)
+{
+	return (unsigned int)(((uint64_t)(unsigned long)ptr *
+				0x61C8864680B583EBull) >> (64-bits));
+}
+
+#define READ_ONCE(x)		(*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile typeof(x) *)&(x) = (v))
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define rcu_read_lock()
+#define rcu_read_unlock()
+/* The read sections are a few memcpys, a grace period is approximated by
+ * a sleep well beyond them */
+#define synchronize_rcu()	usleep(10000)
+
+#define time_before(a, b)	((long)((a)-(b)) < 0)
+#define ktime_get_ns()		((u64)kshim_now_ns())
+
+/** CPU masks are cpu_set_t. There is a single node.
+ */
+struct cpumask {
+	cpu_set_t bits;
+};
+
+#define NUMA_NO_NODE		(-1)
+#define cpu_to_node(cpu)	0
+#define cpumask_clear(m)	CPU_ZERO(&(m)->bits)
+#define cpumask_empty(m)	(CPU_COUNT(&(m)->bits) == 0)
+
+#define nr_cpu_ids		CPU_SETSIZE
+
+extern const struct cpumask *cpu_online_mask;
+
+int cpumask_first(const struct cpumask *m);
+int cpumask_first_and(const struct cpumask *a, const struct cpumask *b);
+
+/** A kthread is a pthread started by wake_up_process(). The placement
+ * and the scheduling class it is given before are taken on when the
+ * pthread starts.
+ */
+struct task_struct {
+	int pid;
+	char comm[16];
+	pthread_t thread;
+	pid_t tid;
+	int started;
+	int (*fn)(void *);
+	void *data;
+	int ret;
+	struct cpumask cpus;		/* empty: anywhere */
+	long nice;
+	int policy;
+	int rt_prio;
+};
+
+extern __thread struct task_struct *kshim_current;
+
+#define current			kshim_current
+#define task_pid_nr(t)		((t) ? (t)->pid : 0)
+
+struct task_struct *kthread_create(int (*fn)(void *), void *data,
+						const char *namefmt, ...);
+int wake_up_process(struct task_struct *t);
+int kthread_stop(struct task_struct *t);
+
+#define SCHED_NORMAL		SCHED_OTHER
+#define MAX_RT_PRIO		100
+
+int set_cpus_allowed_ptr(struct task_struct *t, const struct cpumask *m);
+void set_user_nice(struct task_struct *t, long nice);
+int sched_setscheduler_nocheck(struct task_struct *t, int policy,
+					const struct sched_param *param);
+
+/** A workqueue is one pthread that runs its delayed works when they are
+ * due, one at a time. A work queued on a CPU runs pinned to it, those of
+ * a WQ_HIGHPRI workqueue at nice -20 if the process may.
+ */
+struct work_struct {
+	void (*func)(struct work_struct *);
+};
+
+struct workqueue_struct;
+
+struct delayed_work {
+	struct work_struct work;
+	struct workqueue_struct *wq;	/* of the last queueing */
+	struct delayed_work *next;	/* in the works of wq */
+	long long due;			/* ns */
+	int cpu;
+	int pending;
+};
+
+struct workqueue_struct {
+	unsigned int flags;
+	pthread_t thread;
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	struct delayed_work *works;	/* queued at least once */
+	struct delayed_work *running;
+	int stop;
+};
+
+#define WQ_UNBOUND		(1 << 1)
+#define WQ_SYSFS		(1 << 6)
+#define WQ_HIGHPRI		(1 << 4)
+
+#define WORK_CPU_UNBOUND	CPU_SETSIZE
+#define WORK_BUSY_PENDING	(1 << 0)
+#define WORK_BUSY_RUNNING	(1 << 1)
+
+#define INIT_DELAYED_WORK(w, f)	\
+	((w)->work.func = (f), (w)->wq = NULL, (w)->pending = 0)
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, unsigned int flags,
+							int max_active, ...);
+bool queue_delayed_work_on(int cpu, struct workqueue_struct *wq,
+			struct delayed_work *dwork, unsigned long delay);
+bool mod_delayed_work_on(int cpu, struct workqueue_struct *wq,
+			struct delayed_work *dwork, unsigned long delay);
+bool flush_delayed_work(struct delayed_work *dwork);
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
+unsigned int kshim_delayed_work_busy(struct delayed_work *dwork);
+void destroy_workqueue(struct workqueue_struct *wq);
+
+/** The file, dentry and inode fields the sources use
+ */
+struct qstr {
+	const unsigned char *name;
+	unsigned int len;
+};
+
+struct dentry {
+	spinlock_t d_lock;
+	struct dentry *d_parent;
+	struct qstr d_name;
+	const char *d_path;	/* path from the root of the mount */
+	int d_count;		/* references */
+	bool d_alloced;		/* freed with the last one */
+};
+
+struct inode {
+	umode_t i_mode;
+};
+
+#define IS_DAX(inode)	((void)(inode), 0)
+
+#define PAGE_SHIFT		12
+#define PAGE_SIZE		(1UL << PAGE_SHIFT)
+#define offset_in_page(p)	((unsigned long)(p) & (PAGE_SIZE-1))
+
+typedef unsigned long pgoff_t;
+
+/** A page of a page cache, freed with its last reference
+ */
+struct page {
+	int count;
+	char *virt;
+};
+
+/** A page cache is an array of pages, a NULL one isn't cached
+ */
+struct address_space {
+	struct page **pages;
+	pgoff_t nr_pages;
+};
+
+/** A page with one reference, counted as a get
+ */
+struct page *kshim_page_alloc(void);
+void put_page(struct page *page);
+
+unsigned find_get_pages_contig(struct address_space *mapping, pgoff_t start,
+			unsigned int nr_pages, struct page **pages);
+
+#define kmap(page)		((void *)(page)->virt)
+#define kunmap(page)		((void)(page))
+#define kmap_atomic(page)	((void *)(page)->virt)
+#define kunmap_atomic(addr)	((void)(addr))
+
+#define copy_from_user(to, from, n)	(memcpy((to), (from), (n)), 0UL)
+
+struct path {
+	struct dentry *dentry;
+};
+
+#define FMODE_READ	0x1
+#define FMODE_WRITE	0x2
+
+struct file {
+	struct path f_path;
+	struct inode f_inode;
+	loff_t f_pos;
+	unsigned int f_flags;
+	fmode_t f_mode;
+	int fd;
+	struct address_space *f_mapping;
+	struct file *f_lower;	/* of a trfs file */
+};
+
+#define trfs_lower_file(f)	((f)->f_lower)
+
+#define IS_ROOT(d)	((d) == (d)->d_parent)
+#define file_inode(f)	(&(f)->f_inode)
+
+char *dentry_path_raw(struct dentry *dentry, char *buf, int buflen);
+
+struct dentry *dget(struct dentry *dentry);
+void dput(struct dentry *dentry);
+
+#define dget_parent(d)	dget((d)->d_parent)
+
+/** Whether new_dentry is old_dentry or below it
+ */
+bool is_subdir(struct dentry *new_dentry, struct dentry *old_dentry);
+
+/** A root dentry of its own at path, with one reference held, counted
+ * as a dget
+ */
+struct dentry *kshim_d_alloc(const char *path);
+
+struct file *filp_open(const char *name, int flags, umode_t mode);
+int filp_close(struct file *filp, void *id);
+ssize_t vfs_write(struct file *filp, const char *buf, size_t count,
+								loff_t *pos);
+ssize_t vfs_writev(struct file *filp, const struct iovec *vec,
+					unsigned long vlen, loff_t *pos);
+
+#define KERNEL_DS	0
+#define get_fs()	KERNEL_DS
+#define set_fs(fs)	((void)(fs))
+
+#define IS_ERR_OR_NULL(p)	(!(p) || IS_ERR(p))
+
+#define fls64(x)	((x) ? 64-__builtin_clzll((unsigned long long)(x)) : 0)
+
+/** Per-CPU data is a single copy, the adds are atomic instead
+ */
+#define __percpu
+#define alloc_percpu(type)		((type *)kzalloc(sizeof(type), GFP_KERNEL))
+#define free_percpu(p)			kfree(p)
+#define per_cpu_ptr(p, cpu)		((void)(cpu), (p))
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define this_cpu_add(v, n)		kshim_inc(v, n)
+#define this_cpu_inc(v)			kshim_inc(v, 1)
+
+/** A seq_file prints to a stdio stream, set by whoever shows it
+ */
+struct seq_file {
+	FILE *fp;
+};
+
+#define seq_printf(m, ...)	fprintf((m)->fp, __VA_ARGS__)
+#define seq_puts(m, s)		fputs((s), (m)->fp)
+
+/** Nothing is shown in debugfs, the files are only checked to build
+ */
+struct module;
+
+#define THIS_MODULE	((struct module *)NULL)
+
+/* Module parameters keep the value they are initialized with */
+#define module_param_named(name, var, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+struct file_operations {
+	struct module *owner;
+	int (*open)(struct inode *, struct file *);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+	int (*release)(struct inode *, struct file *);
+};
+
+static inline struct dentry *debugfs_create_dir(const char *name,
+						struct dentry *parent)
+{
+	return NULL;
+}
+
+static inline struct dentry *debugfs_create_file(const char *name,
+		umode_t mode, struct dentry *parent, void *data,
+		const struct file_operations *fops)
+{
+	return NULL;
+}
+
+#define debugfs_remove_recursive(d)		((void)(d))
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+								void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+								loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+
+#endif	/* End of _KSHIM_H_ */
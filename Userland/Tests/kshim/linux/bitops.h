@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/bitops.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/cpumask.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/debugfs.h> */
+#include "../kshim.h"
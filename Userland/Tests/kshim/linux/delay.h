@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/delay.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/hash.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/highmem.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/init.h> */
+#include "../kshim.h"
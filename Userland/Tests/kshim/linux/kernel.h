@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/kernel.h> */
+#include "../kshim.h"
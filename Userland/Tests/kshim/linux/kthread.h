@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/kthread.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/ktime.h> */
+#include "../kshim.h"
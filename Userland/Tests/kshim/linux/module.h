@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/module.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/netdevice.h> */
+#include "../kshim.h"
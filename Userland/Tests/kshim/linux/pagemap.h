@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/pagemap.h> */
+#include "../kshim.h"
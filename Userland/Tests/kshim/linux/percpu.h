@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/percpu.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/sched.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/seq_file.h> */
+#include "../kshim.h"
@@ -0,0 +1,4 @@
+/* kshim stand-in for <linux/types.h>, the uapi headers of libc want the
+ * real one */
+#include_next <linux/types.h>
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/uio.h> */
+#include "../kshim.h"
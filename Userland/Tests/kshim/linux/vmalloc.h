@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/vmalloc.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/wait.h> */
+#include "../kshim.h"
@@ -0,0 +1,2 @@
+/* kshim stand-in for <linux/workqueue.h> */
+#include "../kshim.h"
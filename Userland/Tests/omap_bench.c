@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Benchmark of the replay open file map.
+ *
+ * First times the map alone: N (addr, pid) keys are added, looked up and
+ * deleted, then the same addresses go through open/close cycles the way
+ * the kernel reuses freed struct file objects.
+ *
+ * Then a tfile with N files open at the same time is generated in a
+ * scratch directory and replayed: N opens, a write to each, N closes and
+ * a second round that reuses every file pointer address. The files left
+ * open and the sizes of the written files are checked afterwards.
+ *
+ *	$make bench
+ *	$./Tests/omap_bench [nr_files]
+ */
+
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include "../trfs_ops.h"
+#include "../trfs_parse.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+#define BENCH_NR_FILES	100000
+#define BENCH_NR_PIDS	16
+#define BENCH_WSIZE	64
+
+/* struct file objects come from a slab, 256 bytes apart */
+#define BENCH_ADDR(i)	(0xffff880012340000ULL+(uint64_t)(i)*256)
+#define BENCH_PID(i)	(1000+(int)((i)%BENCH_NR_PIDS))
+
+static unsigned int rid = 0;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int bench_nr_fds(void)
+{
+	int n = 0;
+	DIR *d = opendir("/proc/self/fd");
+	struct dirent *de = NULL;
+
+	if (!d)
+		return -1;
+	while ((de = readdir(d)) != NULL)
+		if (de->d_name[0] != '.')
+			n++;
+	closedir(d);
+	return n-1;	/* the fd of the directory stream */
+}
+
+/** Times add, lookup, delete and reuse cycles on the map alone
+ */
+static int bench_map(int n)
+{
+	int i = 0;
+	int c = 0;
+	int err = 0;
+	double t0, t1, t2, t3, t4;
+	trfs_omap m;
+
+	if (trfs_omap_init(&m, TRFS_OMAP_INIT_SIZE) < 0)
+		return -ENOMEM;
+
+	t0 = bench_now();
+	for (i = 0; i < n; i++)
+		trfs_omap_add(&m, BENCH_ADDR(i), BENCH_PID(i), i);
+	t1 = bench_now();
+	for (i = 0; i < n; i++)
+		if (trfs_omap_getfd(&m, BENCH_ADDR(i), BENCH_PID(i)) != i)
+			err++;
+	t2 = bench_now();
+	for (i = 0; i < n; i++)
+		if (trfs_omap_delete(&m, BENCH_ADDR(i), BENCH_PID(i)) != i)
+			err++;
+	t3 = bench_now();
+	/* Every address is closed and opened again, by another pid */
+	for (c = 0; c < 4; c++) {
+		for (i = 0; i < n; i++)
+			trfs_omap_add(&m, BENCH_ADDR(i), BENCH_PID(i+c), i);
+		for (i = 0; i < n; i++)
+			if (trfs_omap_getfd(&m, BENCH_ADDR(i),
+						BENCH_PID(i+c)) != i)
+				err++;
+		for (i = 0; i < n; i++)
+			if (trfs_omap_delete(&m, BENCH_ADDR(i),
+						BENCH_PID(i+c)) != i)
+				err++;
+	}
+	t4 = bench_now();
+	if (m.count != 0)
+		err++;
+
+	printf("map: %d keys, add %.1f ns, lookup %.1f ns, delete %.1f ns, \
+reuse cycle %.1f ns per key, %d slots\n", n, (t1-t0)*1e9/n, (t2-t1)*1e9/n,
+		(t3-t2)*1e9/n, (t4-t3)*1e9/(4*n), m.size);
+	trfs_omap_destroy(&m);
+	return err ? -EINVAL : 0;
+}
+
+static void bench_put(FILE *f, void *rec, unsigned short size)
+{
+	memcpy(rec, &rid, sizeof(unsigned int));
+	rid++;
+	fwrite(rec, 1, size, f);
+}
+
+static void bench_put_open(FILE *f, char *buf, int i, int round)
+{
+	trfs_open_op *op = (trfs_open_op *)buf;
+
+	memset(buf, 0, sizeof(trfs_open_op)+32);
+	op->r_type = TRFS_OP_OPEN;
+	op->flags = O_WRONLY|O_CREAT|(round ? O_APPEND : O_TRUNC);
+	op->mode = 0644;
+	op->pid = BENCH_PID(i);
+	op->addr = BENCH_ADDR(i);
+	op->len = sprintf(op->pathname, "f%d", i);
+	op->r_size = offsetof(trfs_open_op, pathname)+op->len+1;
+	bench_put(f, op, op->r_size);
+}
+
+static void bench_put_write(FILE *f, char *buf, int i)
+{
+	trfs_write_op *op = (trfs_write_op *)buf;
+
+	memset(buf, 0, sizeof(trfs_write_op)+32+BENCH_WSIZE);
+	op->r_type = TRFS_OP_WRITE;
+	op->pid = BENCH_PID(i);
+	op->addr = BENCH_ADDR(i);
+	op->count = BENCH_WSIZE;
+	op->ret = BENCH_WSIZE;
+	op->len = sprintf(op->pathname, "f%d", i);
+	memset(op->pathname+op->len, 'a', BENCH_WSIZE);
+	op->r_size = offsetof(trfs_write_op, pathname)+op->len+BENCH_WSIZE;
+	bench_put(f, op, op->r_size);
+}
+
+static void bench_put_close(FILE *f, char *buf, int i)
+{
+	trfs_close_op *op = (trfs_close_op *)buf;
+
+	memset(buf, 0, sizeof(trfs_close_op)+32);
+	op->r_type = TRFS_OP_CLOSE;
+	op->pid = BENCH_PID(i);
+	op->addr = BENCH_ADDR(i);
+	op->len = sprintf(op->pathname, "f%d", i);
+	op->r_size = offsetof(trfs_close_op, pathname)+op->len+1;
+	bench_put(f, op, op->r_size);
+}
+
+/** Writes the tfile of the replay benchmark.
+ * Round 0 opens all files before closing any, round 1 reuses every file
+ * pointer address; every 16th file of round 1 is opened twice without a
+ * close in between, as a lost close record would look.
+ */
+static int bench_gen(const char *path, int n)
+{
+	int i = 0;
+	int round = 0;
+	char buf[512];
+	FILE *f = fopen(path, "w");
+
+	if (!f)
+		return -EIO;
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < n; i++) {
+			bench_put_open(f, buf, i, round);
+			if (round && i%16 == 0)
+				bench_put_open(f, buf, i, round);
+		}
+		for (i = 0; i < n; i++)
+			bench_put_write(f, buf, i);
+		for (i = 0; i < n; i++)
+			bench_put_close(f, buf, i);
+	}
+	return fclose(f) ? -EIO : 0;
+}
+
+/** Generates and replays a trace with n files open at the same time
+ */
+static int bench_replay(const char *dir, int n)
+{
+	int i = 0;
+	int ret = 0;
+	int fds = 0;
+	unsigned long nr = 0;
+	double t0, t1;
+	char *rec = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+	trfs_trace trace;
+	struct trfs_rpd *rpd = NULL;
+
+	snprintf(path, sizeof(path), "%s/tfile", dir);
+	if (bench_gen(path, n) < 0 ||
+	    trfs_trace_open(&trace, path, 0) < 0) {
+		printf("Generating the tfile: Failed\n");
+		return -EIO;
+	}
+	if (chdir(dir) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	rpd = trfs_rpd_init(NULL);
+	if (!rpd) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	fds = bench_nr_fds();
+	t0 = bench_now();
+	while ((rec = trfs_trace_next(&trace)) != NULL) {
+		trfs_replay_rec(rpd, rec);
+		nr++;
+	}
+	t1 = bench_now();
+	printf("replay: %d concurrent open files, %lu records in %.3f s, \
+%.0f records/s\n", n, nr, t1-t0, (t1-t0) > 0 ? nr/(t1-t0) : 0);
+
+	if (bench_nr_fds() != fds) {
+		printf("replay: %d fds leaked\n", bench_nr_fds()-fds);
+		ret = -EINVAL;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "f%d", i);
+		if (stat(path, &st) < 0 || st.st_size != 2*BENCH_WSIZE) {
+			printf("replay: f%d has the wrong size\n", i);
+			ret = -EINVAL;
+			break;
+		}
+	}
+out:
+	trfs_rpd_exit(rpd);
+	trfs_trace_close(&trace);
+	return ret;
+}
+
+static void bench_cleanup(const char *dir, int n)
+{
+	int i = 0;
+	char path[PATH_MAX];
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/tfile", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	int n = BENCH_NR_FILES;
+	int ret = 0;
+	char dir[] = "/tmp/trfs_omap_XXXXXX";
+	struct rlimit rl;
+
+	if (argc > 1)
+		n = atoi(argv[1]);
+	if (n <= 0) {
+		printf("Usage: omap_bench [nr_files]\n");
+		return -EINVAL;
+	}
+
+	ret = bench_map(n);
+	if (ret < 0) {
+		printf("map: lookup returned a wrong fd\n");
+		return ret;
+	}
+
+	/* All files are open at once, plus the replay's own fds */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t)n+64) {
+		rl.rlim_cur = rl.rlim_max < (rlim_t)n+64 ? rl.rlim_max : n+64;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur < (rlim_t)n+64) {
+		printf("replay: open file limit is %lu, replaying %lu \
+files instead of %d\n", (unsigned long)rl.rlim_cur,
+			(unsigned long)rl.rlim_cur-64, n);
+		n = rl.rlim_cur-64;
+	}
+
+	if (!mkdtemp(dir)) {
+		printf("Creating the scratch directory: Failed\n");
+		return -EIO;
+	}
+	ret = bench_replay(dir, n);
+	bench_cleanup(dir, n);
+	return ret;
+}
@@ -0,0 +1,819 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Benchmark of the replay.
+ *
+ * tfiles of a few op mixes are generated (or one is given with -f) and
+ * replayed into a scratch directory in each mode of treplay: the parser
+ * alone (over the tfile again and again for BENCH_PARSE_NS at least, a
+ * single pass is too short to time), the serial replay, the parallel replay on a pool of workers and
+ * the io_uring replay. Every run starts from an empty directory and
+ * reports ops/s and MB/s of data read and written, the best of a few runs
+ * (-r); the serial runs also time every op and report the latency
+ * percentiles of each op type.
+ *
+ * The tree the serial replay leaves is kept and the trees of the other
+ * modes are compared with it: entry types, sizes and file contents. A
+ * tree that differs is reported as a mismatch and the benchmark exits
+ * with 1.
+ *
+ * The results can be saved as a baseline (-o) and later runs compared to
+ * it (-c): a run whose ops/s drops by more than the threshold (-x, in
+ * percent) is reported as a regression and the benchmark exits with 1.
+ *
+ *	$make bench
+ *	$./Tests/replay_bench [-n files] [-m mix] [-f tfile] [-r runs]
+ *		[-j jobs] [-u depth] [-d dir] [-o baseline] [-c baseline]
+ *		[-x pct]
+ */
+
+#define _GNU_SOURCE		/* nftw() */
+
+#include <time.h>
+#include <limits.h>
+#include <ftw.h>
+
+#include "../trfs_ops.h"
+#include "../trfs_parse.h"
+#include "../trfs_preplay.h"
+#include "../trfs_uring.h"
+#include "../trfs_write.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+#define BENCH_NR_FILES		1024
+#define BENCH_NR_DIRS		16	/* one pid per directory */
+#define BENCH_IO_SIZE		4096
+#define BENCH_NR_IO		16	/* reads or writes per file */
+#define BENCH_JOBS		4
+#define BENCH_DEPTH		32
+#define BENCH_RUNS		3	/* the best run is reported */
+#define BENCH_THRESHOLD		10	/* percent of ops/s */
+#define BENCH_PARSE_NS		200000000ULL	/* least a parse run takes */
+#define BENCH_MAX_RESULTS	64
+
+#define BENCH_ADDR(i)		(0xffff880012340000ULL+(uint64_t)(i)*256)
+#define BENCH_PID(d)		(1000+(d))
+
+typedef enum bench_mode_ {
+	BENCH_PARSE,
+	BENCH_SERIAL,
+	BENCH_JOBS_MODE,
+	BENCH_URING,
+	BENCH_NR_MODES
+}bench_mode;
+
+static const char *mode_names[BENCH_NR_MODES] = {
+	"parse", "serial", "jobs", "uring"
+};
+
+/** Latencies of one op type in the serial replay, in ns
+ */
+typedef struct bench_lat_ {
+	uint32_t *ns;
+	size_t nr;
+	size_t alloc;
+}bench_lat;
+
+/** Result of one mix in one mode
+ */
+typedef struct bench_res_ {
+	char mix[32];
+	char mode[16];
+	unsigned long long nr;
+	double secs;
+	double ops;		/* per second */
+	double mbs;
+	double p50, p90, p99;	/* us, 0 when not measured */
+	int diff;		/* entries not as the serial replay left them */
+}bench_res;
+
+static bench_res results[BENCH_MAX_RESULTS];
+static int nr_results = 0;
+static bench_lat lat[TRFS_MAX_OPS];
+
+static int nr_files = BENCH_NR_FILES;
+static int nr_jobs = BENCH_JOBS;
+static int ur_depth = BENCH_DEPTH;
+static int nr_runs = BENCH_RUNS;
+static int nr_mismatch = 0;
+
+/** Trees compared by bench_cmp_tree(), nftw() takes no argument
+ */
+static const char *cmp_ref = NULL;
+static const char *cmp_run = NULL;
+static int cmp_diff = 0;
+static int cmp_exist_only = 0;
+
+/** Generator state: the next record ID and timestamp
+ */
+static unsigned int rid = 1;
+static uint64_t gen_ts = 0;
+static char rec_buf[65536];
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+static int bench_put(trfs_writer *w, void *rec, unsigned short size)
+{
+	memcpy(rec, &rid, sizeof(unsigned int));
+	memcpy((char *)rec+sizeof(unsigned int), &size, sizeof(unsigned short));
+	memcpy((char *)rec+offsetof(trfs_open_op, ts), &gen_ts,
+							sizeof(uint64_t));
+	rid++;
+	gen_ts += 1000;
+	return trfs_writer_put(w, (const char *)rec);
+}
+
+/** Records with only a path: mkdir, rmdir and unlink
+ */
+static int bench_put_path(trfs_writer *w, int type, int d, const char *path)
+{
+	trfs_mkdir_op *mk = (trfs_mkdir_op *)rec_buf;
+	trfs_unlink_op *op = (trfs_unlink_op *)rec_buf;
+
+	memset(rec_buf, 0, 512);
+	if (type == TRFS_OP_MKDIR) {
+		mk->r_type = type;
+		mk->pid = BENCH_PID(d);
+		mk->mode = 0755;
+		mk->len = strlen(path);
+		strcpy(mk->pathname, path);
+		return bench_put(w, mk,
+			offsetof(trfs_mkdir_op, pathname)+mk->len+1);
+	}
+	/* rmdir and unlink records have the same layout */
+	op->r_type = type;
+	op->pid = BENCH_PID(d);
+	op->len = strlen(path);
+	strcpy(op->pathname, path);
+	return bench_put(w, op, offsetof(trfs_unlink_op, pathname)+op->len+1);
+}
+
+static int bench_put_open(trfs_writer *w, int i, int d, const char *path,
+								int flags)
+{
+	trfs_open_op *op = (trfs_open_op *)rec_buf;
+
+	memset(rec_buf, 0, 512);
+	op->r_type = TRFS_OP_OPEN;
+	op->flags = flags;
+	op->mode = 0644;
+	op->pid = BENCH_PID(d);
+	op->addr = BENCH_ADDR(i);
+	op->len = strlen(path);
+	strcpy(op->pathname, path);
+	return bench_put(w, op, offsetof(trfs_open_op, pathname)+op->len+1);
+}
+
+static int bench_put_io(trfs_writer *w, int type, int i, int d,
+						const char *path, int ppos)
+{
+	trfs_write_op *wr = (trfs_write_op *)rec_buf;
+	trfs_read_op *rd = (trfs_read_op *)rec_buf;
+
+	memset(rec_buf, 0, 512);
+	if (type == TRFS_OP_WRITE) {
+		wr->r_type = type;
+		wr->pid = BENCH_PID(d);
+		wr->addr = BENCH_ADDR(i);
+		wr->count = BENCH_IO_SIZE;
+		wr->ppos = ppos;
+		wr->ret = BENCH_IO_SIZE;
+		wr->len = strlen(path);
+		memcpy(wr->pathname, path, wr->len);
+		memset(wr->pathname+wr->len, 'a'+i%26, BENCH_IO_SIZE);
+		return bench_put(w, wr, offsetof(trfs_write_op, pathname)+
+						wr->len+BENCH_IO_SIZE);
+	}
+	rd->r_type = type;
+	rd->pid = BENCH_PID(d);
+	rd->addr = BENCH_ADDR(i);
+	rd->count = BENCH_IO_SIZE;
+	rd->ppos = ppos;
+	rd->ret = BENCH_IO_SIZE;
+	rd->len = strlen(path);
+	strcpy(rd->pathname, path);
+	return bench_put(w, rd, offsetof(trfs_read_op, pathname)+rd->len+1);
+}
+
+static int bench_put_close(trfs_writer *w, int i, int d, const char *path)
+{
+	trfs_close_op *op = (trfs_close_op *)rec_buf;
+
+	memset(rec_buf, 0, 512);
+	op->r_type = TRFS_OP_CLOSE;
+	op->pid = BENCH_PID(d);
+	op->addr = BENCH_ADDR(i);
+	op->len = strlen(path);
+	strcpy(op->pathname, path);
+	return bench_put(w, op, offsetof(trfs_close_op, pathname)+op->len+1);
+}
+
+static int bench_put_rename(trfs_writer *w, int d, const char *from,
+							const char *to)
+{
+	trfs_rename_op *op = (trfs_rename_op *)rec_buf;
+
+	memset(rec_buf, 0, 512);
+	op->r_type = TRFS_OP_RENAME;
+	op->pid = BENCH_PID(d);
+	op->len1 = strlen(from);
+	op->len2 = strlen(to);
+	memcpy(op->pathname1, from, op->len1);
+	memcpy(op->pathname1+op->len1, to, op->len2);
+	return bench_put(w, op, offsetof(trfs_rename_op, pathname1)+
+							op->len1+op->len2);
+}
+
+/** Opens, does n reads or writes and closes file i
+ */
+static int bench_put_file(trfs_writer *w, int type, int i, const char *path,
+								int n)
+{
+	int k;
+	int ret = 0;
+	int d = i%BENCH_NR_DIRS;
+	int flags = type == TRFS_OP_WRITE ? O_WRONLY|O_CREAT|O_TRUNC : O_RDONLY;
+
+	ret = bench_put_open(w, i, d, path, flags);
+	for (k = 0; k < n && ret == 0; k++)
+		ret = bench_put_io(w, type, i, d, path, k*BENCH_IO_SIZE);
+	if (ret == 0)
+		ret = bench_put_close(w, i, d, path);
+	return ret;
+}
+
+/** Writes the tfile of a mix:
+ * meta: files created empty, renamed and unlinked, directories made and
+ *	removed;
+ * write: files written in BENCH_IO_SIZE chunks;
+ * read: files written once then read back four times;
+ * mixed: every file written, read back, and every 4th renamed and removed;
+ * shared: every file open twice, written through one fd and read to the
+ *	end then written through the other, so that where the second fd
+ *	writes hangs on the order of the ops across both.
+ */
+static int bench_gen(const char *path, const char *mix)
+{
+	int i, d, r, k;
+	int pa, pb, size;
+	int ret = 0;
+	char p[64], q[64];
+	trfs_writer w;
+
+	ret = trfs_writer_open(&w, path, 0);
+	if (ret < 0)
+		return ret;
+	for (d = 0; d < BENCH_NR_DIRS && ret == 0; d++) {
+		snprintf(p, sizeof(p), "/d%d", d);
+		ret = bench_put_path(&w, TRFS_OP_MKDIR, d, p);
+	}
+	for (i = 0; i < nr_files && ret == 0; i++) {
+		d = i%BENCH_NR_DIRS;
+		snprintf(p, sizeof(p), "/d%d/f%d", d, i);
+		snprintf(q, sizeof(q), "/d%d/g%d", d, i);
+		if (!strcmp(mix, "meta")) {
+			ret = bench_put_file(&w, TRFS_OP_WRITE, i, p, 0);
+			if (ret == 0)
+				ret = bench_put_rename(&w, d, p, q);
+			if (ret == 0)
+				ret = bench_put_path(&w, TRFS_OP_UNLINK, d, q);
+			if (ret == 0 && i%8 == 0)
+				ret = bench_put_path(&w, TRFS_OP_MKDIR, d, q);
+			if (ret == 0 && i%8 == 0)
+				ret = bench_put_path(&w, TRFS_OP_RMDIR, d, q);
+		}
+		else if (!strcmp(mix, "write")) {
+			ret = bench_put_file(&w, TRFS_OP_WRITE, i, p,
+								BENCH_NR_IO);
+		}
+		else if (!strcmp(mix, "read")) {
+			ret = bench_put_file(&w, TRFS_OP_WRITE, i, p,
+								BENCH_NR_IO);
+			for (r = 0; r < 4 && ret == 0; r++)
+				ret = bench_put_file(&w, TRFS_OP_READ, i, p,
+								BENCH_NR_IO);
+		}
+		else if (!strcmp(mix, "shared")) {
+			/* the second fd has the address of file nr_files+i */
+			ret = bench_put_open(&w, i, d, p,
+						O_RDWR|O_CREAT|O_TRUNC);
+			if (ret == 0)
+				ret = bench_put_open(&w, nr_files+i, d, p,
+								O_RDWR);
+			pa = pb = size = 0;
+			for (k = 0; k < BENCH_NR_IO/2 && ret == 0; k++) {
+				ret = bench_put_io(&w, TRFS_OP_WRITE, i, d, p,
+									pa);
+				pa += BENCH_IO_SIZE;
+				size = pa > size ? pa : size;
+				if (ret == 0)
+					ret = bench_put_io(&w, TRFS_OP_READ,
+						nr_files+i, d, p, pb);
+				pb += size-pb < BENCH_IO_SIZE ? size-pb :
+								BENCH_IO_SIZE;
+				if (ret == 0)
+					ret = bench_put_io(&w, TRFS_OP_WRITE,
+						nr_files+i, d, p, pb);
+				pb += BENCH_IO_SIZE;
+				size = pb > size ? pb : size;
+			}
+			if (ret == 0)
+				ret = bench_put_close(&w, nr_files+i, d, p);
+			if (ret == 0)
+				ret = bench_put_close(&w, i, d, p);
+		}
+		else {
+			ret = bench_put_file(&w, TRFS_OP_WRITE, i, p,
+							BENCH_NR_IO/2);
+			if (ret == 0)
+				ret = bench_put_file(&w, TRFS_OP_READ, i, p,
+							BENCH_NR_IO/2);
+			if (ret == 0 && i%4 == 0)
+				ret = bench_put_rename(&w, d, p, q);
+			if (ret == 0 && i%4 == 0)
+				ret = bench_put_path(&w, TRFS_OP_UNLINK, d, q);
+		}
+	}
+	r = trfs_writer_close(&w);
+	return ret ? ret : r;
+}
+
+static int bench_rm(const char *path, const struct stat *st, int flag,
+							struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void bench_rm_tree(const char *dir)
+{
+	nftw(dir, bench_rm, 64, FTW_DEPTH|FTW_PHYS);
+}
+
+/** Checks whether two regular files have the same contents
+ */
+static int bench_same_data(const char *a, const char *b)
+{
+	int fa, fb;
+	int same = 1;
+	ssize_t na, nb;
+	static char ba[65536], bb[65536];
+
+	fa = open(a, O_RDONLY);
+	fb = open(b, O_RDONLY);
+	if (fa < 0 || fb < 0)
+		same = 0;
+	while (same) {
+		na = read(fa, ba, sizeof(ba));
+		nb = read(fb, bb, sizeof(bb));
+		if (na != nb || na < 0 || memcmp(ba, bb, na))
+			same = 0;
+		if (na <= 0)
+			break;
+	}
+	if (fa >= 0)
+		close(fa);
+	if (fb >= 0)
+		close(fb);
+	return same;
+}
+
+/** Compares an entry of cmp_ref with the one of the same name under
+ * cmp_run: the type, and the size and contents of regular files
+ */
+static int bench_cmp_ent(const char *path, const struct stat *st, int flag,
+							struct FTW *ftw)
+{
+	int same = 0;
+	char other[PATH_MAX];
+	struct stat ost;
+
+	if (ftw->level == 0)
+		return 0;
+	snprintf(other, sizeof(other), "%s%s", cmp_run,
+						path+strlen(cmp_ref));
+	if (lstat(other, &ost) == 0)
+		same = cmp_exist_only ||
+			((st->st_mode & S_IFMT) == (ost.st_mode & S_IFMT) &&
+			 (!S_ISREG(st->st_mode) ||
+			  (st->st_size == ost.st_size &&
+			   bench_same_data(path, other))));
+	if (!same && cmp_diff++ < 4)
+		printf("    %s differs\n", path+strlen(cmp_ref));
+	return 0;
+}
+
+/** Compares the tree run with the tree ref both ways.
+ * Returns the number of entries that differ.
+ */
+static int bench_cmp_tree(const char *ref, const char *run)
+{
+	cmp_diff = 0;
+	cmp_ref = ref;
+	cmp_run = run;
+	cmp_exist_only = 0;
+	nftw(ref, bench_cmp_ent, 64, FTW_PHYS);
+	cmp_ref = run;
+	cmp_run = ref;
+	cmp_exist_only = 1;
+	nftw(run, bench_cmp_ent, 64, FTW_PHYS);
+	return cmp_diff;
+}
+
+static void bench_lat_add(unsigned char type, uint64_t ns)
+{
+	bench_lat *l = &lat[type];
+	uint32_t *p = NULL;
+
+	if (l->nr == l->alloc) {
+		l->alloc = l->alloc ? l->alloc*2 : 4096;
+		p = (uint32_t *)realloc(l->ns, l->alloc*sizeof(uint32_t));
+		if (!p)
+			return;
+		l->ns = p;
+	}
+	l->ns[l->nr++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_pct(const uint32_t *ns, size_t nr, double pct)
+{
+	size_t i = nr*pct/100;
+
+	if (nr == 0)
+		return 0;
+	return ns[i < nr ? i : nr-1]/1e3;
+}
+
+/** Prints the latency percentiles of each op type and returns the
+ * percentiles over all ops in r
+ */
+static void bench_lat_report(bench_res *r)
+{
+	int t;
+	size_t nr = 0;
+	uint32_t *all = NULL;
+	bench_lat *l = NULL;
+
+	for (t = 0; t < TRFS_MAX_OPS; t++)
+		nr += lat[t].nr;
+	all = (uint32_t *)malloc((nr ? nr : 1)*sizeof(uint32_t));
+	nr = 0;
+	for (t = 0; t < TRFS_MAX_OPS; t++) {
+		l = &lat[t];
+		if (l->nr == 0)
+			continue;
+		qsort(l->ns, l->nr, sizeof(uint32_t), bench_cmp_u32);
+		printf("    %-10s %8zu ops  p50 %8.1f us  p90 %8.1f us  \
+p99 %8.1f us  max %8.1f us\n", trfs_op_name(t), l->nr,
+			bench_pct(l->ns, l->nr, 50), bench_pct(l->ns, l->nr, 90),
+			bench_pct(l->ns, l->nr, 99), l->ns[l->nr-1]/1e3);
+		if (all)
+			memcpy(all+nr, l->ns, l->nr*sizeof(uint32_t));
+		nr += l->nr;
+		l->nr = 0;
+	}
+	if (all) {
+		qsort(all, nr, sizeof(uint32_t), bench_cmp_u32);
+		r->p50 = bench_pct(all, nr, 50);
+		r->p90 = bench_pct(all, nr, 90);
+		r->p99 = bench_pct(all, nr, 99);
+	}
+	free(all);
+}
+
+/** Replays a tfile once in the given mode into an empty directory and
+ * keeps the best throughput in r. The first serial tree is kept as ref,
+ * the trees of the other modes are compared with it.
+ * Returns 1 if the mode can't run here.
+ */
+static int bench_once(const char *tfile, const char *mix, bench_mode mode,
+					const char *scratch, bench_res *r)
+{
+	int ret = 0;
+	uint64_t t0, t1, t2;
+	unsigned long long nr = 0, bytes = 0;
+	char *rec = NULL;
+	char run[PATH_MAX], ref[PATH_MAX];
+	struct stat st;
+	trfs_trace t;
+	trfs_rec_info ri;
+	trfs_preplay pr;
+	trfs_uring ur;
+	struct trfs_rpd *rpd = NULL;
+
+	memset(&pr, 0, sizeof(trfs_preplay));
+	memset(&ur, 0, sizeof(trfs_uring));
+	snprintf(run, sizeof(run), "%s/run", scratch);
+	snprintf(ref, sizeof(ref), "%s/ref", scratch);
+	if (mkdir(run, 0755) < 0 || trfs_trace_open(&t, tfile, 0) < 0)
+		return -EIO;
+
+	if (mode != BENCH_PARSE) {
+		rpd = trfs_rpd_init(run);
+		if (!rpd) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	if (mode == BENCH_JOBS_MODE &&
+	    trfs_preplay_init(&pr, rpd, nr_jobs) < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (mode == BENCH_URING) {
+		ret = trfs_uring_init(&ur, ur_depth);
+		if (ret < 0) {
+			printf("%-8s %-7s skipped: io_uring is not available \
+(%s)\n", mix, mode_names[mode], strerror(-ret));
+			ret = 1;
+			goto out;
+		}
+	}
+
+	t0 = bench_now_ns();
+again:
+	while ((rec = trfs_trace_next(&t)) != NULL) {
+		if (trfs_rec_info_get(rec, &ri) < 0)
+			continue;
+		nr++;
+		if (ri.type == TRFS_OP_READ || ri.type == TRFS_OP_WRITE)
+			bytes += ri.count;
+		switch (mode) {
+			case BENCH_SERIAL:
+				t1 = bench_now_ns();
+				trfs_replay_rec(rpd, rec);
+				bench_lat_add(ri.type, bench_now_ns()-t1);
+				break;
+			case BENCH_JOBS_MODE:
+				trfs_preplay_submit(&pr, rec);
+				break;
+			case BENCH_URING:
+				trfs_uring_submit(&ur, rpd, rec);
+				break;
+			default:
+				break;
+		}
+	}
+	if (mode == BENCH_PARSE && bench_now_ns()-t0 < BENCH_PARSE_NS) {
+		trfs_trace_close(&t);
+		if (trfs_trace_open(&t, tfile, 0) < 0) {
+			ret = -EIO;
+			goto out_run;
+		}
+		goto again;
+	}
+	if (mode == BENCH_JOBS_MODE)
+		trfs_preplay_flush(&pr);
+	if (mode == BENCH_URING)
+		trfs_uring_drain(&ur);
+	t2 = bench_now_ns();
+
+	if (t2 > t0 && nr*1e9/(t2-t0) > r->ops) {
+		r->nr = nr;
+		r->secs = (t2-t0)/1e9;
+		r->ops = nr*1e9/(t2-t0);
+		r->mbs = bytes*1e3/(t2-t0);
+	}
+	if (mode == BENCH_SERIAL && stat(ref, &st) < 0)
+		rename(run, ref);
+	else if (mode != BENCH_PARSE && stat(ref, &st) == 0)
+		r->diff += bench_cmp_tree(ref, run);
+out:
+	if (mode == BENCH_JOBS_MODE)
+		trfs_preplay_exit(&pr);
+	if (ur.depth)
+		trfs_uring_exit(&ur);
+	if (rpd)
+		trfs_rpd_exit(rpd);
+	trfs_trace_close(&t);
+out_run:
+	bench_rm_tree(run);
+	return ret;
+}
+
+/** Replays a tfile nr_runs times in the given mode and reports the best
+ * run; the latencies are those of all the runs
+ */
+static int bench_run(const char *tfile, const char *mix, bench_mode mode,
+							const char *scratch)
+{
+	int i;
+	int ret = 0;
+	bench_res *r = NULL;
+
+	if (nr_results == BENCH_MAX_RESULTS)
+		return -ENOSPC;
+	r = &results[nr_results];
+	memset(r, 0, sizeof(bench_res));
+	snprintf(r->mix, sizeof(r->mix), "%s", mix);
+	snprintf(r->mode, sizeof(r->mode), "%s", mode_names[mode]);
+	for (i = 0; i < nr_runs && ret == 0; i++)
+		ret = bench_once(tfile, mix, mode, scratch, r);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	nr_results++;
+	printf("%-8s %-7s %10llu ops in %8.3f s: %12.0f ops/s %10.1f MB/s\n",
+			mix, r->mode, r->nr, r->secs, r->ops, r->mbs);
+	if (r->diff) {
+		printf("    %d entries differ from the serial replay  \
+MISMATCH\n", r->diff);
+		nr_mismatch++;
+	}
+	if (mode == BENCH_SERIAL)
+		bench_lat_report(r);
+	return 0;
+}
+
+static int bench_save(const char *path)
+{
+	int i;
+	FILE *f = fopen(path, "w");
+
+	if (!f)
+		return -EIO;
+	fprintf(f, "# mix mode ops/s MB/s p50_us p90_us p99_us\n");
+	for (i = 0; i < nr_results; i++)
+		fprintf(f, "%s %s %.0f %.1f %.1f %.1f %.1f\n", results[i].mix,
+			results[i].mode, results[i].ops, results[i].mbs,
+			results[i].p50, results[i].p90, results[i].p99);
+	return fclose(f) ? -EIO : 0;
+}
+
+/** Compares the results with a saved baseline.
+ * Returns the number of runs whose ops/s dropped by more than pct.
+ */
+static int bench_compare(const char *path, double pct)
+{
+	int i;
+	int nr_reg = 0;
+	double chg;
+	char line[256];
+	bench_res b;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		printf("Opening the baseline %s: Failed\n", path);
+		return -EIO;
+	}
+	printf("\nCompared to %s:\n", path);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%31s %15s %lf %lf %lf %lf \
+%lf", b.mix, b.mode, &b.ops, &b.mbs, &b.p50, &b.p90, &b.p99) != 7)
+			continue;
+		for (i = 0; i < nr_results; i++)
+			if (!strcmp(results[i].mix, b.mix) &&
+			    !strcmp(results[i].mode, b.mode))
+				break;
+		if (i == nr_results || b.ops <= 0)
+			continue;
+		chg = (results[i].ops-b.ops)*100/b.ops;
+		printf("%-8s %-7s %12.0f ops/s, baseline %12.0f: %+6.1f%%",
+				b.mix, b.mode, results[i].ops, b.ops, chg);
+		if (b.p99 > 0)
+			printf(", p99 %.1f us, baseline %.1f us",
+						results[i].p99, b.p99);
+		if (chg < -pct) {
+			printf("  REGRESSION");
+			nr_reg++;
+		}
+		printf("\n");
+	}
+	fclose(f);
+	return nr_reg;
+}
+
+static void bench_usage(void)
+{
+	printf("Usage: replay_bench [-n files] [-m mix] [-f tfile] [-r runs] \
+[-j jobs] [-u depth] [-d dir] [-o baseline] [-c baseline] [-x pct]\n\
+mixes: meta, write, read, mixed, shared; -j 0 and -u 0 leave out a mode\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, m;
+	int choice;
+	int ret = 0;
+	int nr_mixes = 5;
+	const char *mixes[5] = { "meta", "write", "read", "mixed", "shared" };
+	const char *tfile = NULL;
+	const char *dir = NULL;
+	const char *save = NULL;
+	const char *base = NULL;
+	double pct = BENCH_THRESHOLD;
+	char scratch[PATH_MAX/2];	/* leaves room for the names under it */
+	char path[PATH_MAX];
+
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "n:m:f:r:j:u:d:o:c:x:")) != -1) {
+		switch (choice) {
+			case 'n':
+				nr_files = atoi(optarg);
+				break;
+			case 'm':
+				mixes[0] = optarg;
+				nr_mixes = 1;
+				break;
+			case 'f':
+				tfile = optarg;
+				break;
+			case 'r':
+				nr_runs = atoi(optarg);
+				break;
+			case 'j':
+				nr_jobs = atoi(optarg);
+				break;
+			case 'u':
+				ur_depth = atoi(optarg);
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'o':
+				save = optarg;
+				break;
+			case 'c':
+				base = optarg;
+				break;
+			case 'x':
+				pct = atof(optarg);
+				break;
+			default:
+				bench_usage();
+				return -EINVAL;
+		}
+	}
+	if (nr_files <= 0 || nr_runs <= 0 || nr_jobs < 0 || nr_jobs > TRFS_PR_MAX_WORKERS ||
+	    ur_depth < 0 || ur_depth > TRFS_UR_MAX_DEPTH || pct < 0) {
+		bench_usage();
+		return -EINVAL;
+	}
+
+	snprintf(scratch, sizeof(scratch), "%s/trfs_bench_XXXXXX",
+						dir ? dir : "/tmp");
+	if (!mkdtemp(scratch)) {
+		printf("Creating the scratch directory: Failed\n");
+		return -EIO;
+	}
+	if (tfile)
+		nr_mixes = 1;
+	for (i = 0; i < nr_mixes && ret == 0; i++) {
+		if (!tfile) {
+			snprintf(path, sizeof(path), "%s/%s.tfile", scratch,
+								mixes[i]);
+			ret = bench_gen(path, mixes[i]);
+			if (ret < 0) {
+				printf("Generating the %s tfile: Failed\n",
+								mixes[i]);
+				break;
+			}
+		}
+		for (m = 0; m < BENCH_NR_MODES && ret == 0; m++) {
+			if ((m == BENCH_JOBS_MODE && nr_jobs == 0) ||
+			    (m == BENCH_URING && ur_depth == 0))
+				continue;
+			ret = bench_run(tfile ? tfile : path,
+					tfile ? "file" : mixes[i], m, scratch);
+		}
+		if (!tfile)
+			unlink(path);
+		snprintf(path, sizeof(path), "%s/ref", scratch);
+		bench_rm_tree(path);
+	}
+	rmdir(scratch);
+	for (i = 0; i < TRFS_MAX_OPS; i++)
+		free(lat[i].ns);
+	if (ret < 0) {
+		printf("Replay benchmark: Failed (%s)\n", strerror(-ret));
+		return ret;
+	}
+
+	if (save && bench_save(save) < 0)
+		printf("Saving the baseline to %s: Failed\n", save);
+	if (base) {
+		ret = bench_compare(base, pct);
+		if (ret < 0)
+			return ret;
+	}
+	return ret > 0 || nr_mismatch > 0 ? 1 : 0;
+}
@@ -0,0 +1,812 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* trcol: columnar copy of a tfile and queries over it.
+ *
+ * -c converts a tfile into a directory with one file per field of the op
+ * records: rid, type, pid, ret, count, off (the file position of reads and
+ * writes), ts and path, the id of the name in the paths.dict dictionary.
+ * The columns are cut into blocks of 64k rows, each packed as offsets from
+ * a base in as few bytes as they need (deltas for rid and ts).
+ *
+ * A query maps only the columns it names, decodes them a block at a time
+ * and runs the filters and the aggregation as plain loops over the block:
+ *
+ *	$./trcol -c tfile tdir
+ *	$./trcol -w ret<0 -g type tdir		(failed ops by type)
+ *	$./trcol -w type=write -g pid -s count tdir	(bytes asked per pid)
+ *	$./trcol -w path^/var/log -g path -n 5 tdir
+ */
+
+#include <limits.h>
+#include <time.h>
+
+#include "trfs_ops.h"
+#include "trfs_parse.h"
+#include "trfs_col.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+typedef enum trcol_id_ {
+	TRCOL_RID,
+	TRCOL_TYPE,
+	TRCOL_PID,
+	TRCOL_RET,
+	TRCOL_COUNT,
+	TRCOL_OFF,
+	TRCOL_TS,
+	TRCOL_PATH,
+	TRCOL_NR
+}trcol_id;
+
+static const char *col_names[TRCOL_NR] = {
+	[TRCOL_RID]	=	"rid",
+	[TRCOL_TYPE]	=	"type",
+	[TRCOL_PID]	=	"pid",
+	[TRCOL_RET]	=	"ret",
+	[TRCOL_COUNT]	=	"count",
+	[TRCOL_OFF]	=	"off",
+	[TRCOL_TS]	=	"ts",
+	[TRCOL_PATH]	=	"path"
+};
+
+#define TRCOL_MAX_FILTERS	16
+#define TRCOL_TOP		20
+#define TRCOL_DICT		"paths.dict"
+
+typedef enum trcol_cmp_ {
+	TRCOL_EQ,
+	TRCOL_NE,
+	TRCOL_LT,
+	TRCOL_LE,
+	TRCOL_GT,
+	TRCOL_GE,
+	TRCOL_PREFIX		/* path starts with */
+}trcol_cmp;
+
+typedef struct trcol_filter_ {
+	int col;
+	int cmp;
+	int64_t val;
+	const char *str;	/* path filters */
+	uint8_t *match;		/* path ids that pass */
+}trcol_filter;
+
+/** Dictionary of the names, an id per distinct name
+ */
+typedef struct trcol_dict_ {
+	char *buf;
+	size_t len;
+	size_t alloc;
+	uint32_t *off;		/* of each name in buf, behind its length */
+	uint32_t nr;
+	uint32_t nr_alloc;
+	uint32_t *slot;		/* hash of the names, id+1, 0 if free */
+	uint32_t size;
+}trcol_dict;
+
+static uint32_t trcol_hash(const char *name, unsigned short len)
+{
+	uint32_t h = 2166136261U;
+	unsigned short i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static inline unsigned short trcol_dict_len(const trcol_dict *d, uint32_t id)
+{
+	unsigned short len;
+
+	memcpy(&len, d->buf+d->off[id], sizeof(unsigned short));
+	return len;
+}
+
+static inline const char *trcol_dict_name(const trcol_dict *d, uint32_t id)
+{
+	return d->buf+d->off[id]+sizeof(unsigned short);
+}
+
+static int trcol_dict_grow(trcol_dict *d)
+{
+	uint32_t i, j, size = d->size ? d->size*2 : 4096;
+	uint32_t *slot = (uint32_t *)calloc(size, sizeof(uint32_t));
+
+	if (!slot)
+		return -ENOMEM;
+	for (i = 0; i < d->size; i++) {
+		if (!d->slot[i])
+			continue;
+		j = trcol_hash(trcol_dict_name(d, d->slot[i]-1),
+			trcol_dict_len(d, d->slot[i]-1)) & (size-1);
+		while (slot[j])
+			j = (j+1) & (size-1);
+		slot[j] = d->slot[i];
+	}
+	free(d->slot);
+	d->slot = slot;
+	d->size = size;
+	return 0;
+}
+
+/** Id of the name, added to the dictionary if new, -1 on failure
+ */
+static int64_t trcol_dict_id(trcol_dict *d, const char *name,
+						unsigned short len)
+{
+	uint32_t i, id;
+	size_t need = sizeof(unsigned short)+len;
+	void *p = NULL;
+
+	if (d->nr+1 > d->size/4*3 && trcol_dict_grow(d) < 0)
+		return -1;
+	i = trcol_hash(name, len) & (d->size-1);
+	for (; d->slot[i]; i = (i+1) & (d->size-1)) {
+		id = d->slot[i]-1;
+		if (trcol_dict_len(d, id) == len &&
+		    !memcmp(trcol_dict_name(d, id), name, len))
+			return id;
+	}
+	if (d->len+need > d->alloc) {
+		d->alloc = d->alloc ? d->alloc*2 : 1024*1024;
+		while (d->len+need > d->alloc)
+			d->alloc *= 2;
+		p = realloc(d->buf, d->alloc);
+		if (!p)
+			return -1;
+		d->buf = (char *)p;
+	}
+	if (d->nr == d->nr_alloc) {
+		d->nr_alloc = d->nr_alloc ? d->nr_alloc*2 : 4096;
+		p = realloc(d->off, d->nr_alloc*sizeof(uint32_t));
+		if (!p)
+			return -1;
+		d->off = (uint32_t *)p;
+	}
+	d->off[d->nr] = d->len;
+	memcpy(d->buf+d->len, &len, sizeof(unsigned short));
+	memcpy(d->buf+d->len+sizeof(unsigned short), name, len);
+	d->len += need;
+	d->slot[i] = ++d->nr;
+	return d->nr-1;
+}
+
+static void trcol_dict_free(trcol_dict *d)
+{
+	free(d->buf);
+	free(d->off);
+	free(d->slot);
+	memset(d, 0, sizeof(trcol_dict));
+}
+
+/** Loads dir/paths.dict and indexes its names
+ */
+static int trcol_dict_load(trcol_dict *d, const char *dir)
+{
+	int fd;
+	size_t pos = 0;
+	struct stat st;
+	char path[PATH_MAX];
+	void *p = NULL;
+
+	memset(d, 0, sizeof(trcol_dict));
+	snprintf(path, sizeof(path), "%s/%s", dir, TRCOL_DICT);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -ENOENT;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -EIO;
+	}
+	d->len = st.st_size;
+	d->buf = (char *)malloc(d->len+1);
+	if (!d->buf || pread(fd, d->buf, d->len, 0) != (ssize_t)d->len) {
+		close(fd);
+		return -EIO;
+	}
+	close(fd);
+	while (pos+sizeof(unsigned short) <= d->len) {
+		if (d->nr == d->nr_alloc) {
+			d->nr_alloc = d->nr_alloc ? d->nr_alloc*2 : 4096;
+			p = realloc(d->off, d->nr_alloc*sizeof(uint32_t));
+			if (!p)
+				return -ENOMEM;
+			d->off = (uint32_t *)p;
+		}
+		d->off[d->nr++] = pos;
+		pos += sizeof(unsigned short)+trcol_dict_len(d, d->nr-1);
+	}
+	return pos == d->len ? 0 : -EINVAL;
+}
+
+/** Converts the op records of a tfile into columns
+ */
+static int trcol_convert(const char *tfile, const char *dir, int tflags)
+{
+	int i;
+	int ret = 0;
+	int64_t v[TRCOL_NR];
+	uint64_t bytes = 0;
+	unsigned long long nr = 0;
+	char *rec = NULL;
+	char path[PATH_MAX];
+	FILE *f = NULL;
+	trfs_trace t;
+	trfs_rec_info ri;
+	trfs_read_op rd;
+	trfs_write_op wr;
+	trcol_dict dict;
+	trfs_colw col[TRCOL_NR];
+
+	memset(&dict, 0, sizeof(trcol_dict));
+	memset(col, 0, sizeof(col));
+	for (i = 0; i < TRCOL_NR; i++)
+		col[i].fd = -1;
+	if (trfs_trace_open(&t, tfile, tflags) < 0) {
+		printf("Opening the tfile: Failed\n");
+		return -ENOENT;
+	}
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		printf("Creating %s: Failed\n", dir);
+		ret = -errno;
+		goto out;
+	}
+	for (i = 0; i < TRCOL_NR; i++) {
+		ret = trfs_colw_open(&col[i], dir, col_names[i],
+				i == TRCOL_RID || i == TRCOL_TS);
+		if (ret < 0) {
+			printf("Creating the %s column: Failed\n",
+							col_names[i]);
+			goto out;
+		}
+	}
+
+	while ((rec = trfs_trace_next(&t)) != NULL) {
+		if (trfs_rec_info_get(rec, &ri) < 0)
+			continue;
+		v[TRCOL_RID] = trfs_rec_id(rec);
+		v[TRCOL_TYPE] = ri.type;
+		v[TRCOL_PID] = ri.pid;
+		v[TRCOL_RET] = ri.ret;
+		v[TRCOL_COUNT] = ri.count;
+		v[TRCOL_OFF] = 0;
+		if (ri.type == TRFS_OP_READ) {
+			TRFS_REC_LOAD(rd, rec, pathname);
+			v[TRCOL_OFF] = rd.ppos;
+		}
+		else if (ri.type == TRFS_OP_WRITE) {
+			TRFS_REC_LOAD(wr, rec, pathname);
+			v[TRCOL_OFF] = wr.ppos;
+		}
+		v[TRCOL_TS] = ri.ts;
+		v[TRCOL_PATH] = trcol_dict_id(&dict, ri.name, ri.len);
+		if (v[TRCOL_PATH] < 0) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < TRCOL_NR; i++) {
+			ret = trfs_colw_add(&col[i], v[i]);
+			if (ret < 0)
+				goto out;
+		}
+		nr++;
+	}
+	if (t.err)
+		printf("Corrupted or truncated record at offset %lld: \
+stopping\n", (long long)trfs_trace_offset(&t));
+
+	snprintf(path, sizeof(path), "%s/%s", dir, TRCOL_DICT);
+	f = fopen(path, "w");
+	if (!f || fwrite(dict.buf, 1, dict.len, f) != dict.len) {
+		printf("Writing the path dictionary: Failed\n");
+		ret = -EIO;
+	}
+	if (f && fclose(f) != 0)
+		ret = -EIO;
+out:
+	/* Closing flushes the last block of each column */
+	for (i = 0; i < TRCOL_NR; i++) {
+		if (trfs_colw_close(&col[i]) < 0)
+			ret = -EIO;
+		bytes += col[i].bytes;
+	}
+	if (ret == 0)
+		printf("Converted %llu records of %lld bytes into %llu bytes \
+of columns and %zu bytes of %u names\n", nr, (long long)t.fsize,
+			(unsigned long long)bytes, dict.len, dict.nr);
+	trcol_dict_free(&dict);
+	trfs_trace_close(&t);
+	return ret;
+}
+
+static int trcol_col_id(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < TRCOL_NR; i++)
+		if (strlen(col_names[i]) == len &&
+		    !strncmp(col_names[i], name, len))
+			return i;
+	return -1;
+}
+
+/** Parses col<cmp>value, the types may be given by name
+ */
+static int trcol_parse_filter(const char *s, trcol_filter *f)
+{
+	int i;
+	size_t n = strcspn(s, "=!<>^");
+	const char *v = s+n;
+	char *end = NULL;
+
+	memset(f, 0, sizeof(trcol_filter));
+	f->col = trcol_col_id(s, n);
+	if (f->col < 0)
+		return -EINVAL;
+	if (!strncmp(v, "!=", 2))
+		f->cmp = TRCOL_NE, v += 2;
+	else if (!strncmp(v, "<=", 2))
+		f->cmp = TRCOL_LE, v += 2;
+	else if (!strncmp(v, ">=", 2))
+		f->cmp = TRCOL_GE, v += 2;
+	else if (*v == '=')
+		f->cmp = TRCOL_EQ, v++;
+	else if (*v == '<')
+		f->cmp = TRCOL_LT, v++;
+	else if (*v == '>')
+		f->cmp = TRCOL_GT, v++;
+	else if (*v == '^' && f->col == TRCOL_PATH)
+		f->cmp = TRCOL_PREFIX, v++;
+	else
+		return -EINVAL;
+
+	if (f->col == TRCOL_PATH) {
+		if (f->cmp != TRCOL_EQ && f->cmp != TRCOL_NE &&
+		    f->cmp != TRCOL_PREFIX)
+			return -EINVAL;
+		f->str = v;
+		return 0;
+	}
+	if (f->col == TRCOL_TYPE) {
+		for (i = 1; i < TRFS_MAX_OPS; i++) {
+			if (!strcmp(v, trfs_op_name(i))) {
+				f->val = i;
+				return 0;
+			}
+		}
+	}
+	f->val = strtoll(v, &end, 0);
+	return *v && !*end ? 0 : -EINVAL;
+}
+
+/** Path filters become a table of the ids that pass
+ */
+static int trcol_match_paths(trcol_filter *f, const trcol_dict *d)
+{
+	uint32_t id;
+	size_t len = strlen(f->str);
+	unsigned short n;
+	int hit;
+
+	f->match = (uint8_t *)malloc(d->nr+1);
+	if (!f->match)
+		return -ENOMEM;
+	for (id = 0; id < d->nr; id++) {
+		n = trcol_dict_len(d, id);
+		if (f->cmp == TRCOL_PREFIX)
+			hit = n >= len &&
+				!memcmp(trcol_dict_name(d, id), f->str, len);
+		else
+			hit = n == len &&
+				!memcmp(trcol_dict_name(d, id), f->str, len);
+		f->match[id] = f->cmp == TRCOL_NE ? !hit : hit;
+	}
+	return 0;
+}
+
+/** Narrows the selection of a block down by one filter
+ * The comparison is picked once per block, the loops vectorize.
+ */
+static void trcol_apply(const trcol_filter *f, const int64_t *v,
+					uint8_t *sel, unsigned int n, uint32_t nr_paths)
+{
+	unsigned int i;
+	int64_t c = f->val;
+
+	if (f->col == TRCOL_PATH) {
+		for (i = 0; i < n; i++)
+			sel[i] &= (uint64_t)v[i] < nr_paths ? f->match[v[i]] : 0;
+		return;
+	}
+	switch (f->cmp) {
+		case TRCOL_EQ:
+			for (i = 0; i < n; i++)
+				sel[i] &= v[i] == c;
+			break;
+		case TRCOL_NE:
+			for (i = 0; i < n; i++)
+				sel[i] &= v[i] != c;
+			break;
+		case TRCOL_LT:
+			for (i = 0; i < n; i++)
+				sel[i] &= v[i] < c;
+			break;
+		case TRCOL_LE:
+			for (i = 0; i < n; i++)
+				sel[i] &= v[i] <= c;
+			break;
+		case TRCOL_GT:
+			for (i = 0; i < n; i++)
+				sel[i] &= v[i] > c;
+			break;
+		case TRCOL_GE:
+			for (i = 0; i < n; i++)
+				sel[i] &= v[i] >= c;
+			break;
+	}
+}
+
+/** A group of the aggregation
+ */
+typedef struct trcol_grp_ {
+	int64_t key;
+	int used;
+	unsigned long long nr;
+	long long sum;
+}trcol_grp;
+
+typedef struct trcol_agg_ {
+	trcol_grp *grp;
+	unsigned int size;
+	unsigned int count;
+}trcol_agg;
+
+static trcol_grp *trcol_agg_get(trcol_agg *a, int64_t key)
+{
+	unsigned int i, j, size;
+	uint64_t h = (uint64_t)key*0x9e3779b97f4a7c15ULL;
+	trcol_grp *g = NULL;
+
+	if (a->count+1 > a->size/4*3) {
+		size = a->size ? a->size*2 : 1024;
+		g = (trcol_grp *)calloc(size, sizeof(trcol_grp));
+		if (!g)
+			return NULL;
+		for (i = 0; i < a->size; i++) {
+			if (!a->grp[i].used)
+				continue;
+			j = ((uint64_t)a->grp[i].key*0x9e3779b97f4a7c15ULL >>
+							32) & (size-1);
+			while (g[j].used)
+				j = (j+1) & (size-1);
+			g[j] = a->grp[i];
+		}
+		free(a->grp);
+		a->grp = g;
+		a->size = size;
+	}
+	for (i = (h >> 32) & (a->size-1);; i = (i+1) & (a->size-1)) {
+		g = &a->grp[i];
+		if (!g->used) {
+			g->used = 1;
+			g->key = key;
+			a->count++;
+			return g;
+		}
+		if (g->key == key)
+			return g;
+	}
+}
+
+static int trcol_cmp_grp(const void *a, const void *b)
+{
+	const trcol_grp *g1 = a, *g2 = b;
+
+	if (g1->nr != g2->nr)
+		return g1->nr < g2->nr ? 1 : -1;
+	return g1->key < g2->key ? -1 : g1->key > g2->key;
+}
+
+/** Prints a name as a JSON string
+ */
+static void trcol_json_str(const char *s, unsigned short len)
+{
+	unsigned short i;
+	unsigned char c;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void trcol_print_key(int col, int64_t key, const trcol_dict *d,
+								int json)
+{
+	if (col == TRCOL_TYPE) {
+		printf(json ? "\"%s\"" : "%-24s", trfs_op_name(key));
+	}
+	else if (col == TRCOL_PATH && (uint64_t)key < d->nr) {
+		if (json)
+			trcol_json_str(trcol_dict_name(d, key),
+						trcol_dict_len(d, key));
+		else
+			printf("%-24.*s", trcol_dict_len(d, key),
+						trcol_dict_name(d, key));
+	}
+	else {
+		printf(json ? "%lld" : "%-24lld", (long long)key);
+	}
+}
+
+/** Runs the filters over the columns and aggregates what passes
+ */
+static int trcol_query(const char *dir, trcol_filter *filt, int nr_filt,
+			int group, int sum, int top, int json)
+{
+	int i;
+	int ret = 0;
+	int need[TRCOL_NR];
+	unsigned int b, j, n, nr_blocks = 0;
+	unsigned long long nr = 0, total = 0;
+	long long s = 0;
+	double secs;
+	struct timespec ts0, ts1;
+	uint8_t *sel = NULL;
+	int64_t *v[TRCOL_NR];
+	trfs_col col[TRCOL_NR];
+	trcol_dict dict;
+	trcol_agg agg;
+	trcol_grp *g = NULL;
+
+	memset(need, 0, sizeof(need));
+	memset(v, 0, sizeof(v));
+	memset(col, 0, sizeof(col));
+	memset(&dict, 0, sizeof(trcol_dict));
+	memset(&agg, 0, sizeof(trcol_agg));
+
+	/* Only the columns the query names are mapped */
+	for (i = 0; i < nr_filt; i++)
+		need[filt[i].col] = 1;
+	if (group >= 0)
+		need[group] = 1;
+	if (sum >= 0)
+		need[sum] = 1;
+	need[TRCOL_TYPE] = 1;	/* gives the number of rows */
+
+	if (need[TRCOL_PATH] && trcol_dict_load(&dict, dir) < 0) {
+		printf("Loading the path dictionary: Failed\n");
+		ret = -ENOENT;
+		goto out;
+	}
+	for (i = 0; i < nr_filt; i++) {
+		if (filt[i].col == TRCOL_PATH &&
+		    trcol_match_paths(&filt[i], &dict) < 0) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	/* The type column first, the others must have as many rows */
+	for (j = 0; j < TRCOL_NR; j++) {
+		i = j ? (j == TRCOL_TYPE ? 0 : j) : TRCOL_TYPE;
+		if (!need[i])
+			continue;
+		if (trfs_col_open(&col[i], dir, col_names[i]) < 0) {
+			printf("Opening the %s column: Failed\n", col_names[i]);
+			ret = -ENOENT;
+			goto out;
+		}
+		if (col[i].tlr->nr_rows != col[TRCOL_TYPE].tlr->nr_rows ||
+		    col[i].tlr->nr_blocks != col[TRCOL_TYPE].tlr->nr_blocks) {
+			printf("The %s column has %llu rows, not %llu\n",
+				col_names[i],
+				(unsigned long long)col[i].tlr->nr_rows,
+			(unsigned long long)col[TRCOL_TYPE].tlr->nr_rows);
+			ret = -EINVAL;
+			goto out;
+		}
+		v[i] = (int64_t *)malloc(TRFS_COL_BLOCK*sizeof(int64_t));
+		if (!v[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		nr_blocks = col[i].tlr->nr_blocks;
+	}
+	sel = (uint8_t *)malloc(TRFS_COL_BLOCK);
+	if (!sel) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	for (b = 0; b < nr_blocks; b++) {
+		n = trfs_col_read(&col[TRCOL_TYPE], b, v[TRCOL_TYPE]);
+		total += n;
+		memset(sel, 1, n);
+		for (i = 0; i < TRCOL_NR; i++)
+			if (need[i] && i != TRCOL_TYPE &&
+			    trfs_col_read(&col[i], b, v[i]) != n)
+				n = 0;
+		for (i = 0; i < nr_filt; i++)
+			trcol_apply(&filt[i], v[filt[i].col], sel, n, dict.nr);
+
+		if (group < 0) {
+			for (j = 0; j < n; j++)
+				nr += sel[j];
+			if (sum >= 0)
+				for (j = 0; j < n; j++)
+					s += sel[j] ? v[sum][j] : 0;
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			if (!sel[j])
+				continue;
+			g = trcol_agg_get(&agg, v[group][j]);
+			if (!g) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			g->nr++;
+			if (sum >= 0)
+				g->sum += v[sum][j];
+			nr++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	secs = (ts1.tv_sec-ts0.tv_sec)+(ts1.tv_nsec-ts0.tv_nsec)/1e9;
+
+	if (group < 0) {
+		if (json && sum >= 0)
+			printf("{\"rows\": %llu, \"matched\": %llu, \
+\"sum\": %lld}\n", total, nr, s);
+		else if (json)
+			printf("{\"rows\": %llu, \"matched\": %llu}\n",
+								total, nr);
+		else if (sum >= 0)
+			printf("%llu of %llu records match, sum of %s %lld\n",
+					nr, total, col_names[sum], s);
+		else
+			printf("%llu of %llu records match\n", nr, total);
+		goto done;
+	}
+
+	/* The groups are packed to the front and sorted by count */
+	for (b = 0, j = 0; b < agg.size; b++)
+		if (agg.grp[b].used)
+			agg.grp[j++] = agg.grp[b];
+	qsort(agg.grp, agg.count, sizeof(trcol_grp), trcol_cmp_grp);
+	if (top <= 0 || top > (int)agg.count)
+		top = agg.count;
+	if (json)
+		printf("{\"rows\": %llu, \"matched\": %llu, \"groups\": [",
+								total, nr);
+	else
+		printf("%-24s %14s%s%s\n", col_names[group], "records",
+			sum >= 0 ? "      sum of " : "",
+			sum >= 0 ? col_names[sum] : "");
+	for (i = 0; i < top; i++) {
+		g = &agg.grp[i];
+		if (json) {
+			printf("%s\n  {\"%s\": ", i ? "," : "",
+							col_names[group]);
+			trcol_print_key(group, g->key, &dict, 1);
+			printf(", \"records\": %llu", g->nr);
+			if (sum >= 0)
+				printf(", \"sum\": %lld", g->sum);
+			printf("}");
+			continue;
+		}
+		trcol_print_key(group, g->key, &dict, 0);
+		printf(" %14llu", g->nr);
+		if (sum >= 0)
+			printf(" %14lld", g->sum);
+		printf("\n");
+	}
+	if (json)
+		printf("\n]}\n");
+	else
+		printf("%llu of %llu records match, %u groups\n", nr, total,
+								agg.count);
+done:
+	if (!json)
+		printf("Scanned %u blocks in %.3f s\n", nr_blocks, secs);
+out:
+	for (i = 0; i < TRCOL_NR; i++) {
+		trfs_col_close(&col[i]);
+		free(v[i]);
+	}
+	for (i = 0; i < nr_filt; i++)
+		free(filt[i].match);
+	free(sel);
+	free(agg.grp);
+	trcol_dict_free(&dict);
+	return ret;
+}
+
+static void trcol_usage(void)
+{
+	printf("Usage: trcol [-b] -c tfile dir\n\
+       trcol [-w col<cmp>value]... [-g col] [-s col] [-n top] [-J] dir\n\
+columns: rid type pid ret count off ts path, cmp: = != < <= > >= and ^ \
+(path prefix)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int choice;
+	int json = 0;
+	int top = TRCOL_TOP;
+	int tflags = 0;
+	int group = -1, sum = -1;
+	int nr_filt = 0;
+	const char *tfile = NULL;
+	trcol_filter filt[TRCOL_MAX_FILTERS];
+
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "bc:w:g:s:n:J")) != -1) {
+		switch (choice) {
+			case 'b':
+				tflags |= TRFS_TRACE_STREAM;
+				break;
+			case 'c':
+				tfile = optarg;
+				break;
+			case 'w':
+				if (nr_filt == TRCOL_MAX_FILTERS ||
+				    trcol_parse_filter(optarg,
+						&filt[nr_filt]) < 0) {
+					printf("Bad filter %s\n", optarg);
+					return -EINVAL;
+				}
+				nr_filt++;
+				break;
+			case 'g':
+				group = trcol_col_id(optarg, strlen(optarg));
+				if (group < 0) {
+					printf("Unknown column %s\n", optarg);
+					return -EINVAL;
+				}
+				break;
+			case 's':
+				sum = trcol_col_id(optarg, strlen(optarg));
+				if (sum < 0 || sum == TRCOL_PATH ||
+				    sum == TRCOL_TYPE) {
+					printf("Can't sum column %s\n", optarg);
+					return -EINVAL;
+				}
+				break;
+			case 'n':
+				top = atoi(optarg);
+				break;
+			case 'J':
+				json = 1;
+				break;
+			default:
+				trcol_usage();
+				return -EINVAL;
+		}
+	}
+	if (optind != argc-1) {
+		trcol_usage();
+		return -EINVAL;
+	}
+	if (tfile)
+		return trcol_convert(tfile, argv[optind], tflags);
+	return trcol_query(argv[optind], filt, nr_filt, group, sum, top, json);
+}
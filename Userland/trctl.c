@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -9,29 +10,149 @@
 
 #include "trctl.h" 
 
+/** Asks trfs to dump its flight recorder to path, "-" copies the dump
+ * from a temporary file to stdout
+ */
+static int trctl_dump(int fd, const char *path)
+{
+	int dfd;
+	int ret = 0;
+	ssize_t bytes;
+	char buf[65536];
+
+	if (strcmp(path, "-") == 0)
+		dfd = open("/tmp", O_TMPFILE|O_RDWR, 0600);
+	else
+		dfd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (dfd < 0)
+		return -errno;
+	if (ioctl(fd, IOCTL_TRFS_DUMP, dfd) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if (strcmp(path, "-") == 0) {
+		lseek(dfd, 0, SEEK_SET);
+		while ((bytes = read(dfd, buf, sizeof(buf))) > 0)
+			if (write(1, buf, bytes) != bytes) {
+				ret = -EIO;
+				break;
+			}
+	}
+out:
+	close(dfd);
+	return ret;
+}
+
+/** Parses full, count or sample:N into the level args
+ */
+static int trctl_level(const char *level, trctl_level_args *largs)
+{
+	if (strcmp(level, "full") == 0)
+		largs->level = 0;
+	else if (strcmp(level, "count") == 0)
+		largs->level = 2;
+	else if (strncmp(level, "sample:", 7) == 0 && atoi(level+7) > 0) {
+		largs->level = 1;
+		largs->sample = atoi(level+7);
+	}
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static void trctl_stats_print(int fd)
+{
+	int i;
+	trctl_stats st;
+	const char *levels[] = {"full", "sampled", "counters"};
+
+	if (ioctl(fd, IOCTL_TRFS_GET_STATS, &st) < 0) {
+		printf("Getting the counters: Failed \n");
+		return;
+	}
+	printf("level %s%s, %llu ops traced, %llu triggers fired\n",
+		st.level >= 0 && st.level <= 2 ? levels[st.level] : "?",
+		st.full ? " (full tracing window open)" : "",
+		(unsigned long long)st.nr_traced,
+		(unsigned long long)st.nr_fired);
+	printf("dropped by the queue: %llu data, %llu file, %llu namespace\n",
+		(unsigned long long)st.nr_dropped[0],
+		(unsigned long long)st.nr_dropped[1],
+		(unsigned long long)st.nr_dropped[2]);
+	printf("op        count       errors\n");
+	for (i = 0; i < TRCTL_MAX_OPS; i++)
+		if (st.nr_ops[i])
+			printf("%2d %12llu %12llu\n", i,
+				(unsigned long long)st.nr_ops[i],
+				(unsigned long long)st.nr_err[i]);
+}
+
 int main( int argc, char *argv[]) 
 {
 	int retval = 0;
 	char *cmd = NULL;
+	char *dump = NULL;
 	char mpoint[256];
 	int fd, choice, ret = 0;
+	int rotate = 0;
+	int set_level = 0, fire = 0, stats = 0;
 	trctl_args *args = NULL;
+	trctl_level_args largs;
 
 	/* Validate the number of command line parameters. */
 	if (argc<2)  {
-		printf("Invalid arguments: Please try ./trctl [cmd] \
-				 TrfsMountPoint\n");
+		printf("Invalid arguments: Please try ./trctl [-c cmd] [-r] \
+				 [-d file] [-L level] [-E errno] [-P prefix] \
+				 [-l usecs] [-w secs] [-f] [-s] TrfsMountPoint\n");
 		goto out;
 
 	}
 
 	/* Extract the flags. */
 	opterr = 0;
- 	while ((choice = getopt (argc, argv, "c:")) != -1) {
+	memset(&largs, 0, sizeof(trctl_level_args));
+ 	while ((choice = getopt (argc, argv, "c:rd:L:E:P:l:w:fs")) != -1) {
 		switch(choice) {
 			case 'c':
 				cmd = optarg;
 				break;
+			case 'r':
+				rotate = 1;
+				break;
+			case 'd':
+				dump = optarg;
+				break;
+			case 'L':
+				if (trctl_level(optarg, &largs) < 0) {
+					printf("Level is full, count or \
+sample:N\n");
+					goto out;
+				}
+				set_level = 1;
+				break;
+			case 'E':
+				largs.err = atoi(optarg);
+				set_level = 1;
+				break;
+			case 'P':
+				strncpy(largs.prefix, optarg,
+						sizeof(largs.prefix)-1);
+				set_level = 1;
+				break;
+			case 'l':
+				largs.lat_ns = strtoull(optarg, NULL, 10)*1000;
+				set_level = 1;
+				break;
+			case 'w':
+				largs.window = atoi(optarg);
+				set_level = 1;
+				break;
+			case 'f':
+				fire = 1;
+				break;
+			case 's':
+				stats = 1;
+				break;
 			case '?' :
 				perror("Unknown option character.\n");
 				goto out;
@@ -51,7 +172,35 @@ int main( int argc, char *argv[])
                 printf("Error in opening file \n");
                 exit(-1);
         }
-	if (cmd) {
+	if (rotate) {
+		/* Close the current tfile segment and start the next one */
+ 		retval = ioctl(fd, IOCTL_TRFS_ROTATE, 0); 
+		if (retval < 0)
+			printf("Rotating the tfile: Failed \n");
+	}
+	else if (dump) {
+		/* Freeze the flight recorder and write it out as a tfile */
+		ret = trctl_dump(fd, dump);
+		if (ret < 0)
+			fprintf(stderr, "Dumping the flight recorder: %s \n",
+							strerror(-ret));
+	}
+	else if (set_level) {
+		/* The level and all the triggers are replaced at once */
+		retval = ioctl(fd, IOCTL_TRFS_SET_LEVEL, &largs);
+		if (retval < 0)
+			printf("Setting the level: Failed \n");
+	}
+	else if (fire) {
+		/* Full tracing for the window of the triggers */
+		retval = ioctl(fd, IOCTL_TRFS_FIRE, 0);
+		if (retval < 0)
+			printf("Firing the trigger: Failed \n");
+	}
+	else if (stats) {
+		trctl_stats_print(fd);
+	}
+	else if (cmd) {
 		args = (trctl_args *)malloc(sizeof(trctl_args));
 		if (strcmp(cmd, "all")==0)
 			args->bitmap = ~(args->bitmap&0);
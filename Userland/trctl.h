@@ -1,4 +1,5 @@
 #include <linux/ioctl.h>
+#include <stdint.h>
 
 #ifndef __TRFS_IOCTL_BITMAP__
 #define __TRFS_IOCTL_BITMAP__
@@ -6,11 +7,41 @@
 #define IOC_MAGIC 'k'
 #define IOCTL_TRFS_SET_BITMAP _IO(IOC_MAGIC,0) 
 #define IOCTL_TRFS_GET_BITMAP _IO(IOC_MAGIC,1) 
+#define IOCTL_TRFS_ROTATE _IO(IOC_MAGIC,2) 
+#define IOCTL_TRFS_DUMP _IO(IOC_MAGIC,3) 
+#define IOCTL_TRFS_SET_LEVEL _IO(IOC_MAGIC,4) 
+#define IOCTL_TRFS_FIRE _IO(IOC_MAGIC,5) 
+#define IOCTL_TRFS_GET_STATS _IO(IOC_MAGIC,6) 
+
+#define TRCTL_MAX_OPS 32
+#define TRCTL_NR_PRI 3
 
 typedef struct trctl_args_ {
 	unsigned int bitmap;
 }trctl_args;
 
+/** Tracing level and the triggers that escalate it to full tracing
+ */
+typedef struct trctl_level_args_ {
+	int level;			/* 0 full, 1 sampled, 2 counters */
+	unsigned int sample;		/* one op in sample is traced */
+	int err;			/* errno that fires, 0 for none */
+	unsigned int window;		/* seconds of full tracing */
+	uint64_t lat_ns;		/* latency that fires, 0 for none */
+	char prefix[256];		/* path under the mount that fires */
+}trctl_level_args;
+
+typedef struct trctl_stats_ {
+	uint64_t nr_ops[TRCTL_MAX_OPS];
+	uint64_t nr_err[TRCTL_MAX_OPS];
+	uint64_t nr_traced;		/* ops that got a record */
+	uint64_t nr_fired;		/* triggers fired */
+	uint64_t nr_dropped[TRCTL_NR_PRI];	/* refused by a full queue,
+						 * data, file and namespace */
+	int level;
+	int full;			/* a trigger window is open */
+}trctl_stats;
+
 int trfs_ioctl_init(void);
 void trfs_ioctl_exit(void);
 
@@ -25,86 +25,201 @@
  * **                                                                            **
  * *******************************************************************************/
 
-#include "trfs_ops.h"
+#include <limits.h>
+#include <time.h>
 
-#define PAGE_SIZE 4096
+#include "trfs_ops.h"
+#include "trfs_index.h"
+#include "trfs_parse.h"
+#include "trfs_preplay.h"
+#include "trfs_uring.h"
 
 int gflags = 0;
+int gquiet = 0;
+
+/** Range of records to replay, set by the -R, -T and -O options
+ */
+static unsigned int first_id = 0;
+static unsigned int last_id = UINT_MAX;
+static int op_type = -1;
+static int range_done = 0;
+static double t_lo = 0, t_hi = -1;	/* seconds from the first record */
+static uint64_t trace_t0 = 0;		/* time of the first record, in ns */
+
+/** Dry run: parse the records without replaying them (-d)
+ */
+static int dry_run = 0;
+static unsigned long long nr_parsed = 0;
+static unsigned long long bytes_parsed = 0;
+
+/** Parallel replay on a pool of workers (-j)
+ */
+static int nr_jobs = 1;
+static trfs_preplay preplay;
+
+/** Asynchronous replay through io_uring with up to ur_depth ops in flight
+ * (-u)
+ */
+static unsigned int ur_depth = 0;
+static trfs_uring uring;
+
+/** Timed replay (-t speed): every record is issued at its offset from the
+ * first replayed record in the trace, divided by speed. 0 replays as fast
+ * as possible.
+ */
+#define TRFS_LATE_NS	1000000ULL
+
+static double speed = 0;
+static uint64_t sched_ts0 = 0;	/* trace time of the first replayed record */
+static uint64_t sched_t0 = 0;	/* monotonic time it was replayed at */
+static uint64_t sched_due = 0;	/* when the last record was due */
+static uint64_t lag_sum = 0, lag_max = 0;
+static unsigned long long nr_timed = 0, nr_late = 0;
+
+/** Checks whether a record is outside the requested range
+ * param[in] rec Record
+ */
+static int trfs_rec_skip(const char *rec)
+{
+	unsigned int rid = trfs_rec_id(rec);
+	unsigned char rtype = trfs_rec_type(rec);
+	uint64_t ts = 0;
+
+	/* Segment headers, footers and index records are not replayed */
+	if (rtype >= TRFS_MAX_OPS)
+		return 1;
+	ts = trfs_rec_ts(rec);
+	if (trace_t0 == 0)
+		trace_t0 = ts;
+	if (ts < trace_t0+t_lo*1e9)
+		return 1;
+	if (t_hi >= 0 && ts > trace_t0+t_hi*1e9)
+		return 1;
+	if (rid > last_id) {
+		range_done = 1;
+		return 1;
+	}
+	if (rid < first_id)
+		return 1;
+	if (op_type >= 0 && rtype != op_type)
+		return 1;
+	return 0;
+}
+
+static uint64_t trfs_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
 
-/** Reads the tfile into a page and reads each record from the page buffer
- * param[in] buf buffer
- * param[in] len Length of the buffer
+/** Sleeps until the record is due, or notes how late it is
+ * param[in] rec Record about to be replayed
  */
-static unsigned int trfs_read_tfile_buf(struct trfs_rpd *this,
-						 	char *buf, int len)
+static void trfs_replay_wait(const char *rec)
+{
+	uint64_t ts = trfs_rec_ts(rec);
+	uint64_t now = trfs_now_ns();
+	uint64_t lag = 0;
+	struct timespec due;
+
+	if (nr_timed++ == 0) {
+		sched_ts0 = ts;
+		sched_t0 = now;
+		sched_due = now;
+		return;
+	}
+	/* Records that were queued out of order are simply due at once */
+	sched_due = sched_t0;
+	if (ts > sched_ts0)
+		sched_due += (uint64_t)((ts-sched_ts0)/speed);
+
+	if (now < sched_due) {
+		/* The workers get what is due so far before we sleep */
+		if (preplay.nr_workers)
+			trfs_preplay_flush(&preplay);
+		now = trfs_now_ns();
+	}
+	if (now < sched_due) {
+		due.tv_sec = sched_due/1000000000ULL;
+		due.tv_nsec = sched_due%1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		return;
+	}
+	lag = now-sched_due;
+	lag_sum += lag;
+	if (lag > lag_max)
+		lag_max = lag;
+	if (lag > TRFS_LATE_NS)
+		nr_late++;
+}
+
+/** Replays the records between two offsets of the tfile
+ * The records are decoded in place from the mapping of the tfile.
+ * param[in] t View of the tfile
+ * param[in] start Offset of the first record
+ * param[in] end Offset where the replay stops
+ */
+static void trfs_replay_range(struct trfs_rpd *rpd, trfs_trace *t,
+						off_t start, off_t end)
 {
 	char *rec = NULL;
-	int ret = 0;
-	unsigned short rsize = 0;
-	unsigned char rtype = 0;
-
-	while (len>0) {
-		memcpy(&rsize, buf+sizeof(int), sizeof(unsigned short));
-		if (rsize>len) {
-			ret = rsize;
-			break;	
-		}
-		rec = (char *)malloc(rsize);
-		memcpy(rec, buf, rsize);
-		rtype = rec[sizeof(int)+sizeof(unsigned short)];
-		switch (rtype) {
-			case TRFS_OP_MKDIR:
-				this->ops->replay_mkdir_op(this,\
-							 (trfs_mkdir_op *)buf);
-				break;
-			case TRFS_OP_RMDIR:
-				this->ops->replay_rmdir_op(this,\
-							(trfs_rmdir_op *)buf);
-				break;
-			case TRFS_OP_LINK:
-				this->ops->replay_link_op(this,\
-							(trfs_link_op *)buf);
-				break;
-			case TRFS_OP_SYMLINK:
-				this->ops->replay_symlink_op(this,\
-							(trfs_symlink_op *)buf);
-				break;
-			case TRFS_OP_UNLINK:
-				this->ops->replay_unlink_op(this,\
-							(trfs_unlink_op *)buf);
-				break;
-			case TRFS_OP_TRUNCATE:
-				this->ops->replay_trunct_op(this,\
-							(trfs_trunct_op *)buf);
-				break;
-			case TRFS_OP_RENAME:
-				this->ops->replay_rename_op(this,\
-							(trfs_rename_op *)buf);
-				break;
-			case TRFS_OP_OPEN:
-				this->ops->replay_open_op(this,\
-							(trfs_open_op *)buf);
-				break;
-			case TRFS_OP_READ:
-				this->ops->replay_read_op(this,\
-							(trfs_read_op *)buf);
-				break;
-			case TRFS_OP_WRITE:
-				this->ops->replay_write_op(this,\
-							(trfs_write_op *)buf);
-				break;
-			case TRFS_OP_CLOSE:
-				this->ops->replay_close_op(this,\
-							(trfs_close_op *)buf);
-				break;
-			default:
-				break;
-		}
-		len -= rsize;
-		buf += rsize;	
-		free(rec);
+
+	if (trfs_trace_seek(t, start, end) < 0) {
+		printf("Seeking in the tfile: Failed\n");
+		return;
+	}
+	while (!range_done && (rec = trfs_trace_next(t)) != NULL) {
+		if (trfs_rec_skip(rec))
+			continue;
+		/* A dry run parses the records the replay would take */
+		nr_parsed++;
+		bytes_parsed += trfs_rec_size(rec);
+		if (dry_run)
+			continue;
+		if (speed > 0)
+			trfs_replay_wait(rec);
+		if (nr_jobs > 1)
+			trfs_preplay_submit(&preplay, rec);
+		else if (ur_depth)
+			trfs_uring_submit(&uring, rpd, rec);
+		else
+			trfs_replay_rec(rpd, rec);
+	}
+	if (t->err)
+		printf("Corrupted or truncated record at offset %lld: \
+stopping\n", (long long)trfs_trace_offset(t));
+}
+
+/** Replays only the blocks of the index that the requested range touches.
+ * The records of the first and last block are filtered by their own time.
+ * param[in] idx Index of the tfile
+ */
+static void trfs_replay_index(struct trfs_rpd *rpd, trfs_trace *t,
+						const trfs_index *idx)
+{
+	int b, b0 = 0, b1 = idx->nr_ent-1;
+	uint64_t t0 = idx->ent[0].ts;
+
+	trace_t0 = t0;
+
+	if (first_id > 0)
+		b0 = trfs_index_find_id(idx, first_id);
+	if (last_id < UINT_MAX)
+		b1 = trfs_index_find_id(idx, last_id);
+	if (t_lo > 0 && trfs_index_find_ts(idx, t0+t_lo*1e9) > b0)
+		b0 = trfs_index_find_ts(idx, t0+t_lo*1e9);
+	if (t_hi >= 0 && trfs_index_find_ts(idx, t0+t_hi*1e9) < b1)
+		b1 = trfs_index_find_ts(idx, t0+t_hi*1e9);
+
+	for (b = b0; b <= b1 && !range_done; b++) {
+		/* Blocks without the requested op are not even read */
+		if (op_type >= 0 && idx->ent[b].op_count[op_type] == 0)
+			continue;
+		trfs_replay_range(rpd, t, idx->ent[b].offset,
+					trfs_index_block_end(idx, b));
 	}
-	return ret;
 }
 
 /** Main function to test the functionality of trfs in userland. 
@@ -114,24 +229,32 @@ static unsigned int trfs_read_tfile_buf(struct trfs_rpd *this,
 int main(int argc, char *argv[])
 {
 	int choice;
-	char tfile[256];
-	struct stat buf;
-	char *page = NULL;
-	int left_bytes = 0;
-	int ret = 0, fd = 0;
-	int fsize = 0, bytes = 0;
+	int ret = 0;
+	int use_index = 0, dump_index = 0;
+	int tflags = 0;
+	double secs = 0;
+	const char *root = NULL;
+	struct timespec ts0, ts1;
+	trfs_index idx;
+	trfs_trace trace;
 	struct trfs_rpd *rpd = NULL;
 
+	memset(&idx, 0, sizeof(trfs_index));
+	memset(&trace, 0, sizeof(trfs_trace));
+	trace.fd = -1;
+
 	/* Validate the number of command line parameters. */
-	if ((argc<2) || (argc>4))  {
-		printf("Invalid arguments: Please try ./treplay [ns] tfile\n");
+	if (argc<2)  {
+		printf("Invalid arguments: Please try ./treplay [nsdbq] \
+[-j jobs | -u depth] [-r root] [-t speed] [-R first:last] [-T from:to] [-O op] \
+[-I] tfile\n");
 		goto out;
 
 	}
 
 	/* Extract the flags. */
 	opterr = 0;
- 	while ((choice = getopt (argc, argv, "ns")) != -1) {
+ 	while ((choice = getopt (argc, argv, "nsdbqj:u:r:t:R:T:O:I")) != -1) {
 		switch(choice) {
 			case 'n':
 				gflags = 1;
@@ -139,6 +262,77 @@ int main(int argc, char *argv[])
 			case 's':
 				gflags = 2;
 				break;
+			case 'd':
+				dry_run = 1;
+				break;
+			case 'q':
+				/* No per op messages */
+				gquiet = 1;
+				break;
+			case 'b':
+				/* Stream through a buffer instead of mmap */
+				tflags |= TRFS_TRACE_STREAM;
+				break;
+			case 'j':
+				nr_jobs = atoi(optarg);
+				if (nr_jobs < 1 ||
+				    nr_jobs > TRFS_PR_MAX_WORKERS) {
+					printf("Bad number of jobs %s\n", optarg);
+					ret = -EINVAL;
+					goto out;
+				}
+				break;
+			case 'u':
+				ur_depth = atoi(optarg);
+				if (ur_depth < 1 ||
+				    ur_depth > TRFS_UR_MAX_DEPTH) {
+					printf("Bad queue depth %s\n", optarg);
+					ret = -EINVAL;
+					goto out;
+				}
+				break;
+			case 'r':
+				/* Traced paths are replayed under root */
+				root = optarg;
+				break;
+			case 't':
+				/* Speed of the timed replay, 0 or max for
+				 * as fast as possible */
+				speed = strcmp(optarg, "max") ? atof(optarg) : 0;
+				if (speed < 0) {
+					printf("Bad speed %s\n", optarg);
+					ret = -EINVAL;
+					goto out;
+				}
+				break;
+			case 'R':
+				/* Record ID range, first:last */
+				if (sscanf(optarg, "%u:%u", &first_id,
+							&last_id) < 1) {
+					printf("Bad record range %s\n", optarg);
+					ret = -EINVAL;
+					goto out;
+				}
+				use_index = 1;
+				break;
+			case 'T':
+				/* Seconds from the start of the trace */
+				if (sscanf(optarg, "%lf:%lf", &t_lo,
+							&t_hi) < 1) {
+					printf("Bad time range %s\n", optarg);
+					ret = -EINVAL;
+					goto out;
+				}
+				use_index = 1;
+				break;
+			case 'O':
+				op_type = atoi(optarg);
+				use_index = 1;
+				break;
+			case 'I':
+				dump_index = 1;
+				use_index = 1;
+				break;
 			case '?' :
 				printf("Unknown option/No trace file.\n");
 				ret = -ENOENT;
@@ -151,45 +345,99 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (nr_jobs > 1 && ur_depth) {
+		printf("-j and -u can't be combined\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
 	if (optind >= argc) {
 		printf("No trace file specified \n");
 		ret = -ENOENT;
 		goto out;
 	}
 
-	/* Extract the input filename. */
-     	strcpy(tfile, argv[optind]);
-
-	fd = open(tfile, O_RDONLY);
-	if (fd<0) {
+	if (trfs_trace_open(&trace, argv[optind], tflags) < 0) {
 		printf("Opening the tfile: Failed \n");
 		ret = -ENOENT;
 		goto out;
 	}
 	
-	rpd = trfs_rpd_init();
+	rpd = trfs_rpd_init(root);
+	if (!rpd) {
+		printf("Initializing the replay: Failed\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (nr_jobs > 1 && !dry_run &&
+	    trfs_preplay_init(&preplay, rpd, nr_jobs) < 0) {
+		printf("Starting %d replay workers: Failed\n", nr_jobs);
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (ur_depth && !dry_run) {
+		ret = trfs_uring_init(&uring, ur_depth);
+		if (ret < 0) {
+			printf("Setting up io_uring: Failed (%s)\n",
+							strerror(-ret));
+			goto out;
+		}
+	}
 
-	fstat(fd, &buf);
-	fsize = buf.st_size;
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	if (use_index &&
+	    trfs_index_load(trace.fd, trace.fsize, &idx) == 0) {
+		if (dump_index)
+			trfs_index_dump(&idx);
+		else
+			trfs_replay_index(rpd, &trace, &idx);
+	}
+	else if (dump_index) {
+		printf("No index in the tfile\n");
+	}
+	else {
+		trfs_replay_range(rpd, &trace, 0, trace.fsize);
+	}
+	if (preplay.nr_workers) {
+		/* Waits for the last window of the parallel replay */
+		trfs_preplay_flush(&preplay);
+		TRFS_PRINT("Replayed on %d workers: %llu windows, %llu \
+dependencies\n", preplay.nr_workers, preplay.nr_windows, preplay.nr_edges);
+	}
+	if (uring.depth) {
+		trfs_uring_drain(&uring);
+		TRFS_PRINT("Replayed through io_uring at depth %u: %llu ops, \
+%llu linked, %llu waits on a path, %llu bytes, %llu drains, %llu results \
+differ from the trace\n", uring.depth, uring.nr_ops, uring.nr_linked,
+			uring.nr_path_waits, uring.nr_bytes, uring.nr_drains,
+			uring.nr_differ);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
 
-	page = (char *)malloc(PAGE_SIZE);
+	if (speed > 0 && nr_timed > 0) {
+		/* How far behind schedule the last record finished */
+		printf("Timed replay at %gx: %llu records, %llu late by more \
+than 1 ms, lag mean %.3f ms, max %.3f ms, at the end %.3f ms\n", speed,
+			nr_timed, nr_late, lag_sum/1e6/nr_timed, lag_max/1e6,
+			trfs_now_ns() > sched_due ?
+				(trfs_now_ns()-sched_due)/1e6 : 0);
+	}
 
-	while (fsize>0) {
-		bytes = read(fd, page, PAGE_SIZE);
-		if (bytes<=0) {
-			printf("Parsing completed: Partially\n");
-			break;
-		}
-		fsize -= bytes;
-		left_bytes = trfs_read_tfile_buf(rpd, page, bytes);
-		fsize += left_bytes;
-		lseek(fd, (off_t)-left_bytes, SEEK_CUR);
+	if (dry_run) {
+		secs = (ts1.tv_sec-ts0.tv_sec)+(ts1.tv_nsec-ts0.tv_nsec)/1e9;
+		printf("Parsed %llu records, %llu bytes in %.3f s: \
+%.0f records/s, %.3f GB/s (%s)\n", nr_parsed, bytes_parsed, secs,
+			secs > 0 ? nr_parsed/secs : 0,
+			secs > 0 ? bytes_parsed/secs/1e9 : 0,
+			trace.mapped ? "mmap" : "stream");
 	}
 out:
+	trfs_preplay_exit(&preplay);
+	if (uring.depth)
+		trfs_uring_exit(&uring);
+	trfs_index_free(&idx);
 	trfs_rpd_exit(rpd);
-	if (page)
-		free(page);
-	close(fd);
+	trfs_trace_close(&trace);
         return ret;
 }
 
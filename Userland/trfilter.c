@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* trfilter: cuts a smaller tfile out of a trace.
+ *
+ * The records that match every predicate are written to a new segment
+ * with its own index and footer, so the result replays like any tfile.
+ * A read, write or close that is kept takes the open of its file along
+ * if the open did not match, and the close of a kept open is kept too, so
+ * that treplay finds an fd for every op of the slice.
+ *
+ * Worker threads evaluate the predicates over runs of index blocks and
+ * list the records of interest; the main thread then pairs the opens and
+ * closes in trace order and writes the slice. Blocks past the end of the
+ * requested time or ID range are not read at all, blocks before it only
+ * for their opens.
+ *
+ *	$./trfilter [-p pid] [-d path] [-T from:to] [-R first:last] [-O op]
+ *		[-e] [-j threads] tfile out
+ */
+
+#include <limits.h>
+
+#include "trfs_ops.h"
+#include "trfs_index.h"
+#include "trfs_parse.h"
+#include "trfs_write.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+#define TRF_MAX_PIDS		64
+#define TRF_MAX_PATHS		16
+#define TRF_MAX_THREADS		64
+#define TRF_UNITS_PER_THREAD	4
+
+/* Flags of a record of interest */
+#define TRF_MATCH		0x1	/* matches the predicates */
+
+/** Predicates, a record is kept if it matches all of them
+ */
+static unsigned int pids[TRF_MAX_PIDS];
+static int nr_pids = 0;
+static const char *paths[TRF_MAX_PATHS];
+static size_t path_len[TRF_MAX_PATHS];
+static int nr_paths = 0;
+static double t_lo = 0, t_hi = -1;	/* seconds from the first record */
+static uint64_t ts_lo = 0, ts_hi = UINT64_MAX;
+static unsigned int first_id = 0, last_id = UINT_MAX;
+static uint32_t op_mask = 0;		/* bit per op type, 0 for all */
+static int only_errors = 0;
+
+/** Records of a run of blocks, filtered by one thread. ctx is set for the
+ * runs before the requested range, which only give their opens.
+ */
+typedef struct trf_unit_ {
+	off_t start;
+	off_t end;
+	int ctx;
+	uint64_t *rec;		/* offset<<1 | TRF_MATCH */
+	size_t nr;
+	size_t alloc;
+	int err;
+}trf_unit;
+
+static trf_unit *units = NULL;
+static int nr_units = 0;
+static int next_unit = 0;
+static const char *tfile = NULL;
+static int tflags = 0;
+
+/** An open seen in the trace and whether it went to the slice
+ */
+typedef struct trf_open_ {
+	off_t off;
+	int kept;
+}trf_open;
+
+static int trf_has_prefix(const char *name, unsigned short len, int i)
+{
+	return len >= path_len[i] && !memcmp(name, paths[i], path_len[i]) &&
+		(len == path_len[i] || paths[i][path_len[i]-1] == '/' ||
+		 name[path_len[i]] == '/');
+}
+
+/** Checks a record against the predicates
+ */
+static int trf_match(const char *rec, const trfs_rec_info *ri)
+{
+	int i;
+	unsigned int rid = trfs_rec_id(rec);
+
+	if (rid < first_id || rid > last_id)
+		return 0;
+	if (ri->ts < ts_lo || ri->ts > ts_hi)
+		return 0;
+	if (op_mask && !(op_mask & (1U << ri->type)))
+		return 0;
+	if (only_errors && ri->ret >= 0)
+		return 0;
+	if (nr_pids) {
+		for (i = 0; i < nr_pids; i++)
+			if (pids[i] == ri->pid)
+				break;
+		if (i == nr_pids)
+			return 0;
+	}
+	if (nr_paths) {
+		for (i = 0; i < nr_paths; i++)
+			if (trf_has_prefix(ri->name, ri->len, i) ||
+			    (ri->name2 && ri->type != TRFS_OP_SYMLINK &&
+			     trf_has_prefix(ri->name2, ri->len2, i)))
+				break;
+		if (i == nr_paths)
+			return 0;
+	}
+	return 1;
+}
+
+static int trf_unit_add(trf_unit *u, off_t off, int flags)
+{
+	uint64_t *p = NULL;
+
+	if (u->nr == u->alloc) {
+		u->alloc = u->alloc ? u->alloc*2 : 4096;
+		p = (uint64_t *)realloc(u->rec, u->alloc*sizeof(uint64_t));
+		if (!p)
+			return -ENOMEM;
+		u->rec = p;
+	}
+	u->rec[u->nr++] = ((uint64_t)off << 1) | flags;
+	return 0;
+}
+
+/** Lists the records of a unit the writer needs: the matching ones and
+ * every open and close, which carry the pairing
+ */
+static void trf_scan(trfs_trace *t, trf_unit *u)
+{
+	int match;
+	off_t off;
+	char *rec = NULL;
+	trfs_rec_info ri;
+
+	if (trfs_trace_seek(t, u->start, u->end) < 0) {
+		u->err = -EIO;
+		return;
+	}
+	for (off = trfs_trace_offset(t); (rec = trfs_trace_next(t)) != NULL;
+					off = trfs_trace_offset(t)) {
+		if (trfs_rec_info_get(rec, &ri) < 0)
+			continue;
+		match = !u->ctx && trf_match(rec, &ri);
+		if (!match && ri.type != TRFS_OP_OPEN &&
+		    ri.type != TRFS_OP_CLOSE)
+			continue;
+		if (trf_unit_add(u, off, match ? TRF_MATCH : 0) < 0) {
+			u->err = -ENOMEM;
+			return;
+		}
+	}
+	if (t->err)
+		u->err = t->err;
+}
+
+static void *trf_worker(void *arg)
+{
+	int u;
+	trfs_trace t;
+
+	if (trfs_trace_open(&t, tfile, tflags) < 0) {
+		/* Another thread takes the units */
+		return NULL;
+	}
+	while ((u = __atomic_fetch_add(&next_unit, 1, __ATOMIC_RELAXED)) <
+								nr_units)
+		trf_scan(&t, &units[u]);
+	trfs_trace_close(&t);
+	return NULL;
+}
+
+static int trf_unit_new(off_t start, off_t end, int ctx)
+{
+	trf_unit *nu = (trf_unit *)realloc(units,
+					(nr_units+1)*sizeof(trf_unit));
+
+	if (!nu)
+		return -ENOMEM;
+	units = nu;
+	memset(&units[nr_units], 0, sizeof(trf_unit));
+	units[nr_units].start = start;
+	units[nr_units].end = end;
+	units[nr_units++].ctx = ctx;
+	return 0;
+}
+
+/** Time of the first op record, from the index or the tfile itself
+ */
+static uint64_t trf_first_ts(const trfs_index *idx)
+{
+	char *rec = NULL;
+	uint64_t ts = 0;
+	trfs_trace t;
+
+	if (idx->nr_ent > 0)
+		return idx->ent[0].ts;
+	if (trfs_trace_open(&t, tfile, tflags) < 0)
+		return 0;
+	while ((rec = trfs_trace_next(&t)) != NULL) {
+		if (trfs_rec_type(rec) < TRFS_MAX_OPS) {
+			ts = trfs_rec_ts(rec);
+			break;
+		}
+	}
+	trfs_trace_close(&t);
+	return ts;
+}
+
+/** Whether a block has anything the slice needs. Before the range only
+ * its opens and closes matter.
+ */
+static int trf_block_wanted(const trfs_idx_ent *e, int ctx)
+{
+	int i;
+
+	if (e->op_count[TRFS_OP_OPEN] || e->op_count[TRFS_OP_CLOSE])
+		return 1;
+	if (ctx)
+		return 0;
+	if (!op_mask)
+		return 1;
+	for (i = 0; i < TRFS_MAX_OPS; i++)
+		if ((op_mask & (1U << i)) && e->op_count[i])
+			return 1;
+	return 0;
+}
+
+/** Cuts the tfile into units of up to run blocks. With an index, the
+ * blocks past the range are left out and the blocks without anything the
+ * slice needs are skipped.
+ */
+static int trf_plan(off_t fsize, const trfs_index *idx, int nr_threads)
+{
+	int b, b0, b1, k, run;
+	int ctx;
+	int ret = 0;
+
+	if (idx->nr_ent == 0)
+		return trf_unit_new(0, fsize, 0);
+
+	b0 = 0;
+	b1 = idx->nr_ent-1;
+	if (first_id > 0 && trfs_index_find_id(idx, first_id) > b0)
+		b0 = trfs_index_find_id(idx, first_id);
+	if (last_id < UINT_MAX && trfs_index_find_id(idx, last_id) >= 0)
+		b1 = trfs_index_find_id(idx, last_id);
+	if (ts_lo > 0 && trfs_index_find_ts(idx, ts_lo) > b0)
+		b0 = trfs_index_find_ts(idx, ts_lo);
+	if (ts_hi < UINT64_MAX && trfs_index_find_ts(idx, ts_hi) >= 0 &&
+	    trfs_index_find_ts(idx, ts_hi) < b1)
+		b1 = trfs_index_find_ts(idx, ts_hi);
+
+	run = idx->nr_ent/(nr_threads*TRF_UNITS_PER_THREAD);
+	if (run < 1)
+		run = 1;
+	for (b = 0; b <= b1 && ret == 0; b += k) {
+		ctx = b < b0;
+		if (!trf_block_wanted(&idx->ent[b], ctx)) {
+			k = 1;
+			continue;
+		}
+		/* A run of wanted blocks on one side of the range start */
+		for (k = 1; k < run && b+k <= b1 && (b+k < b0) == ctx &&
+			    trf_block_wanted(&idx->ent[b+k], ctx); k++)
+			;
+		ret = trf_unit_new(idx->ent[b].offset,
+				trfs_index_block_end(idx, b+k-1), ctx);
+	}
+	return ret;
+}
+
+/** The record at off, from the mapping or read into buf
+ */
+static const char *trf_rec_at(trfs_trace *t, off_t off, char *buf)
+{
+	unsigned short size;
+
+	if (t->mapped)
+		return t->buf+off;
+	if (pread(t->fd, buf, TRFS_REC_HDR_SIZE, off) !=
+					(ssize_t)TRFS_REC_HDR_SIZE)
+		return NULL;
+	size = trfs_rec_size(buf);
+	if (pread(t->fd, buf, size, off) != size)
+		return NULL;
+	return buf;
+}
+
+/** Writes the slice: the matching records in trace order with the opens
+ * and closes that pair with them
+ */
+static int trf_write(trfs_trace *t, trfs_writer *w, unsigned long long *nr,
+						unsigned long long *nr_ctx)
+{
+	int i, u;
+	int ret = 0;
+	int match;
+	size_t j;
+	uint64_t addr;
+	int nr_opens = 0, nr_alloc = 0, nr_free = 0;
+	int *free_open = NULL;
+	const char *rec = NULL;
+	const char *orec = NULL;
+	char *buf = NULL;
+	trf_open *opens = NULL;
+	void *p = NULL;
+	trfs_omap map;
+	trfs_rec_info ri;
+
+	buf = (char *)malloc(65536);
+	if (!buf || trfs_omap_init(&map, TRFS_OMAP_INIT_SIZE) < 0) {
+		free(buf);
+		return -ENOMEM;
+	}
+	for (u = 0; u < nr_units && ret == 0; u++) {
+		for (j = 0; j < units[u].nr && ret == 0; j++) {
+			rec = trf_rec_at(t, units[u].rec[j] >> 1, buf);
+			if (!rec || trfs_rec_info_get(rec, &ri) < 0) {
+				ret = -EIO;
+				break;
+			}
+			match = units[u].rec[j] & TRF_MATCH;
+			addr = ri.addr;
+
+			if (ri.type == TRFS_OP_OPEN) {
+				/* The open takes a free slot of opens */
+				if (nr_free > 0) {
+					i = free_open[--nr_free];
+				}
+				else {
+					if (nr_opens == nr_alloc) {
+						nr_alloc = nr_alloc ?
+							nr_alloc*2 : 1024;
+						p = realloc(opens, nr_alloc*
+							sizeof(trf_open));
+						if (!p) {
+							ret = -ENOMEM;
+							break;
+						}
+						opens = (trf_open *)p;
+						p = realloc(free_open,
+							nr_alloc*sizeof(int));
+						if (!p) {
+							ret = -ENOMEM;
+							break;
+						}
+						free_open = (int *)p;
+					}
+					i = nr_opens++;
+				}
+				opens[i].off = units[u].rec[j] >> 1;
+				opens[i].kept = match;
+				i = trfs_omap_add(&map, addr, ri.pid, i);
+				/* Reused file pointer, the close was lost */
+				if (i >= 0)
+					free_open[nr_free++] = i;
+				if (match)
+					ret = trfs_writer_put(w, rec);
+				*nr += match;
+				continue;
+			}
+
+			i = -1;
+			if (ri.type == TRFS_OP_CLOSE)
+				i = trfs_omap_delete(&map, addr, ri.pid);
+			else if (addr)
+				i = trfs_omap_getfd(&map, addr, ri.pid);
+			/* The open of a kept op goes first */
+			if (match && i >= 0 && !opens[i].kept) {
+				orec = trf_rec_at(t, opens[i].off, buf);
+				if (!orec ||
+				    (ret = trfs_writer_put(w, orec)) < 0)
+					break;
+				opens[i].kept = 1;
+				(*nr_ctx)++;
+				/* buf held the open, read the op again */
+				rec = trf_rec_at(t, units[u].rec[j] >> 1,
+								buf);
+				if (!rec) {
+					ret = -EIO;
+					break;
+				}
+			}
+			if (match || (ri.type == TRFS_OP_CLOSE && i >= 0 &&
+						opens[i].kept)) {
+				ret = trfs_writer_put(w, rec);
+				*nr += match;
+				*nr_ctx += !match;
+			}
+			if (ri.type == TRFS_OP_CLOSE && i >= 0)
+				free_open[nr_free++] = i;
+		}
+	}
+	trfs_omap_destroy(&map);
+	free(opens);
+	free(free_open);
+	free(buf);
+	return ret;
+}
+
+static void trf_usage(void)
+{
+	printf("Usage: trfilter [-p pid] [-d path] [-T from:to] \
+[-R first:last] [-O op] [-e] [-j threads] [-b] tfile out\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int choice;
+	int ret = 0;
+	int nr_threads = 1;
+	unsigned long long nr = 0, nr_ctx = 0, nr_cand = 0;
+	uint64_t t0 = 0;
+	pthread_t tid[TRF_MAX_THREADS];
+	trfs_index idx;
+	trfs_trace t;
+	trfs_writer w;
+
+	memset(&idx, 0, sizeof(trfs_index));
+	t.fd = -1;
+	w.fd = -1;
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "p:d:T:R:O:ej:b")) != -1) {
+		switch (choice) {
+			case 'p':
+				if (nr_pids == TRF_MAX_PIDS) {
+					printf("Too many pids\n");
+					return -EINVAL;
+				}
+				pids[nr_pids++] = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				if (nr_paths == TRF_MAX_PATHS) {
+					printf("Too many paths\n");
+					return -EINVAL;
+				}
+				path_len[nr_paths] = strlen(optarg);
+				paths[nr_paths++] = optarg;
+				break;
+			case 'T':
+				/* Seconds from the start of the trace */
+				if (sscanf(optarg, "%lf:%lf", &t_lo,
+							&t_hi) < 1) {
+					printf("Bad time range %s\n", optarg);
+					return -EINVAL;
+				}
+				break;
+			case 'R':
+				if (sscanf(optarg, "%u:%u", &first_id,
+							&last_id) < 1) {
+					printf("Bad record range %s\n", optarg);
+					return -EINVAL;
+				}
+				break;
+			case 'O':
+				/* By number or by name */
+				for (i = 1; i < TRFS_MAX_OPS; i++)
+					if (!strcmp(optarg, trfs_op_name(i)))
+						break;
+				if (i == TRFS_MAX_OPS)
+					i = atoi(optarg);
+				if (i <= 0 || i >= TRFS_MAX_OPS) {
+					printf("Bad op %s\n", optarg);
+					return -EINVAL;
+				}
+				op_mask |= 1U << i;
+				break;
+			case 'e':
+				only_errors = 1;
+				break;
+			case 'j':
+				nr_threads = atoi(optarg);
+				if (nr_threads < 1 ||
+				    nr_threads > TRF_MAX_THREADS) {
+					printf("Bad number of threads %s\n",
+								optarg);
+					return -EINVAL;
+				}
+				break;
+			case 'b':
+				tflags |= TRFS_TRACE_STREAM;
+				break;
+			default:
+				trf_usage();
+				return -EINVAL;
+		}
+	}
+	if (optind != argc-2) {
+		trf_usage();
+		return -EINVAL;
+	}
+	tfile = argv[optind];
+
+	if (trfs_trace_open(&t, tfile, tflags) < 0) {
+		printf("Opening the tfile: Failed\n");
+		return -ENOENT;
+	}
+	trfs_index_load(t.fd, t.fsize, &idx);
+	if (t_lo > 0 || t_hi >= 0) {
+		t0 = trf_first_ts(&idx);
+		ts_lo = t0+t_lo*1e9;
+		if (t_hi >= 0)
+			ts_hi = t0+t_hi*1e9;
+	}
+	ret = trf_plan(t.fsize, &idx, nr_threads);
+	if (ret < 0)
+		goto out;
+
+	if (nr_units < nr_threads)
+		nr_threads = nr_units;
+	for (i = 1; i < nr_threads; i++)
+		pthread_create(&tid[i], NULL, trf_worker, NULL);
+	trf_worker(NULL);
+	for (i = 1; i < nr_threads; i++)
+		pthread_join(tid[i], NULL);
+	for (i = 0; i < nr_units; i++) {
+		if (units[i].err == -ENOMEM) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (units[i].err)
+			printf("Corrupted or truncated record in [%lld, %lld): \
+the rest of it is left out\n", (long long)units[i].start,
+						(long long)units[i].end);
+		nr_cand += units[i].nr;
+	}
+
+	ret = trfs_writer_open(&w, argv[optind+1], 0);
+	if (ret < 0) {
+		printf("Creating %s: Failed\n", argv[optind+1]);
+		goto out;
+	}
+	ret = trf_write(&t, &w, &nr, &nr_ctx);
+	i = trfs_writer_close(&w);
+	if (ret == 0)
+		ret = i;
+	if (ret < 0) {
+		printf("Writing %s: Failed\n", argv[optind+1]);
+		goto out;
+	}
+	printf("Kept %llu matching records and %llu opens and closes that \
+pair with them, %d units, %llu candidates\n", nr, nr_ctx, nr_units, nr_cand);
+out:
+	for (i = 0; i < nr_units; i++)
+		free(units[i].rec);
+	free(units);
+	trfs_index_free(&idx);
+	trfs_trace_close(&t);
+	return ret;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trfs_col.h"
+
+static void trfs_col_path(char *path, const char *dir, const char *name)
+{
+	snprintf(path, PATH_MAX, "%s/%s.col", dir, name);
+}
+
+int trfs_colw_open(trfs_colw *w, const char *dir, const char *name,
+								int delta)
+{
+	char path[PATH_MAX];
+
+	memset(w, 0, sizeof(trfs_colw));
+	trfs_col_path(path, dir, name);
+	w->buf = (int64_t *)malloc(TRFS_COL_BLOCK*sizeof(int64_t));
+	w->pack = (uint8_t *)malloc(TRFS_COL_BLOCK*sizeof(int64_t));
+	if (!w->buf || !w->pack) {
+		free(w->buf);
+		free(w->pack);
+		return -ENOMEM;
+	}
+	w->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (w->fd < 0) {
+		free(w->buf);
+		free(w->pack);
+		return -errno;
+	}
+	w->delta = delta;
+	return 0;
+}
+
+static int trfs_col_write(int fd, const void *buf, size_t len)
+{
+	ssize_t bytes;
+
+	while (len > 0) {
+		bytes = write(fd, buf, len);
+		if (bytes <= 0)
+			return -EIO;
+		buf = (const char *)buf+bytes;
+		len -= bytes;
+	}
+	return 0;
+}
+
+/** Bytes needed for an unsigned value, 1, 2, 4 or 8
+ */
+static uint8_t trfs_col_width(uint64_t max)
+{
+	if (max <= 0xff)
+		return 1;
+	if (max <= 0xffff)
+		return 2;
+	if (max <= 0xffffffffULL)
+		return 4;
+	return 8;
+}
+
+/** Packs the buffered values into a block
+ */
+static int trfs_colw_flush(trfs_colw *w)
+{
+	unsigned int i;
+	int delta = w->delta;
+	uint64_t max = 0;
+	int64_t base;
+	trfs_col_blk *b = NULL;
+
+	if (w->n == 0)
+		return 0;
+	if (w->nr_blocks == w->nr_alloc) {
+		w->nr_alloc = w->nr_alloc ? w->nr_alloc*2 : 64;
+		b = (trfs_col_blk *)realloc(w->blk,
+					w->nr_alloc*sizeof(trfs_col_blk));
+		if (!b)
+			return -ENOMEM;
+		w->blk = b;
+	}
+	b = &w->blk[w->nr_blocks++];
+
+	/* Delta only pays, and only decodes, for a block that never drops */
+	for (i = 1; delta && i < w->n; i++)
+		if (w->buf[i] < w->buf[i-1])
+			delta = 0;
+	base = w->buf[0];
+	if (delta) {
+		for (i = w->n-1; i > 0; i--) {
+			w->buf[i] -= w->buf[i-1];
+			if ((uint64_t)w->buf[i] > max)
+				max = w->buf[i];
+		}
+		w->buf[0] = 0;
+	}
+	else {
+		for (i = 1; i < w->n; i++)
+			if (w->buf[i] < base)
+				base = w->buf[i];
+		for (i = 0; i < w->n; i++) {
+			w->buf[i] = (uint64_t)w->buf[i]-(uint64_t)base;
+			if ((uint64_t)w->buf[i] > max)
+				max = w->buf[i];
+		}
+	}
+
+	b->off = w->off;
+	b->base = base;
+	b->n = w->n;
+	b->width = trfs_col_width(max);
+	b->delta = delta;
+	b->pad = 0;
+	switch (b->width) {
+		case 1:
+			for (i = 0; i < w->n; i++)
+				w->pack[i] = w->buf[i];
+			break;
+		case 2:
+			for (i = 0; i < w->n; i++)
+				((uint16_t *)w->pack)[i] = w->buf[i];
+			break;
+		case 4:
+			for (i = 0; i < w->n; i++)
+				((uint32_t *)w->pack)[i] = w->buf[i];
+			break;
+		default:
+			memcpy(w->pack, w->buf, w->n*sizeof(int64_t));
+			break;
+	}
+	if (trfs_col_write(w->fd, w->pack, (size_t)w->n*b->width) < 0)
+		return -EIO;
+	w->off += (uint64_t)w->n*b->width;
+	w->bytes += (uint64_t)w->n*b->width;
+	w->n = 0;
+	return 0;
+}
+
+int trfs_colw_add(trfs_colw *w, int64_t v)
+{
+	w->buf[w->n++] = v;
+	w->nr_rows++;
+	if (w->n == TRFS_COL_BLOCK)
+		return trfs_colw_flush(w);
+	return 0;
+}
+
+int trfs_colw_close(trfs_colw *w)
+{
+	int ret = 0;
+	trfs_col_tlr tlr;
+
+	if (w->fd < 0)
+		return 0;
+	ret = trfs_colw_flush(w);
+	if (ret < 0)
+		goto out;
+	memset(&tlr, 0, sizeof(trfs_col_tlr));
+	tlr.magic = TRFS_COL_MAGIC;
+	tlr.version = TRFS_COL_VERSION;
+	tlr.nr_rows = w->nr_rows;
+	tlr.dir_off = w->off;
+	tlr.nr_blocks = w->nr_blocks;
+	if (trfs_col_write(w->fd, w->blk,
+			w->nr_blocks*sizeof(trfs_col_blk)) < 0 ||
+	    trfs_col_write(w->fd, &tlr, sizeof(trfs_col_tlr)) < 0)
+		ret = -EIO;
+out:
+	if (close(w->fd) < 0 && ret == 0)
+		ret = -EIO;
+	w->fd = -1;
+	free(w->buf);
+	free(w->pack);
+	free(w->blk);
+	return ret;
+}
+
+int trfs_col_open(trfs_col *c, const char *dir, const char *name)
+{
+	int fd;
+	struct stat st;
+	char path[PATH_MAX];
+
+	memset(c, 0, sizeof(trfs_col));
+	trfs_col_path(path, dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -ENOENT;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(trfs_col_tlr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	c->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return -ENOMEM;
+	}
+	c->len = st.st_size;
+	c->tlr = (const trfs_col_tlr *)(c->map+c->len-sizeof(trfs_col_tlr));
+	if (c->tlr->magic != TRFS_COL_MAGIC ||
+	    c->tlr->version != TRFS_COL_VERSION ||
+	    c->tlr->dir_off+(uint64_t)c->tlr->nr_blocks*sizeof(trfs_col_blk) !=
+				c->len-sizeof(trfs_col_tlr)) {
+		trfs_col_close(c);
+		return -EINVAL;
+	}
+	c->blk = (const trfs_col_blk *)(c->map+c->tlr->dir_off);
+	madvise(c->map, c->len, MADV_SEQUENTIAL);
+	return 0;
+}
+
+void trfs_col_close(trfs_col *c)
+{
+	if (c->map)
+		munmap(c->map, c->len);
+	c->map = NULL;
+}
+
+/** Decodes block b into v, which holds TRFS_COL_BLOCK values.
+ * The loops are kept simple so that the compiler vectorizes them.
+ */
+unsigned int trfs_col_read(const trfs_col *c, unsigned int b, int64_t *v)
+{
+	unsigned int i, n;
+	int64_t base;
+	const trfs_col_blk *blk = &c->blk[b];
+	const char *p = c->map+blk->off;
+
+	n = blk->n;
+	base = blk->base;
+	if (n > TRFS_COL_BLOCK || blk->off+(uint64_t)n*blk->width >
+							c->tlr->dir_off)
+		return 0;
+	switch (blk->width) {
+		case 1:
+			for (i = 0; i < n; i++)
+				v[i] = ((const uint8_t *)p)[i];
+			break;
+		case 2:
+			for (i = 0; i < n; i++)
+				v[i] = ((const uint16_t *)p)[i];
+			break;
+		case 4:
+			for (i = 0; i < n; i++)
+				v[i] = ((const uint32_t *)p)[i];
+			break;
+		default:
+			memcpy(v, p, n*sizeof(int64_t));
+			break;
+	}
+	if (blk->delta) {
+		v[0] = base;
+		for (i = 1; i < n; i++)
+			v[i] += v[i-1];
+	}
+	else {
+		for (i = 0; i < n; i++)
+			v[i] = (uint64_t)v[i]+(uint64_t)base;
+	}
+	return n;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_COL_H_
+#define _TRFS_COL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TRFS_COL_MAGIC		0x4c4f4354	/* "TCOL" */
+#define TRFS_COL_VERSION	1
+/* Rows of a column block, the unit of encoding and of a query pass */
+#define TRFS_COL_BLOCK		65536
+
+/** Where a block of a column is and how it is packed. Values are stored
+ * as unsigned offsets from base in width bytes; with delta set, as the
+ * offsets from the value before them, for columns that only grow.
+ */
+typedef struct trfs_col_blk_ {
+	uint64_t off;
+	int64_t base;
+	uint32_t n;
+	uint8_t width;
+	uint8_t delta;
+	uint16_t pad;
+}trfs_col_blk;
+
+/** Last bytes of a column file, behind the blocks and their directory
+ */
+typedef struct trfs_col_tlr_ {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nr_rows;
+	uint64_t dir_off;
+	uint32_t nr_blocks;
+	uint32_t pad;
+}trfs_col_tlr;
+
+/** A column being written, one value per op record
+ */
+typedef struct trfs_colw_ {
+	int fd;
+	int delta;		/* try delta encoding, the column grows */
+	int64_t *buf;
+	unsigned int n;
+	uint8_t *pack;
+	trfs_col_blk *blk;
+	unsigned int nr_blocks;
+	unsigned int nr_alloc;
+	uint64_t nr_rows;
+	uint64_t off;
+	uint64_t bytes;		/* packed bytes written */
+}trfs_colw;
+
+/** A column mapped for reading
+ */
+typedef struct trfs_col_ {
+	char *map;
+	size_t len;
+	const trfs_col_tlr *tlr;
+	const trfs_col_blk *blk;
+}trfs_col;
+
+/** Creates dir/name.col.
+ */
+int trfs_colw_open(trfs_colw *w, const char *dir, const char *name,
+								int delta);
+
+int trfs_colw_add(trfs_colw *w, int64_t v);
+
+/** Writes the last block, the directory and the trailer.
+ */
+int trfs_colw_close(trfs_colw *w);
+
+/** Maps dir/name.col.
+ */
+int trfs_col_open(trfs_col *c, const char *dir, const char *name);
+
+void trfs_col_close(trfs_col *c);
+
+/** Decodes block b into v, which holds TRFS_COL_BLOCK values.
+ * Returns the number of values of the block.
+ */
+unsigned int trfs_col_read(const trfs_col *c, unsigned int b, int64_t *v);
+
+#endif	/* End of _TRFS_COL_H_ */
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "trfs_ops.h"
+#include "trfs_index.h"
+
+/** Orders the index entries by their offset in the segment
+ */
+static int trfs_index_cmp(const void *a, const void *b)
+{
+	const trfs_idx_ent *e1 = a, *e2 = b;
+
+	if (e1->offset < e2->offset)
+		return -1;
+	return e1->offset > e2->offset;
+}
+
+/** Loads the index of the segment from its footer.
+ * param[in] fd File descriptor of the tfile
+ * param[in] fsize Size of the tfile
+ * param[out] idx Index to be filled
+ */
+int trfs_index_load(int fd, off_t fsize, trfs_index *idx)
+{
+	int ret = 0;
+	off_t off = 0;
+	int nr_alloc = 0;
+	trfs_idx_rec *rec = NULL;
+	trfs_idx_ent *ent = NULL;
+
+	memset(idx, 0, sizeof(trfs_index));
+	if (fsize < (off_t)(sizeof(trfs_seg_hdr)+sizeof(trfs_seg_ftr)))
+		return -ENOENT;
+
+	/* The footer is the last record of a closed segment */
+	idx->end = fsize-sizeof(trfs_seg_ftr);
+	if (pread(fd, &idx->ftr, sizeof(trfs_seg_ftr), idx->end) !=
+					sizeof(trfs_seg_ftr))
+		return -ENOENT;
+	if (idx->ftr.r_type != TRFS_REC_SEG_FTR ||
+	    idx->ftr.magic != TRFS_TRACE_MAGIC ||
+	    idx->ftr.r_size != sizeof(trfs_seg_ftr) || !idx->ftr.idx_off)
+		return -ENOENT;
+
+	rec = (trfs_idx_rec *)malloc(sizeof(trfs_idx_rec));
+	if (!rec)
+		return -ENOMEM;
+
+	/* Walk the chain of index records backwards from the footer */
+	off = idx->ftr.idx_off;
+	while (off > 0 && off < idx->end) {
+		if (pread(fd, rec, sizeof(trfs_idx_rec), off) <
+			    (ssize_t)offsetof(trfs_idx_rec, ent) ||
+		    rec->r_type != TRFS_REC_INDEX ||
+		    rec->magic != TRFS_TRACE_MAGIC ||
+		    rec->nr_ent > TRFS_IDX_ENTRIES ||
+		    rec->prev >= (uint64_t)off) {
+			ret = -EINVAL;
+			break;
+		}
+		if (idx->nr_ent+rec->nr_ent > nr_alloc) {
+			nr_alloc = 2*(idx->nr_ent+rec->nr_ent);
+			ent = (trfs_idx_ent *)realloc(idx->ent,
+					nr_alloc*sizeof(trfs_idx_ent));
+			if (!ent) {
+				ret = -ENOMEM;
+				break;
+			}
+			idx->ent = ent;
+		}
+		memcpy(idx->ent+idx->nr_ent, rec->ent,
+					rec->nr_ent*sizeof(trfs_idx_ent));
+		idx->nr_ent += rec->nr_ent;
+		off = rec->prev;
+	}
+	free(rec);
+
+	if (ret < 0 || idx->nr_ent == 0) {
+		trfs_index_free(idx);
+		return ret < 0 ? ret : -ENOENT;
+	}
+	qsort(idx->ent, idx->nr_ent, sizeof(trfs_idx_ent), trfs_index_cmp);
+	return 0;
+}
+
+void trfs_index_free(trfs_index *idx)
+{
+	if (idx->ent)
+		free(idx->ent);
+	idx->ent = NULL;
+	idx->nr_ent = 0;
+}
+
+/** Returns the block which holds the given record ID, -1 if none.
+ * Record IDs grow along the segment, so this is a binary search.
+ */
+int trfs_index_find_id(const trfs_index *idx, unsigned int r_id)
+{
+	int lo = 0, hi = idx->nr_ent-1, mid;
+
+	if (idx->nr_ent == 0 || r_id < idx->ent[0].first_id)
+		return idx->nr_ent ? 0 : -1;
+	while (lo < hi) {
+		mid = (lo+hi+1)/2;
+		if (idx->ent[mid].first_id <= r_id)
+			lo = mid;
+		else
+			hi = mid-1;
+	}
+	return lo;
+}
+
+/** Returns the block which was being written at the given time, -1 if none.
+ */
+int trfs_index_find_ts(const trfs_index *idx, uint64_t ts)
+{
+	int lo = 0, hi = idx->nr_ent-1, mid;
+
+	if (idx->nr_ent == 0 || ts < idx->ent[0].ts)
+		return idx->nr_ent ? 0 : -1;
+	while (lo < hi) {
+		mid = (lo+hi+1)/2;
+		if (idx->ent[mid].ts <= ts)
+			lo = mid;
+		else
+			hi = mid-1;
+	}
+	return lo;
+}
+
+/** Byte offset where the given block ends.
+ */
+off_t trfs_index_block_end(const trfs_index *idx, int blk)
+{
+	if (blk+1 < idx->nr_ent)
+		return idx->ent[blk+1].offset;
+	return idx->end;
+}
+
+/** Prints the blocks of the index along with their op counts.
+ */
+void trfs_index_dump(const trfs_index *idx)
+{
+	int i, t;
+	const trfs_idx_ent *e;
+	uint64_t t0 = idx->nr_ent ? idx->ent[0].ts : 0;
+
+	printf("segment %u: records %u-%u, %u records, %d blocks\n",
+		idx->ftr.seg_no, idx->ftr.first_id, idx->ftr.last_id,
+		idx->ftr.nr_recs, idx->nr_ent);
+	for (i = 0; i < idx->nr_ent; i++) {
+		e = &idx->ent[i];
+		printf("block %d: offset %llu, +%.3fs, records %u-%u (%u):",
+			i, (unsigned long long)e->offset,
+			(double)(e->ts-t0)/1e9, e->first_id, e->last_id,
+			e->nr_recs);
+		for (t = 0; t < TRFS_MAX_OPS; t++)
+			if (e->op_count[t])
+				printf(" %s=%u", trfs_op_name(t),
+							e->op_count[t]);
+		printf("\n");
+	}
+}
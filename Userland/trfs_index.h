@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_INDEX_H_
+#define _TRFS_INDEX_H_
+
+#include <sys/types.h>
+
+#include "structs.h"
+
+/** Sparse index of a tfile segment, one entry per block of records
+ */
+typedef struct trfs_index_ {
+	trfs_idx_ent *ent;	/* entries sorted by offset */
+	int nr_ent;
+	off_t end;		/* offset of the segment footer */
+	trfs_seg_ftr ftr;
+}trfs_index;
+
+/** Loads the index of the segment from its footer.
+ * Returns 0 on success, -ENOENT if the segment has no footer or no index.
+ */
+int trfs_index_load(int fd, off_t fsize, trfs_index *idx);
+
+void trfs_index_free(trfs_index *idx);
+
+/** Returns the block which holds the given record ID, -1 if none.
+ */
+int trfs_index_find_id(const trfs_index *idx, unsigned int r_id);
+
+/** Returns the block which was being written at the given time, -1 if none.
+ */
+int trfs_index_find_ts(const trfs_index *idx, uint64_t ts);
+
+/** Byte offset where the given block ends.
+ */
+off_t trfs_index_block_end(const trfs_index *idx, int blk);
+
+void trfs_index_dump(const trfs_index *idx);
+
+#endif	/* End of _TRFS_INDEX_H_ */
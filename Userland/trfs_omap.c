@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "trfs_omap.h"
+
+/** Hash of the key. struct file pointers are slab aligned, so the low
+ * bits carry little entropy; mix everything into the high bits.
+ */
+static inline unsigned int trfs_omap_hash(const trfs_omap *m,
+						uint64_t addr, int pid)
+{
+	uint64_t h = (addr ^ ((uint64_t)(unsigned int)pid << 32)) *
+						0x9e3779b97f4a7c15ULL;
+
+	h ^= h >> 29;
+	return (unsigned int)h & (m->size-1);
+}
+
+static int trfs_omap_alloc(trfs_omap *m, unsigned int size)
+{
+	unsigned int i;
+
+	m->slot = (trfs_omap_ent *)malloc(size*sizeof(trfs_omap_ent));
+	if (!m->slot)
+		return -ENOMEM;
+	for (i = 0; i < size; i++)
+		m->slot[i].fd = -1;
+	m->size = size;
+	m->count = 0;
+	return 0;
+}
+
+int trfs_omap_init(trfs_omap *m, unsigned int size)
+{
+	unsigned int n = TRFS_OMAP_INIT_SIZE;
+
+	while (n < size)
+		n <<= 1;
+	return trfs_omap_alloc(m, n);
+}
+
+void trfs_omap_destroy(trfs_omap *m)
+{
+	if (m->slot)
+		free(m->slot);
+	m->slot = NULL;
+	m->size = 0;
+	m->count = 0;
+}
+
+/** Doubles the table once it is 3/4 full
+ */
+static int trfs_omap_grow(trfs_omap *m)
+{
+	unsigned int i;
+	trfs_omap old = *m;
+
+	if (trfs_omap_alloc(m, old.size*2) < 0) {
+		*m = old;
+		return -ENOMEM;
+	}
+	for (i = 0; i < old.size; i++)
+		if (old.slot[i].fd >= 0)
+			trfs_omap_add(m, old.slot[i].addr, old.slot[i].pid,
+							old.slot[i].fd);
+	free(old.slot);
+	return 0;
+}
+
+/** Maps (addr, pid) to fd, returns the fd it was mapped to before or -1.
+ */
+int trfs_omap_add(trfs_omap *m, uint64_t addr, int pid, int fd)
+{
+	int old = -1;
+	unsigned int i;
+
+	if ((m->count+1)*4 > m->size*3 && trfs_omap_grow(m) < 0)
+		return -1;
+
+	i = trfs_omap_hash(m, addr, pid);
+	while (m->slot[i].fd >= 0) {
+		if (m->slot[i].addr == addr && m->slot[i].pid == pid) {
+			old = m->slot[i].fd;
+			m->slot[i].fd = fd;
+			return old;
+		}
+		i = (i+1) & (m->size-1);
+	}
+	m->slot[i].addr = addr;
+	m->slot[i].pid = pid;
+	m->slot[i].fd = fd;
+	m->count++;
+	return old;
+}
+
+static int trfs_omap_find(const trfs_omap *m, uint64_t addr, int pid)
+{
+	unsigned int i;
+
+	if (!m->slot)
+		return -1;
+	i = trfs_omap_hash(m, addr, pid);
+	while (m->slot[i].fd >= 0) {
+		if (m->slot[i].addr == addr && m->slot[i].pid == pid)
+			return i;
+		i = (i+1) & (m->size-1);
+	}
+	return -1;
+}
+
+/** Returns the fd mapped to (addr, pid), -1 if none.
+ */
+int trfs_omap_getfd(const trfs_omap *m, uint64_t addr, int pid)
+{
+	int i = trfs_omap_find(m, addr, pid);
+
+	return i < 0 ? -1 : m->slot[i].fd;
+}
+
+/** Removes (addr, pid) and returns its fd, -1 if it was not mapped.
+ * The slots behind it are shifted back so that no probe chain breaks.
+ */
+int trfs_omap_delete(trfs_omap *m, uint64_t addr, int pid)
+{
+	int fd;
+	int i = trfs_omap_find(m, addr, pid);
+	unsigned int hole, j, home;
+
+	if (i < 0)
+		return -1;
+	fd = m->slot[i].fd;
+
+	hole = i;
+	j = (hole+1) & (m->size-1);
+	while (m->slot[j].fd >= 0) {
+		home = trfs_omap_hash(m, m->slot[j].addr, m->slot[j].pid);
+		/* Move the entry if its home is not between hole and j */
+		if (((j-home) & (m->size-1)) >= ((j-hole) & (m->size-1))) {
+			m->slot[hole] = m->slot[j];
+			hole = j;
+		}
+		j = (j+1) & (m->size-1);
+	}
+	m->slot[hole].fd = -1;
+	m->count--;
+	return fd;
+}
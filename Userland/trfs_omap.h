@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_OMAP_H_
+#define _TRFS_OMAP_H_
+
+#include <stdint.h>
+
+/* Initial number of slots of the open file map, a power of two */
+#define TRFS_OMAP_INIT_SIZE	1024
+
+/** Slot of the open file map, fd is -1 for a free slot
+ */
+typedef struct trfs_omap_ent_ {
+	uint64_t addr;
+	int pid;
+	int fd;
+}trfs_omap_ent;
+
+/** Maps the (file pointer, pid) of a traced open to the replayed fd.
+ * Open addressing with linear probing; deletion shifts the following
+ * slots back instead of leaving tombstones, so lookups stay short however
+ * many open/close cycles go through the map.
+ */
+typedef struct trfs_omap_ {
+	trfs_omap_ent *slot;
+	unsigned int size;
+	unsigned int count;
+}trfs_omap;
+
+int trfs_omap_init(trfs_omap *m, unsigned int size);
+
+void trfs_omap_destroy(trfs_omap *m);
+
+/** Maps (addr, pid) to fd.
+ * Returns the fd the key was mapped to before, or -1. The kernel reuses
+ * the address of a freed struct file, so an open may hit a key whose
+ * close was never traced; the caller owns the stale fd.
+ */
+int trfs_omap_add(trfs_omap *m, uint64_t addr, int pid, int fd);
+
+/** Returns the fd mapped to (addr, pid), -1 if none.
+ */
+int trfs_omap_getfd(const trfs_omap *m, uint64_t addr, int pid);
+
+/** Removes (addr, pid) and returns its fd, -1 if it was not mapped.
+ */
+int trfs_omap_delete(trfs_omap *m, uint64_t addr, int pid);
+
+#endif	/* End of _TRFS_OMAP_H_ */
@@ -1,91 +1,20 @@
+#include <limits.h>
 #include "trfs_ops.h"
+#include "trfs_parse.h"
 
 #define MAX_BYTES 4096
 
 extern int gflags;
 
-/** List that contains the chain of operations
+/** Map of the traced open files to the replayed fds. The parallel replay
+ * works on different files from several threads, so the map is locked.
  */
-trfs_omap_list *omap;
+trfs_omap omap;
+static pthread_mutex_t omap_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/** Add functionality of linked list
+/** Parent directories of the replayed names under the replay root
  */
-static void trfs_omap_add_op(trfs_omap_list *head, trfs_omap_list *node)
-{
-	trfs_omap_list *temp = NULL;
-
-	if (!omap) {
-		omap = node;
-		omap->next = NULL;
-		return;
-	}
-
-	temp = omap;
-	while (temp->next)
-		temp = temp->next;
-	temp->next = node;
-	temp->next->next = NULL;
-}
-
-/** delete functionality of linked list
- */
-static void trfs_omap_delete_op(trfs_omap_list *head, uint64_t addr, int pid)
-{
-	trfs_omap_list *temp, *prev;
-
-	if (!omap)
-		return;
-	if (omap->addr == addr && omap->pid == pid) {
-		temp = omap;
-		omap = omap->next;
-		free(temp);
-		temp = NULL;
-		return;
-	}
-
-	temp = omap;
-	while (temp) {
-		if (temp->addr == addr && temp->pid == pid) {
-			prev->next = temp->next;
-			free(temp);
-			temp = NULL;
-			break;
-		}
-		prev = temp;
-		temp = temp->next;
-	}
-}
-
-/** Destroy the linked list of mapped operations
- */
-static void trfs_omap_destroy_list(trfs_omap_list *head)
-{
-	trfs_omap_list *temp, *curr;
-
-	temp = omap;
-	while (temp) {
-		curr = temp;
-		temp = temp->next;
-		free(curr);
-		curr = NULL;
-	}
-}
-
-/** get the corresponding fd to a given address and pid
- */
-static int trfs_omap_getfd(trfs_omap_list *head, uint64_t addr, int pid)
-{
-	trfs_omap_list *temp = head;
-
-	if (!temp)
-		return -1;
-	while (temp) {
-		if (temp->addr == addr && temp->pid == pid)
-			return temp->fd;
-		temp = temp->next;
-	}
-	return -1;
-}
+trfs_pcache pcache = { .root = -1 };
 
 /* Tracing mkdir operation
  * @param[in] this structure of trace driver
@@ -93,8 +22,14 @@ static int trfs_omap_getfd(trfs_omap_list *head, uint64_t addr, int pid)
 static void trfs_run_mkdir_op(const struct trfs_rpd *this, trfs_mkdir_op *op)
 {
 	int ret = 0;
-
-	ret = mkdir(op->pathname, op->mode);
+	int fd, tmp;
+	char base[PATH_MAX];
+
+	trfs_pcache_hold(&pcache);
+	fd = trfs_pcache_at(&pcache, op->pathname, op->len, base, &tmp);
+	ret = mkdirat(fd, base, op->mode);
+	trfs_pcache_put(fd, tmp);
+	trfs_pcache_release(&pcache);
 	MAP_RETVAL(ret, op->ret)
 }
 
@@ -104,21 +39,33 @@ static void trfs_run_mkdir_op(const struct trfs_rpd *this, trfs_mkdir_op *op)
 static void trfs_run_rmdir_op(const struct trfs_rpd *this, trfs_rmdir_op *op)
 {
 	int ret = 0;
-
-	ret = rmdir(op->pathname);
+	int fd, tmp;
+	char base[PATH_MAX];
+
+	trfs_pcache_hold(&pcache);
+	fd = trfs_pcache_at(&pcache, op->pathname, op->len, base, &tmp);
+	ret = unlinkat(fd, base, AT_REMOVEDIR);
+	trfs_pcache_put(fd, tmp);
+	trfs_pcache_release(&pcache);
+	if (ret == 0)
+		trfs_pcache_forget(&pcache, op->pathname, op->len);
 	MAP_RETVAL(ret, op->ret)
 }
 
 void trfs_run_link_op(const struct trfs_rpd *this, trfs_link_op *op)
 {
 	int ret = 0;
-	char p1[256], p2[256];
-
-	memcpy(p1, op->pathname, op->plen);
-	memcpy(p2, op->pathname+op->plen, op->hlen);
-	p1[op->plen] = '\0';
-	p2[op->hlen] = '\0';
-	ret = link(p1, p2);
+	int fd1, fd2, tmp1, tmp2;
+	char p1[PATH_MAX], p2[PATH_MAX];
+
+	trfs_pcache_hold(&pcache);
+	fd1 = trfs_pcache_at(&pcache, op->pathname, op->plen, p1, &tmp1);
+	fd2 = trfs_pcache_at(&pcache, op->pathname+op->plen, op->hlen, p2,
+									&tmp2);
+	ret = linkat(fd1, p1, fd2, p2, 0);
+	trfs_pcache_put(fd1, tmp1);
+	trfs_pcache_put(fd2, tmp2);
+	trfs_pcache_release(&pcache);
 	MAP_RETVAL(ret, op->ret)
 
 }
@@ -126,13 +73,19 @@ void trfs_run_link_op(const struct trfs_rpd *this, trfs_link_op *op)
 void trfs_run_symlink_op(const struct trfs_rpd *this, trfs_symlink_op *op)
 {
 	int ret = 0;
-	char p1[256], p2[256];
+	int fd, tmp;
+	char p1[PATH_MAX], p2[PATH_MAX];
 
-	memcpy(p1, op->pathname, op->plen);
+	/* The target is stored as given, relative or not */
+	if (op->slen >= sizeof(p2))
+		return;
 	memcpy(p2, op->pathname+op->plen, op->slen);
-	p1[op->plen] = '\0';
 	p2[op->slen] = '\0';
-	ret = symlink(p2, p1);
+	trfs_pcache_hold(&pcache);
+	fd = trfs_pcache_at(&pcache, op->pathname, op->plen, p1, &tmp);
+	ret = symlinkat(p2, fd, p1);
+	trfs_pcache_put(fd, tmp);
+	trfs_pcache_release(&pcache);
 	MAP_RETVAL(ret, op->ret)
 }
 
@@ -142,8 +95,14 @@ void trfs_run_symlink_op(const struct trfs_rpd *this, trfs_symlink_op *op)
 static void trfs_run_unlink_op(const struct trfs_rpd *this, trfs_unlink_op *op)
 {
 	int ret = 0;
-
-	ret = unlink(op->pathname);
+	int fd, tmp;
+	char base[PATH_MAX];
+
+	trfs_pcache_hold(&pcache);
+	fd = trfs_pcache_at(&pcache, op->pathname, op->len, base, &tmp);
+	ret = unlinkat(fd, base, 0);
+	trfs_pcache_put(fd, tmp);
+	trfs_pcache_release(&pcache);
 	MAP_RETVAL(ret, op->ret)
 }
 
@@ -158,34 +117,50 @@ static void trfs_run_trunct_op(const struct trfs_rpd *this, trfs_trunct_op *op)
 static void trfs_run_rename_op(const struct trfs_rpd *this, trfs_rename_op *op)
 {
 	int ret = 0;
-	char p1[256], p2[256];
-
-	memcpy(p1, op->pathname1, op->len1);
-	memcpy(p2, op->pathname1+op->len1, op->len2);
-	p2[op->len2] = '\0';
-	ret = rename(p1, p2);
+	int fd1, fd2, tmp1, tmp2;
+	char p1[PATH_MAX], p2[PATH_MAX];
+
+	trfs_pcache_hold(&pcache);
+	fd1 = trfs_pcache_at(&pcache, op->pathname1, op->len1, p1, &tmp1);
+	fd2 = trfs_pcache_at(&pcache, op->pathname1+op->len1, op->len2, p2,
+									&tmp2);
+	ret = renameat(fd1, p1, fd2, p2);
+	trfs_pcache_put(fd1, tmp1);
+	trfs_pcache_put(fd2, tmp2);
+	trfs_pcache_release(&pcache);
+	/* Directories cached under either name are gone or moved */
+	if (ret == 0) {
+		trfs_pcache_forget(&pcache, op->pathname1, op->len1);
+		trfs_pcache_forget(&pcache, op->pathname1+op->len1, op->len2);
+	}
 	MAP_RETVAL(ret, op->ret)
 }
 
-#define OMAP_OP(a, b, c) \
-		trfs_omap_list *node; \
-		node = (trfs_omap_list *)malloc(sizeof(trfs_omap_list)); \
-		node->fd = a; \
-		node->addr = b; \
-		node->pid = c; \
-		node->next = NULL; \
-		trfs_omap_add_op(omap, node);
-
 /* Tracing open operation
  * @param[in] this structure of trace driver
  */
 static void trfs_run_open_op(const struct trfs_rpd *this, trfs_open_op *op)
 {
 	int ret = 0;
-
-	ret = open(op->pathname, op->flags, op->mode);
-	OMAP_OP(ret, op->addr, op->pid);
-	printf("opened %s file \n",op->pathname);
+	int old = -1;
+	int fd, tmp;
+	char base[PATH_MAX];
+
+	trfs_pcache_hold(&pcache);
+	fd = trfs_pcache_at(&pcache, op->pathname, op->len, base, &tmp);
+	ret = openat(fd, base, op->flags, op->mode);
+	trfs_pcache_put(fd, tmp);
+	trfs_pcache_release(&pcache);
+	pthread_mutex_lock(&omap_lock);
+	if (ret >= 0)
+		old = trfs_omap_add(&omap, op->addr, op->pid, ret);
+	else
+		old = trfs_omap_delete(&omap, op->addr, op->pid);
+	pthread_mutex_unlock(&omap_lock);
+	/* The struct file address was reused without a traced close */
+	if (old >= 0)
+		close(old);
+	TRFS_PRINT("opened %.*s file \n", op->len, op->pathname);
 }
 
 /* Tracing read operation
@@ -196,11 +171,25 @@ static void trfs_run_read_op(const struct trfs_rpd *this, trfs_read_op *op)
 	int fd = 0;
 	int bytes = 0;
 	char buf[MAX_BYTES];
-
-	fd = trfs_omap_getfd(omap, op->addr, op->pid);
-	bytes = read(fd, buf, op->count);
+	char *p = buf;
+	size_t count = op->count < TRFS_READ_MAX ? op->count : TRFS_READ_MAX;
+
+	pthread_mutex_lock(&omap_lock);
+	fd = trfs_omap_getfd(&omap, op->addr, op->pid);
+	pthread_mutex_unlock(&omap_lock);
+	/* The whole count is read, a shorter read would move the position
+	 * elsewhere than the traced one did */
+	if (count > MAX_BYTES)
+		p = (char *)malloc(count);
+	if (!p) {
+		p = buf;
+		count = MAX_BYTES;
+	}
+	bytes = read(fd, p, count);
+	if (p != buf)
+		free(p);
 	MAP_RETVAL(bytes, op->ret)
-	printf("reading from %s file \n",op->pathname);
+	TRFS_PRINT("reading from %.*s file \n", op->len, op->pathname);
 }
 
 /* Tracing write operation
@@ -211,10 +200,12 @@ static void trfs_run_write_op(const struct trfs_rpd *this, trfs_write_op *op)
 	int fd = 0;
 	int bytes = 0;
 
-	fd = trfs_omap_getfd(omap, op->addr, op->pid);
+	pthread_mutex_lock(&omap_lock);
+	fd = trfs_omap_getfd(&omap, op->addr, op->pid);
+	pthread_mutex_unlock(&omap_lock);
 	bytes = write(fd, op->pathname+op->len, op->count);
 	MAP_RETVAL(bytes, op->count);
-	printf("writing to %s file \n",op->pathname);
+	TRFS_PRINT("writing to %.*s file \n", op->len, op->pathname);
 }
 
 /* Tracing close operation
@@ -224,10 +215,12 @@ static void trfs_run_close_op(const struct trfs_rpd *this, trfs_close_op *op)
 {
 	int fd = 0;
 
-	fd = trfs_omap_getfd(omap, op->addr, op->pid);
-	trfs_omap_delete_op(omap, op->addr, op->pid);
-	close(fd);
-	printf("Closing %s file \n",op->pathname);
+	pthread_mutex_lock(&omap_lock);
+	fd = trfs_omap_delete(&omap, op->addr, op->pid);
+	pthread_mutex_unlock(&omap_lock);
+	if (fd >= 0)
+		close(fd);
+	TRFS_PRINT("Closing %.*s file \n", op->len, op->pathname);
 }
 
 /* Tracing setattr operation
@@ -298,13 +291,119 @@ static struct trfs_log_ops log_ops = {
 	replay_removexattr_op	:	trfs_run_removexattr_op
 };
 
+/* The replay ops read a record through its struct: one that sits at an
+ * offset of the tfile the struct can't be read at is copied here first */
+static __thread uint64_t rec_copy[(USHRT_MAX+1)/sizeof(uint64_t)];
+
+/** Dispatches a record to its replay operation
+ * param[in] this structure of trace driver
+ * param[in] rec Record, validated by the parser
+ */
+void trfs_replay_rec(struct trfs_rpd *this, char *rec)
+{
+	if ((uintptr_t)rec & (__alignof__(uint64_t)-1)) {
+		memcpy(rec_copy, rec, trfs_rec_size(rec));
+		rec = (char *)rec_copy;
+	}
+	switch (rec[sizeof(int)+sizeof(unsigned short)]) {
+		case TRFS_OP_MKDIR:
+			this->ops->replay_mkdir_op(this, (trfs_mkdir_op *)rec);
+			break;
+		case TRFS_OP_RMDIR:
+			this->ops->replay_rmdir_op(this, (trfs_rmdir_op *)rec);
+			break;
+		case TRFS_OP_LINK:
+			this->ops->replay_link_op(this, (trfs_link_op *)rec);
+			break;
+		case TRFS_OP_SYMLINK:
+			this->ops->replay_symlink_op(this,
+						(trfs_symlink_op *)rec);
+			break;
+		case TRFS_OP_UNLINK:
+			this->ops->replay_unlink_op(this,
+						(trfs_unlink_op *)rec);
+			break;
+		case TRFS_OP_TRUNCATE:
+			this->ops->replay_trunct_op(this,
+						(trfs_trunct_op *)rec);
+			break;
+		case TRFS_OP_RENAME:
+			this->ops->replay_rename_op(this,
+						(trfs_rename_op *)rec);
+			break;
+		case TRFS_OP_OPEN:
+			this->ops->replay_open_op(this, (trfs_open_op *)rec);
+			break;
+		case TRFS_OP_READ:
+			this->ops->replay_read_op(this, (trfs_read_op *)rec);
+			break;
+		case TRFS_OP_WRITE:
+			this->ops->replay_write_op(this, (trfs_write_op *)rec);
+			break;
+		case TRFS_OP_CLOSE:
+			this->ops->replay_close_op(this, (trfs_close_op *)rec);
+			break;
+		default:
+			break;
+	}
+}
+
+/** Names of the operations, indexed by the record type
+ */
+static const char *op_names[] = {
+	[TRFS_OP_CREATE]	=	"create",
+	[TRFS_OP_LOOKUP]	=	"lookup",
+	[TRFS_OP_LINK]		=	"link",
+	[TRFS_OP_UNLINK]	=	"unlink",
+	[TRFS_OP_SYMLINK]	=	"symlink",
+	[TRFS_OP_MKDIR]		=	"mkdir",
+	[TRFS_OP_RMDIR]		=	"rmdir",
+	[TRFS_OP_MKNOD]		=	"mknod",
+	[TRFS_OP_TRUNCATE]	=	"truncate",
+	[TRFS_OP_RENAME]	=	"rename",
+	[TRFS_OP_PERMISSION]	=	"permission",
+	[TRFS_OP_SETATTR]	=	"setattr",
+	[TRFS_OP_GETATTR]	=	"getattr",
+	[TRFS_OP_SETXATTR]	=	"setxattr",
+	[TRFS_OP_GETXATTR]	=	"getxattr",
+	[TRFS_OP_LISTXATTR]	=	"listxattr",
+	[TRFS_OP_REMOVEXATTR]	=	"removexattr",
+	[TRFS_OP_D_REVALIDATE]	=	"d_revalidate",
+	[TRFS_OP_D_RELEASE]	=	"d_release",
+	[TRFS_OP_READ]		=	"read",
+	[TRFS_OP_WRITE]		=	"write",
+	[TRFS_OP_MMAP]		=	"mmap",
+	[TRFS_OP_OPEN]		=	"open",
+	[TRFS_OP_CLOSE]		=	"close",
+	[TRFS_OP_FLUSH]		=	"flush",
+	[TRFS_OP_FSYNC]		=	"fsync",
+	[TRFS_OP_FASYNC]	=	"fasync",
+	[TRFS_OP_READ_ITER]	=	"read_iter",
+	[TRFS_OP_WRITE_ITER]	=	"write_iter",
+	[TRFS_OP_FILE_RELEASE]	=	"file_release"
+};
+
+/** Name of the operation for the given record type
+ */
+const char *trfs_op_name(int type)
+{
+	if (type <= 0 || type > TRFS_OP_FILE_RELEASE || !op_names[type])
+		return "unknown";
+	return op_names[type];
+}
+
 /** Initialize the replay structure
+ * param[in] root Directory the traced paths are replayed under, the
+ *		current directory if NULL
  */
-struct trfs_rpd *trfs_rpd_init(void)
+struct trfs_rpd *trfs_rpd_init(const char *root)
 {
 	struct trfs_rpd *rpd = NULL;
 		
-	omap = NULL;
+	if (trfs_pcache_init(&pcache, root) < 0)
+		return NULL;
+	if (trfs_omap_init(&omap, TRFS_OMAP_INIT_SIZE) < 0)
+		return NULL;
 
 	rpd = (struct trfs_rpd *)malloc(sizeof(struct trfs_rpd));
 	if (rpd)
@@ -312,11 +411,18 @@ struct trfs_rpd *trfs_rpd_init(void)
 	return rpd;
 }
 
-/** Destroy the mapping list of replay ops
+/** Destroy the replay structure, closes the files left open
  */
 void trfs_rpd_exit(struct trfs_rpd *rpd)
 {
+	unsigned int i;
+
 	if (rpd)
 		free(rpd);
-	trfs_omap_destroy_list(omap);
+	/* Files the trace never closed */
+	for (i = 0; i < omap.size; i++)
+		if (omap.slot[i].fd >= 0)
+			close(omap.slot[i].fd);
+	trfs_omap_destroy(&omap);
+	trfs_pcache_destroy(&pcache);
 }
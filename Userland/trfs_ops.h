@@ -15,25 +15,40 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "structs.h"
+#include "trfs_omap.h"
+#include "trfs_path.h"
+
+/* Most bytes a replayed read asks for, so that it leaves the file
+ * position where the traced one did */
+#define TRFS_READ_MAX	(1024*1024)
+
+/* Per op messages are not printed when replaying with -q */
+#define TRFS_PRINT(...) \
+		do { \
+			if (!gquiet) \
+				printf(__VA_ARGS__); \
+		} while (0)
 
 #define MAP_RETVAL(r1, r2) \
 		if (r1 == r2) {\
-			printf("Success\n"); \
+			TRFS_PRINT("Success\n"); \
 			if (gflags == 1) {\
 				printf("Operation can be replayed \n");\
 				return;\
 			}\
 		} \
 		else {\
-			printf("Failure\n");\
+			TRFS_PRINT("Failure\n");\
 			if (gflags == 2) {\
 				printf("Running with -s: aborting\n"); \
 				exit(0); \
@@ -73,13 +88,6 @@ typedef enum trfs_ops_ {
 	TRFS_OP_FILE_RELEASE	= 30
 }trfs_ops;
 
-typedef struct trfs_omap_list_ {
-	int fd;
-	uint64_t addr;
-	int pid;
-	struct trfs_omap_list_ *next;
-}trfs_omap_list;
-
 struct trfs_rpd;
 
 struct trfs_log_ops {
@@ -119,10 +127,23 @@ struct trfs_rpd {
         struct trfs_log_ops *ops;
 };
 
-extern int flags;
+extern int gflags;
+extern int gquiet;
 
-struct trfs_rpd* trfs_rpd_init(void);
+extern trfs_pcache pcache;
+
+/** Sets up the replay of the traced paths under root
+ */
+struct trfs_rpd* trfs_rpd_init(const char *root);
+
+/** Name of the operation for the given record type
+ */
+const char *trfs_op_name(int type);
 
 void trfs_rpd_exit(struct trfs_rpd*);
 
+/** Dispatches a record to its replay operation
+ */
+void trfs_replay_rec(struct trfs_rpd *this, char *rec);
+
 #endif	/* End of _TRFS_OPS_H_ */
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "trfs_ops.h"
+#include "trfs_parse.h"
+
+/** Opens the tfile and maps it, falls back to streaming if it can't.
+ * param[out] t View of the tfile
+ * param[in] path Path of the tfile
+ * param[in] flags TRFS_TRACE_STREAM to read it through a buffer
+ */
+int trfs_trace_open(trfs_trace *t, const char *path, int flags)
+{
+	struct stat st;
+
+	memset(t, 0, sizeof(trfs_trace));
+	t->fd = open(path, O_RDONLY);
+	if (t->fd < 0)
+		return -ENOENT;
+	if (fstat(t->fd, &st) < 0) {
+		close(t->fd);
+		return -EIO;
+	}
+
+	t->fsize = S_ISREG(st.st_mode) ? st.st_size : LLONG_MAX;
+	t->limit = t->fsize;
+	if (!(flags & TRFS_TRACE_STREAM) && S_ISREG(st.st_mode) &&
+							st.st_size > 0) {
+		t->buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+								t->fd, 0);
+		if (t->buf != MAP_FAILED) {
+			madvise(t->buf, st.st_size, MADV_SEQUENTIAL);
+			t->mapped = 1;
+			t->len = st.st_size;
+			return 0;
+		}
+	}
+
+	t->buf = (char *)malloc(TRFS_STREAM_BUF_SIZE);
+	if (!t->buf) {
+		close(t->fd);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void trfs_trace_close(trfs_trace *t)
+{
+	if (t->mapped)
+		munmap(t->buf, t->len);
+	else if (t->buf)
+		free(t->buf);
+	t->buf = NULL;
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+}
+
+/** Restricts the iteration to the records in [start, end) of the tfile.
+ */
+int trfs_trace_seek(trfs_trace *t, off_t start, off_t end)
+{
+	if (start < 0 || start > end)
+		return -EINVAL;
+	t->err = 0;
+	t->limit = end < t->fsize ? end : t->fsize;
+	if (t->mapped) {
+		t->pos = start < t->fsize ? start : t->fsize;
+		return 0;
+	}
+	if (lseek(t->fd, start, SEEK_SET) < 0)
+		return -EIO;
+	t->base = start;
+	t->len = 0;
+	t->pos = 0;
+	return 0;
+}
+
+/** Moves the partial record to the front of the stream buffer and reads
+ * as much as fits behind it.
+ */
+static void trfs_trace_fill(trfs_trace *t)
+{
+	ssize_t bytes = 0;
+	size_t want = 0;
+
+	memmove(t->buf, t->buf+t->pos, t->len-t->pos);
+	t->base += t->pos;
+	t->len -= t->pos;
+	t->pos = 0;
+
+	while (t->len < TRFS_STREAM_BUF_SIZE && t->base+t->len < t->limit) {
+		want = TRFS_STREAM_BUF_SIZE-t->len;
+		if ((off_t)want > t->limit-t->base-(off_t)t->len)
+			want = t->limit-t->base-t->len;
+		bytes = read(t->fd, t->buf+t->len, want);
+		if (bytes <= 0) {
+			t->limit = t->base+t->len;
+			break;
+		}
+		t->len += bytes;
+	}
+}
+
+/** Returns the next record, NULL at the end of the range or on error.
+ * The record is bounds checked against the range and its own r_size.
+ */
+char *trfs_trace_next(trfs_trace *t)
+{
+	char *rec = NULL;
+	size_t left = 0;
+	unsigned short rsize = 0;
+
+	if (t->err || trfs_trace_offset(t) >= t->limit)
+		return NULL;
+
+	left = t->len-t->pos;
+	if (!t->mapped && (left < TRFS_REC_HDR_SIZE ||
+			   left < trfs_rec_size(t->buf+t->pos))) {
+		trfs_trace_fill(t);
+		left = t->len-t->pos;
+	}
+	if ((off_t)left > t->limit-trfs_trace_offset(t))
+		left = t->limit-trfs_trace_offset(t);
+	if (left == 0)
+		return NULL;
+
+	rec = t->buf+t->pos;
+	if (left < TRFS_REC_HDR_SIZE) {
+		t->err = -EINVAL;
+		return NULL;
+	}
+	rsize = trfs_rec_size(rec);
+	if (rsize < TRFS_REC_HDR_SIZE || rsize > left ||
+	    !trfs_rec_valid(rec, rsize)) {
+		t->err = -EINVAL;
+		return NULL;
+	}
+	t->pos += rsize;
+	return rec;
+}
+
+/* The fixed part of the record and the names behind it fit in r_size */
+#define TRFS_REC_FITS(type, name, var_len) \
+		do { \
+			type op; \
+			if (rsize < offsetof(type, name)) \
+				return 0; \
+			TRFS_REC_LOAD(op, rec, name); \
+			return offsetof(type, name)+(size_t)(var_len) <= rsize; \
+		} while (0)
+
+/** Checks that the fields of a record stay within its r_size.
+ * param[in] rec Record
+ * param[in] rsize Size of the record
+ */
+int trfs_rec_valid(const char *rec, unsigned short rsize)
+{
+	switch (trfs_rec_type(rec)) {
+		case TRFS_OP_MKDIR:
+			TRFS_REC_FITS(trfs_mkdir_op, pathname, op.len);
+		case TRFS_OP_RMDIR:
+			TRFS_REC_FITS(trfs_rmdir_op, pathname, op.len);
+		case TRFS_OP_UNLINK:
+			TRFS_REC_FITS(trfs_unlink_op, pathname, op.len);
+		case TRFS_OP_TRUNCATE:
+			TRFS_REC_FITS(trfs_trunct_op, pathname, op.len);
+		case TRFS_OP_LINK:
+			TRFS_REC_FITS(trfs_link_op, pathname,
+						op.plen+op.hlen);
+		case TRFS_OP_SYMLINK:
+			TRFS_REC_FITS(trfs_symlink_op, pathname,
+						op.plen+op.slen);
+		case TRFS_OP_RENAME:
+			TRFS_REC_FITS(trfs_rename_op, pathname1,
+						op.len1+op.len2);
+		case TRFS_OP_OPEN:
+			TRFS_REC_FITS(trfs_open_op, pathname, op.len);
+		case TRFS_OP_READ:
+			TRFS_REC_FITS(trfs_read_op, pathname, op.len);
+		case TRFS_OP_WRITE:
+			TRFS_REC_FITS(trfs_write_op, pathname,
+						op.len+op.count);
+		case TRFS_OP_CLOSE:
+			TRFS_REC_FITS(trfs_close_op, pathname, op.len);
+		case TRFS_OP_SETXATTR:
+		case TRFS_OP_GETXATTR:
+		case TRFS_OP_LISTXATTR:
+		case TRFS_OP_REMOVEXATTR:
+			TRFS_REC_FITS(trfs_setxattr_op, pathname, op.len);
+		case TRFS_REC_SEG_HDR:
+			return rsize >= sizeof(trfs_seg_hdr);
+		case TRFS_REC_SEG_FTR:
+			return rsize == sizeof(trfs_seg_ftr);
+		case TRFS_REC_INDEX:
+			TRFS_REC_FITS(trfs_idx_rec, ent,
+					op.nr_ent*sizeof(trfs_idx_ent));
+		default:
+			return 1;
+	}
+}
+
+/* Records with one name */
+#define TRFS_REC_INFO(type, ri) \
+		do { \
+			type op; \
+			TRFS_REC_LOAD(op, rec, pathname); \
+			(ri)->pid = op.pid; \
+			(ri)->ret = op.ret; \
+			(ri)->name = TRFS_REC_NAME(rec, type, pathname); \
+			(ri)->len = op.len; \
+		} while (0)
+
+/* Records with one name and the open file */
+#define TRFS_REC_INFO_FILE(type, ri) \
+		do { \
+			type op; \
+			TRFS_REC_INFO(type, ri); \
+			TRFS_REC_LOAD(op, rec, pathname); \
+			(ri)->addr = op.addr; \
+		} while (0)
+
+/** Decodes the common fields of a validated op record.
+ * param[in] rec Record, validated by the parser
+ * param[out] ri Fields of the record
+ */
+int trfs_rec_info_get(const char *rec, trfs_rec_info *ri)
+{
+	memset(ri, 0, sizeof(trfs_rec_info));
+	ri->type = trfs_rec_type(rec);
+	if (ri->type >= TRFS_MAX_OPS)
+		return -EINVAL;
+	ri->ts = trfs_rec_ts(rec);
+
+	switch (ri->type) {
+		case TRFS_OP_OPEN:
+			TRFS_REC_INFO_FILE(trfs_open_op, ri);
+			break;
+		case TRFS_OP_READ: {
+			trfs_read_op op;
+
+			TRFS_REC_INFO_FILE(trfs_read_op, ri);
+			TRFS_REC_LOAD(op, rec, pathname);
+			ri->count = op.count;
+			break;
+		}
+		case TRFS_OP_WRITE: {
+			trfs_write_op op;
+
+			TRFS_REC_INFO_FILE(trfs_write_op, ri);
+			TRFS_REC_LOAD(op, rec, pathname);
+			ri->count = op.count;
+			ri->wflags = op.wflags;
+			break;
+		}
+		case TRFS_OP_CLOSE:
+			TRFS_REC_INFO_FILE(trfs_close_op, ri);
+			break;
+		case TRFS_OP_MKDIR:
+			TRFS_REC_INFO(trfs_mkdir_op, ri);
+			break;
+		case TRFS_OP_RMDIR:
+			TRFS_REC_INFO(trfs_rmdir_op, ri);
+			break;
+		case TRFS_OP_UNLINK:
+			TRFS_REC_INFO(trfs_unlink_op, ri);
+			break;
+		case TRFS_OP_TRUNCATE:
+			TRFS_REC_INFO(trfs_trunct_op, ri);
+			break;
+		case TRFS_OP_SETXATTR:
+		case TRFS_OP_GETXATTR:
+		case TRFS_OP_LISTXATTR:
+		case TRFS_OP_REMOVEXATTR:
+			TRFS_REC_INFO_FILE(trfs_setxattr_op, ri);
+			break;
+		case TRFS_OP_LINK: {
+			trfs_link_op op;
+
+			TRFS_REC_LOAD(op, rec, pathname);
+			ri->pid = op.pid;
+			ri->ret = op.ret;
+			ri->name = TRFS_REC_NAME(rec, trfs_link_op, pathname);
+			ri->len = op.plen;
+			ri->name2 = ri->name+op.plen;
+			ri->len2 = op.hlen;
+			break;
+		}
+		case TRFS_OP_SYMLINK: {
+			trfs_symlink_op op;
+
+			TRFS_REC_LOAD(op, rec, pathname);
+			ri->pid = op.pid;
+			ri->ret = op.ret;
+			ri->name = TRFS_REC_NAME(rec, trfs_symlink_op, pathname);
+			ri->len = op.plen;
+			ri->name2 = ri->name+op.plen;
+			ri->len2 = op.slen;
+			break;
+		}
+		case TRFS_OP_RENAME: {
+			trfs_rename_op op;
+
+			TRFS_REC_LOAD(op, rec, pathname1);
+			ri->pid = op.pid;
+			ri->ret = op.ret;
+			ri->name = TRFS_REC_NAME(rec, trfs_rename_op, pathname1);
+			ri->len = op.len1;
+			ri->name2 = ri->name+op.len1;
+			ri->len2 = op.len2;
+			break;
+		}
+		default:
+			return -EINVAL;
+	}
+	/* Names are logged with or without their NUL */
+	while (ri->len > 0 && ri->name[ri->len-1] == '\0')
+		ri->len--;
+	while (ri->len2 > 0 && ri->name2[ri->len2-1] == '\0')
+		ri->len2--;
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_PARSE_H_
+#define _TRFS_PARSE_H_
+
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "structs.h"
+
+/* Every record starts with <4B: record ID><2B: size><1B: type> */
+#define TRFS_REC_HDR_SIZE	(sizeof(unsigned int)+sizeof(unsigned short)+1)
+
+/* Size of the buffer when the tfile is streamed instead of mapped */
+#define TRFS_STREAM_BUF_SIZE	(8*1024*1024)
+
+/* Flags of trfs_trace_open() */
+#define TRFS_TRACE_STREAM	0x1	/* read() into a buffer, no mmap */
+
+/** View of a tfile. The records are decoded in place: a record returned
+ * by trfs_trace_next() points into the mapping (or the stream buffer) and
+ * stays valid until the next call. No memory is allocated per record.
+ */
+typedef struct trfs_trace_ {
+	int fd;
+	char *buf;		/* mapping of the tfile or stream buffer */
+	size_t len;		/* bytes valid in buf */
+	size_t pos;		/* offset of the next record in buf */
+	off_t fsize;		/* size of the tfile */
+	off_t base;		/* file offset of buf[0] */
+	off_t limit;		/* iteration stops at this file offset */
+	int mapped;
+	int err;		/* -EINVAL once a corrupted record is met */
+}trfs_trace;
+
+static inline unsigned int trfs_rec_id(const char *rec)
+{
+	unsigned int id;
+
+	memcpy(&id, rec, sizeof(unsigned int));
+	return id;
+}
+
+static inline unsigned short trfs_rec_size(const char *rec)
+{
+	unsigned short size;
+
+	memcpy(&size, rec+sizeof(unsigned int), sizeof(unsigned short));
+	return size;
+}
+
+static inline unsigned char trfs_rec_type(const char *rec)
+{
+	return rec[sizeof(unsigned int)+sizeof(unsigned short)];
+}
+
+/** Copies the fixed part of a record, up to the names at its member name,
+ * into the struct op. Records start at any byte of the tfile, so their
+ * fields are not read through a pointer to the struct.
+ */
+#define TRFS_REC_LOAD(op, rec, name) \
+		memcpy(&(op), (rec), offsetof(typeof(op), name))
+
+/** Names behind the fixed part of a record of the given type
+ */
+#define TRFS_REC_NAME(rec, type, name) \
+		((const char *)(rec)+offsetof(type, name))
+
+/** Time at which an op record was traced, in ns since the epoch.
+ * Only op records (type below TRFS_MAX_OPS) carry it.
+ */
+static inline uint64_t trfs_rec_ts(const char *rec)
+{
+	uint64_t ts;
+
+	memcpy(&ts, rec+offsetof(trfs_open_op, ts), sizeof(uint64_t));
+	return ts;
+}
+
+/** Fields the op records have in common, whichever struct they use.
+ * The names point into the record.
+ */
+typedef struct trfs_rec_info_ {
+	unsigned char type;
+	uint64_t ts;
+	unsigned int pid;
+	uint64_t addr;		/* open file, 0 for namespace ops */
+	int ret;
+	size_t count;		/* bytes asked for by read and write */
+	unsigned short wflags;	/* TRFS_WR_* of a write */
+	const char *name;
+	unsigned short len;
+	const char *name2;	/* new name of link and rename, symlink target */
+	unsigned short len2;
+}trfs_rec_info;
+
+/** Opens the tfile and maps it, falls back to streaming if it can't.
+ */
+int trfs_trace_open(trfs_trace *t, const char *path, int flags);
+
+void trfs_trace_close(trfs_trace *t);
+
+/** Restricts the iteration to the records in [start, end) of the tfile.
+ */
+int trfs_trace_seek(trfs_trace *t, off_t start, off_t end);
+
+/** Returns the next record, NULL at the end of the range or on error.
+ */
+char *trfs_trace_next(trfs_trace *t);
+
+/** File offset of the record trfs_trace_next() returns next.
+ */
+static inline off_t trfs_trace_offset(const trfs_trace *t)
+{
+	return t->base+t->pos;
+}
+
+/** Checks that the fields of a record stay within its r_size.
+ */
+int trfs_rec_valid(const char *rec, unsigned short rsize);
+
+/** Decodes the common fields of a validated op record.
+ * Returns -EINVAL for segment records and ops that are not traced.
+ */
+int trfs_rec_info_get(const char *rec, trfs_rec_info *ri);
+
+#endif	/* End of _TRFS_PARSE_H_ */
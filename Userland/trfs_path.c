@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* O_PATH */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "trfs_path.h"
+
+/** FNV-1a hash of a directory path
+ */
+static unsigned int trfs_pc_hash(const char *path, unsigned int len)
+{
+	unsigned int h = 2166136261U;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)path[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/** Last '/' in the first len bytes of path, NULL if none
+ */
+static const char *trfs_pc_slash(const char *path, unsigned int len)
+{
+	while (len > 0)
+		if (path[--len] == '/')
+			return path+len;
+	return NULL;
+}
+
+int trfs_pcache_init(trfs_pcache *pc, const char *root)
+{
+	unsigned int i;
+
+	memset(pc, 0, sizeof(trfs_pcache));
+	pc->root = open(root ? root : ".", O_PATH|O_DIRECTORY);
+	if (pc->root < 0)
+		return -errno;
+	for (i = 0; i < TRFS_PC_SIZE; i++)
+		pc->ent[i].fd = -1;
+	pthread_rwlock_init(&pc->rw, NULL);
+	pthread_mutex_init(&pc->lock, NULL);
+	return 0;
+}
+
+static void trfs_pc_clear(trfs_pcache *pc)
+{
+	unsigned int i;
+
+	for (i = 0; i < TRFS_PC_SIZE; i++) {
+		if (!pc->ent[i].path)
+			continue;
+		close(pc->ent[i].fd);
+		free(pc->ent[i].path);
+		pc->ent[i].path = NULL;
+		pc->ent[i].fd = -1;
+	}
+	pc->count = 0;
+}
+
+void trfs_pcache_destroy(trfs_pcache *pc)
+{
+	if (pc->root < 0)
+		return;
+	trfs_pc_clear(pc);
+	close(pc->root);
+	pc->root = -1;
+	pthread_rwlock_destroy(&pc->rw);
+	pthread_mutex_destroy(&pc->lock);
+}
+
+void trfs_pcache_hold(trfs_pcache *pc)
+{
+	pthread_rwlock_rdlock(&pc->rw);
+}
+
+void trfs_pcache_release(trfs_pcache *pc)
+{
+	pthread_rwlock_unlock(&pc->rw);
+}
+
+/** Slot of the directory, or the free slot it goes to. Called with the
+ * table locked.
+ */
+static trfs_pc_ent *trfs_pc_find(trfs_pcache *pc, const char *dir,
+					unsigned int len, unsigned int hash)
+{
+	unsigned int i = hash & (TRFS_PC_SIZE-1);
+	trfs_pc_ent *e = NULL;
+
+	for (;; i = (i+1) & (TRFS_PC_SIZE-1)) {
+		e = &pc->ent[i];
+		if (!e->path)
+			return e;
+		if (e->hash == hash && e->len == len &&
+		    memcmp(e->path, dir, len) == 0)
+			return e;
+	}
+}
+
+/** Opens the directory dir, relative to the root, through its cached
+ * parent. The table is never full, it holds TRFS_PC_MAX directories in
+ * TRFS_PC_SIZE slots; the directories past that are not cached.
+ */
+static int trfs_pc_dir(trfs_pcache *pc, const char *dir, unsigned int len,
+								int *tmp)
+{
+	int fd, pfd;
+	int ptmp = 0;
+	unsigned int hash = trfs_pc_hash(dir, len);
+	const char *comp = dir;
+	char name[NAME_MAX+1];
+	trfs_pc_ent *e = NULL;
+
+	*tmp = 0;
+	pthread_mutex_lock(&pc->lock);
+	e = trfs_pc_find(pc, dir, len, hash);
+	if (e->path) {
+		pc->nr_hits++;
+		fd = e->fd;
+		pthread_mutex_unlock(&pc->lock);
+		return fd;
+	}
+	pc->nr_misses++;
+	pthread_mutex_unlock(&pc->lock);
+
+	/* The parent first, then the last component from it */
+	pfd = pc->root;
+	comp = trfs_pc_slash(dir, len);
+	if (comp) {
+		pfd = trfs_pc_dir(pc, dir, comp-dir, &ptmp);
+		if (pfd < 0)
+			return pfd;
+		comp++;
+	}
+	else {
+		comp = dir;
+	}
+	if (dir+len-comp > NAME_MAX) {
+		trfs_pcache_put(pfd, ptmp);
+		return -ENAMETOOLONG;
+	}
+	memcpy(name, comp, dir+len-comp);
+	name[dir+len-comp] = '\0';
+	fd = openat(pfd, name, O_PATH|O_DIRECTORY);
+	trfs_pcache_put(pfd, ptmp);
+	if (fd < 0)
+		return -errno;
+
+	pthread_mutex_lock(&pc->lock);
+	e = trfs_pc_find(pc, dir, len, hash);
+	if (e->path) {
+		/* Another op opened it meanwhile */
+		close(fd);
+		fd = e->fd;
+	}
+	else if (pc->count < TRFS_PC_MAX &&
+		 (e->path = (char *)malloc(len)) != NULL) {
+		memcpy(e->path, dir, len);
+		e->len = len;
+		e->hash = hash;
+		e->fd = fd;
+		pc->count++;
+	}
+	else {
+		*tmp = 1;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return fd;
+}
+
+int trfs_pcache_at(trfs_pcache *pc, const char *name, unsigned int len,
+						char *base, int *tmp)
+{
+	int fd;
+	const char *slash = NULL;
+
+	*tmp = 0;
+	/* Paths are from the root of the mount */
+	while (len > 0 && *name == '/') {
+		name++;
+		len--;
+	}
+	if (len >= PATH_MAX)
+		len = PATH_MAX-1;
+	slash = trfs_pc_slash(name, len);
+	if (slash) {
+		fd = trfs_pc_dir(pc, name, slash-name, tmp);
+		if (fd >= 0) {
+			len -= slash+1-name;
+			name = slash+1;
+		}
+		else {
+			fd = pc->root;
+			*tmp = 0;
+		}
+	}
+	else {
+		fd = pc->root;
+	}
+	memcpy(base, name, len);
+	base[len] = '\0';
+	return fd;
+}
+
+void trfs_pcache_put(int fd, int tmp)
+{
+	if (tmp)
+		close(fd);
+}
+
+void trfs_pcache_forget(trfs_pcache *pc, const char *name, unsigned int len)
+{
+	unsigned int i, n = 0;
+	trfs_pc_ent *keep = NULL;
+	trfs_pc_ent *e = NULL;
+
+	while (len > 0 && *name == '/') {
+		name++;
+		len--;
+	}
+	pthread_rwlock_wrlock(&pc->rw);
+	if (pc->count == 0)
+		goto out;
+	keep = (trfs_pc_ent *)malloc(pc->count*sizeof(trfs_pc_ent));
+	if (!keep) {
+		trfs_pc_clear(pc);
+		goto out;
+	}
+	for (i = 0; i < TRFS_PC_SIZE; i++) {
+		e = &pc->ent[i];
+		if (!e->path)
+			continue;
+		if (e->len >= len && memcmp(e->path, name, len) == 0 &&
+		    (e->len == len || e->path[len] == '/')) {
+			close(e->fd);
+			free(e->path);
+		}
+		else {
+			keep[n++] = *e;
+		}
+		e->path = NULL;
+		e->fd = -1;
+	}
+	/* Linear probing has no deletes, the survivors go in again */
+	for (i = 0; i < n; i++)
+		*trfs_pc_find(pc, keep[i].path, keep[i].len,
+						keep[i].hash) = keep[i];
+	pc->count = n;
+	free(keep);
+out:
+	pthread_rwlock_unlock(&pc->rw);
+}
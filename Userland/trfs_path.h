@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_PATH_H_
+#define _TRFS_PATH_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* Slots of the directory cache, a power of two */
+#define TRFS_PC_SIZE		1024
+/* Directories cached at most, the rest are opened per op */
+#define TRFS_PC_MAX		(TRFS_PC_SIZE/4*3)
+
+/** Cached directory, path is NULL for a free slot
+ */
+typedef struct trfs_pc_ent_ {
+	char *path;
+	unsigned int len;
+	unsigned int hash;
+	int fd;
+}trfs_pc_ent;
+
+/** Resolves the traced paths under the replay root.
+ * Traced names are paths from the root of the trfs mount. They are
+ * replayed with the *at() calls relative to an O_PATH descriptor of their
+ * parent directory, which is cached, so the kernel walks one component per
+ * op instead of the whole path. Ops hold the cache shared while they use
+ * a descriptor; rename and rmdir take it exclusively to drop the
+ * directories they move or remove.
+ */
+typedef struct trfs_pcache_ {
+	int root;
+	trfs_pc_ent ent[TRFS_PC_SIZE];
+	unsigned int count;
+	pthread_rwlock_t rw;
+	pthread_mutex_t lock;	/* the table, under a shared rw */
+	unsigned long long nr_hits;
+	unsigned long long nr_misses;
+}trfs_pcache;
+
+/** Opens the replay root, the current directory if root is NULL.
+ */
+int trfs_pcache_init(trfs_pcache *pc, const char *root);
+
+void trfs_pcache_destroy(trfs_pcache *pc);
+
+/** Holds the descriptors returned by trfs_pcache_at() valid until
+ * trfs_pcache_release().
+ */
+void trfs_pcache_hold(trfs_pcache *pc);
+
+void trfs_pcache_release(trfs_pcache *pc);
+
+/** Directory descriptor and NUL terminated base name of a traced path.
+ * base holds PATH_MAX bytes. If the directory can't be opened, the root
+ * and the path relative to it are returned so that the op fails the way
+ * the kernel has it. *tmp is set if the descriptor is not cached and has
+ * to be given back with trfs_pcache_put().
+ */
+int trfs_pcache_at(trfs_pcache *pc, const char *name, unsigned int len,
+						char *base, int *tmp);
+
+void trfs_pcache_put(int fd, int tmp);
+
+/** Drops the cached directories at and under name, after the directory
+ * was renamed or removed.
+ */
+void trfs_pcache_forget(trfs_pcache *pc, const char *name, unsigned int len);
+
+#endif	/* End of _TRFS_PATH_H_ */
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "trfs_preplay.h"
+#include "trfs_parse.h"
+
+/* Kinds of keys, mixed into the hash so that they never match each other */
+#define TRFS_PR_KEY_FILE	0x1ULL
+#define TRFS_PR_KEY_PATH	0x2ULL
+
+typedef struct trfs_pr_ref_ {
+	uint64_t key;
+	int excl;
+}trfs_pr_ref;
+
+static inline uint64_t trfs_pr_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h ? h : 1;
+}
+
+static uint64_t trfs_pr_file_key(uint64_t addr, unsigned int pid)
+{
+	return trfs_pr_mix((addr*0x9e3779b97f4a7c15ULL) ^
+				((uint64_t)pid << 8) ^ TRFS_PR_KEY_FILE);
+}
+
+/** FNV-1a of the name, without a trailing '/' or NUL
+ */
+uint64_t trfs_pr_path_key(const char *name, int len)
+{
+	int i;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len > 0 && (name[len-1] == '/' || name[len-1] == '\0'))
+		len--;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 0x100000001b3ULL;
+	}
+	return trfs_pr_mix(h ^ TRFS_PR_KEY_PATH);
+}
+
+/** Adds the keys of a pathname: the name itself and its parent directory
+ */
+static int trfs_pr_path_refs(trfs_pr_ref *ref, int n, const char *name,
+								int len)
+{
+	int p = len;
+
+	while (p > 0 && (name[p-1] == '/' || name[p-1] == '\0'))
+		p--;
+	while (p > 0 && name[p-1] != '/')
+		p--;
+	ref[n].key = trfs_pr_path_key(name, len);
+	ref[n++].excl = 1;
+	ref[n].key = trfs_pr_path_key(name, p);
+	ref[n++].excl = 0;
+	return n;
+}
+
+/** Keys a record holds while it is replayed
+ * param[in] rec Record, validated by the parser
+ * param[out] ref Keys and whether they are held exclusively
+ */
+static int trfs_pr_refs(const char *rec, trfs_pr_ref *ref)
+{
+	int n = 0;
+	trfs_rec_info ri;
+
+	if (trfs_rec_info_get(rec, &ri) < 0)
+		return 0;
+	switch (ri.type) {
+		case TRFS_OP_OPEN:
+			ref[n].key = trfs_pr_file_key(ri.addr, ri.pid);
+			ref[n++].excl = 1;
+			return trfs_pr_path_refs(ref, n, ri.name, ri.len);
+		case TRFS_OP_READ:
+		case TRFS_OP_WRITE:
+		case TRFS_OP_CLOSE:
+			ref[n].key = trfs_pr_file_key(ri.addr, ri.pid);
+			ref[n++].excl = 1;
+			ref[n].key = trfs_pr_path_key(ri.name, ri.len);
+			ref[n++].excl = 1;
+			return n;
+		case TRFS_OP_MKDIR:
+		case TRFS_OP_RMDIR:
+		case TRFS_OP_UNLINK:
+		case TRFS_OP_TRUNCATE:
+		case TRFS_OP_SYMLINK:
+			/* The target of a symlink is only the content of the
+			 * link */
+			return trfs_pr_path_refs(ref, n, ri.name, ri.len);
+		case TRFS_OP_LINK:
+		case TRFS_OP_RENAME:
+			n = trfs_pr_path_refs(ref, n, ri.name, ri.len);
+			return trfs_pr_path_refs(ref, n, ri.name2, ri.len2);
+		case TRFS_OP_SETXATTR:
+		case TRFS_OP_GETXATTR:
+		case TRFS_OP_LISTXATTR:
+		case TRFS_OP_REMOVEXATTR:
+			ref[n].key = trfs_pr_path_key(ri.name, ri.len);
+			ref[n++].excl = 1;
+			return n;
+		default:
+			return 0;
+	}
+}
+
+static trfs_pr_key *trfs_pr_key_get(trfs_preplay *pr, uint64_t key)
+{
+	unsigned int i = (unsigned int)key & (pr->key_size-1);
+
+	while (pr->key[i].gen == pr->gen) {
+		if (pr->key[i].key == key)
+			return &pr->key[i];
+		i = (i+1) & (pr->key_size-1);
+	}
+	pr->key[i].key = key;
+	pr->key[i].gen = pr->gen;
+	pr->key[i].excl = -1;
+	pr->key[i].shared = -1;
+	return &pr->key[i];
+}
+
+static void trfs_pr_add_edge(trfs_preplay *pr, int from, int to)
+{
+	if (from < 0 || from == to)
+		return;
+	pr->edge[pr->nr_edge].to = to;
+	pr->edge[pr->nr_edge].next = pr->task[from].succ;
+	pr->task[from].succ = pr->nr_edge++;
+	pr->task[to].npred++;
+}
+
+/** Links a new task behind the holders of its keys
+ */
+static void trfs_pr_link(trfs_preplay *pr, int t)
+{
+	int i, n, s;
+	trfs_pr_key *k = NULL;
+	trfs_pr_ref ref[TRFS_PR_MAX_KEYS];
+
+	n = trfs_pr_refs(pr->task[t].rec, ref);
+	for (i = 0; i < n; i++) {
+		k = trfs_pr_key_get(pr, ref[i].key);
+		if (!ref[i].excl) {
+			trfs_pr_add_edge(pr, k->excl, t);
+			pr->sh[pr->nr_sh].to = t;
+			pr->sh[pr->nr_sh].next = k->shared;
+			k->shared = pr->nr_sh++;
+			continue;
+		}
+		if (k->shared < 0)
+			trfs_pr_add_edge(pr, k->excl, t);
+		/* The shared holders already wait for the exclusive one */
+		for (s = k->shared; s >= 0; s = pr->sh[s].next)
+			trfs_pr_add_edge(pr, pr->sh[s].to, t);
+		k->excl = t;
+		k->shared = -1;
+	}
+}
+
+/* Called with pr->lock held */
+static void trfs_pr_ready(trfs_preplay *pr, int t)
+{
+	pr->ready[pr->ready_tail++] = t;
+	pthread_cond_signal(&pr->work);
+}
+
+static void *trfs_pr_worker(void *arg)
+{
+	int t, e;
+	trfs_preplay *pr = (trfs_preplay *)arg;
+
+	pthread_mutex_lock(&pr->lock);
+	while (1) {
+		while (!pr->stop && pr->ready_head == pr->ready_tail)
+			pthread_cond_wait(&pr->work, &pr->lock);
+		if (pr->ready_head == pr->ready_tail)
+			break;
+		t = pr->ready[pr->ready_head++];
+		pthread_mutex_unlock(&pr->lock);
+
+		trfs_replay_rec(pr->rpd, pr->task[t].rec);
+
+		pthread_mutex_lock(&pr->lock);
+		for (e = pr->task[t].succ; e >= 0; e = pr->edge[e].next)
+			if (--pr->task[pr->edge[e].to].npred == 0)
+				trfs_pr_ready(pr, pr->edge[e].to);
+		if (++pr->nr_done == pr->nr_task)
+			pthread_cond_signal(&pr->idle);
+	}
+	pthread_mutex_unlock(&pr->lock);
+	return NULL;
+}
+
+/** Starts nr_workers threads replaying through rpd.
+ * param[in] rpd Replay structure shared by the workers
+ * param[in] nr_workers Size of the worker pool
+ */
+int trfs_preplay_init(trfs_preplay *pr, struct trfs_rpd *rpd, int nr_workers)
+{
+	int i;
+
+	memset(pr, 0, sizeof(trfs_preplay));
+	if (nr_workers < 1 || nr_workers > TRFS_PR_MAX_WORKERS)
+		return -EINVAL;
+	pr->rpd = rpd;
+	pr->gen = 1;
+	/* At most half full, a power of two */
+	pr->key_size = 1;
+	while (pr->key_size < 2*TRFS_PR_MAX_KEYS*TRFS_PR_WINDOW)
+		pr->key_size <<= 1;
+	pr->task = (trfs_pr_task *)malloc(TRFS_PR_WINDOW*sizeof(trfs_pr_task));
+	pr->ready = (int *)malloc(TRFS_PR_WINDOW*sizeof(int));
+	pr->arena = (char *)malloc(TRFS_PR_ARENA_SIZE);
+	/* A key adds one edge, or one per shared holder it drains */
+	pr->edge = (trfs_pr_edge *)malloc(2*TRFS_PR_MAX_KEYS*TRFS_PR_WINDOW*
+							sizeof(trfs_pr_edge));
+	pr->sh = (trfs_pr_edge *)malloc(TRFS_PR_MAX_KEYS*TRFS_PR_WINDOW*
+							sizeof(trfs_pr_edge));
+	pr->key = (trfs_pr_key *)calloc(pr->key_size, sizeof(trfs_pr_key));
+	if (!pr->task || !pr->ready || !pr->arena || !pr->edge || !pr->sh ||
+	    !pr->key)
+		goto out_free;
+
+	pthread_mutex_init(&pr->lock, NULL);
+	pthread_cond_init(&pr->work, NULL);
+	pthread_cond_init(&pr->idle, NULL);
+	for (i = 0; i < nr_workers; i++) {
+		if (pthread_create(&pr->workers[i], NULL, trfs_pr_worker, pr))
+			break;
+		pr->nr_workers++;
+	}
+	if (pr->nr_workers == 0) {
+		trfs_preplay_exit(pr);
+		return -EAGAIN;
+	}
+	return 0;
+
+out_free:
+	free(pr->task);
+	free(pr->ready);
+	free(pr->arena);
+	free(pr->edge);
+	free(pr->sh);
+	free(pr->key);
+	memset(pr, 0, sizeof(trfs_preplay));
+	return -ENOMEM;
+}
+
+/** Adds a record to the window. The window is replayed when it is full.
+ * param[in] rec Record, validated by the parser
+ */
+void trfs_preplay_submit(trfs_preplay *pr, const char *rec)
+{
+	int t;
+	unsigned short rsize = trfs_rec_size(rec);
+
+	if (pr->nr_task == TRFS_PR_WINDOW ||
+	    pr->arena_used+rsize > TRFS_PR_ARENA_SIZE)
+		trfs_preplay_flush(pr);
+
+	t = pr->nr_task++;
+	pr->task[t].rec = pr->arena+pr->arena_used;
+	memcpy(pr->task[t].rec, rec, rsize);
+	/* Keep the records aligned for the workers that decode them */
+	pr->arena_used += (rsize+7) & ~7;
+	pr->task[t].npred = 0;
+	pr->task[t].succ = -1;
+	trfs_pr_link(pr, t);
+}
+
+/** Replays the records submitted so far and waits for them.
+ * Dependencies on earlier windows are met once their flush returns.
+ */
+void trfs_preplay_flush(trfs_preplay *pr)
+{
+	int t;
+
+	if (pr->nr_task == 0)
+		return;
+
+	pthread_mutex_lock(&pr->lock);
+	pr->ready_head = 0;
+	pr->ready_tail = 0;
+	pr->nr_done = 0;
+	for (t = 0; t < pr->nr_task; t++)
+		if (pr->task[t].npred == 0)
+			pr->ready[pr->ready_tail++] = t;
+	pthread_cond_broadcast(&pr->work);
+	while (pr->nr_done < pr->nr_task)
+		pthread_cond_wait(&pr->idle, &pr->lock);
+	pthread_mutex_unlock(&pr->lock);
+
+	pr->nr_edges += pr->nr_edge;
+	pr->nr_windows++;
+	pr->nr_task = 0;
+	pr->nr_edge = 0;
+	pr->nr_sh = 0;
+	pr->arena_used = 0;
+	/* Forgets all keys of the window */
+	if (++pr->gen == 0) {
+		memset(pr->key, 0, pr->key_size*sizeof(trfs_pr_key));
+		pr->gen = 1;
+	}
+}
+
+/** Flushes the window and stops the workers.
+ */
+void trfs_preplay_exit(trfs_preplay *pr)
+{
+	int i;
+
+	if (!pr->task)
+		return;
+	trfs_preplay_flush(pr);
+
+	pthread_mutex_lock(&pr->lock);
+	pr->stop = 1;
+	pthread_cond_broadcast(&pr->work);
+	pthread_mutex_unlock(&pr->lock);
+	for (i = 0; i < pr->nr_workers; i++)
+		pthread_join(pr->workers[i], NULL);
+
+	pthread_mutex_destroy(&pr->lock);
+	pthread_cond_destroy(&pr->work);
+	pthread_cond_destroy(&pr->idle);
+	free(pr->task);
+	free(pr->ready);
+	free(pr->arena);
+	free(pr->edge);
+	free(pr->sh);
+	free(pr->key);
+	memset(pr, 0, sizeof(trfs_preplay));
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_PREPLAY_H_
+#define _TRFS_PREPLAY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "trfs_ops.h"
+
+/* Records scheduled together; the window is drained before the next one */
+#define TRFS_PR_WINDOW		65536
+/* Bytes of records copied into a window */
+#define TRFS_PR_ARENA_SIZE	(16*1024*1024)
+/* Most keys a record holds: rename holds two paths and two parents */
+#define TRFS_PR_MAX_KEYS	4
+#define TRFS_PR_MAX_WORKERS	256
+
+/** A record of the window and the records that wait for it
+ */
+typedef struct trfs_pr_task_ {
+	char *rec;
+	unsigned int npred;	/* predecessors not replayed yet */
+	int succ;		/* first edge to a successor, -1 if none */
+}trfs_pr_task;
+
+/** Edge of the dependency graph, also used to chain the shared holders
+ * of a key.
+ */
+typedef struct trfs_pr_edge_ {
+	int to;
+	int next;
+}trfs_pr_edge;
+
+/** Last holders of a key within the window. gen tells stale slots from
+ * live ones, so the table is not cleared between windows.
+ */
+typedef struct trfs_pr_key_ {
+	uint64_t key;
+	unsigned int gen;
+	int excl;		/* last exclusive holder, -1 if none */
+	int shared;		/* shared holders since excl, -1 if none */
+}trfs_pr_key;
+
+/** Parallel replay engine.
+ * Every record takes a few keys: the open file it works on, the pathnames
+ * it touches (exclusive) and their parent directories (shared). A record
+ * waits for the previous exclusive holder of each of its keys, and an
+ * exclusive holder also for the shared holders before it. So ops on one
+ * file or one name keep their trace order, creates in a directory run
+ * side by side but not before the directory exists, and everything else
+ * runs concurrently on the worker pool.
+ */
+typedef struct trfs_preplay_ {
+	struct trfs_rpd *rpd;
+	int nr_workers;
+	pthread_t workers[TRFS_PR_MAX_WORKERS];
+
+	/* Window being built by the parsing thread */
+	trfs_pr_task *task;
+	int nr_task;
+	char *arena;
+	size_t arena_used;
+	trfs_pr_edge *edge;
+	int nr_edge;
+	trfs_pr_edge *sh;
+	int nr_sh;
+	trfs_pr_key *key;
+	unsigned int key_size;
+	unsigned int gen;
+
+	/* Window being replayed, under lock */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	int *ready;
+	int ready_head;
+	int ready_tail;
+	int nr_done;
+	int stop;
+
+	unsigned long long nr_edges;	/* dependencies over all windows */
+	unsigned long long nr_windows;
+}trfs_preplay;
+
+/** Key of a pathname, the same for every name of it with or without a
+ * trailing '/'. The io_uring replay orders the ops on a path with it too.
+ */
+uint64_t trfs_pr_path_key(const char *name, int len);
+
+/** Starts nr_workers threads replaying through rpd.
+ */
+int trfs_preplay_init(trfs_preplay *pr, struct trfs_rpd *rpd, int nr_workers);
+
+/** Adds a record to the window. The record is copied, the caller's view
+ * may move on. The window is replayed when it is full.
+ */
+void trfs_preplay_submit(trfs_preplay *pr, const char *rec);
+
+/** Replays the records submitted so far and waits for them.
+ */
+void trfs_preplay_flush(trfs_preplay *pr);
+
+/** Flushes the window and stops the workers.
+ */
+void trfs_preplay_exit(trfs_preplay *pr);
+
+#endif	/* End of _TRFS_PREPLAY_H_ */
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "trfs_uring.h"
+#include "trfs_parse.h"
+#include "trfs_preplay.h"
+
+static int trfs_ur_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int trfs_ur_enter(int fd, unsigned int to_submit,
+			unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+							flags, NULL, 0);
+}
+
+static int trfs_ur_register(int fd, unsigned int opcode, void *arg,
+							unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** Registers a fixed file table of nr empty slots
+ */
+static int trfs_ur_register_files(trfs_uring *ur, unsigned int nr)
+{
+	int ret;
+	unsigned int i;
+	int *fds = NULL;
+	struct io_uring_rsrc_register rr;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.nr = nr;
+	rr.flags = IORING_RSRC_REGISTER_SPARSE;
+	ret = trfs_ur_register(ur->fd, IORING_REGISTER_FILES2, &rr,
+							sizeof(rr));
+	if (ret == 0)
+		return 0;
+
+	/* Kernels before 5.19 take a table of -1 instead */
+	fds = (int *)malloc(nr*sizeof(int));
+	if (!fds)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		fds[i] = -1;
+	ret = trfs_ur_register(ur->fd, IORING_REGISTER_FILES, fds, nr);
+	free(fds);
+	return ret < 0 ? -errno : 0;
+}
+
+/** Sets up a ring of the given depth.
+ * param[in] depth Most ops in flight at once
+ */
+int trfs_uring_init(trfs_uring *ur, unsigned int depth)
+{
+	int ret = 0;
+	unsigned int i;
+	struct rlimit rl;
+	struct io_uring_params p;
+
+	memset(ur, 0, sizeof(trfs_uring));
+	ur->fd = -1;
+	if (depth < 1 || depth > TRFS_UR_MAX_DEPTH)
+		return -EINVAL;
+	ur->depth = depth;
+
+	memset(&p, 0, sizeof(p));
+	ur->fd = trfs_ur_setup(depth, &p);
+	if (ur->fd < 0)
+		return -errno;
+
+	ur->sq_ring_len = p.sq_off.array+p.sq_entries*sizeof(unsigned int);
+	ur->cq_ring_len = p.cq_off.cqes+
+				p.cq_entries*sizeof(struct io_uring_cqe);
+	ur->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+	ur->sq_ring = mmap(NULL, ur->sq_ring_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	ur->cq_ring = mmap(NULL, ur->cq_ring_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+	ur->sqes = (struct io_uring_sqe *)mmap(NULL, ur->sqes_len,
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			ur->fd, IORING_OFF_SQES);
+	if (ur->sq_ring == MAP_FAILED || ur->cq_ring == MAP_FAILED ||
+	    ur->sqes == MAP_FAILED) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ur->sq_head = (unsigned int *)((char *)ur->sq_ring+p.sq_off.head);
+	ur->sq_tail = (unsigned int *)((char *)ur->sq_ring+p.sq_off.tail);
+	ur->sq_array = (unsigned int *)((char *)ur->sq_ring+p.sq_off.array);
+	ur->sq_mask = *(unsigned int *)((char *)ur->sq_ring+
+						p.sq_off.ring_mask);
+	ur->sq_entries = p.sq_entries;
+	ur->sq_local = *ur->sq_tail;
+	ur->cq_head = (unsigned int *)((char *)ur->cq_ring+p.cq_off.head);
+	ur->cq_tail = (unsigned int *)((char *)ur->cq_ring+p.cq_off.tail);
+	ur->cq_mask = *(unsigned int *)((char *)ur->cq_ring+
+						p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((char *)ur->cq_ring+
+							p.cq_off.cqes);
+
+	/* The table of direct descriptors counts against RLIMIT_NOFILE */
+	ur->nr_files = TRFS_UR_FILES;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < ur->nr_files)
+		ur->nr_files = rl.rlim_cur;
+	ret = trfs_ur_register_files(ur, ur->nr_files);
+	if (ret < 0)
+		goto out;
+
+	ur->file = (trfs_ur_file *)calloc(ur->nr_files, sizeof(trfs_ur_file));
+	ur->free_slot = (int *)malloc(ur->nr_files*sizeof(int));
+	ur->rbuf = (char *)malloc(TRFS_UR_READ_MAX);
+	if (!ur->file || !ur->free_slot || !ur->rbuf ||
+	    trfs_omap_init(&ur->map, TRFS_OMAP_INIT_SIZE) < 0 ||
+	    trfs_omap_init(&ur->pmap, TRFS_OMAP_INIT_SIZE) < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < ur->nr_files; i++)
+		ur->free_slot[i] = ur->nr_files-1-i;
+	ur->nr_free = ur->nr_files;
+	return 0;
+
+out:
+	trfs_uring_exit(ur);
+	return ret;
+}
+
+/** Hands the prepared SQEs to the kernel, waiting for wait completions
+ */
+static int trfs_ur_flush(trfs_uring *ur, unsigned int wait)
+{
+	int ret;
+	unsigned int to_submit = ur->sq_local-*ur->sq_tail;
+
+	__atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+	if (to_submit == 0 && wait == 0)
+		return 0;
+	do {
+		ret = trfs_ur_enter(ur->fd, to_submit, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : 0;
+}
+
+/** Returns a free SQE, submitting the prepared ones if the ring is full
+ */
+static struct io_uring_sqe *trfs_ur_get_sqe(trfs_uring *ur)
+{
+	unsigned int head;
+	struct io_uring_sqe *sqe = NULL;
+
+	head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+	if (ur->sq_local-head >= ur->sq_entries) {
+		trfs_ur_flush(ur, 0);
+		head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+		if (ur->sq_local-head >= ur->sq_entries)
+			return NULL;
+	}
+	sqe = &ur->sqes[ur->sq_local & ur->sq_mask];
+	ur->sq_array[ur->sq_local & ur->sq_mask] = ur->sq_local & ur->sq_mask;
+	ur->sq_local++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/** Prepares the SQE of a request
+ * param[in] after File whose last SQE, the one prepared just before, it
+ *	is hard linked to. NULL for none.
+ */
+static void trfs_ur_prep(trfs_uring *ur, trfs_ur_req *req,
+							trfs_ur_file *after)
+{
+	trfs_ur_file *f = &ur->file[req->slot];
+	struct io_uring_sqe *sqe = NULL;
+
+	sqe = trfs_ur_get_sqe(ur);
+	if (!sqe) {
+		/* Can't happen with the SQ sized to the depth */
+		free(req);
+		return;
+	}
+	if (after)
+		ur->sqes[after->last_seq & ur->sq_mask].flags |=
+							IOSQE_IO_HARDLINK;
+
+	switch (req->type) {
+		case TRFS_OP_OPEN: {
+			trfs_open_op *op = (trfs_open_op *)req->rec;
+
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = req->dfd;
+			sqe->addr = (uintptr_t)req->path;
+			sqe->len = op->mode;
+			sqe->open_flags = op->flags;
+			sqe->file_index = req->slot+1;
+			break;
+		}
+		case TRFS_OP_READ: {
+			trfs_read_op *op = (trfs_read_op *)req->rec;
+
+			sqe->opcode = IORING_OP_READ;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fd = req->slot;
+			sqe->addr = (uintptr_t)ur->rbuf;
+			sqe->len = op->count < TRFS_UR_READ_MAX ? op->count :
+							TRFS_UR_READ_MAX;
+			/* At the file position, like read() */
+			sqe->off = (uint64_t)-1;
+			break;
+		}
+		case TRFS_OP_WRITE: {
+			trfs_write_op *op = (trfs_write_op *)req->rec;
+
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fd = req->slot;
+			sqe->addr = (uintptr_t)(op->pathname+op->len);
+			sqe->len = op->count;
+			sqe->off = (uint64_t)-1;
+			break;
+		}
+		case TRFS_OP_CLOSE:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->file_index = req->slot+1;
+			break;
+	}
+	sqe->user_data = (uintptr_t)req;
+
+	f->last_seq = ur->sq_local-1;
+	f->inflight++;
+	ur->inflight++;
+	ur->nr_ops++;
+	ur->nr_linked += after != NULL;
+}
+
+/** Prepares the requests queued on a file as one hard linked chain
+ */
+static void trfs_ur_push(trfs_uring *ur, trfs_ur_file *f)
+{
+	int link = 0;
+	unsigned int head;
+	trfs_ur_req *req = NULL;
+
+	while ((req = f->head) != NULL) {
+		/* A chain must not be split across two submissions */
+		head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+		if (link && ur->sq_local-head >= ur->sq_entries)
+			break;
+		f->head = req->next;
+		if (!f->head)
+			f->tail = NULL;
+		trfs_ur_prep(ur, req, link ? f : NULL);
+		link = 1;
+	}
+}
+
+/* What the path map holds for a file: its slot and generation, so that a
+ * slot given back and taken by another file is told apart */
+#define TRFS_UR_PVAL(slot, gen)	((int)((((gen) & 0x7fff) << 16) | (slot)))
+#define TRFS_UR_PVAL_SLOT(v)	((v) & 0xffff)
+
+static void trfs_ur_put_slot(trfs_uring *ur, int slot)
+{
+	trfs_ur_file *f = &ur->file[slot];
+
+	trfs_omap_delete(&ur->map, f->addr, f->pid);
+	if (trfs_omap_getfd(&ur->pmap, f->pkey, 0) ==
+					TRFS_UR_PVAL(slot, f->gen))
+		trfs_omap_delete(&ur->pmap, f->pkey, 0);
+	f->gen++;
+	f->used = 0;
+	ur->free_slot[ur->nr_free++] = slot;
+}
+
+/** Accounts a completion and starts what waited on its file
+ */
+static void trfs_ur_complete(trfs_uring *ur, trfs_ur_req *req, int res)
+{
+	trfs_ur_file *f = &ur->file[req->slot];
+
+	ur->inflight--;
+	f->inflight--;
+
+	switch (req->type) {
+		case TRFS_OP_READ:
+		case TRFS_OP_WRITE:
+			if (res > 0)
+				ur->nr_bytes += res;
+			if (res != req->ret)
+				ur->nr_differ++;
+			break;
+		default:
+			if ((res < 0) != (req->ret < 0))
+				ur->nr_differ++;
+			break;
+	}
+	if (req->type == TRFS_OP_CLOSE)
+		f->closed = 1;
+	else if (req->type == TRFS_OP_OPEN)
+		f->closed = 0;
+	free(req);
+
+	if (f->inflight > 0)
+		return;
+	if (f->head)
+		trfs_ur_push(ur, f);
+	else if (f->closed)
+		trfs_ur_put_slot(ur, f-ur->file);
+}
+
+/** Submits what is prepared and reaps completions, waiting for wait
+ */
+static void trfs_ur_reap(trfs_uring *ur, unsigned int wait)
+{
+	unsigned int head, tail;
+	struct io_uring_cqe *cqe = NULL;
+	trfs_ur_req *req = NULL;
+	int res;
+
+	if (trfs_ur_flush(ur, wait) < 0 && wait) {
+		printf("io_uring_enter: Failed (%s)\n", strerror(errno));
+		exit(1);
+	}
+	head = *ur->cq_head;
+	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &ur->cqes[head & ur->cq_mask];
+		req = (trfs_ur_req *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		head++;
+		/* Completing may prepare new SQEs, free the CQE first */
+		__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+		trfs_ur_complete(ur, req, res);
+		tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+/** Copies a record into a request, open gets its name NUL terminated and
+ * the directory it is relative to. The cached directories stay open while
+ * the open is in flight: the namespace ops that drop them drain the ring.
+ */
+static trfs_ur_req *trfs_ur_req_alloc(const char *rec, int slot)
+{
+	int tmp = 0;
+	unsigned short rsize = trfs_rec_size(rec);
+	trfs_ur_req *req = NULL;
+	trfs_open_op op;
+	const char *name = TRFS_REC_NAME(rec, trfs_open_op, pathname);
+	size_t len = sizeof(trfs_ur_req)+rsize;
+	trfs_rec_info ri;
+
+	if (trfs_rec_info_get(rec, &ri) < 0)
+		return NULL;
+	if (ri.type == TRFS_OP_OPEN) {
+		TRFS_REC_LOAD(op, rec, pathname);
+		len += op.len+1;
+	}
+	req = (trfs_ur_req *)malloc(len);
+	if (!req)
+		return NULL;
+	req->next = NULL;
+	req->slot = slot;
+	req->type = ri.type;
+	req->ret = ri.ret;
+	req->rec = (char *)(req+1);
+	req->path = NULL;
+	req->dfd = -1;
+	/* The copy is aligned, the SQEs are prepared from its fields */
+	memcpy(req->rec, rec, rsize);
+
+	if (req->type == TRFS_OP_OPEN) {
+		req->path = req->rec+rsize;
+		trfs_pcache_hold(&pcache);
+		req->dfd = trfs_pcache_at(&pcache, name, op.len, req->path,
+									&tmp);
+		trfs_pcache_release(&pcache);
+		if (tmp) {
+			/* Not cached, resolved from the root instead */
+			trfs_pcache_put(req->dfd, tmp);
+			req->dfd = pcache.root;
+			memcpy(req->path, name, op.len);
+			req->path[op.len] = '\0';
+			while (*req->path == '/')
+				req->path++;
+		}
+	}
+	return req;
+}
+
+/** Checks whether the last SQE of the file is the last one prepared and
+ * not submitted yet, so that the next one can be linked to it.
+ */
+static int trfs_ur_is_tail(trfs_uring *ur, trfs_ur_file *f)
+{
+	unsigned int head;
+
+	if (f->last_seq+1 != ur->sq_local ||
+	    (int)(f->last_seq-*ur->sq_tail) < 0)
+		return 0;
+	/* The chain must fit in this submission */
+	head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+	return ur->sq_local-head < ur->sq_entries;
+}
+
+/** Fixed file slot of the traced file, a new one for an unknown file
+ */
+static int trfs_ur_slot(trfs_uring *ur, uint64_t addr, int pid)
+{
+	int slot = trfs_omap_getfd(&ur->map, addr, pid);
+	unsigned int gen;
+	trfs_ur_file *f = NULL;
+
+	if (slot >= 0)
+		return slot;
+	/* Closes in flight give their slots back */
+	while (ur->nr_free == 0 && ur->inflight > 0)
+		trfs_ur_reap(ur, 1);
+	if (ur->nr_free == 0)
+		return -EMFILE;
+
+	slot = ur->free_slot[--ur->nr_free];
+	f = &ur->file[slot];
+	gen = f->gen;
+	memset(f, 0, sizeof(trfs_ur_file));
+	f->gen = gen;
+	f->addr = addr;
+	f->pid = pid;
+	f->used = 1;
+	trfs_omap_add(&ur->map, addr, pid, slot);
+	return slot;
+}
+
+/** Key of the path of an open, read, write or close
+ */
+static uint64_t trfs_ur_path_key(const trfs_rec_info *ri)
+{
+	return trfs_pr_path_key(ri->name, ri->len);
+}
+
+/** Other file the last op on the path went through, while it still has
+ * ops in flight or waiting. NULL if the op is free to go. A file keeps
+ * its slot until its close completes, so the ops of a path can also sit
+ * behind those of another path on the slot: it is the slot that counts.
+ */
+static trfs_ur_file *trfs_ur_path_prev(trfs_uring *ur, uint64_t pkey,
+					int slot, unsigned int *gen)
+{
+	int v = trfs_omap_getfd(&ur->pmap, pkey, 0);
+	trfs_ur_file *p = NULL;
+
+	if (v < 0 || TRFS_UR_PVAL_SLOT(v) == slot)
+		return NULL;
+	p = &ur->file[TRFS_UR_PVAL_SLOT(v)];
+	if (!p->used || TRFS_UR_PVAL(TRFS_UR_PVAL_SLOT(v), p->gen) != v ||
+	    (p->inflight == 0 && !p->head))
+		return NULL;
+	*gen = p->gen;
+	return p;
+}
+
+/** Checks whether an op of the file in slot can be hard linked to the
+ * last SQE of p: the file is idle and that SQE the last one prepared.
+ */
+static int trfs_ur_path_linkable(trfs_uring *ur, trfs_ur_file *p, int slot)
+{
+	trfs_ur_file *f = slot >= 0 ? &ur->file[slot] : NULL;
+
+	if (f && (f->inflight > 0 || f->head))
+		return 0;
+	return !p->head && trfs_ur_is_tail(ur, p);
+}
+
+/** Reaps until the file p of generation gen is idle or gone
+ */
+static void trfs_ur_path_wait(trfs_uring *ur, trfs_ur_file *p,
+							unsigned int gen)
+{
+	while (p->used && p->gen == gen && (p->inflight > 0 || p->head))
+		trfs_ur_reap(ur, 1);
+}
+
+/** Submits a record, namespace ops are replayed through rpd.
+ * param[in] rec Record, validated by the parser
+ */
+void trfs_uring_submit(trfs_uring *ur, struct trfs_rpd *rpd,
+							const char *rec)
+{
+	int slot;
+	uint64_t addr, pkey;
+	unsigned int pid, gen = 0;
+	trfs_ur_file *f = NULL, *p = NULL;
+	trfs_ur_req *req = NULL;
+	trfs_rec_info ri;
+
+	switch (trfs_rec_type(rec)) {
+		case TRFS_OP_OPEN:
+		case TRFS_OP_READ:
+		case TRFS_OP_WRITE:
+		case TRFS_OP_CLOSE:
+			break;
+		default:
+			/* Namespace ops see every earlier op completed */
+			trfs_uring_drain(ur);
+			ur->nr_drains++;
+			trfs_replay_rec(rpd, (char *)rec);
+			return;
+	}
+
+	if (trfs_rec_info_get(rec, &ri) < 0)
+		return;
+	pid = ri.pid;
+	addr = ri.addr;
+
+	/* Waits come first: they reap, and a completed close would give
+	 * the slot of the file away under us */
+	while (ur->inflight >= ur->depth)
+		trfs_ur_reap(ur, 1);
+
+	/* An op through another fd of the path came first. It goes right
+	 * behind the SQE of that op if its own file is idle, otherwise it
+	 * waits for that file to finish: a read at EOF would return another
+	 * count, and move the writes that follow it. */
+	pkey = trfs_ur_path_key(&ri);
+	slot = trfs_omap_getfd(&ur->map, addr, pid);
+	p = trfs_ur_path_prev(ur, pkey, slot, &gen);
+	if (p && !trfs_ur_path_linkable(ur, p, slot)) {
+		ur->nr_path_waits++;
+		trfs_ur_path_wait(ur, p, gen);
+	}
+
+	slot = trfs_ur_slot(ur, addr, pid);
+	if (slot < 0) {
+		TRFS_PRINT("No fixed file slot left: skipping record %u\n",
+							trfs_rec_id(rec));
+		return;
+	}
+	f = &ur->file[slot];
+	req = trfs_ur_req_alloc(rec, slot);
+	if (!req)
+		return;
+	/* A new file may have had to reap for its slot, which submits the
+	 * SQE of p */
+	p = trfs_ur_path_prev(ur, pkey, slot, &gen);
+	if (p && !trfs_ur_path_linkable(ur, p, slot)) {
+		ur->nr_path_waits++;
+		trfs_ur_path_wait(ur, p, gen);
+		p = NULL;
+	}
+	f->pkey = pkey;
+	trfs_omap_add(&ur->pmap, pkey, 0, TRFS_UR_PVAL(slot, f->gen));
+
+	if (p) {
+		trfs_ur_prep(ur, req, p);
+	}
+	else if (f->inflight > 0 && !f->head && trfs_ur_is_tail(ur, f)) {
+		/* Its last SQE is not submitted yet: chain right behind it */
+		trfs_ur_prep(ur, req, f);
+	}
+	else if (f->inflight > 0 || f->head) {
+		if (f->tail)
+			f->tail->next = req;
+		else
+			f->head = req;
+		f->tail = req;
+	}
+	else {
+		trfs_ur_prep(ur, req, NULL);
+	}
+}
+
+/** Waits until all submitted ops have completed.
+ */
+void trfs_uring_drain(trfs_uring *ur)
+{
+	while (ur->inflight > 0)
+		trfs_ur_reap(ur, 1);
+}
+
+void trfs_uring_exit(trfs_uring *ur)
+{
+	if (ur->fd >= 0 && ur->file)
+		trfs_uring_drain(ur);
+	if (ur->sqes && ur->sqes != MAP_FAILED)
+		munmap(ur->sqes, ur->sqes_len);
+	if (ur->cq_ring && ur->cq_ring != MAP_FAILED)
+		munmap(ur->cq_ring, ur->cq_ring_len);
+	if (ur->sq_ring && ur->sq_ring != MAP_FAILED)
+		munmap(ur->sq_ring, ur->sq_ring_len);
+	/* Closing the ring closes the files still in the table */
+	if (ur->fd >= 0)
+		close(ur->fd);
+	trfs_omap_destroy(&ur->map);
+	trfs_omap_destroy(&ur->pmap);
+	free(ur->file);
+	free(ur->free_slot);
+	free(ur->rbuf);
+	memset(ur, 0, sizeof(trfs_uring));
+	ur->fd = -1;
+}
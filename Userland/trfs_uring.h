@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_URING_H_
+#define _TRFS_URING_H_
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include "trfs_ops.h"
+
+#define TRFS_UR_DEPTH		64	/* default queue depth */
+#define TRFS_UR_MAX_DEPTH	4096
+#define TRFS_UR_FILES		65536	/* fixed file slots, open files */
+#define TRFS_UR_READ_MAX	TRFS_READ_MAX	/* reads land in one buffer */
+
+/** An op in flight, or queued behind the ops in flight on its file
+ */
+typedef struct trfs_ur_req_ {
+	struct trfs_ur_req_ *next;
+	int slot;		/* fixed file of the traced file */
+	unsigned char type;
+	int ret;		/* return value in the trace */
+	int dfd;		/* directory path is relative to */
+	char *path;		/* NUL terminated name for open */
+	char *rec;		/* copy of the record, holds the write data */
+}trfs_ur_req;
+
+/** A traced open file. It owns one fixed file slot for its lifetime, the
+ * replayed open installs the file there and the close removes it again.
+ */
+typedef struct trfs_ur_file_ {
+	uint64_t addr;
+	int pid;
+	int used;
+	int closed;		/* the last op completed was a close */
+	int inflight;
+	unsigned int last_seq;	/* SQ position of its last SQE */
+	uint64_t pkey;		/* path of its last op */
+	unsigned int gen;	/* bumped when the slot is given back */
+	trfs_ur_req *head;	/* waiting for the ops in flight */
+	trfs_ur_req *tail;
+}trfs_ur_file;
+
+/** io_uring replay backend.
+ * Reads, writes, opens and closes are submitted through one ring with up
+ * to depth ops in flight. The ops of one file run in trace order: an op
+ * whose predecessor on the file is still prepared but unsubmitted is
+ * hard linked to it, otherwise it waits on the file until the ops in
+ * flight complete. The ops on one path through different files keep
+ * their order as well: an op follows the last op on its path the same
+ * way, by a link or by waiting for that file to finish. Files are direct
+ * descriptors in the fixed file table, so a read can be linked to the
+ * open that creates its file. Namespace ops drain the ring and run
+ * synchronously.
+ */
+typedef struct trfs_uring_ {
+	int fd;
+	unsigned int depth;
+	unsigned int inflight;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local;	/* tail of the prepared SQEs */
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	trfs_omap map;		/* (addr, pid) to fixed file slot */
+	trfs_omap pmap;		/* path key to the slot and gen of its last op */
+	trfs_ur_file *file;
+	unsigned int nr_files;
+	int *free_slot;
+	unsigned int nr_free;
+	char *rbuf;
+
+	unsigned long long nr_ops;
+	unsigned long long nr_linked;
+	unsigned long long nr_path_waits;	/* on another file of the path */
+	unsigned long long nr_bytes;
+	unsigned long long nr_differ;	/* results that differ from the trace */
+	unsigned long long nr_drains;
+}trfs_uring;
+
+/** Sets up a ring of the given depth.
+ */
+int trfs_uring_init(trfs_uring *ur, unsigned int depth);
+
+/** Submits a record, namespace ops are replayed through rpd.
+ */
+void trfs_uring_submit(trfs_uring *ur, struct trfs_rpd *rpd,
+							const char *rec);
+
+/** Waits until all submitted ops have completed.
+ */
+void trfs_uring_drain(trfs_uring *ur);
+
+void trfs_uring_exit(trfs_uring *ur);
+
+#endif	/* End of _TRFS_URING_H_ */
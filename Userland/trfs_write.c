@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <time.h>
+
+#include "trfs_ops.h"
+#include "trfs_parse.h"
+#include "trfs_write.h"
+
+static void trfs_writer_flush(trfs_writer *w)
+{
+	size_t done = 0;
+	ssize_t bytes = 0;
+
+	while (!w->err && done < w->len) {
+		bytes = write(w->fd, w->buf+done, w->len-done);
+		if (bytes <= 0)
+			w->err = -EIO;
+		else
+			done += bytes;
+	}
+	w->off += w->len;
+	w->len = 0;
+}
+
+/** Copies bytes to the buffer, it is written once it is full
+ */
+static void trfs_writer_raw(trfs_writer *w, const void *rec, size_t len)
+{
+	if (w->len+len > TRFS_WRITE_BUF_SIZE)
+		trfs_writer_flush(w);
+	memcpy(w->buf+w->len, rec, len);
+	w->len += len;
+}
+
+int trfs_writer_open(trfs_writer *w, const char *path, unsigned int seg_no)
+{
+	struct timespec now;
+	trfs_seg_hdr hdr;
+
+	memset(w, 0, sizeof(trfs_writer));
+	w->buf = (char *)malloc(TRFS_WRITE_BUF_SIZE);
+	if (!w->buf)
+		return -ENOMEM;
+	w->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (w->fd < 0) {
+		free(w->buf);
+		return -errno;
+	}
+	w->ftr.seg_no = seg_no;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&hdr, 0, sizeof(trfs_seg_hdr));
+	hdr.r_size = sizeof(trfs_seg_hdr);
+	hdr.r_type = TRFS_REC_SEG_HDR;
+	hdr.magic = TRFS_TRACE_MAGIC;
+	hdr.version = TRFS_TRACE_VERSION;
+	hdr.seg_no = seg_no;
+	hdr.ctime = now.tv_sec*1000000000ULL+now.tv_nsec;
+	trfs_writer_raw(w, &hdr, hdr.r_size);
+	return 0;
+}
+
+/** Writes the pending index entries as an index record chained to the
+ * previous one
+ */
+static void trfs_writer_idx(trfs_writer *w)
+{
+	uint64_t off = w->off+w->len;
+
+	if (w->idx.nr_ent == 0)
+		return;
+	w->idx.r_id = 0;
+	w->idx.r_size = offsetof(trfs_idx_rec, ent)+
+				w->idx.nr_ent*sizeof(trfs_idx_ent);
+	w->idx.r_type = TRFS_REC_INDEX;
+	w->idx.magic = TRFS_TRACE_MAGIC;
+	w->idx.prev = w->idx_prev;
+	trfs_writer_raw(w, &w->idx, w->idx.r_size);
+	w->idx_prev = off;
+	w->idx.nr_ent = 0;
+}
+
+int trfs_writer_put(trfs_writer *w, const char *rec)
+{
+	unsigned int r_id = trfs_rec_id(rec);
+	unsigned short len = trfs_rec_size(rec);
+	unsigned char r_type = trfs_rec_type(rec);
+	uint64_t off = w->off+w->len;
+	trfs_idx_ent *ent = NULL;
+
+	if (r_type >= TRFS_MAX_OPS)
+		return -EINVAL;
+
+	/* A new index entry every TRFS_IDX_BLOCK_SIZE bytes */
+	if (w->idx.nr_ent > 0)
+		ent = &w->idx.ent[w->idx.nr_ent-1];
+	if (!ent || off-ent->offset >= TRFS_IDX_BLOCK_SIZE) {
+		if (w->idx.nr_ent == TRFS_IDX_ENTRIES) {
+			trfs_writer_idx(w);
+			off = w->off+w->len;
+		}
+		ent = &w->idx.ent[w->idx.nr_ent++];
+		memset(ent, 0, sizeof(trfs_idx_ent));
+		ent->offset = off;
+		ent->ts = trfs_rec_ts(rec);
+		ent->first_id = r_id;
+	}
+	ent->last_id = r_id;
+	ent->nr_recs++;
+	ent->op_count[r_type]++;
+
+	if (w->ftr.nr_recs == 0)
+		w->ftr.first_id = r_id;
+	w->ftr.last_id = r_id;
+	w->ftr.nr_recs++;
+	w->ftr.nr_bytes += len;
+	w->ftr.op_count[r_type]++;
+
+	trfs_writer_raw(w, rec, len);
+	return w->err;
+}
+
+int trfs_writer_close(trfs_writer *w)
+{
+	int ret = 0;
+
+	if (w->fd < 0)
+		return 0;
+	trfs_writer_idx(w);
+	w->ftr.idx_off = w->idx_prev;
+	w->ftr.r_id = 0;
+	w->ftr.r_size = sizeof(trfs_seg_ftr);
+	w->ftr.r_type = TRFS_REC_SEG_FTR;
+	w->ftr.magic = TRFS_TRACE_MAGIC;
+	trfs_writer_raw(w, &w->ftr, sizeof(trfs_seg_ftr));
+	trfs_writer_flush(w);
+	ret = w->err;
+	if (close(w->fd) < 0 && ret == 0)
+		ret = -EIO;
+	w->fd = -1;
+	free(w->buf);
+	w->buf = NULL;
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_WRITE_H_
+#define _TRFS_WRITE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "structs.h"
+
+/* Records are gathered in a buffer of this size before they are written */
+#define TRFS_WRITE_BUF_SIZE	(4*1024*1024)
+
+/** Writes a tfile segment the way the kernel does: a header, the records
+ * with an index entry for every TRFS_IDX_BLOCK_SIZE bytes of them, index
+ * records every TRFS_IDX_ENTRIES entries and a footer. Tools that cut or
+ * combine traces produce segments treplay can index like a traced one.
+ */
+typedef struct trfs_writer_ {
+	int fd;
+	char *buf;
+	size_t len;
+	uint64_t off;		/* offset of buf[0] in the segment */
+	trfs_seg_ftr ftr;
+	trfs_idx_rec idx;
+	uint64_t idx_prev;
+	int err;
+}trfs_writer;
+
+/** Creates the segment and writes its header.
+ */
+int trfs_writer_open(trfs_writer *w, const char *path, unsigned int seg_no);
+
+/** Appends an op record, r_size bytes of it.
+ */
+int trfs_writer_put(trfs_writer *w, const char *rec);
+
+/** Writes the index and the footer and closes the segment.
+ */
+int trfs_writer_close(trfs_writer *w);
+
+#endif	/* End of _TRFS_WRITE_H_ */
@@ -0,0 +1,844 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* trgen: writes a synthetic tfile from a workload spec.
+ *
+ * The spec is a file of "key = value" lines (-s), and the same pairs can be
+ * given on the command line after it, which override the file:
+ *
+ *	records = 10M		op records to write, or
+ *	bytes = 100G		size of the tfile to reach
+ *	files = 100000		files, spread over the directories
+ *	dirs = 64		directories, each depth levels deep
+ *	depth = 1
+ *	procs = 16		pids issuing ops
+ *	open = 64		files a pid keeps open at most
+ *	mix = read:40,write:40,open:8,close:8,unlink:1,rename:1,mkdir:1,rmdir:1
+ *	wsize = pow2:9:16	size of the writes, fixed:N, uniform:A:B,
+ *	rsize = exp:4096	exp:MEAN or pow2:A:B (2^A to 2^B)
+ *	errors = 0.5		percent of ops that fail
+ *	rate = 100000		ops per second of trace time
+ *	seed = 1
+ *
+ * The ops are generated against a model of the namespace and of the open
+ * files of every pid, so reads and writes go to open files, a file is
+ * created before it is renamed and rmdir removes a directory made by the
+ * same pid; an op drawn from the mix that can't go anywhere is replaced by
+ * one that can. The tfile is a segment with an index and a footer written
+ * with trfs_writer, so it parses, indexes and replays like a traced one.
+ * The payload of a write is limited by the 64k record size.
+ *
+ *	$./trgen [-s spec] [key=value...] out
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#include "trfs_ops.h"
+#include "trfs_parse.h"
+#include "trfs_write.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+#define TG_MIX_SLOTS		1024	/* resolution of the op mix */
+#define TG_ADDR_BASE		0xffff880000000000ULL
+#define TG_PID_BASE		1000
+#define TG_MAX_REC		65535
+
+/* Kinds of size distributions */
+#define TG_FIXED		0
+#define TG_UNIFORM		1
+#define TG_EXP			2
+#define TG_POW2			3
+
+typedef struct tg_dist_ {
+	int kind;
+	uint64_t a;
+	uint64_t b;
+}tg_dist;
+
+/** Workload spec, with the defaults of tg_spec_init()
+ */
+typedef struct tg_spec_ {
+	unsigned long long records;
+	unsigned long long bytes;
+	unsigned int files;
+	unsigned int dirs;
+	unsigned int depth;
+	unsigned int procs;
+	unsigned int open;
+	unsigned int mix[TRFS_MAX_OPS];		/* weights */
+	tg_dist wsize;
+	tg_dist rsize;
+	double errors;
+	unsigned long long rate;
+	uint64_t seed;
+}tg_spec;
+
+/** Open file slot of a pid
+ */
+typedef struct tg_slot_ {
+	int file;		/* -1 if the slot is free */
+	int ppos;
+}tg_slot;
+
+typedef struct tg_proc_ {
+	unsigned int pid;
+	tg_slot *slot;
+	unsigned int *used;	/* slots in use, in no order */
+	unsigned int nr_used;
+	unsigned int nr_sub;	/* directories made and not removed yet */
+}tg_proc;
+
+static tg_spec spec;
+static tg_proc *procs = NULL;
+static unsigned char *exists = NULL;	/* per file */
+static unsigned int *ex_file = NULL;	/* the files that exist, in no order */
+static unsigned int *ex_pos = NULL;	/* per file, its place in ex_file */
+static unsigned int nr_exist = 0;
+static unsigned int *nr_open = NULL;	/* per file, slots it is open in */
+static char *dir_path = NULL;		/* dirs, NUL terminated, PATH_MAX apart */
+static unsigned char mix_tab[TG_MIX_SLOTS];
+static uint64_t rng;
+static uint64_t ts;
+static unsigned long long nr_links = 0;
+static unsigned long long nr_recs = 0;
+static unsigned long long nr_ops[TRFS_MAX_OPS];
+/* Aligned for the structs the records are built through */
+static char rec_buf[TG_MAX_REC+1] __attribute__((aligned(8)));
+static char payload[TG_MAX_REC+1];
+
+/** xorshift64*, a few ns per draw
+ */
+static inline uint64_t tg_rand(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng*0x2545F4914F6CDD1DULL;
+}
+
+static inline unsigned int tg_rand_n(unsigned int n)
+{
+	return ((tg_rand() >> 32)*n) >> 32;
+}
+
+static uint64_t tg_draw(const tg_dist *d)
+{
+	double u;
+
+	switch (d->kind) {
+		case TG_UNIFORM:
+			return d->a+tg_rand()%(d->b-d->a+1);
+		case TG_EXP:
+			u = ((tg_rand() >> 11)+1)*(1.0/9007199254740992.0);
+			return (uint64_t)(-log(u)*d->a)+1;
+		case TG_POW2:
+			return 1ULL << (d->a+tg_rand()%(d->b-d->a+1));
+		default:
+			return d->a;
+	}
+}
+
+/** Parses a count with an optional K, M or G suffix
+ */
+static unsigned long long tg_parse_num(const char *s)
+{
+	char *end = NULL;
+	unsigned long long v = strtoull(s, &end, 0);
+
+	switch (*end) {
+		case 'k': case 'K':
+			return v << 10;
+		case 'm': case 'M':
+			return v << 20;
+		case 'g': case 'G':
+			return v << 30;
+		case 't': case 'T':
+			return v << 40;
+		default:
+			return v;
+	}
+}
+
+static int tg_parse_dist(const char *s, tg_dist *d)
+{
+	const char *arg = strchr(s, ':');
+	const char *arg2 = arg ? strchr(arg+1, ':') : NULL;
+
+	if (!arg)
+		return -EINVAL;
+	d->a = tg_parse_num(arg+1);
+	d->b = arg2 ? tg_parse_num(arg2+1) : d->a;
+	if (!strncmp(s, "fixed:", 6))
+		d->kind = TG_FIXED;
+	else if (!strncmp(s, "uniform:", 8) && arg2 && d->b >= d->a)
+		d->kind = TG_UNIFORM;
+	else if (!strncmp(s, "exp:", 4) && d->a > 0)
+		d->kind = TG_EXP;
+	else if (!strncmp(s, "pow2:", 5) && arg2 && d->b >= d->a && d->b < 32)
+		d->kind = TG_POW2;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/** Parses "op:weight,op:weight..." into the weights of the mix
+ */
+static int tg_parse_mix(char *s)
+{
+	int t;
+	char *tok = NULL, *save = NULL, *w = NULL;
+
+	memset(spec.mix, 0, sizeof(spec.mix));
+	for (tok = strtok_r(s, ",", &save); tok;
+				tok = strtok_r(NULL, ",", &save)) {
+		w = strchr(tok, ':');
+		if (!w)
+			return -EINVAL;
+		*w++ = '\0';
+		for (t = 1; t < TRFS_MAX_OPS; t++)
+			if (!strcmp(tok, trfs_op_name(t)))
+				break;
+		switch (t) {
+			case TRFS_OP_OPEN:
+			case TRFS_OP_CLOSE:
+			case TRFS_OP_READ:
+			case TRFS_OP_WRITE:
+			case TRFS_OP_MKDIR:
+			case TRFS_OP_RMDIR:
+			case TRFS_OP_UNLINK:
+			case TRFS_OP_RENAME:
+			case TRFS_OP_LINK:
+			case TRFS_OP_SYMLINK:
+				spec.mix[t] = atoi(w);
+				break;
+			default:
+				printf("Op %s can't be generated\n", tok);
+				return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/** Applies one "key = value" of the spec
+ */
+static int tg_set(char *line)
+{
+	char *key = line, *val = NULL, *end = NULL;
+
+	val = strchr(line, '=');
+	if (!val)
+		return -EINVAL;
+	*val++ = '\0';
+	while (*key == ' ' || *key == '\t')
+		key++;
+	for (end = val-2; end >= key && (*end == ' ' || *end == '\t'); end--)
+		*end = '\0';
+	while (*val == ' ' || *val == '\t')
+		val++;
+	for (end = val+strlen(val)-1; end >= val && (*end == ' ' ||
+			*end == '\t' || *end == '\n' || *end == '\r'); end--)
+		*end = '\0';
+
+	if (!strcmp(key, "records"))
+		spec.records = tg_parse_num(val);
+	else if (!strcmp(key, "bytes"))
+		spec.bytes = tg_parse_num(val);
+	else if (!strcmp(key, "files"))
+		spec.files = tg_parse_num(val);
+	else if (!strcmp(key, "dirs"))
+		spec.dirs = tg_parse_num(val);
+	else if (!strcmp(key, "depth"))
+		spec.depth = tg_parse_num(val);
+	else if (!strcmp(key, "procs"))
+		spec.procs = tg_parse_num(val);
+	else if (!strcmp(key, "open"))
+		spec.open = tg_parse_num(val);
+	else if (!strcmp(key, "mix"))
+		return tg_parse_mix(val);
+	else if (!strcmp(key, "wsize"))
+		return tg_parse_dist(val, &spec.wsize);
+	else if (!strcmp(key, "rsize"))
+		return tg_parse_dist(val, &spec.rsize);
+	else if (!strcmp(key, "errors"))
+		spec.errors = atof(val);
+	else if (!strcmp(key, "rate"))
+		spec.rate = tg_parse_num(val);
+	else if (!strcmp(key, "seed"))
+		spec.seed = tg_parse_num(val);
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static int tg_load_spec(const char *path)
+{
+	int n = 0;
+	char *p = NULL;
+	char line[1024];
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -ENOENT;
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		p = line+strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (tg_set(p) < 0) {
+			printf("%s:%d: bad line\n", path, n);
+			fclose(f);
+			return -EINVAL;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static void tg_spec_init(void)
+{
+	memset(&spec, 0, sizeof(tg_spec));
+	spec.records = 1000000;
+	spec.files = 10000;
+	spec.dirs = 64;
+	spec.depth = 1;
+	spec.procs = 16;
+	spec.open = 64;
+	spec.mix[TRFS_OP_READ] = 40;
+	spec.mix[TRFS_OP_WRITE] = 40;
+	spec.mix[TRFS_OP_OPEN] = 8;
+	spec.mix[TRFS_OP_CLOSE] = 8;
+	spec.mix[TRFS_OP_UNLINK] = 1;
+	spec.mix[TRFS_OP_RENAME] = 1;
+	spec.mix[TRFS_OP_MKDIR] = 1;
+	spec.mix[TRFS_OP_RMDIR] = 1;
+	spec.wsize.kind = TG_POW2;
+	spec.wsize.a = 9;
+	spec.wsize.b = 16;
+	spec.rsize.kind = TG_EXP;
+	spec.rsize.a = 4096;
+	spec.rate = 100000;
+	spec.seed = 1;
+}
+
+/** Lays the weights of the mix out over TG_MIX_SLOTS slots
+ */
+static int tg_mix_init(void)
+{
+	int t, i = 0;
+	unsigned int total = 0, acc = 0;
+
+	for (t = 0; t < TRFS_MAX_OPS; t++)
+		total += spec.mix[t];
+	if (total == 0)
+		return -EINVAL;
+	for (t = 0; t < TRFS_MAX_OPS; t++) {
+		acc += spec.mix[t];
+		for (; i < (int)((uint64_t)acc*TG_MIX_SLOTS/total); i++)
+			mix_tab[i] = t;
+	}
+	return 0;
+}
+
+static inline const char *tg_dir(unsigned int d)
+{
+	return dir_path+(size_t)d*PATH_MAX;
+}
+
+/** Path of file f, in directory f%dirs
+ */
+static int tg_file_path(char *p, unsigned int f)
+{
+	return snprintf(p, PATH_MAX, "%s/f%u", tg_dir(f%spec.dirs), f);
+}
+
+/** Fills the header and time of the record in rec_buf and writes it
+ */
+static int tg_put(trfs_writer *w, unsigned char type, unsigned short size)
+{
+	unsigned int rid = ++nr_recs;
+
+	memcpy(rec_buf, &rid, sizeof(unsigned int));
+	memcpy(rec_buf+sizeof(unsigned int), &size, sizeof(unsigned short));
+	rec_buf[sizeof(unsigned int)+sizeof(unsigned short)] = type;
+	memcpy(rec_buf+offsetof(trfs_open_op, ts), &ts, sizeof(uint64_t));
+	ts += 1000000000ULL/spec.rate/2+tg_rand_n(1000000000ULL/spec.rate+1);
+	nr_ops[type]++;
+	return trfs_writer_put(w, rec_buf);
+}
+
+static inline int tg_fail(void)
+{
+	return spec.errors > 0 && tg_rand_n(1000000) < spec.errors*10000;
+}
+
+/** mkdir, rmdir and unlink: a path and the result
+ */
+static int tg_path_op(trfs_writer *w, unsigned char type, tg_proc *p,
+						const char *path, int ret)
+{
+	trfs_mkdir_op *mk = (trfs_mkdir_op *)rec_buf;
+	trfs_unlink_op *op = (trfs_unlink_op *)rec_buf;
+	size_t len = strlen(path);
+
+	if (type == TRFS_OP_MKDIR) {
+		mk->pid = p->pid;
+		mk->mode = 0755;
+		mk->ret = ret;
+		mk->len = len;
+		memcpy(mk->pathname, path, len+1);
+		return tg_put(w, type, offsetof(trfs_mkdir_op, pathname)+len+1);
+	}
+	/* rmdir and unlink records have the same layout */
+	op->pid = p->pid;
+	op->ret = ret;
+	op->len = len;
+	memcpy(op->pathname, path, len+1);
+	return tg_put(w, type, offsetof(trfs_unlink_op, pathname)+len+1);
+}
+
+/** Records with two paths: rename, link and symlink
+ */
+static int tg_path2_op(trfs_writer *w, unsigned char type, tg_proc *p,
+				const char *p1, const char *p2, int ret)
+{
+	size_t l1 = strlen(p1), l2 = strlen(p2);
+	trfs_rename_op *rn = (trfs_rename_op *)rec_buf;
+	trfs_link_op *ln = (trfs_link_op *)rec_buf;
+	trfs_symlink_op *sl = (trfs_symlink_op *)rec_buf;
+
+	switch (type) {
+		case TRFS_OP_RENAME:
+			rn->pid = p->pid;
+			rn->ret = ret;
+			rn->len1 = l1;
+			rn->len2 = l2;
+			memcpy(rn->pathname1, p1, l1);
+			memcpy(rn->pathname1+l1, p2, l2);
+			return tg_put(w, type, offsetof(trfs_rename_op,
+						pathname1)+l1+l2);
+		case TRFS_OP_LINK:
+			ln->pid = p->pid;
+			ln->ret = ret;
+			ln->plen = l1;
+			ln->hlen = l2;
+			memcpy(ln->pathname, p1, l1);
+			memcpy(ln->pathname+l1, p2, l2);
+			return tg_put(w, type, offsetof(trfs_link_op,
+						pathname)+l1+l2);
+		default:
+			/* The link is p1, its target p2 */
+			sl->pid = p->pid;
+			sl->ret = ret;
+			sl->plen = l1;
+			sl->slen = l2;
+			memcpy(sl->pathname, p1, l1);
+			memcpy(sl->pathname+l1, p2, l2);
+			return tg_put(w, type, offsetof(trfs_symlink_op,
+						pathname)+l1+l2);
+	}
+}
+
+static void tg_exist_add(unsigned int f)
+{
+	if (exists[f])
+		return;
+	exists[f] = 1;
+	ex_pos[f] = nr_exist;
+	ex_file[nr_exist++] = f;
+}
+
+static void tg_exist_del(unsigned int f)
+{
+	unsigned int g;
+
+	if (!exists[f])
+		return;
+	exists[f] = 0;
+	g = ex_file[--nr_exist];
+	ex_file[ex_pos[f]] = g;
+	ex_pos[g] = ex_pos[f];
+}
+
+/** A file for an op on an existing name: an existing one, or any one if
+ * the op is to fail. Returns -1 if there is none.
+ */
+static int tg_pick(int fail)
+{
+	if (fail)
+		return tg_rand_n(spec.files);
+	if (nr_exist == 0)
+		return -1;
+	return ex_file[tg_rand_n(nr_exist)];
+}
+
+/** Moves the slots open on file f to file g after a rename: their later
+ * ops are traced under the new name
+ */
+static void tg_rename_slots(unsigned int f, unsigned int g)
+{
+	unsigned int i, u;
+	tg_proc *p = NULL;
+
+	for (i = 0; i < spec.procs && nr_open[f] > 0; i++) {
+		p = &procs[i];
+		for (u = 0; u < p->nr_used; u++) {
+			if (p->slot[p->used[u]].file != (int)f)
+				continue;
+			p->slot[p->used[u]].file = g;
+			nr_open[f]--;
+			nr_open[g]++;
+		}
+	}
+}
+
+static inline uint64_t tg_addr(const tg_proc *p, unsigned int s)
+{
+	return TG_ADDR_BASE+((uint64_t)(p-procs)*spec.open+s)*256;
+}
+
+static int tg_open(trfs_writer *w, tg_proc *p)
+{
+	unsigned int s, f = tg_rand_n(spec.files);
+	int ret = tg_fail() ? -ENOENT : 0;
+	trfs_open_op *op = (trfs_open_op *)rec_buf;
+
+	/* The first free slot, there is one */
+	for (s = tg_rand_n(spec.open); p->slot[s].file >= 0;
+					s = (s+1)%spec.open)
+		;
+	op->flags = O_RDWR|O_CREAT;
+	op->mode = 0644;
+	op->pid = p->pid;
+	op->addr = tg_addr(p, s);
+	op->ret = ret;
+	op->len = tg_file_path(op->pathname, f);
+	if (ret == 0) {
+		p->slot[s].file = f;
+		p->slot[s].ppos = 0;
+		p->used[p->nr_used++] = s;
+		nr_open[f]++;
+		tg_exist_add(f);
+	}
+	return tg_put(w, TRFS_OP_OPEN, offsetof(trfs_open_op, pathname)+
+								op->len+1);
+}
+
+static int tg_close(trfs_writer *w, tg_proc *p, unsigned int u)
+{
+	unsigned int s = p->used[u];
+	trfs_close_op *op = (trfs_close_op *)rec_buf;
+
+	op->pid = p->pid;
+	op->addr = tg_addr(p, s);
+	op->ret = 0;
+	op->len = tg_file_path(op->pathname, p->slot[s].file);
+	nr_open[p->slot[s].file]--;
+	p->slot[s].file = -1;
+	p->used[u] = p->used[--p->nr_used];
+	return tg_put(w, TRFS_OP_CLOSE, offsetof(trfs_close_op, pathname)+
+								op->len+1);
+}
+
+static int tg_io(trfs_writer *w, unsigned char type, tg_proc *p)
+{
+	unsigned int s = p->used[tg_rand_n(p->nr_used)];
+	uint64_t count;
+	unsigned short len;
+	trfs_write_op *wr = (trfs_write_op *)rec_buf;
+	trfs_read_op *rd = (trfs_read_op *)rec_buf;
+
+	if (type == TRFS_OP_WRITE) {
+		wr->pid = p->pid;
+		wr->addr = tg_addr(p, s);
+		wr->len = len = tg_file_path(wr->pathname, p->slot[s].file);
+		/* The payload has to fit the record */
+		count = tg_draw(&spec.wsize);
+		if (count > TG_MAX_REC-offsetof(trfs_write_op, pathname)-len)
+			count = TG_MAX_REC-offsetof(trfs_write_op, pathname)-
+									len;
+		wr->count = count;
+		wr->ppos = p->slot[s].ppos;
+		wr->ret = tg_fail() ? -EIO : (int)count;
+		wr->wflags = 0;
+		memcpy(wr->pathname+len, payload, count);
+		if (wr->ret > 0)
+			p->slot[s].ppos += count;
+		return tg_put(w, type, offsetof(trfs_write_op, pathname)+len+
+								count);
+	}
+	rd->pid = p->pid;
+	rd->addr = tg_addr(p, s);
+	rd->len = len = tg_file_path(rd->pathname, p->slot[s].file);
+	count = tg_draw(&spec.rsize);
+	rd->count = count;
+	rd->ppos = p->slot[s].ppos;
+	rd->ret = tg_fail() ? -EIO : (int)(count > INT_MAX ? INT_MAX : count);
+	if (rd->ret > 0)
+		p->slot[s].ppos += rd->ret;
+	return tg_put(w, type, offsetof(trfs_read_op, pathname)+len+1);
+}
+
+/** Generates one op of the mix for a random pid
+ */
+static int tg_op(trfs_writer *w)
+{
+	unsigned int g;
+	int f, fail, ret;
+	char p1[PATH_MAX], p2[PATH_MAX];
+	unsigned char type = mix_tab[tg_rand_n(TG_MIX_SLOTS)];
+	tg_proc *p = &procs[tg_rand_n(spec.procs)];
+
+	/* Ops that can't go anywhere become ones that can */
+	if ((type == TRFS_OP_READ || type == TRFS_OP_WRITE ||
+	     type == TRFS_OP_CLOSE) && p->nr_used == 0)
+		type = TRFS_OP_OPEN;
+	if (type == TRFS_OP_OPEN && p->nr_used == spec.open)
+		type = TRFS_OP_CLOSE;
+	if (type == TRFS_OP_RMDIR && p->nr_sub == 0)
+		type = TRFS_OP_MKDIR;
+	/* unlink, rename and link go to an existing file unless they are
+	 * to fail; with none, a file is opened (and made) instead */
+	fail = 0;
+	f = -1;
+	if (type == TRFS_OP_UNLINK || type == TRFS_OP_RENAME ||
+	    type == TRFS_OP_LINK) {
+		fail = tg_fail();
+		f = tg_pick(fail);
+		if (f < 0)
+			type = p->nr_used < spec.open ? TRFS_OP_OPEN :
+								TRFS_OP_CLOSE;
+	}
+
+	switch (type) {
+		case TRFS_OP_OPEN:
+			return tg_open(w, p);
+		case TRFS_OP_CLOSE:
+			return tg_close(w, p, tg_rand_n(p->nr_used));
+		case TRFS_OP_READ:
+		case TRFS_OP_WRITE:
+			return tg_io(w, type, p);
+		case TRFS_OP_MKDIR:
+		case TRFS_OP_RMDIR:
+			/* A stack of directories per pid */
+			if (type == TRFS_OP_RMDIR)
+				p->nr_sub--;
+			snprintf(p1, sizeof(p1), "%s/p%u_%u",
+				tg_dir(p->pid%spec.dirs), p->pid, p->nr_sub);
+			ret = tg_fail() ? (type == TRFS_OP_MKDIR ? -EEXIST :
+							-ENOENT) : 0;
+			if (type == TRFS_OP_MKDIR && ret == 0)
+				p->nr_sub++;
+			else if (type == TRFS_OP_RMDIR && ret < 0)
+				p->nr_sub++;
+			return tg_path_op(w, type, p, p1, ret);
+		case TRFS_OP_UNLINK:
+			tg_file_path(p1, f);
+			ret = fail ? -ENOENT : 0;
+			if (ret == 0)
+				tg_exist_del(f);
+			return tg_path_op(w, type, p, p1, ret);
+		case TRFS_OP_RENAME:
+			g = tg_rand_n(spec.files);
+			tg_file_path(p1, f);
+			tg_file_path(p2, g);
+			ret = fail ? -ENOENT : 0;
+			if (ret == 0 && (unsigned int)f != g) {
+				tg_exist_del(f);
+				tg_exist_add(g);
+				tg_rename_slots(f, g);
+			}
+			return tg_path2_op(w, type, p, p1, p2, ret);
+		default:
+			/* link and symlink make a new name for a file */
+			if (type == TRFS_OP_SYMLINK)
+				f = tg_rand_n(spec.files);
+			tg_file_path(p1, f);
+			snprintf(p2, sizeof(p2), "%s/l%llu",
+					tg_dir(f%spec.dirs), nr_links++);
+			if (type == TRFS_OP_LINK) {
+				ret = fail ? -ENOENT : 0;
+				return tg_path2_op(w, type, p, p1, p2, ret);
+			}
+			/* The target is relative, the link is next to it */
+			snprintf(p1, sizeof(p1), "f%u", f);
+			ret = tg_fail() ? -EEXIST : 0;
+			return tg_path2_op(w, type, p, p2, p1, ret);
+	}
+}
+
+/** Builds the directory paths and writes the mkdir of every level
+ */
+static int tg_dirs(trfs_writer *w)
+{
+	unsigned int d, l;
+	int ret = 0;
+	size_t len;
+	char *p = NULL;
+
+	dir_path = (char *)malloc((size_t)spec.dirs*PATH_MAX);
+	if (!dir_path)
+		return -ENOMEM;
+	for (d = 0; d < spec.dirs && ret == 0; d++) {
+		p = dir_path+(size_t)d*PATH_MAX;
+		len = snprintf(p, PATH_MAX, "/d%u", d);
+		ret = tg_path_op(w, TRFS_OP_MKDIR, &procs[0], p, 0);
+		for (l = 1; l < spec.depth && ret == 0; l++) {
+			len += snprintf(p+len, PATH_MAX-len, "/l%u", l);
+			ret = tg_path_op(w, TRFS_OP_MKDIR, &procs[0], p, 0);
+		}
+	}
+	return ret;
+}
+
+static int tg_procs_init(void)
+{
+	unsigned int i, s;
+
+	procs = (tg_proc *)calloc(spec.procs, sizeof(tg_proc));
+	exists = (unsigned char *)calloc(spec.files, 1);
+	ex_file = (unsigned int *)malloc(spec.files*sizeof(unsigned int));
+	ex_pos = (unsigned int *)malloc(spec.files*sizeof(unsigned int));
+	nr_open = (unsigned int *)calloc(spec.files, sizeof(unsigned int));
+	if (!procs || !exists || !ex_file || !ex_pos || !nr_open)
+		return -ENOMEM;
+	for (i = 0; i < spec.procs; i++) {
+		procs[i].pid = TG_PID_BASE+i;
+		procs[i].slot = (tg_slot *)malloc(spec.open*sizeof(tg_slot));
+		procs[i].used = (unsigned int *)malloc(spec.open*
+							sizeof(unsigned int));
+		if (!procs[i].slot || !procs[i].used)
+			return -ENOMEM;
+		for (s = 0; s < spec.open; s++)
+			procs[i].slot[s].file = -1;
+	}
+	return 0;
+}
+
+static void tg_procs_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; procs && i < spec.procs; i++) {
+		free(procs[i].slot);
+		free(procs[i].used);
+	}
+	free(procs);
+	free(exists);
+	free(ex_file);
+	free(ex_pos);
+	free(nr_open);
+	free(dir_path);
+}
+
+static void tg_usage(void)
+{
+	printf("Usage: trgen [-s spec] [key=value...] out\n\
+keys: records bytes files dirs depth procs open mix wsize rsize errors \
+rate seed\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, t;
+	int choice;
+	int ret = 0;
+	int done = 0;
+	uint64_t bytes;
+	double secs;
+	struct timespec ts0, ts1;
+	trfs_writer w;
+
+	tg_spec_init();
+	w.fd = -1;
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "s:")) != -1) {
+		switch (choice) {
+			case 's':
+				ret = tg_load_spec(optarg);
+				if (ret == -ENOENT)
+					printf("Opening %s: Failed\n", optarg);
+				if (ret < 0)
+					return ret;
+				break;
+			default:
+				tg_usage();
+				return -EINVAL;
+		}
+	}
+	for (; optind < argc-1; optind++) {
+		if (tg_set(argv[optind]) < 0) {
+			printf("Bad setting %s\n", argv[optind]);
+			tg_usage();
+			return -EINVAL;
+		}
+	}
+	if (optind != argc-1) {
+		tg_usage();
+		return -EINVAL;
+	}
+	if (spec.files == 0 || spec.dirs == 0 || spec.depth == 0 ||
+	    spec.procs == 0 || spec.open == 0 || spec.rate == 0 ||
+	    spec.rate > 1000000000ULL || spec.files > INT_MAX ||
+	    (size_t)spec.depth*12+32 > PATH_MAX || tg_mix_init() < 0) {
+		printf("Bad spec\n");
+		return -EINVAL;
+	}
+
+	rng = spec.seed ? spec.seed : 1;
+	for (i = 0; i < (int)sizeof(payload); i++)
+		payload[i] = 'a'+i%26;
+	memset(rec_buf, 0, sizeof(rec_buf));
+	clock_gettime(CLOCK_REALTIME, &ts0);
+	ts = ts0.tv_sec*1000000000ULL+ts0.tv_nsec;
+
+	ret = tg_procs_init();
+	if (ret < 0)
+		goto out;
+	ret = trfs_writer_open(&w, argv[optind], 0);
+	if (ret < 0) {
+		printf("Creating %s: Failed\n", argv[optind]);
+		goto out;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	ret = tg_dirs(&w);
+	while (ret == 0 && !done) {
+		ret = tg_op(&w);
+		if (spec.bytes)
+			done = w.off+w.len >= spec.bytes;
+		else
+			done = nr_recs >= spec.records;
+	}
+	/* Every file left open is closed */
+	for (i = 0; i < (int)spec.procs && ret == 0; i++)
+		while (procs[i].nr_used > 0 && ret == 0)
+			ret = tg_close(&w, &procs[i], 0);
+	bytes = w.off+w.len;
+	t = trfs_writer_close(&w);
+	if (ret == 0)
+		ret = t;
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	if (ret < 0) {
+		printf("Writing %s: Failed\n", argv[optind]);
+		goto out;
+	}
+
+	secs = (ts1.tv_sec-ts0.tv_sec)+(ts1.tv_nsec-ts0.tv_nsec)/1e9;
+	printf("Wrote %llu records, %llu bytes in %.3f s: %.3f GB/s\n",
+		nr_recs, (unsigned long long)bytes, secs,
+		secs > 0 ? bytes/secs/1e9 : 0);
+	for (t = 0; t < TRFS_MAX_OPS; t++)
+		if (nr_ops[t])
+			printf("    %-10s %llu\n", trfs_op_name(t), nr_ops[t]);
+out:
+	tg_procs_free();
+	return ret;
+}
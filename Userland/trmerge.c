@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* trmerge: merges the tfiles of several mounts or hosts into one.
+ *
+ * The op records of the inputs are merged by timestamp (or by record ID
+ * with -i) through a min-heap holding the next record of every input, and
+ * written as one segment with its own index and footer. Each input is
+ * streamed through a buffer of TRFS_STREAM_BUF_SIZE bytes with large
+ * sequential reads, so the memory used does not depend on the size of the
+ * tfiles. The inputs are expected in order themselves; a record that goes
+ * back in time is written where it is met.
+ *
+ * Traces taken apart number their records and name their open files on
+ * their own. With -u the merged records are renumbered from 1 and the file
+ * pointer of each open file gets the input number in its top byte, so
+ * that treplay does not confuse the files of two inputs.
+ *
+ *	$./trmerge [-i] [-u] out tfile...
+ */
+
+#include <limits.h>
+
+#include "trfs_ops.h"
+#include "trfs_parse.h"
+#include "trfs_write.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+#define TRM_MAX_INPUTS		256	/* input number fits the top byte */
+#define TRM_SRC_SHIFT		56
+
+/** An input and its next op record
+ */
+typedef struct trm_input_ {
+	const char *path;
+	trfs_trace t;
+	char *rec;
+	uint64_t key;
+	unsigned long long nr;
+}trm_input;
+
+static trm_input inputs[TRM_MAX_INPUTS];
+static int heap[TRM_MAX_INPUTS];
+static int nr_heap = 0;
+static int by_id = 0;
+static int unique = 0;
+
+/** Moves an input to its next op record, NULL at its end
+ */
+static void trm_next(trm_input *in)
+{
+	while ((in->rec = trfs_trace_next(&in->t)) != NULL) {
+		if (trfs_rec_type(in->rec) >= TRFS_MAX_OPS)
+			continue;
+		in->key = by_id ? trfs_rec_id(in->rec) : trfs_rec_ts(in->rec);
+		return;
+	}
+}
+
+/** Orders inputs by key, then by input number so that equal keys keep
+ * the order of the command line
+ */
+static int trm_less(int a, int b)
+{
+	if (inputs[a].key != inputs[b].key)
+		return inputs[a].key < inputs[b].key;
+	return a < b;
+}
+
+static void trm_sift_down(int i)
+{
+	int c, tmp;
+
+	for (c = 2*i+1; c < nr_heap; i = c, c = 2*i+1) {
+		if (c+1 < nr_heap && trm_less(heap[c+1], heap[c]))
+			c++;
+		if (!trm_less(heap[c], heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+	}
+}
+
+/** Offset of the file pointer in an op record, 0 for the ops without one
+ */
+static size_t trm_addr_off(unsigned char type)
+{
+	switch (type) {
+		case TRFS_OP_OPEN:
+			return offsetof(trfs_open_op, addr);
+		case TRFS_OP_READ:
+			return offsetof(trfs_read_op, addr);
+		case TRFS_OP_WRITE:
+			return offsetof(trfs_write_op, addr);
+		case TRFS_OP_CLOSE:
+			return offsetof(trfs_close_op, addr);
+		case TRFS_OP_SETXATTR:
+			return offsetof(trfs_setxattr_op, addr);
+		case TRFS_OP_GETXATTR:
+			return offsetof(trfs_getxattr_op, addr);
+		case TRFS_OP_LISTXATTR:
+			return offsetof(trfs_listxattr_op, addr);
+		case TRFS_OP_REMOVEXATTR:
+			return offsetof(trfs_removexattr_op, addr);
+		default:
+			return 0;
+	}
+}
+
+/** Copies the record to buf with a new record ID and the input number in
+ * the file pointer
+ */
+static const char *trm_rewrite(const char *rec, char *buf, int src,
+							unsigned int r_id)
+{
+	uint64_t addr;
+	size_t off = trm_addr_off(trfs_rec_type(rec));
+
+	memcpy(buf, rec, trfs_rec_size(rec));
+	memcpy(buf, &r_id, sizeof(unsigned int));
+	if (off) {
+		memcpy(&addr, buf+off, sizeof(uint64_t));
+		if (addr) {
+			addr ^= (uint64_t)src << TRM_SRC_SHIFT;
+			memcpy(buf+off, &addr, sizeof(uint64_t));
+		}
+	}
+	return buf;
+}
+
+static void trm_usage(void)
+{
+	printf("Usage: trmerge [-i] [-u] out tfile...\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int i, s;
+	int choice;
+	int ret = 0;
+	int nr_inputs = 0;
+	unsigned int r_id = 0;
+	const char *rec = NULL;
+	char *buf = NULL;
+	trfs_writer w;
+
+	w.fd = -1;
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "iu")) != -1) {
+		switch (choice) {
+			case 'i':
+				by_id = 1;
+				break;
+			case 'u':
+				unique = 1;
+				break;
+			default:
+				trm_usage();
+				return -EINVAL;
+		}
+	}
+	if (argc-optind < 2) {
+		trm_usage();
+		return -EINVAL;
+	}
+	if (argc-optind-1 > TRM_MAX_INPUTS) {
+		printf("At most %d tfiles can be merged\n", TRM_MAX_INPUTS);
+		return -EINVAL;
+	}
+
+	buf = (char *)malloc(USHRT_MAX+1);
+	if (!buf)
+		return -ENOMEM;
+	for (i = optind+1; i < argc; i++, nr_inputs++) {
+		inputs[nr_inputs].path = argv[i];
+		if (trfs_trace_open(&inputs[nr_inputs].t, argv[i],
+						TRFS_TRACE_STREAM) < 0) {
+			printf("Opening %s: Failed\n", argv[i]);
+			ret = -ENOENT;
+			goto out;
+		}
+		posix_fadvise(inputs[nr_inputs].t.fd, 0, 0,
+						POSIX_FADV_SEQUENTIAL);
+		trm_next(&inputs[nr_inputs]);
+		if (inputs[nr_inputs].rec)
+			heap[nr_heap++] = nr_inputs;
+	}
+	for (i = nr_heap/2-1; i >= 0; i--)
+		trm_sift_down(i);
+
+	ret = trfs_writer_open(&w, argv[optind], 0);
+	if (ret < 0) {
+		printf("Creating %s: Failed\n", argv[optind]);
+		goto out;
+	}
+	while (nr_heap > 0 && ret == 0) {
+		s = heap[0];
+		rec = inputs[s].rec;
+		if (unique)
+			rec = trm_rewrite(rec, buf, s, ++r_id);
+		ret = trfs_writer_put(&w, rec);
+		inputs[s].nr++;
+
+		trm_next(&inputs[s]);
+		if (!inputs[s].rec)
+			heap[0] = heap[--nr_heap];
+		trm_sift_down(0);
+	}
+	i = trfs_writer_close(&w);
+	if (ret == 0)
+		ret = i;
+	if (ret < 0) {
+		printf("Writing %s: Failed\n", argv[optind]);
+		goto out;
+	}
+
+	for (i = 0; i < nr_inputs; i++) {
+		if (inputs[i].t.err)
+			printf("%s: corrupted or truncated record, the rest of \
+it is left out\n", inputs[i].path);
+		printf("%s: %llu records\n", inputs[i].path, inputs[i].nr);
+	}
+out:
+	for (i = 0; i < nr_inputs; i++)
+		trfs_trace_close(&inputs[i].t);
+	free(buf);
+	return ret;
+}
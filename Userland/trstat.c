@@ -0,0 +1,714 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* trstat: summary of one or more tfiles without replaying them.
+ *
+ * A single pass over the records with the parser of treplay gives the per
+ * op counts and error rates, the bytes read and written, log2 histograms
+ * of the read and write sizes and the top files and pids by ops and by
+ * bytes. Segments with an index are cut into runs of blocks that worker
+ * threads summarize side by side; the per thread results are merged at
+ * the end.
+ *
+ *	$./trstat [-j threads] [-n top] [-J] [-b] tfile...
+ */
+
+#include <limits.h>
+#include <time.h>
+
+#include "trfs_ops.h"
+#include "trfs_index.h"
+#include "trfs_parse.h"
+
+int gflags = 0;
+int gquiet = 1;
+
+#define TRST_TOP		10	/* default entries of the top lists */
+#define TRST_TAB_INIT		1024
+#define TRST_NR_HIST		64	/* log2 buckets of the io sizes */
+#define TRST_MAX_THREADS	64
+#define TRST_UNITS_PER_THREAD	4
+
+/** A file or a pid, hash is 0 for a free slot
+ */
+typedef struct trst_ent_ {
+	uint64_t hash;
+	unsigned int pid;
+	unsigned short len;
+	char *name;		/* NULL for a pid */
+	unsigned long long ops;
+	unsigned long long bytes;
+	unsigned long long errors;
+}trst_ent;
+
+/** Open addressing table of files or pids
+ */
+typedef struct trst_tab_ {
+	trst_ent *ent;
+	unsigned int size;
+	unsigned int count;
+}trst_tab;
+
+typedef struct trst_stats_ {
+	unsigned long long nr_recs;	/* op records */
+	unsigned long long nr_other;	/* segment and unknown records */
+	unsigned long long nr_bytes;	/* bytes of the tfiles parsed */
+	unsigned long long ops[TRFS_MAX_OPS];
+	unsigned long long errors[TRFS_MAX_OPS];
+	unsigned long long rd_bytes;
+	unsigned long long wr_bytes;
+	unsigned long long rd_hist[TRST_NR_HIST];
+	unsigned long long wr_hist[TRST_NR_HIST];
+	unsigned long long wr_cut;	/* payloads short of the write */
+	unsigned long long wr_inexact;	/* and maybe overwritten */
+	uint64_t ts_min;
+	uint64_t ts_max;
+	trst_tab files;
+	trst_tab pids;
+	int nr_corrupt;
+}trst_stats;
+
+/** Records of a tfile in [start, end), summarized by one thread
+ */
+typedef struct trst_unit_ {
+	const char *path;
+	off_t start;
+	off_t end;
+}trst_unit;
+
+static trst_unit *units = NULL;
+static int nr_units = 0;
+static int next_unit = 0;
+static int tflags = 0;
+
+static uint64_t trst_hash_name(const char *name, unsigned short len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	unsigned short i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+static uint64_t trst_hash_pid(unsigned int pid)
+{
+	uint64_t h = (pid+1ULL)*0x9e3779b97f4a7c15ULL;
+
+	h ^= h >> 29;
+	return h ? h : 1;
+}
+
+static int trst_tab_init(trst_tab *t, unsigned int size)
+{
+	t->ent = (trst_ent *)calloc(size, sizeof(trst_ent));
+	if (!t->ent)
+		return -ENOMEM;
+	t->size = size;
+	t->count = 0;
+	return 0;
+}
+
+static void trst_tab_free(trst_tab *t)
+{
+	unsigned int i;
+
+	if (!t->ent)
+		return;
+	for (i = 0; i < t->size; i++)
+		if (t->ent[i].hash && t->ent[i].name)
+			free(t->ent[i].name);
+	free(t->ent);
+	t->ent = NULL;
+}
+
+static trst_ent *trst_tab_slot(trst_tab *t, uint64_t hash, unsigned int pid,
+				const char *name, unsigned short len)
+{
+	unsigned int i = (unsigned int)hash & (t->size-1);
+	trst_ent *e = NULL;
+
+	for (;; i = (i+1) & (t->size-1)) {
+		e = &t->ent[i];
+		if (!e->hash)
+			return e;
+		if (e->hash != hash)
+			continue;
+		if (name ? (e->len == len && !memcmp(e->name, name, len)) :
+			   e->pid == pid)
+			return e;
+	}
+}
+
+/** Doubles the table once it is 3/4 full
+ */
+static int trst_tab_grow(trst_tab *t)
+{
+	unsigned int i;
+	trst_tab n;
+
+	if (trst_tab_init(&n, t->size*2) < 0)
+		return -ENOMEM;
+	for (i = 0; i < t->size; i++)
+		if (t->ent[i].hash)
+			*trst_tab_slot(&n, t->ent[i].hash, t->ent[i].pid,
+				t->ent[i].name, t->ent[i].len) = t->ent[i];
+	n.count = t->count;
+	free(t->ent);
+	*t = n;
+	return 0;
+}
+
+/** Entry of the file name or of the pid if name is NULL, added if new.
+ * The name is copied, the record it points into goes away.
+ */
+static trst_ent *trst_tab_get(trst_tab *t, unsigned int pid,
+				const char *name, unsigned short len)
+{
+	uint64_t hash = name ? trst_hash_name(name, len) : trst_hash_pid(pid);
+	trst_ent *e = trst_tab_slot(t, hash, pid, name, len);
+
+	if (e->hash)
+		return e;
+	if (t->count+1 > t->size/4*3) {
+		if (trst_tab_grow(t) < 0)
+			return NULL;
+		e = trst_tab_slot(t, hash, pid, name, len);
+	}
+	if (name) {
+		e->name = (char *)malloc(len ? len : 1);
+		if (!e->name)
+			return NULL;
+		memcpy(e->name, name, len);
+	}
+	e->hash = hash;
+	e->pid = pid;
+	e->len = len;
+	t->count++;
+	return e;
+}
+
+static int trst_stats_init(trst_stats *st)
+{
+	memset(st, 0, sizeof(trst_stats));
+	st->ts_min = UINT64_MAX;
+	if (trst_tab_init(&st->files, TRST_TAB_INIT) < 0 ||
+	    trst_tab_init(&st->pids, TRST_TAB_INIT) < 0)
+		return -ENOMEM;
+	return 0;
+}
+
+static void trst_stats_free(trst_stats *st)
+{
+	trst_tab_free(&st->files);
+	trst_tab_free(&st->pids);
+}
+
+/** log2 bucket of an io size: 0 for 0, b for [2^(b-1), 2^b)
+ */
+static inline int trst_bucket(size_t size)
+{
+	return size ? 64-__builtin_clzll((unsigned long long)size) : 0;
+}
+
+static void trst_ent_add(trst_ent *e, unsigned long long ops,
+			unsigned long long bytes, unsigned long long errors)
+{
+	if (!e)
+		return;
+	e->ops += ops;
+	e->bytes += bytes;
+	e->errors += errors;
+}
+
+/** Adds a record to the statistics
+ * param[in] rec Record, validated by the parser
+ */
+static void trst_add_rec(trst_stats *st, const char *rec)
+{
+	int err = 0;
+	unsigned long long bytes = 0;
+	trfs_rec_info ri;
+
+	st->nr_bytes += trfs_rec_size(rec);
+	if (trfs_rec_info_get(rec, &ri) < 0) {
+		st->nr_other++;
+		return;
+	}
+	st->nr_recs++;
+	st->ops[ri.type]++;
+	err = ri.ret < 0;
+	st->errors[ri.type] += err;
+	if (ri.ts < st->ts_min)
+		st->ts_min = ri.ts;
+	if (ri.ts > st->ts_max)
+		st->ts_max = ri.ts;
+
+	if (ri.type == TRFS_OP_READ) {
+		bytes = ri.ret > 0 ? ri.ret : 0;
+		st->rd_bytes += bytes;
+		st->rd_hist[trst_bucket(ri.count)]++;
+	}
+	else if (ri.type == TRFS_OP_WRITE) {
+		bytes = ri.ret > 0 ? ri.ret : 0;
+		st->wr_bytes += bytes;
+		st->wr_hist[trst_bucket(ri.count)]++;
+		st->wr_cut += (ri.wflags & TRFS_WR_CUT) != 0;
+		st->wr_inexact += (ri.wflags & TRFS_WR_INEXACT) != 0;
+	}
+	trst_ent_add(trst_tab_get(&st->files, 0, ri.name, ri.len), 1,
+							bytes, err);
+	trst_ent_add(trst_tab_get(&st->pids, ri.pid, NULL, 0), 1,
+							bytes, err);
+}
+
+/** Adds the statistics of a thread to the total
+ */
+static void trst_merge(trst_stats *to, const trst_stats *from)
+{
+	int i;
+	unsigned int j;
+	const trst_ent *e = NULL;
+
+	to->nr_recs += from->nr_recs;
+	to->nr_other += from->nr_other;
+	to->nr_bytes += from->nr_bytes;
+	to->nr_corrupt += from->nr_corrupt;
+	to->rd_bytes += from->rd_bytes;
+	to->wr_bytes += from->wr_bytes;
+	to->wr_cut += from->wr_cut;
+	to->wr_inexact += from->wr_inexact;
+	for (i = 0; i < TRFS_MAX_OPS; i++) {
+		to->ops[i] += from->ops[i];
+		to->errors[i] += from->errors[i];
+	}
+	for (i = 0; i < TRST_NR_HIST; i++) {
+		to->rd_hist[i] += from->rd_hist[i];
+		to->wr_hist[i] += from->wr_hist[i];
+	}
+	if (from->ts_min < to->ts_min)
+		to->ts_min = from->ts_min;
+	if (from->ts_max > to->ts_max)
+		to->ts_max = from->ts_max;
+	for (j = 0; j < from->files.size; j++) {
+		e = &from->files.ent[j];
+		if (e->hash)
+			trst_ent_add(trst_tab_get(&to->files, 0, e->name,
+				e->len), e->ops, e->bytes, e->errors);
+	}
+	for (j = 0; j < from->pids.size; j++) {
+		e = &from->pids.ent[j];
+		if (e->hash)
+			trst_ent_add(trst_tab_get(&to->pids, e->pid, NULL, 0),
+					e->ops, e->bytes, e->errors);
+	}
+}
+
+/** Summarizes the units handed out to this thread
+ */
+static void *trst_worker(void *arg)
+{
+	int u;
+	const char *cur = NULL;
+	char *rec = NULL;
+	trst_stats *st = (trst_stats *)arg;
+	trfs_trace t;
+
+	t.fd = -1;
+	while ((u = __atomic_fetch_add(&next_unit, 1, __ATOMIC_RELAXED)) <
+								nr_units) {
+		/* Units of one tfile are handed out in a row */
+		if (cur != units[u].path) {
+			if (cur)
+				trfs_trace_close(&t);
+			cur = units[u].path;
+			if (trfs_trace_open(&t, cur, tflags) < 0) {
+				printf("Opening %s: Failed\n", cur);
+				cur = NULL;
+				st->nr_corrupt++;
+				continue;
+			}
+		}
+		if (trfs_trace_seek(&t, units[u].start, units[u].end) < 0)
+			continue;
+		while ((rec = trfs_trace_next(&t)) != NULL)
+			trst_add_rec(st, rec);
+		if (t.err) {
+			printf("%s: corrupted or truncated record at offset \
+%lld\n", cur, (long long)trfs_trace_offset(&t));
+			st->nr_corrupt++;
+		}
+	}
+	if (cur)
+		trfs_trace_close(&t);
+	return NULL;
+}
+
+/** Cuts a tfile into units: runs of index blocks if it has an index and
+ * there are threads to share them, the whole file otherwise.
+ */
+static int trst_add_units(const char *path, int nr_threads)
+{
+	int b, run, n;
+	int fd = -1;
+	struct stat st;
+	trfs_index idx;
+	trst_unit *nu = NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Opening %s: Failed\n", path);
+		if (fd >= 0)
+			close(fd);
+		return -ENOENT;
+	}
+	n = 1;
+	if (nr_threads > 1 && trfs_index_load(fd, st.st_size, &idx) == 0)
+		n = idx.nr_ent;
+	else
+		idx.nr_ent = 0;
+	close(fd);
+
+	run = n/(nr_threads*TRST_UNITS_PER_THREAD);
+	if (run < 1)
+		run = 1;
+	nu = (trst_unit *)realloc(units, (nr_units+n/run+3)*sizeof(trst_unit));
+	if (!nu) {
+		trfs_index_free(&idx);
+		return -ENOMEM;
+	}
+	units = nu;
+
+	if (idx.nr_ent == 0) {
+		units[nr_units].path = path;
+		units[nr_units].start = 0;
+		units[nr_units++].end = st.st_size;
+		return 0;
+	}
+	/* The segment header before the first block */
+	units[nr_units].path = path;
+	units[nr_units].start = 0;
+	units[nr_units++].end = idx.ent[0].offset;
+	for (b = 0; b < idx.nr_ent; b += run) {
+		units[nr_units].path = path;
+		units[nr_units].start = idx.ent[b].offset;
+		units[nr_units++].end = trfs_index_block_end(&idx,
+			b+run < idx.nr_ent ? b+run-1 : idx.nr_ent-1);
+	}
+	/* The index records and the footer */
+	units[nr_units].path = path;
+	units[nr_units].start = trfs_index_block_end(&idx, idx.nr_ent-1);
+	units[nr_units++].end = st.st_size;
+	trfs_index_free(&idx);
+	return 0;
+}
+
+/** Orders ties by name or pid, so that the output does not depend on
+ * the order of the hash table
+ */
+static int trst_cmp_key(const trst_ent *e1, const trst_ent *e2)
+{
+	int c;
+
+	if (!e1->name)
+		return e1->pid < e2->pid ? -1 : e1->pid > e2->pid;
+	c = memcmp(e1->name, e2->name, e1->len < e2->len ? e1->len : e2->len);
+	return c ? c : (int)e1->len-(int)e2->len;
+}
+
+/** Orders entries by ops, then bytes, descending
+ */
+static int trst_cmp_ops(const void *a, const void *b)
+{
+	const trst_ent *e1 = *(const trst_ent **)a;
+	const trst_ent *e2 = *(const trst_ent **)b;
+
+	if (e1->ops != e2->ops)
+		return e1->ops < e2->ops ? 1 : -1;
+	if (e1->bytes != e2->bytes)
+		return e1->bytes < e2->bytes ? 1 : -1;
+	return trst_cmp_key(e1, e2);
+}
+
+static int trst_cmp_bytes(const void *a, const void *b)
+{
+	const trst_ent *e1 = *(const trst_ent **)a;
+	const trst_ent *e2 = *(const trst_ent **)b;
+
+	if (e1->bytes != e2->bytes)
+		return e1->bytes < e2->bytes ? 1 : -1;
+	if (e1->ops != e2->ops)
+		return e1->ops < e2->ops ? 1 : -1;
+	return trst_cmp_key(e1, e2);
+}
+
+/** Sorted entries of a table, the caller frees the array
+ */
+static const trst_ent **trst_sorted(const trst_tab *t,
+			int (*cmp)(const void *, const void *))
+{
+	unsigned int i, n = 0;
+	const trst_ent **v = NULL;
+
+	v = (const trst_ent **)malloc((t->count+1)*sizeof(trst_ent *));
+	if (!v)
+		return NULL;
+	for (i = 0; i < t->size; i++)
+		if (t->ent[i].hash)
+			v[n++] = &t->ent[i];
+	qsort(v, n, sizeof(trst_ent *), cmp);
+	return v;
+}
+
+/** Prints a name as a JSON string
+ */
+static void trst_json_str(const char *s, unsigned short len)
+{
+	unsigned short i;
+	unsigned char c;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void trst_print_top(const trst_tab *t, const char *what, int top,
+			int (*cmp)(const void *, const void *), int json)
+{
+	int i, n;
+	const trst_ent **v = trst_sorted(t, cmp);
+
+	if (!v)
+		return;
+	n = (int)t->count < top ? (int)t->count : top;
+	if (!json)
+		printf("\nTop %d %s:\n", n, what);
+	for (i = 0; i < n; i++) {
+		if (json) {
+			printf("%s\n      {", i ? "," : "");
+			if (v[i]->name) {
+				printf("\"name\": ");
+				trst_json_str(v[i]->name, v[i]->len);
+			}
+			else {
+				printf("\"pid\": %u", v[i]->pid);
+			}
+			printf(", \"ops\": %llu, \"bytes\": %llu, \
+\"errors\": %llu}", v[i]->ops, v[i]->bytes, v[i]->errors);
+			continue;
+		}
+		printf("  %12llu ops %14llu bytes %10llu errors  ",
+				v[i]->ops, v[i]->bytes, v[i]->errors);
+		if (v[i]->name)
+			printf("%.*s\n", v[i]->len, v[i]->name);
+		else
+			printf("pid %u\n", v[i]->pid);
+	}
+	free(v);
+}
+
+static int trst_hist_empty(const unsigned long long *hist)
+{
+	int b;
+
+	for (b = 0; b < TRST_NR_HIST; b++)
+		if (hist[b])
+			return 0;
+	return 1;
+}
+
+static void trst_print_hist(const unsigned long long *hist, const char *what,
+								int json)
+{
+	int b;
+	int first = 1;
+
+	if (!json)
+		printf("\n%s sizes:%s\n", what, trst_hist_empty(hist) ? " none" : "");
+	for (b = 0; b < TRST_NR_HIST; b++) {
+		if (!hist[b])
+			continue;
+		if (json)
+			printf("%s\n      {\"min\": %llu, \"count\": %llu}",
+				first ? "" : ",", b ? 1ULL << (b-1) : 0,
+								hist[b]);
+		else
+			printf("  >= %12llu  %12llu\n",
+					b ? 1ULL << (b-1) : 0, hist[b]);
+		first = 0;
+	}
+}
+
+static void trst_print(const trst_stats *st, int top, double secs)
+{
+	int i;
+	double span = st->ts_max > st->ts_min ?
+				(st->ts_max-st->ts_min)/1e9 : 0;
+
+	printf("Records: %llu ops, %llu other, %llu bytes, %.3f s of \
+trace\n", st->nr_recs, st->nr_other, st->nr_bytes, span);
+	printf("\n%-14s %12s %12s %8s\n", "op", "count", "errors", "err%");
+	for (i = 0; i < TRFS_MAX_OPS; i++)
+		if (st->ops[i])
+			printf("%-14s %12llu %12llu %7.2f%%\n",
+				trfs_op_name(i), st->ops[i], st->errors[i],
+				100.0*st->errors[i]/st->ops[i]);
+	printf("\nRead %llu bytes, wrote %llu bytes\n", st->rd_bytes,
+								st->wr_bytes);
+	if (st->wr_cut || st->wr_inexact)
+		printf("Write payloads cut %llu, inexact %llu\n", st->wr_cut,
+							st->wr_inexact);
+	trst_print_hist(st->rd_hist, "Read", 0);
+	trst_print_hist(st->wr_hist, "Write", 0);
+	trst_print_top(&st->files, "files by ops", top, trst_cmp_ops, 0);
+	trst_print_top(&st->files, "files by bytes", top, trst_cmp_bytes, 0);
+	trst_print_top(&st->pids, "pids by ops", top, trst_cmp_ops, 0);
+	trst_print_top(&st->pids, "pids by bytes", top, trst_cmp_bytes, 0);
+	printf("\nParsed in %.3f s: %.3f GB/s\n", secs,
+				secs > 0 ? st->nr_bytes/secs/1e9 : 0);
+}
+
+static void trst_print_json(const trst_stats *st, int top, double secs)
+{
+	int i;
+	int first = 1;
+
+	printf("{\n  \"records\": %llu,\n  \"other_records\": %llu,\n\
+  \"bytes\": %llu,\n  \"corrupt\": %d,\n", st->nr_recs, st->nr_other,
+					st->nr_bytes, st->nr_corrupt);
+	printf("  \"first_ts\": %llu,\n  \"last_ts\": %llu,\n",
+			st->nr_recs ? (unsigned long long)st->ts_min : 0,
+			(unsigned long long)st->ts_max);
+	printf("  \"ops\": {");
+	for (i = 0; i < TRFS_MAX_OPS; i++) {
+		if (!st->ops[i])
+			continue;
+		printf("%s\n    \"%s\": {\"count\": %llu, \"errors\": %llu}",
+			first ? "" : ",", trfs_op_name(i), st->ops[i],
+							st->errors[i]);
+		first = 0;
+	}
+	printf("\n  },\n  \"read_bytes\": %llu,\n  \"write_bytes\": %llu,\n",
+						st->rd_bytes, st->wr_bytes);
+	printf("  \"write_payloads_cut\": %llu,\n  \"write_payloads_inexact\": \
+%llu,\n", st->wr_cut, st->wr_inexact);
+	printf("  \"read_sizes\": [");
+	trst_print_hist(st->rd_hist, "Read", 1);
+	printf("\n  ],\n  \"write_sizes\": [");
+	trst_print_hist(st->wr_hist, "Write", 1);
+	printf("\n  ],\n  \"top_files_by_ops\": [");
+	trst_print_top(&st->files, NULL, top, trst_cmp_ops, 1);
+	printf("\n  ],\n  \"top_files_by_bytes\": [");
+	trst_print_top(&st->files, NULL, top, trst_cmp_bytes, 1);
+	printf("\n  ],\n  \"top_pids_by_ops\": [");
+	trst_print_top(&st->pids, NULL, top, trst_cmp_ops, 1);
+	printf("\n  ],\n  \"top_pids_by_bytes\": [");
+	trst_print_top(&st->pids, NULL, top, trst_cmp_bytes, 1);
+	printf("\n  ],\n  \"seconds\": %.6f\n}\n", secs);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int choice;
+	int ret = 0;
+	int json = 0;
+	int top = TRST_TOP;
+	int nr_threads = 1;
+	int nr_stats = 0;
+	double secs = 0;
+	struct timespec ts0, ts1;
+	pthread_t tid[TRST_MAX_THREADS];
+	trst_stats *st = NULL;
+
+	opterr = 0;
+	while ((choice = getopt(argc, argv, "j:n:Jb")) != -1) {
+		switch (choice) {
+			case 'j':
+				nr_threads = atoi(optarg);
+				if (nr_threads < 1 ||
+				    nr_threads > TRST_MAX_THREADS) {
+					printf("Bad number of threads %s\n",
+								optarg);
+					return -EINVAL;
+				}
+				break;
+			case 'n':
+				top = atoi(optarg);
+				break;
+			case 'J':
+				json = 1;
+				break;
+			case 'b':
+				tflags |= TRFS_TRACE_STREAM;
+				break;
+			default:
+				printf("Usage: trstat [-j threads] [-n top] \
+[-J] [-b] tfile...\n");
+				return -EINVAL;
+		}
+	}
+	if (optind >= argc) {
+		printf("Usage: trstat [-j threads] [-n top] [-J] [-b] \
+tfile...\n");
+		return -EINVAL;
+	}
+
+	for (i = optind; i < argc; i++) {
+		ret = trst_add_units(argv[i], nr_threads);
+		if (ret < 0)
+			goto out;
+	}
+	st = (trst_stats *)calloc(nr_threads, sizeof(trst_stats));
+	if (!st) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (nr_stats = 0; nr_stats < nr_threads; nr_stats++) {
+		if (trst_stats_init(&st[nr_stats]) < 0) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	if (nr_units < nr_threads)
+		nr_threads = nr_units;
+	for (i = 1; i < nr_threads; i++)
+		pthread_create(&tid[i], NULL, trst_worker, &st[i]);
+	trst_worker(&st[0]);
+	for (i = 1; i < nr_threads; i++) {
+		pthread_join(tid[i], NULL);
+		trst_merge(&st[0], &st[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	secs = (ts1.tv_sec-ts0.tv_sec)+(ts1.tv_nsec-ts0.tv_nsec)/1e9;
+
+	if (json)
+		trst_print_json(&st[0], top, secs);
+	else
+		trst_print(&st[0], top, secs);
+	if (st[0].nr_corrupt)
+		ret = -EINVAL;
+out:
+	for (i = 0; i < nr_stats; i++)
+		trst_stats_free(&st[i]);
+	free(st);
+	free(units);
+	return ret;
+}
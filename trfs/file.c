@@ -13,12 +13,14 @@
 #include "tr_fs.h"
 #include "trfs_ops.h"
 #include "trfs_msgq.h"
+#include "trfs_stat.h"
 
 extern struct trfs_log_driver *tld;
 
 static ssize_t trfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
@@ -31,6 +33,7 @@ static ssize_t trfs_read(struct file *file, char __user *buf,
 					file_inode(lower_file));
 
 	/* Trace read file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_read_op(tld, file, count, ppos, err);
 	return err;
 }
@@ -38,13 +41,25 @@ static ssize_t trfs_read(struct file *file, char __user *buf,
 static ssize_t trfs_write(struct file *file, const char __user *buf,
 			    size_t count, loff_t *ppos)
 {
+	bool timed = trfs_stat_timed();
+	u64 start = timed ? ktime_get_ns() : trfs_trigger_start(tld);
+	u64 end = 0;
 	int err;
 
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
 
 	lower_file = trfs_lower_file(file);
+	trfs_wr_begin(lower_file);
 	err = vfs_write(lower_file, buf, count, ppos);
+	trfs_wr_end(lower_file);
+	if (timed) {
+		end = ktime_get_ns();
+		trfs_stat_hist(TRFS_HI_LOWER_WRITE, end-start);
+	}
+	trfs_stat_add(TRFS_ST_LOWER_WRITES, 1);
+	if (err > 0)
+		trfs_stat_add(TRFS_ST_LOWER_BYTES, err);
 	/* update our inode times+sizes upon a successful lower write */
 	if (err >= 0) {
 		fsstack_copy_inode_size(d_inode(dentry),
@@ -54,7 +69,10 @@ static ssize_t trfs_write(struct file *file, const char __user *buf,
 	}
 
 	/* Trace write file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_write_op(tld, file, buf, count, ppos, err);
+	if (timed)
+		trfs_stat_hist(TRFS_HI_WRITE_HOOK, ktime_get_ns()-end);
 	return err;
 }
 
@@ -174,6 +192,7 @@ out:
 
 static int trfs_open(struct inode *inode, struct file *file)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err = 0;
 	struct file *lower_file = NULL;
 	struct path lower_path;
@@ -212,6 +231,7 @@ static int trfs_open(struct inode *inode, struct file *file)
 		fsstack_copy_attr_all(inode, trfs_lower_inode(inode));
 out_err:
 	/* Trace open file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_open_op(tld, inode, file, err);
 	return err;
 }
@@ -233,6 +253,7 @@ static int trfs_flush(struct file *file, fl_owner_t id)
 /* release all lower object references & free the file info structure */
 static int trfs_file_release(struct inode *inode, struct file *file)
 {
+	u64 start = trfs_trigger_start(tld);
 	struct file *lower_file;
 
 	lower_file = trfs_lower_file(file);
@@ -242,6 +263,7 @@ static int trfs_file_release(struct inode *inode, struct file *file)
 	}
 
 	/* Trace close file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_close_op(tld, inode, file, 0);
 	kfree(TRFS_F(file));
 	return 0;
@@ -345,7 +367,9 @@ trfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 
 	get_file(lower_file); /* prevent lower_file from being released */
 	iocb->ki_filp = lower_file;
+	trfs_wr_begin(lower_file);
 	err = lower_file->f_op->write_iter(iocb, iter);
+	trfs_wr_end(lower_file);
 	iocb->ki_filp = file;
 	fput(lower_file);
 	/* update upper inode times/sizes as needed */
@@ -10,7 +10,9 @@
  */
 
 #include "trfs.h"
+#include "tr_fs.h"
 #include "trfs_ops.h"
+#include "trfs_msgq.h"
 
 extern struct trfs_log_driver *tld;
 
@@ -45,6 +47,7 @@ out:
 static int trfs_link(struct dentry *old_dentry, struct inode *dir,
 		       struct dentry *new_dentry)
 {
+	u64 start = trfs_trigger_start(tld);
 	struct dentry *lower_old_dentry;
 	struct dentry *lower_new_dentry;
 	struct dentry *lower_dir_dentry;
@@ -74,6 +77,7 @@ static int trfs_link(struct dentry *old_dentry, struct inode *dir,
 	i_size_write(d_inode(new_dentry), file_size_save);
 out:
 	/* Trace link file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_link_op(tld, old_dentry, dir, new_dentry, err);
 
 	unlock_dir(lower_dir_dentry);
@@ -84,6 +88,7 @@ out:
 
 static int trfs_unlink(struct inode *dir, struct dentry *dentry)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct inode *lower_dir_inode = trfs_lower_inode(dir);
@@ -116,6 +121,7 @@ static int trfs_unlink(struct inode *dir, struct dentry *dentry)
 	d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
 out:
 	/* Trace unlink file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_unlink_op(tld, dir, dentry, err);
 
 	unlock_dir(lower_dir_dentry);
@@ -127,6 +133,7 @@ out:
 static int trfs_symlink(struct inode *dir, struct dentry *dentry,
 			  const char *symname)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
@@ -147,6 +154,7 @@ static int trfs_symlink(struct inode *dir, struct dentry *dentry,
 
 out:
 	/* Trace symlink file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_symlink_op(tld, dir, dentry, symname, err);
 
 	unlock_dir(lower_parent_dentry);
@@ -156,6 +164,7 @@ out:
 
 static int trfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
@@ -180,6 +189,7 @@ static int trfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 
 out:
 	/* Trace mkdir file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_mkdir_op(tld, dir, dentry, mode, err);
 
 	unlock_dir(lower_parent_dentry);
@@ -189,6 +199,7 @@ out:
 
 static int trfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
+	u64 start = trfs_trigger_start(tld);
 	struct dentry *lower_dentry;
 	struct dentry *lower_dir_dentry;
 	int err = 0;
@@ -211,6 +222,7 @@ static int trfs_rmdir(struct inode *dir, struct dentry *dentry)
 
 out:
 	/* Trace rmdir file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_rmdir_op(tld, dir, dentry, err);
 
 	unlock_dir(lower_dir_dentry);
@@ -221,6 +233,7 @@ out:
 static int trfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 			dev_t dev)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
@@ -242,6 +255,7 @@ static int trfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 out:
 	/* Trace rmdir file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_mknod_op(tld, dir, dentry, mode, dev, err);
 
 	unlock_dir(lower_parent_dentry);
@@ -256,6 +270,7 @@ out:
 static int trfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			 struct inode *new_dir, struct dentry *new_dentry)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err = 0;
 	struct dentry *lower_old_dentry = NULL;
 	struct dentry *lower_new_dentry = NULL;
@@ -300,6 +315,7 @@ static int trfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 
 out:
 	/* Trace rename file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_rename_op(tld, old_dir,
 					 old_dentry, new_dir, new_dentry, err);
 
@@ -308,6 +324,12 @@ out:
 	dput(lower_new_dir_dentry);
 	trfs_put_lower_path(old_dentry, &lower_old_path);
 	trfs_put_lower_path(new_dentry, &lower_new_path);
+
+	/* The events queued so far keep their parents by reference, which
+	 * d_move() is about to take to the new path of the directory. The
+	 * paths through it are taken now, the writer isn't waited for. */
+	if (!err && d_is_dir(old_dentry))
+		trfs_log_rename_dir(old_dentry);
 	return err;
 }
 
@@ -480,6 +502,7 @@ static int
 trfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 		size_t size, int flags)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err; struct dentry *lower_dentry;
 	struct path lower_path;
 
@@ -496,6 +519,7 @@ trfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 			      d_inode(lower_path.dentry));
 out:
 	/* Trace setattr file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_setxattr_op(tld, dentry, name, value, size, flags, err);
 
 	trfs_put_lower_path(dentry, &lower_path);
@@ -506,6 +530,7 @@ static ssize_t
 trfs_getxattr(struct dentry *dentry, const char *name, void *buffer,
 		size_t size)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct path lower_path;
@@ -523,6 +548,7 @@ trfs_getxattr(struct dentry *dentry, const char *name, void *buffer,
 				d_inode(lower_path.dentry));
 out:
 	/* Trace getattr file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_getxattr_op(tld, dentry, name, buffer, size, err);
 
 	trfs_put_lower_path(dentry, &lower_path);
@@ -532,6 +558,7 @@ out:
 static ssize_t
 trfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct path lower_path;
@@ -549,6 +576,7 @@ trfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 				d_inode(lower_path.dentry));
 out:
 	/* Trace listxattr file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_listxattr_op(tld, dentry, buffer, buffer_size, err);
 
 	trfs_put_lower_path(dentry, &lower_path);
@@ -558,6 +586,7 @@ out:
 static int
 trfs_removexattr(struct dentry *dentry, const char *name)
 {
+	u64 start = trfs_trigger_start(tld);
 	int err;
 	struct dentry *lower_dentry;
 	struct path lower_path;
@@ -576,6 +605,7 @@ trfs_removexattr(struct dentry *dentry, const char *name)
 			      d_inode(lower_path.dentry));
 out:
 	/* Trace removexattr file operation */
+	trfs_trigger_latency(tld, start);
 	tld->ops->trace_removexattr_op(tld, dentry, name, err);
 
 	trfs_put_lower_path(dentry, &lower_path);
@@ -18,17 +18,40 @@
 #include "trfs_msgq.h"
 #include "trfs_ioct.h"
 #include "trfs_ops.h"
+#include "trfs_stat.h"
 
 trfs_log_write tlw;
 struct trfs_log_driver *tld = NULL;
 
 typedef enum trfs_tokens_ {
 	trfs_filename,
+	trfs_seg_size,
+	trfs_seg_time,
+	trfs_ring_size,
+	trfs_q_depth,
+	trfs_buf_size,
+	trfs_batch,
+	trfs_flush,
+	trfs_cpus,
+	trfs_nice,
+	trfs_prio,
+	trfs_wq,
+	trfs_wait,
 	trfs_opt_err
 }trfs_tokens;
 
 typedef struct trfs_options_ {
 	char *filename;
+	loff_t seg_size;
+	unsigned int seg_time;
+	size_t ring_size;
+	int q_depth;		/* records the queue holds */
+	int buf_size;		/* bytes the writer buffers per vfs_write */
+	int batch;		/* records the writer dequeues at a time */
+	int flush_ms;		/* longest a record waits for the writer */
+	int send_ms;		/* longest a hook waits for room, 0 never */
+	trfs_sched sched;	/* where the writer runs */
+	unsigned int set;	/* bit 1 << token for each option given */
 	int err;
 }trfs_options;
 
@@ -39,10 +62,21 @@ typedef struct trfs_raw_data_ {
 
 static const match_table_t tokens = {
 	{trfs_filename, "tfile=%s"},
+	{trfs_seg_size, "tseg_size=%s"},
+	{trfs_seg_time, "tseg_time=%u"},
+	{trfs_ring_size, "tring=%s"},
+	{trfs_q_depth, "tq_depth=%u"},
+	{trfs_buf_size, "tbuf_size=%s"},
+	{trfs_batch, "tbatch=%u"},
+	{trfs_flush, "tflush=%u"},
+	{trfs_cpus, "tcpus=%s"},
+	{trfs_nice, "tnice=%d"},
+	{trfs_prio, "tprio=%u"},
+	{trfs_wq, "twq"},
+	{trfs_wait, "twait=%u"},
 	{trfs_opt_err, NULL}
 };
 
-struct task_struct *trfs_kthread;
 struct task_struct *trfs_fthread;
 
 trfs_options* trfs_parse_options(char *options)
@@ -61,6 +95,19 @@ trfs_options* trfs_parse_options(char *options)
 	
 	t_op->err = 0;
 	t_op->filename = NULL;
+	t_op->seg_size = 0;
+	t_op->seg_time = 0;
+	t_op->ring_size = 0;
+	t_op->q_depth = TRFS_MQ_DEFAULT_MSGS;
+	t_op->buf_size = TRFS_PAGE_SIZE;
+	t_op->batch = TRFS_LOG_BATCH;
+	t_op->flush_ms = TRFS_MQ_FLUSH_MS;
+	t_op->send_ms = 0;
+	cpumask_clear(&t_op->sched.cpus);
+	t_op->sched.nice = 0;
+	t_op->sched.rt_prio = 0;
+	t_op->sched.use_wq = 0;
+	t_op->set = 0;
 
 	if (!options) {
                 t_op->err = -EINVAL;
@@ -70,6 +117,7 @@ trfs_options* trfs_parse_options(char *options)
                 if (!*p)
                         continue;
                 token = match_token(p, tokens, args);
+		t_op->set |= 1 << token;
 		switch (token) {
 			case trfs_filename: 
 				len = strlen(args[0].from);
@@ -77,6 +125,91 @@ trfs_options* trfs_parse_options(char *options)
 				strcpy(t_op->filename,args[0].from);
 				t_op->err=0;		
 				break;
+			case trfs_seg_size:
+				/* Accepts the K, M and G suffixes */
+				t_op->seg_size = memparse(args[0].from, NULL);
+				break;
+			case trfs_seg_time:
+				if (match_int(&args[0], &len) || len < 0) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->seg_time = len;
+				break;
+			case trfs_ring_size:
+				/* Flight recorder of this many bytes */
+				t_op->ring_size = memparse(args[0].from, NULL);
+				break;
+			case trfs_q_depth:
+				/* Each priority class needs a few slots */
+				if (match_int(&args[0], &len) || len < 8 ||
+				    len > TRFS_MQ_MAX_NO_OF_MSGS) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->q_depth = len;
+				break;
+			case trfs_buf_size:
+				t_op->buf_size = memparse(args[0].from, NULL);
+				if (t_op->buf_size < TRFS_PAGE_SIZE ||
+				    t_op->buf_size > TRFS_MAX_BUF_SIZE)
+					t_op->err=-EINVAL;
+				break;
+			case trfs_batch:
+				if (match_int(&args[0], &len) || len <= 0 ||
+				    len > TRFS_MQ_MAX_NO_OF_MSGS) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->batch = len;
+				break;
+			case trfs_flush:
+				/* ms, 0 hands every record over at once */
+				if (match_int(&args[0], &len) || len < 0 ||
+				    len > TRFS_MAX_FLUSH_MS) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->flush_ms = len;
+				break;
+			case trfs_cpus:
+				/* A cpulist like 0-1,6 */
+				if (cpulist_parse(args[0].from,
+						  &t_op->sched.cpus) ||
+				    !cpumask_intersects(&t_op->sched.cpus,
+							cpu_online_mask))
+					t_op->err=-EINVAL;
+				break;
+			case trfs_nice:
+				if (match_int(&args[0], &len) ||
+				    len < MIN_NICE || len > MAX_NICE) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->sched.nice = len;
+				break;
+			case trfs_prio:
+				/* SCHED_FIFO, 0 back to SCHED_NORMAL */
+				if (match_int(&args[0], &len) || len < 0 ||
+				    len >= MAX_RT_PRIO) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->sched.rt_prio = len;
+				break;
+			case trfs_wq:
+				t_op->sched.use_wq = 1;
+				break;
+			case trfs_wait:
+				/* ms a file or namespace record waits for
+				 * room in the queue, 0 drops it at once */
+				if (match_int(&args[0], &len) || len < 0 ||
+				    len > TRFS_MQ_SEND_MS) {
+					t_op->err=-EINVAL;
+					break;
+				}
+				t_op->send_ms = len;
+				break;
 			case trfs_opt_err:
 			default:
 				t_op->err=-EINVAL;
@@ -88,6 +221,104 @@ out:
 	return t_op;	
 }
 
+/** Applies the tracing options given to mount -o remount, tracing goes
+ * on with the others as they are.
+ */
+int trfs_remount_options(char *options)
+{
+	int err = 0;
+	unsigned int what = 0;
+	trfs_options *t_op = NULL;
+	trfs_log_write t;
+	trfs_sched sched;
+	unsigned int sched_set = (1 << trfs_cpus) | (1 << trfs_nice) |
+					(1 << trfs_prio) | (1 << trfs_wq);
+
+	if (!options || !*options)
+		return 0;
+	t_op = trfs_parse_options(options);
+	if (!t_op)
+		return -ENOMEM;
+	if (t_op->err != 0) {
+		printk("Error in Parsing\n");
+		err = t_op->err;
+		goto out;
+	}
+
+	/* The writer stays a kthread or work items, as it was started */
+	if (t_op->set & (1 << trfs_wq)) {
+		printk("trfs: twq is not changed by a remount\n");
+		err = -EINVAL;
+		goto out;
+	}
+	sched = tlw.sched;
+	if (t_op->set & (1 << trfs_cpus))
+		sched.cpus = t_op->sched.cpus;
+	if (t_op->set & (1 << trfs_nice))
+		sched.nice = t_op->sched.nice;
+	if (t_op->set & (1 << trfs_prio))
+		sched.rt_prio = t_op->sched.rt_prio;
+
+	memset(&t, 0, sizeof(trfs_log_write));
+	/* The same tfile again would truncate the trace being written */
+	if ((t_op->set & (1 << trfs_filename)) && (!tlw.tfile_name ||
+	    strcmp(t_op->filename, tlw.tfile_name) != 0)) {
+		t.tfile_name = t_op->filename;
+		t_op->filename = NULL;
+		what |= TRFS_CONF_TFILE;
+	}
+	t.seg_size = tlw.seg_size;
+	t.seg_time = tlw.seg_time;
+	if (t_op->set & (1 << trfs_seg_size)) {
+		t.seg_size = t_op->seg_size;
+		what |= TRFS_CONF_SEG;
+	}
+	if (t_op->set & (1 << trfs_seg_time)) {
+		t.seg_time = t_op->seg_time;
+		what |= TRFS_CONF_SEG;
+	}
+	if (t_op->set & (1 << trfs_ring_size)) {
+		t.ring_size = t_op->ring_size;
+		what |= TRFS_CONF_RING;
+	}
+	if ((t_op->set & (1 << trfs_q_depth)) && t_op->q_depth != tlw.q_depth) {
+		t.q_depth = t_op->q_depth;
+		what |= TRFS_CONF_DEPTH;
+	}
+	if ((t_op->set & (1 << trfs_buf_size)) &&
+	    t_op->buf_size != tlw.page_cap) {
+		t.page_cap = t_op->buf_size;
+		what |= TRFS_CONF_BUF;
+	}
+	if (t_op->set & (1 << trfs_batch)) {
+		t.batch = min(t_op->batch, (t_op->set & (1 << trfs_q_depth)) ?
+					t_op->q_depth : tlw.q_depth);
+		what |= TRFS_CONF_BATCH;
+	}
+	if (t_op->set & (1 << trfs_flush)) {
+		t.flush_ms = t_op->flush_ms;
+		what |= TRFS_CONF_FLUSH;
+	}
+	if (t_op->set & (1 << trfs_wait)) {
+		t.send_ms = t_op->send_ms;
+		what |= TRFS_CONF_WAIT;
+	}
+
+	err = trfs_log_write_reconf(&t, what);
+	if (err < 0) {
+		kfree(t.tfile_name);
+		goto out;
+	}
+	if (t_op->set & sched_set)
+		err = trfs_writer_resched(&sched);
+	if (err == 0)
+		printk("trfs: tracing options 0x%x changed\n", what);
+out:
+	kfree(t_op->filename);
+	kfree(t_op);
+	return err;
+}
+
 /*
  * There is no need to lock the trfs_super_info's rwsem as there is no
  * way anyone can have a reference to the superblock at this point in time.
@@ -121,28 +352,39 @@ static int trfs_read_super(struct super_block *sb, void *raw_data, int silent)
                 err=t_op->err;
                 goto out;
         }
-	if (trfs_create_log_q() < 0) {
+	if (trfs_create_log_q(t_op->q_depth, t_op->flush_ms) < 0) {
 		printk("Message queue creation failed \n");
 		err = -EINVAL;
 		goto out;
 	}
 	tlw1.tfile_name = t_op->filename;
+	tlw1.seg_size = t_op->seg_size;
+	tlw1.seg_time = t_op->seg_time;
+	tlw1.ring_size = t_op->ring_size;
+	tlw1.page_cap = t_op->buf_size;
+	tlw1.batch = min(t_op->batch, t_op->q_depth);
+	tlw1.q_depth = t_op->q_depth;
+	tlw1.flush_ms = t_op->flush_ms;
+	tlw1.send_ms = t_op->send_ms;
 	if (trfs_log_write_init(&tlw1) < 0 ) {
 		printk("Output write init failed \n");
 		err = -EINVAL;
 		goto out;
 	}
 
-	//trfs_kthread_create(trfs_fthread, "TRFS_FLUSH_THREAD",
-	//					&trfs_log_flush_func);
+	//trfs_fthread = trfs_kthread_create("TRFS_FLUSH_THREAD",
+	//				&trfs_log_flush_func, &t_op->sched);
 	tld = trfs_log_driver_init();
-	trfs_kthread_create(trfs_kthread, "TRFS_LOG_THREAD",
-						&trfs_log_write_func);
 	if (tld == NULL) {
 		printk("No Memory for log driver \n");
 		err = -ENOMEM;
 		goto out;
 	}
+	err = trfs_writer_start(&t_op->sched);
+	if (err < 0) {
+		printk("Starting the writer failed %d\n", err);
+		goto out;
+	}
 	trfs_ioctl_init();
 	
 	/* parse lower path */
@@ -248,11 +490,19 @@ struct dentry *trfs_mount(struct file_system_type *fs_type, int flags,
 			   trfs_read_super);
 }
 
+/* Queued events hold dentries of the mount, the writer has to drop them
+ * before its dcache is shrunk */
+static void trfs_kill_sb(struct super_block *sb)
+{
+	trfs_writer_stop();
+	generic_shutdown_super(sb);
+}
+
 static struct file_system_type trfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= TRFS_NAME,
 	.mount		= trfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= trfs_kill_sb,
 	.fs_flags	= 0,
 };
 MODULE_ALIAS_FS(TRFS_NAME);
@@ -270,6 +520,11 @@ static int __init init_trfs_fs(void)
 	if (err)
 		goto out;
 	err = register_filesystem(&trfs_fs_type);
+	if (err)
+		goto out;
+	/* Kept to the unload: hooks of the last mount may still count */
+	if (trfs_stat_init() < 0)
+		pr_info("trfs: no pipeline statistics\n");
 out:
 	if (err) {
 		trfs_destroy_inode_cache();
@@ -283,6 +538,7 @@ static void __exit exit_trfs_fs(void)
 	trfs_destroy_inode_cache();
 	trfs_destroy_dentry_cache();
 	unregister_filesystem(&trfs_fs_type);
+	trfs_stat_exit();
 	pr_info("Completed trfs module unload\n");
 }
 
@@ -17,6 +17,7 @@ typedef struct trfs_open_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         int flags;
         mode_t mode;
         unsigned int pid;
@@ -30,6 +31,7 @@ typedef struct trfs_read_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         size_t  count;
@@ -43,19 +45,27 @@ typedef struct trfs_write_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         size_t  count;
         unsigned short ppos;
         int ret;
+        unsigned short wflags;
         unsigned short len;
         char pathname[1];
 }trfs_write_op;
 
+/* wflags of a write record: the payload isn't what the write put in the
+ * file */
+#define TRFS_WR_CUT		0x1	/* only its first count bytes */
+#define TRFS_WR_INEXACT		0x2	/* a later write may show in it */
+
 typedef struct trfs_close_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         int ret;
@@ -67,6 +77,7 @@ typedef struct trfs_mkdir_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         int mode;
         int ret;
@@ -78,6 +89,7 @@ typedef struct trfs_rmdir_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short len;
@@ -88,6 +100,7 @@ typedef struct trfs_unlink_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short len;
@@ -98,6 +111,7 @@ typedef struct trfs_rename_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short len1;
@@ -110,6 +124,7 @@ typedef struct trfs_link_op_ {
         unsigned int r_id;
         unsigned short r_size;
         char r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short plen;
@@ -121,6 +136,7 @@ typedef struct trfs_symlink_op_ {
         unsigned int r_id;
         unsigned short r_size;
         char r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short plen;
@@ -132,6 +148,7 @@ typedef struct trfs_trunct_op_ {
         unsigned int r_id;
         unsigned short r_size;
         char r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short len;
@@ -142,6 +159,7 @@ typedef struct trfs_mknod_op_ {
         unsigned int r_id;
         unsigned short r_size;
         char r_type;
+        uint64_t ts;
         unsigned int pid;
         int ret;
         unsigned short len;
@@ -152,6 +170,7 @@ typedef struct trfs_setxattr_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         int ret;
@@ -163,6 +182,7 @@ typedef struct trfs_getxattr_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         int ret;
@@ -174,6 +194,7 @@ typedef struct trfs_listxattr_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         int ret;
@@ -185,6 +206,7 @@ typedef struct trfs_removexattr_op_ {
         unsigned int r_id;
         unsigned short r_size;
         uint8_t r_type;
+        uint64_t ts;
         unsigned int pid;
         uint64_t addr;
         int ret;
@@ -192,4 +214,77 @@ typedef struct trfs_removexattr_op_ {
         char pathname[1];
 }trfs_removexattr_op;
 
+/* Every trace file segment starts with a header record and ends with a
+ * footer record. Both share the r_id/r_size/r_type prefix of the op records
+ * so that a parser which does not know them simply skips over them.
+ */
+#define TRFS_TRACE_MAGIC	0x53465254	/* "TRFS" */
+/* Version 3: op records carry ts, the wall clock time in ns at which the
+ * op was traced, right after r_type.
+ * Version 4: names are paths from the root of the mount, not just the
+ * last component.
+ * Version 5: write records carry wflags, before len.
+ */
+#define TRFS_TRACE_VERSION	5
+
+#define TRFS_REC_SEG_HDR	96
+#define TRFS_REC_SEG_FTR	97
+#define TRFS_REC_INDEX		98
+
+/* Size of the per op counters, indexed by the record type */
+#define TRFS_MAX_OPS		32
+
+typedef struct trfs_seg_hdr_ {
+        unsigned int r_id;
+        unsigned short r_size;
+        uint8_t r_type;
+        unsigned int magic;
+        unsigned short version;
+        unsigned int seg_no;
+        uint64_t ctime;
+}trfs_seg_hdr;
+
+typedef struct trfs_seg_ftr_ {
+        unsigned int r_id;
+        unsigned short r_size;
+        uint8_t r_type;
+        unsigned int magic;
+        unsigned int seg_no;
+        unsigned int first_id;
+        unsigned int last_id;
+        unsigned int nr_recs;
+        uint64_t nr_bytes;
+        uint64_t idx_off;
+        unsigned int op_count[TRFS_MAX_OPS];
+}trfs_seg_ftr;
+
+/* The writer cuts the records of a segment into blocks of about
+ * TRFS_IDX_BLOCK_SIZE bytes and describes each block with an index entry.
+ * Every TRFS_IDX_ENTRIES entries are written to the segment as an index
+ * record, each index record points back to the previous one and the footer
+ * points to the last one. A reader thus finds the whole index from the end
+ * of the segment without scanning it.
+ */
+#define TRFS_IDX_BLOCK_SIZE	(256*1024)
+#define TRFS_IDX_ENTRIES	64
+
+typedef struct trfs_idx_ent_ {
+        uint64_t offset;
+        uint64_t ts;
+        unsigned int first_id;
+        unsigned int last_id;
+        unsigned int nr_recs;
+        unsigned int op_count[TRFS_MAX_OPS];
+}trfs_idx_ent;
+
+typedef struct trfs_idx_rec_ {
+        unsigned int r_id;
+        unsigned short r_size;
+        uint8_t r_type;
+        unsigned int magic;
+        unsigned int nr_ent;
+        uint64_t prev;
+        trfs_idx_ent ent[TRFS_IDX_ENTRIES];
+}trfs_idx_rec;
+
 #endif 
@@ -14,23 +14,23 @@
 #include "trfs_msgq.h"
 #include "trfs_ioct.h"
 #include "trfs_ops.h"
+#include "trfs_stat.h"
 
 /*
  * The inode cache is used with alloc_inode for both our inode info and the
  * vfs inode.
  */
 static struct kmem_cache *trfs_inode_cachep;
-extern struct task_struct *trfs_kthread;
 //extern struct task_struct *trfs_fthread;
 
 extern struct trfs_log_driver *tld;
 
 static void trfs_exit(void)
 {
+	/* The writer drains the queue before the segment is closed */
+	trfs_writer_stop();
 	trfs_log_write_flush();
 	trfs_log_write_close();
-	if (trfs_kthread) 
-		trfs_kthread_exit(trfs_kthread);
 	//if (trfs_fthread) 
 		//trfs_kthread_exit(trfs_fthread);
 	trfs_delete_log_q();
@@ -91,8 +91,12 @@ static int trfs_remount_fs(struct super_block *sb, int *flags, char *options)
 		printk(KERN_ERR
 		       "trfs: remount flags 0x%x unsupported\n", *flags);
 		err = -EINVAL;
+		goto out;
 	}
 
+	/* The tracing options are switched while tracing goes on */
+	err = trfs_remount_options(options);
+out:
 	return err;
 }
 
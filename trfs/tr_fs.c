@@ -11,10 +11,15 @@
  */
 
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
 
 #include "trfs.h"
 #include "tr_fs.h"
 #include "trfs_msgq.h"
+#include "trfs_ops.h"
+#include "trfs_stat.h"
 
 /** Global stucture for async writing 
  */
@@ -24,12 +29,9 @@ extern trfs_log_write tlw;
  */
 unsigned int get_next_record_id( )
 {
-	static unsigned int id = 1;
+	static atomic_t id = ATOMIC_INIT(1);
 
-	mutex_lock(&tlw.id_lock);
-	id++;
-	mutex_unlock(&tlw.id_lock);
-	return id;
+	return atomic_inc_return(&id);
 }
 
 /** Function to validate the newly opened/created file.
@@ -84,6 +86,10 @@ out:
 	return ret;
 }
 
+static int trfs_seg_open(void);
+static void trfs_idx_write(void);
+static trfs_ring *trfs_ring_alloc(size_t size);
+
 /** Initializes the trace file writing 
  * param[in] t Global stucture for async writing 
  */
@@ -92,17 +98,50 @@ int trfs_log_write_init(trfs_log_write *t)
 	int err = 0;
 
 	tlw.tfile_name = t->tfile_name;
-	if (tlw.tfile_name == NULL) {
+	if (tlw.tfile_name == NULL && !t->ring_size) {
 		printk("Output file is null \n");
 		err = -ENOENT;
 		goto out;
 	}
 
-	tlw.tfile = filp_open(tlw.tfile_name, O_WRONLY|O_CREAT|O_TRUNC, 0777);
-        err = trfs_file_verify(tlw.tfile, TRFS_WRITE_PERM);
-	tlw.tfile->f_pos = 0;
+	tlw.page_cap = t->page_cap ? t->page_cap : TRFS_PAGE_SIZE;
+	tlw.batch = t->batch ? t->batch : TRFS_LOG_BATCH;
+	tlw.q_depth = t->q_depth;
+	tlw.flush_ms = t->flush_ms;
+	tlw.send_ms = t->send_ms;
+	tlw.msgs = NULL;
+	tlw.lens = NULL;
+	tlw.nr_msgs = 0;
+	tlw.q_msg = NULL;
+	init_waitqueue_head(&tlw.conf_wq);
+	tlw.seg_err = 0;
+	tlw.idx = (trfs_idx_rec *)kmalloc(sizeof(trfs_idx_rec), GFP_KERNEL);
+	tlw.page = (char *)vmalloc(tlw.page_cap);
+	tlw.page_size = 0;
+	tlw.nr_sg = 0;
+	tlw.sg_cut = 0;
+	tlw.sg_size = 0;
+	if (tlw.idx == NULL || tlw.page == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	tlw.seg_no = 0;
+	tlw.seg_size = t->seg_size;
+	tlw.seg_time = t->seg_time;
+	atomic_set(&tlw.rotate_req, 0);
         mutex_init(&tlw.q_lock); 
-        mutex_init(&tlw.id_lock); 
+        mutex_init(&tlw.page_lock); 
+	mutex_init(&tlw.ev_lock);
+
+	/* The flight recorder keeps the records in memory until a dump */
+	if (t->ring_size) {
+		tlw.ring = trfs_ring_alloc(t->ring_size);
+		if (!tlw.ring)
+			err = -ENOMEM;
+	}
+	else
+		err = trfs_seg_open();
 out:
 	return err;
 }
@@ -113,9 +152,10 @@ out:
  * param[in] size Number of bytes to be written.
  */
 static int trfs_file_write(struct file* filp,
-				 unsigned char* data, unsigned int size)
+				 char* data, unsigned int size)
 {
 	int bytes = 0;
+	u64 start;
 	mm_segment_t oldfs;
 
         /* File pointer verification. */
@@ -129,14 +169,56 @@ static int trfs_file_write(struct file* filp,
 	set_fs(KERNEL_DS);
 	
 	/* Write into the file byte by byte. */	
+	start = ktime_get_ns();
 	bytes = vfs_write(filp, data, size, &filp->f_pos); 
+	trfs_stat_hist(TRFS_HI_FLUSH, ktime_get_ns()-start);
 
 	set_fs(oldfs);
 
         if ((bytes == 0) || (bytes < 0)) {
+		trfs_stat_add(TRFS_ST_FLUSH_ERR, 1);
                 bytes = -EBADF;
                 goto out;
         }
+	trfs_stat_add(TRFS_ST_FLUSHES, 1);
+	trfs_stat_add(TRFS_ST_FLUSH_BYTES, bytes);
+out:
+	return bytes;
+}
+
+/** Writes the nr_vec buffers of vec to the file in one go.
+ * param[in] filp File pointer to output file.
+ * param[in] vec Buffers to be written, in kernel memory.
+ * param[in] nr_vec Number of buffers.
+ */
+static int trfs_file_writev(struct file *filp, struct iovec *vec,
+							unsigned long nr_vec)
+{
+	int bytes = 0;
+	u64 start;
+	mm_segment_t oldfs;
+
+	if (!filp) {
+		printk(KERN_INFO "File Pointer error. \n");
+		bytes = -EACCES;
+		goto out;
+	}
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	start = ktime_get_ns();
+	bytes = vfs_writev(filp, (const struct iovec __user *)vec, nr_vec,
+								&filp->f_pos);
+	trfs_stat_hist(TRFS_HI_FLUSH, ktime_get_ns()-start);
+	set_fs(oldfs);
+
+	if (bytes <= 0) {
+		trfs_stat_add(TRFS_ST_FLUSH_ERR, 1);
+		bytes = -EBADF;
+		goto out;
+	}
+	trfs_stat_add(TRFS_ST_FLUSHES, 1);
+	trfs_stat_add(TRFS_ST_FLUSH_BYTES, bytes);
 out:
 	return bytes;
 }
@@ -151,11 +233,399 @@ static void trfs_file_close(struct file* filp)
 			filp_close(filp, NULL);
 }
 
+/** Adds a segment to the next write to the tfile
+ */
+static void trfs_sg_add(struct page *page, unsigned int off,
+							unsigned int len)
+{
+	trfs_sg *sg = &tlw.sg[tlw.nr_sg++];
+
+	sg->page = page;
+	sg->off = off;
+	sg->len = len;
+	sg->wr_gen = NULL;
+}
+
+/** Sets TRFS_WR_INEXACT in the write record at rec, which may not be
+ * aligned, if mark. Returns whether the record has it.
+ */
+static bool trfs_wr_inexact(char *rec, bool mark)
+{
+	unsigned short wflags = 0;
+	char *p = rec+offsetof(trfs_write_op, wflags);
+
+	memcpy(&wflags, p, sizeof(wflags));
+	if (mark) {
+		wflags |= TRFS_WR_INEXACT;
+		memcpy(p, &wflags, sizeof(wflags));
+	}
+	return wflags & TRFS_WR_INEXACT;
+}
+
+/** Writes the page and the payloads it is cut by in one vfs_writev, the
+ * payloads go from the page cache of the lower file to the tfile, so a
+ * write to the file until then shows in them: their records are marked
+ * inexact here, short of a write racing with the vfs_writev itself. Then
+ * the references to their pages are dropped.
+ * Caller holds page_lock.
+ */
+static void trfs_sg_flush(void)
+{
+	int i;
+	trfs_sg *sg = NULL;
+
+	if (tlw.page_size > tlw.sg_cut)
+		trfs_sg_add(NULL, tlw.sg_cut, tlw.page_size-tlw.sg_cut);
+	for (i = 0; i < tlw.nr_sg; i++) {
+		sg = &tlw.sg[i];
+		/* The file was written to since the record was built */
+		if (sg->wr_gen && sg->rec_off >= 0 &&
+		    trfs_wr_inexact(tlw.page+sg->rec_off,
+				trfs_wr_stale(sg->wr_gen, sg->wr_begun)))
+			trfs_stat_add(TRFS_ST_DATA_INEXACT, 1);
+		if (sg->page)
+			tlw.iov[i].iov_base = (char *)kmap(sg->page)+sg->off;
+		else
+			tlw.iov[i].iov_base = tlw.page+sg->off;
+		tlw.iov[i].iov_len = sg->len;
+	}
+	trfs_file_writev(tlw.tfile, tlw.iov, tlw.nr_sg);
+	for (i = 0; i < tlw.nr_sg; i++) {
+		sg = &tlw.sg[i];
+		if (sg->page) {
+			kunmap(sg->page);
+			put_page(sg->page);
+		}
+	}
+	tlw.nr_sg = 0;
+	tlw.sg_cut = 0;
+	tlw.sg_size = 0;
+}
+
+/** Writes the buffered records to the tfile.
+ * Caller holds page_lock.
+ */
+static void trfs_page_flush(void)
+{
+	if (tlw.nr_sg > 0)
+		trfs_sg_flush();
+	else if (tlw.page && tlw.page_size > 0)
+		trfs_file_write(tlw.tfile, tlw.page, tlw.page_size);
+	tlw.page_size = 0;
+}
+
+/** Starts a segment in filp: writes its header and resets the footer
+ * and the index.
+ */
+static void trfs_seg_start(struct file *filp)
+{
+	trfs_seg_hdr hdr;
+
+	tlw.tfile = filp;
+	tlw.tfile->f_pos = 0;
+	tlw.seg_start = jiffies;
+	tlw.seg_err = 0;
+	memset(&tlw.seg_ftr, 0, sizeof(trfs_seg_ftr));
+	tlw.idx->nr_ent = 0;
+	tlw.idx_prev = 0;
+
+	memset(&hdr, 0, sizeof(trfs_seg_hdr));
+	hdr.r_size = sizeof(trfs_seg_hdr);
+	hdr.r_type = TRFS_REC_SEG_HDR;
+	hdr.magic = TRFS_TRACE_MAGIC;
+	hdr.version = TRFS_TRACE_VERSION;
+	hdr.seg_no = tlw.seg_no;
+	hdr.ctime = ktime_get_real_ns();
+	trfs_file_write(tlw.tfile, (char *)&hdr, hdr.r_size);
+}
+
+/** Opens the next trace segment and writes its header.
+ * Segment 0 is the tfile itself, later ones are named tfile.<seg_no>
+ */
+static int trfs_seg_open(void)
+{
+	int err = 0;
+	char *name = tlw.tfile_name;
+	struct file *filp = NULL;
+
+	if (tlw.seg_no > 0) {
+		name = kasprintf(GFP_KERNEL, "%s.%u",
+					tlw.tfile_name, tlw.seg_no);
+		if (!name) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	filp = filp_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0777);
+	if (name != tlw.tfile_name)
+		kfree(name);
+        err = trfs_file_verify(filp, TRFS_WRITE_PERM);
+	if (err < 0) {
+		tlw.tfile = NULL;
+		goto out;
+	}
+	trfs_seg_start(filp);
+out:
+	return err;
+}
+
+/** Flushes the pending records and writes the index and the footer.
+ * Caller holds page_lock.
+ */
+static void trfs_seg_finish(void)
+{
+	trfs_idx_write();
+	trfs_page_flush();
+	tlw.seg_ftr.idx_off = tlw.idx_prev;
+	tlw.seg_ftr.r_size = sizeof(trfs_seg_ftr);
+	tlw.seg_ftr.r_type = TRFS_REC_SEG_FTR;
+	tlw.seg_ftr.magic = TRFS_TRACE_MAGIC;
+	tlw.seg_ftr.seg_no = tlw.seg_no;
+	trfs_file_write(tlw.tfile, (char *)&tlw.seg_ftr,
+						sizeof(trfs_seg_ftr));
+}
+
+/** Finishes the segment and closes it.
+ * Caller holds page_lock.
+ */
+static void trfs_seg_close(void)
+{
+	if (!tlw.tfile)
+		return;
+
+	trfs_seg_finish();
+	trfs_file_close(tlw.tfile);
+	tlw.tfile = NULL;
+}
+
+/** Opens the segment that failed to open, reporting only the first
+ * failure in a row. The records are lost until it opens.
+ * Caller holds page_lock.
+ */
+static void trfs_seg_reopen(void)
+{
+	int err = 0;
+
+	if (tlw.tfile || tlw.ring || !tlw.tfile_name)
+		return;
+	err = trfs_seg_open();
+	if (err < 0 && !tlw.seg_err)
+		pr_err("trfs: opening trace segment %u failed (%d), \
+records are lost until it opens\n", tlw.seg_no, err);
+	tlw.seg_err = err < 0;
+}
+
+/** Closes the current segment and opens the next one if the rotation
+ * is due by size, by age or by an ioctl request.
+ * Caller holds page_lock.
+ */
+static void trfs_seg_rotate_check(void)
+{
+	int due = 0;
+
+	if (atomic_xchg(&tlw.rotate_req, 0))
+		due = 1;
+	if (tlw.seg_size && tlw.seg_ftr.nr_bytes >= tlw.seg_size)
+		due = 1;
+	if (tlw.seg_time && tlw.seg_ftr.nr_recs &&
+	    time_after_eq(jiffies, tlw.seg_start + tlw.seg_time*HZ))
+		due = 1;
+	if (!due)
+		return;
+
+	trfs_seg_close();
+	tlw.seg_no++;
+	trfs_seg_reopen();
+}
+
+/** Updates the footer of the open segment with a new record.
+ * param[in] rec Record to be written.
+ * param[in] len Length of the record.
+ */
+static void trfs_seg_account(char *rec, int len)
+{
+	unsigned int r_id = 0;
+	uint8_t r_type = 0;
+
+	memcpy(&r_id, rec, sizeof(unsigned int));
+	r_type = rec[sizeof(unsigned int)+sizeof(unsigned short)];
+
+	if (tlw.seg_ftr.nr_recs == 0)
+		tlw.seg_ftr.first_id = r_id;
+	tlw.seg_ftr.last_id = r_id;
+	tlw.seg_ftr.nr_recs++;
+	tlw.seg_ftr.nr_bytes += len;
+	if (r_type < TRFS_MAX_OPS)
+		tlw.seg_ftr.op_count[r_type]++;
+}
+
+/** Copies a record to the page, the page is written once it is full.
+ * Records bigger than the page go to the tfile directly.
+ * Caller holds page_lock.
+ */
+static void trfs_page_put(char *rec, int len)
+{
+	if (tlw.page_size+len > tlw.page_cap)
+		trfs_page_flush();
+	if (len > tlw.page_cap) {
+		trfs_file_write(tlw.tfile, rec, len);
+		return;
+	}
+	memcpy(tlw.page+tlw.page_size, rec, len);
+	tlw.page_size += len;
+}
+
+/** Offset in the segment at which the next record will land.
+ */
+static loff_t trfs_seg_offset(void)
+{
+	if (!tlw.tfile)
+		return 0;
+	return tlw.tfile->f_pos + tlw.page_size + tlw.sg_size;
+}
+
+/** Writes the pending index entries as an index record and chains it to
+ * the previous one.
+ * Caller holds page_lock.
+ */
+static void trfs_idx_write(void)
+{
+	loff_t off = trfs_seg_offset();
+
+	if (tlw.idx->nr_ent == 0)
+		return;
+
+	tlw.idx->r_id = 0;
+	tlw.idx->r_size = offsetof(trfs_idx_rec, ent) +
+				tlw.idx->nr_ent*sizeof(trfs_idx_ent);
+	tlw.idx->r_type = TRFS_REC_INDEX;
+	tlw.idx->magic = TRFS_TRACE_MAGIC;
+	tlw.idx->prev = tlw.idx_prev;
+	trfs_page_put((char *)tlw.idx, tlw.idx->r_size);
+	tlw.idx_prev = off;
+	tlw.idx->nr_ent = 0;
+}
+
+/** Time of a record: when it was traced for op records, now for others
+ */
+static uint64_t trfs_rec_ts(char *rec, uint8_t r_type)
+{
+	uint64_t ts = 0;
+
+	if (r_type >= TRFS_MAX_OPS)
+		return ktime_get_real_ns();
+	memcpy(&ts, rec+offsetof(trfs_open_op, ts), sizeof(uint64_t));
+	return ts;
+}
+
+/** Adds a record to the index entry of the current block, a new block is
+ * started once the current one has grown beyond TRFS_IDX_BLOCK_SIZE.
+ * Caller holds page_lock.
+ */
+static void trfs_idx_account(char *rec, int len)
+{
+	unsigned int r_id = 0;
+	uint8_t r_type = 0;
+	loff_t off = trfs_seg_offset();
+	trfs_idx_ent *ent = NULL;
+
+	memcpy(&r_id, rec, sizeof(unsigned int));
+	r_type = rec[sizeof(unsigned int)+sizeof(unsigned short)];
+
+	if (tlw.idx->nr_ent > 0)
+		ent = &tlw.idx->ent[tlw.idx->nr_ent-1];
+	if (!ent || off-ent->offset >= TRFS_IDX_BLOCK_SIZE) {
+		if (tlw.idx->nr_ent == TRFS_IDX_ENTRIES) {
+			trfs_idx_write();
+			off = trfs_seg_offset();
+		}
+		ent = &tlw.idx->ent[tlw.idx->nr_ent++];
+		memset(ent, 0, sizeof(trfs_idx_ent));
+		ent->offset = off;
+		ent->ts = trfs_rec_ts(rec, r_type);
+		ent->first_id = r_id;
+	}
+	ent->last_id = r_id;
+	ent->nr_recs++;
+	if (r_type < TRFS_MAX_OPS)
+		ent->op_count[r_type]++;
+}
+
+/** Appends a trace record to the open segment.
+ * Caller holds page_lock.
+ */
+static void trfs_page_append(char *rec, int len)
+{
+	if (!tlw.tfile || !tlw.idx) {
+		trfs_stat_add(TRFS_ST_SEG_LOST, 1);
+		return;
+	}
+	trfs_idx_account(rec, len);
+	trfs_seg_account(rec, len);
+	trfs_page_put(rec, len);
+	trfs_stat_add(TRFS_ST_RECS_OUT, 1);
+	trfs_stat_add(TRFS_ST_BYTES_OUT, len);
+}
+
+/** Appends a write record whose payload ev still holds in its pages,
+ * rec has the rest of the record. The payload is not copied: the pages
+ * are written from where they are once the page is, the writer keeps the
+ * references of ev until then.
+ * Caller holds page_lock.
+ */
+static void trfs_page_append_data(char *rec, int len, trfs_event *ev)
+{
+	int i, rec_off;
+	trfs_sg *sg = NULL;
+	size_t n, left = ev->count;
+	unsigned int off = ev->pg_off;
+
+	if (!tlw.tfile || !tlw.idx) {
+		trfs_stat_add(TRFS_ST_SEG_LOST, 1);
+		return;
+	}
+	if (tlw.nr_sg+ev->nr_pages+2 > TRFS_LOG_SG)
+		trfs_page_flush();
+	trfs_idx_account(rec, len);
+	trfs_seg_account(rec, len);
+	trfs_wr_inexact(rec, trfs_wr_stale(ev->wr_gen, ev->wr_begun));
+	trfs_page_put(rec, len-left);
+	/* Unless it went to the tfile already, too big for the page */
+	rec_off = len-left <= tlw.page_cap ? tlw.page_size-(len-left) : -1;
+	if (rec_off < 0 && trfs_wr_inexact(rec, false))
+		trfs_stat_add(TRFS_ST_DATA_INEXACT, 1);
+
+	if (tlw.page_size > tlw.sg_cut) {
+		trfs_sg_add(NULL, tlw.sg_cut, tlw.page_size-tlw.sg_cut);
+		tlw.sg_cut = tlw.page_size;
+	}
+	for (i = 0; i < ev->nr_pages; i++) {
+		n = min_t(size_t, left, PAGE_SIZE-off);
+		trfs_sg_add(ev->pages[i], off, n);
+		left -= n;
+		off = 0;
+	}
+	if (ev->nr_pages > 0) {
+		sg = &tlw.sg[tlw.nr_sg-ev->nr_pages];
+		sg->wr_gen = ev->wr_gen;
+		sg->wr_begun = ev->wr_begun;
+		sg->rec_off = rec_off;
+	}
+	tlw.sg_size += ev->count;
+	ev->nr_pages = 0;
+	trfs_stat_add(TRFS_ST_RECS_OUT, 1);
+	trfs_stat_add(TRFS_ST_BYTES_OUT, len);
+	trfs_stat_add(TRFS_ST_DATA_OUT, ev->count);
+}
+
 /** Function to flush the remaining bytes to tfile. 
  */
 void trfs_log_write_flush(void)
 {
-	trfs_file_write(tlw.tfile, (char *)tlw.page, tlw.page_size);
+	mutex_lock(&tlw.page_lock);
+	trfs_page_flush();
+	mutex_unlock(&tlw.page_lock);
 }
 
 /** Function to flush the bytes to tfile periodically. 
@@ -163,78 +633,613 @@ void trfs_log_write_flush(void)
 void trfs_log_write_flush_periodic(void)
 {
 	while(1) {
-		trfs_file_write(tlw.tfile, (char *)tlw.page, tlw.page_size);
-		tlw.page_size = 0;
+		trfs_log_write_flush();
 		msleep(10000);
 	}
 }
 
+/** Asks the writer to close the current segment and start a new one.
+ * Producers are not blocked, records keep queueing while it rotates.
+ */
+void trfs_log_rotate_request(void)
+{
+	if (tlw.ring)
+		return;
+	atomic_set(&tlw.rotate_req, 1);
+	trfs_mq_kick(TRFS_LOG_QID);
+}
+
+/** Allocates the flight recorder ring up front, nothing is allocated
+ * while tracing: the hooks build the records of events in the buffers
+ * of the ring.
+ */
+static trfs_ring *trfs_ring_alloc(size_t size)
+{
+	trfs_ring *ring = NULL;
+
+	ring = (trfs_ring *)kmalloc(sizeof(trfs_ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
+	ring->buf = vmalloc(size);
+	ring->ev_rec = (char *)vmalloc(TRFS_EV_REC_MAX+TRFS_WR_DATA_MAX);
+	ring->ev_path = (char *)kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!ring->buf || !ring->ev_rec || !ring->ev_path) {
+		vfree(ring->buf);
+		vfree(ring->ev_rec);
+		kfree(ring->ev_path);
+		kfree(ring);
+		return NULL;
+	}
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->nr_lost = 0;
+	spin_lock_init(&ring->lock);
+	return ring;
+}
+
+static void trfs_ring_free(trfs_ring *ring)
+{
+	if (!ring)
+		return;
+	vfree(ring->buf);
+	vfree(ring->ev_rec);
+	kfree(ring->ev_path);
+	kfree(ring);
+}
+
+/** Copies len bytes from the ring at offset off, wrapping at its end.
+ */
+static void trfs_ring_read(trfs_ring *ring, char *dst, uint64_t off,
+								size_t len)
+{
+	size_t pos = off % ring->size;
+	size_t n = min(len, ring->size-pos);
+
+	memcpy(dst, ring->buf+pos, n);
+	memcpy(dst+n, ring->buf, len-n);
+}
+
+static void trfs_ring_write(trfs_ring *ring, uint64_t off, char *src,
+								size_t len)
+{
+	size_t pos = off % ring->size;
+	size_t n = min(len, ring->size-pos);
+
+	memcpy(ring->buf+pos, src, n);
+	memcpy(ring->buf, src+n, len-n);
+}
+
+/** Adds a record to the ring, dropping the oldest ones to make room.
+ * Caller holds the lock of the ring.
+ */
+static void __trfs_ring_put(trfs_ring *ring, char *rec, int len)
+{
+	unsigned short r_size = 0;
+
+	while (ring->tail+len-ring->head > ring->size) {
+		trfs_ring_read(ring, (char *)&r_size,
+			ring->head+sizeof(unsigned int), sizeof(unsigned short));
+		ring->head += r_size;
+		ring->nr_lost++;
+	}
+	trfs_ring_write(ring, ring->tail, rec, len);
+	ring->tail += len;
+}
+
+static void trfs_ring_put(trfs_ring *ring, char *rec, int len)
+{
+	if (len > ring->size)
+		return;
+
+	spin_lock(&ring->lock);
+	__trfs_ring_put(ring, rec, len);
+	spin_unlock(&ring->lock);
+	trfs_stat_add(TRFS_ST_RING_RECS, 1);
+	trfs_stat_add(TRFS_ST_RING_BYTES, len);
+}
+
+/** Builds the record of ev in the buffers of the ring and adds it, under
+ * the lock of the ring, so that a hook allocates nothing for it. The
+ * caller still releases ev.
+ */
+static void trfs_ring_put_event(trfs_ring *ring, trfs_event *ev)
+{
+	int len = 0;
+
+	spin_lock(&ring->lock);
+	len = trfs_event_build(ev, ring->ev_rec, ring->ev_path, true);
+	if (len > ring->size)
+		len = 0;
+	if (len > 0)
+		__trfs_ring_put(ring, ring->ev_rec, len);
+	spin_unlock(&ring->lock);
+	if (len > 0) {
+		trfs_stat_add(TRFS_ST_RING_RECS, 1);
+		trfs_stat_add(TRFS_ST_RING_BYTES, len);
+	}
+}
+
+/** Priority class of a record in the queue, by its op type. A bare int
+ * is the end marker.
+ */
+static int trfs_log_pri(char *rec, int len)
+{
+	if (len < sizeof(unsigned int)+sizeof(unsigned short)+1)
+		return TRFS_MQ_PRI_NS;
+	return trfs_op_pri(rec[sizeof(unsigned int)+sizeof(unsigned short)]);
+}
+
+bool trfs_log_shed(int r_type)
+{
+	/* The ring takes everything, overwriting the oldest */
+	if (trfs_op_pri(r_type) != TRFS_MQ_PRI_DATA || READ_ONCE(tlw.ring))
+		return false;
+	if (!trfs_mq_shed(TRFS_LOG_QID, TRFS_MQ_PRI_DATA))
+		return false;
+	trfs_stat_add(TRFS_ST_ENQ_FULL, 1);
+	return true;
+}
+
+void trfs_log_put(char *rec, int len)
+{
+	int ret, pri;
+	bool ev;
+	size_t data = 0;
+	trfs_ring *ring = NULL;
+
+	/* A remount may take the ring away, it waits for us to be done */
+	rcu_read_lock();
+	ring = READ_ONCE(tlw.ring);
+	if (rec && ring) {
+		/* No writer reads the ring, events are built here */
+		ev = trfs_is_event(rec, len);
+		if (ev)
+			trfs_ring_put_event(ring, (trfs_event *)rec);
+		else
+			trfs_ring_put(ring, rec, len);
+		rcu_read_unlock();
+		/* Dropping the references of an event may sleep */
+		trfs_rec_free(rec, len);
+		return;
+	}
+	rcu_read_unlock();
+	/* Once queued rec is the writer's, what is counted is taken before */
+	ev = trfs_is_event(rec, len);
+	if (ev && ((trfs_event *)rec)->nr_pages)
+		data = ((trfs_event *)rec)->count;
+	/* Replay can do without data records, not without the others:
+	 * with twait= these wait that long for the writer to make room */
+	pri = rec ? trfs_log_pri(rec, len) : TRFS_MQ_PRI_DATA;
+	ret = trfsMqSend(TRFS_LOG_QID, (unsigned char *)rec, len, pri,
+			pri == TRFS_MQ_PRI_DATA ? -1 : READ_ONCE(tlw.send_ms));
+	if (ret < 0) {
+		/* A full class is counted by the queue, not reported */
+		if (ret != TRFS_ERR_MQ_FULL)
+			printk("Pushing the record into queue: Failed \n");
+		trfs_stat_add(ret == TRFS_ERR_MQ_FULL ? TRFS_ST_ENQ_FULL :
+						TRFS_ST_ENQ_ERR, 1);
+		if (rec)
+			trfs_rec_free(rec, len);
+		return;
+	}
+	trfs_stat_add(ev ? TRFS_ST_EVENTS_IN : TRFS_ST_RECS_IN, 1);
+	trfs_stat_add(TRFS_ST_BYTES_IN, len);
+	trfs_stat_add(TRFS_ST_DATA_IN, data);
+}
+
+static void trfs_log_pin(unsigned char *msg, int len, void *dir)
+{
+	if (trfs_is_event((char *)msg, len) &&
+	    trfs_event_pin((trfs_event *)msg, (struct dentry *)dir,
+							tlw.ev_path))
+		trfs_stat_add(TRFS_ST_EV_PINNED, 1);
+}
+
+void trfs_log_rename_dir(struct dentry *dir)
+{
+	if (!trfs_log_qid)
+		return;
+	/* The writer builds an event under ev_lock, the queue and its
+	 * batch are walked under the lock of the queue. Nothing waits for
+	 * the writer to get to them. */
+	mutex_lock(&tlw.ev_lock);
+	if (tlw.ev_path)
+		trfs_mq_for_each(TRFS_LOG_QID, trfs_log_pin, dir);
+	mutex_unlock(&tlw.ev_lock);
+}
+
+/** Freezes the ring by copying it out under its lock, so that tracing
+ * goes on while the copy is written out as a segment with its own index
+ * and footer.
+ */
+int trfs_ring_dump(struct file *filp)
+{
+	int err = 0;
+	size_t len, off;
+	unsigned short r_size = 0;
+	char *snap = NULL;
+	trfs_ring *ring = NULL;
+
+	err = trfs_file_verify(filp, TRFS_WRITE_PERM);
+	if (err < 0)
+		return err;
+
+	/* page_lock keeps a remount from switching the ring meanwhile */
+	mutex_lock(&tlw.page_lock);
+	ring = tlw.ring;
+	if (!ring) {
+		mutex_unlock(&tlw.page_lock);
+		return -EINVAL;
+	}
+	snap = vmalloc(ring->size);
+	if (!snap) {
+		mutex_unlock(&tlw.page_lock);
+		return -ENOMEM;
+	}
+
+	spin_lock(&ring->lock);
+	len = ring->tail-ring->head;
+	trfs_ring_read(ring, snap, ring->head, len);
+	spin_unlock(&ring->lock);
+
+	trfs_seg_start(filp);
+	for (off = 0; off < len; off += r_size) {
+		memcpy(&r_size, snap+off+sizeof(unsigned int),
+						sizeof(unsigned short));
+		trfs_page_append(snap+off, r_size);
+	}
+	trfs_seg_finish();
+	tlw.tfile = NULL;
+	mutex_unlock(&tlw.page_lock);
+
+	vfree(snap);
+	return err;
+}
+
+/** Writes a batch taken from the queue, returns 1 if it ends with the
+ * end marker. Records queued before a switch to the flight recorder go
+ * to the ring.
+ */
+static int trfs_log_write_batch(int n)
+{
+	int i;
+	int len;
+	int done = 0;
+	char *rec = NULL;
+	trfs_event *ev = NULL;
+	uint64_t ts = 0;
+	uint64_t now = ktime_get_real_ns();
+	u64 start = ktime_get_ns();
+
+	trfs_stat_add(TRFS_ST_BATCHES, 1);
+	trfs_stat_hist(TRFS_HI_BATCH, n);
+	mutex_lock(&tlw.page_lock);
+	/* The segment a rotation couldn't open is tried again */
+	if (tlw.seg_err)
+		trfs_seg_reopen();
+	for (i = 0; i < n; i++) {
+		rec = (char *)tlw.msgs[i];
+		len = tlw.lens[i];
+		/* Records of ops and events start with the time of the op,
+		 * the end marker is a bare int */
+		if (len >= offsetof(trfs_open_op, ts)+sizeof(uint64_t)) {
+			memcpy(&ts, rec+offsetof(trfs_open_op, ts),
+							sizeof(uint64_t));
+			if (now > ts)
+				trfs_stat_hist(TRFS_HI_QUEUE_WAIT, now-ts);
+		}
+		/* End of the file system tracing. Records start with
+		 * their ID, only a bare int can be the end marker. */
+		if (len == sizeof(int) && *tlw.msgs[i] == TRFS_LOG_COMPLETE) {
+    	            	printk("Exiting: Rx thread \n");
+			done = 1;
+			continue;
+		}
+		/* The record of an event is assembled here, a payload
+		 * left in the page cache goes to the tfile from there */
+		if (trfs_is_event(rec, len)) {
+			ev = (trfs_event *)rec;
+			mutex_lock(&tlw.ev_lock);
+			len = trfs_event_build(ev, tlw.ev_rec, tlw.ev_path,
+							tlw.ring != NULL);
+			mutex_unlock(&tlw.ev_lock);
+			rec = tlw.ev_rec;
+			trfs_stat_add(TRFS_ST_EVENTS_OUT, 1);
+			if (len == 0)
+				continue;
+			if (ev->nr_pages > 0 && !tlw.ring) {
+				trfs_page_append_data(rec, len, ev);
+				continue;
+			}
+		}
+		if (tlw.ring)
+			trfs_ring_put(tlw.ring, rec, len);
+		else
+			trfs_page_append(rec, len);
+	}
+	trfs_seg_rotate_check();
+	mutex_unlock(&tlw.page_lock);
+
+	/* Dropping the references of an event may release the dentry */
+	trfs_mq_rx_done(TRFS_LOG_QID);
+	for (i = 0; i < n; i++)
+		trfs_rec_free((char *)tlw.msgs[i], tlw.lens[i]);
+	trfs_stat_hist(TRFS_HI_BATCH_NS, ktime_get_ns()-start);
+	return done;
+}
+
+/** Applies what a remount left to the writer: the size of its batch and
+ * the depth of the queue. The queue is moved to its new array once the
+ * records it holds fit in it, the writer drains it until then.
+ */
+static void trfs_log_writer_conf(void)
+{
+	int n;
+	int **msgs = NULL;
+	int *lens = NULL;
+	trfsMqMsg_t *q_msg = READ_ONCE(tlw.q_msg);
+
+	if (tlw.batch != tlw.nr_msgs) {
+		msgs = (int **)kmalloc(tlw.batch*sizeof(int *), GFP_KERNEL);
+		lens = (int *)kmalloc(tlw.batch*sizeof(int), GFP_KERNEL);
+		if (msgs && lens) {
+			kfree(tlw.msgs);
+			kfree(tlw.lens);
+			tlw.msgs = msgs;
+			tlw.lens = lens;
+			tlw.nr_msgs = tlw.batch;
+		}
+		else {
+			kfree(msgs);
+			kfree(lens);
+			tlw.batch = tlw.nr_msgs;
+		}
+	}
+	if (!q_msg || !tlw.msgs)
+		return;
+	smp_rmb();
+
+	while (trfsMqResize(TRFS_LOG_QID, q_msg, tlw.q_depth) ==
+							TRFS_ERR_MQ_FULL) {
+		n = trfsMqRecvBatch(TRFS_LOG_QID, tlw.msgs, tlw.lens,
+							tlw.nr_msgs, 0);
+		if (n > 0)
+			trfs_log_write_batch(n);
+	}
+	WRITE_ONCE(tlw.q_msg, NULL);
+	wake_up_interruptible(&tlw.conf_wq);
+}
+
+/** Buffers of the writer, for the records it builds from events
+ */
+static int trfs_writer_alloc(void)
+{
+	tlw.ev_rec = (char *)vmalloc(TRFS_EV_REC_MAX+TRFS_WR_DATA_MAX);
+	/* A rename takes paths in it too */
+	mutex_lock(&tlw.ev_lock);
+	tlw.ev_path = (char *)kmalloc(PATH_MAX, GFP_KERNEL);
+	mutex_unlock(&tlw.ev_lock);
+	if (!tlw.ev_rec || !tlw.ev_path)
+		return -ENOMEM;
+	return 0;
+}
+
+static void trfs_writer_free(void)
+{
+	vfree(tlw.ev_rec);
+	mutex_lock(&tlw.ev_lock);
+	kfree(tlw.ev_path);
+	tlw.ev_path = NULL;
+	mutex_unlock(&tlw.ev_lock);
+	tlw.ev_rec = NULL;
+	kfree(tlw.msgs);
+	kfree(tlw.lens);
+	tlw.msgs = NULL;
+	tlw.lens = NULL;
+	tlw.nr_msgs = 0;
+}
+
 /** Async record writing thread
  * It contains the efficient queue handling
- * Blocks until there is a message in the queue
- * Takes only a pointer of the message
+ * Blocks until there is a batch of messages in the queue
+ * Takes only the pointers of the messages
  */
 int trfs_log_write_func(void *p)
 {
 	int err = 0;
-    	int *msg1 = NULL, *msg2 = NULL, len=1;
-	char *buf = NULL;
-	
-	tlw.page = (char *)kmalloc(TRFS_PAGE_SIZE, GFP_KERNEL);
-	buf = tlw.page;
-	tlw.page_size = 0;
+	int n = 0;
+	int done = 0;
+	int timeout = -1;
+
+	err = trfs_writer_alloc();
+	if (err < 0)
+		goto out;
 	
-    	while(1)
+    	while(!done)
     	{
-    	    	msg1 = kmalloc(sizeof(int), GFP_KERNEL);
-	    	msg2 = msg1;
-    	    	if(trfsMqRecv(TRFS_LOG_QID, &msg1, &len, 0, -1) < 0 )
-    	    	{
+		if (tlw.batch != tlw.nr_msgs || READ_ONCE(tlw.q_msg))
+			trfs_log_writer_conf();
+		if (!tlw.msgs) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		/* Wake up periodically to check for time based rotation */
+		timeout = tlw.seg_time ? TRFS_SEG_POLL_MS : -1;
+		n = trfsMqRecvBatch(TRFS_LOG_QID, tlw.msgs, tlw.lens,
+						tlw.nr_msgs, timeout);
+		if ((n == TRFS_FLUSH_TIMEOUT) || (n == TRFS_MQ_KICKED)) {
+			mutex_lock(&tlw.page_lock);
+			trfs_seg_rotate_check();
+			mutex_unlock(&tlw.page_lock);
+			continue;
+		}
+    	    	if (n < 0) {
     	    	   	printk("before uuMqRecv failure\n");
 	    	    	err = -EINVAL;
 	    	    	goto out;
     	    	}
-    	 	else {
-			/* End of the file system tracing */
-			if(*msg1 == TRFS_LOG_COMPLETE) {
-    	            		printk("Exiting: Rx thread \n");
-    	            		break; 
-    	        	}
-    	        	else
-    	        	{
-				if (tlw.page_size+len>TRFS_PAGE_SIZE) {
-    	        	    		trfs_file_write(tlw.tfile,
-					    (char *)tlw.page, tlw.page_size);
-					buf = tlw.page;
-					tlw.page_size = 0;
-				}
-				memcpy(buf, (char *)msg1, len);
-				buf += len;
-			        tlw.page_size += len;
-    	        	    	if (msg1) {
-    	        	    	   kfree(msg1);
-			    	   msg1 = NULL;
-    	        	    	}
-    	        	    	if (msg2) {
-    	        	    	   kfree(msg2);
-			    	   msg2 = NULL;
-    	        	    	}
-    	        	} 
-    	    	}
+		done = trfs_log_write_batch(n);
     	}
 out:
-	if (tlw.page) {
-		kfree(tlw.page);
-		tlw.page = NULL;
+	trfs_writer_free();
+	return err;
+}
+
+/** Moves the records of a ring nobody puts records in any more to the
+ * open segment, or to the ring to if there is one. rec is a buffer for
+ * the largest record.
+ * Caller holds page_lock.
+ */
+static void trfs_ring_move(trfs_ring *from, trfs_ring *to, char *rec)
+{
+	uint64_t off;
+	unsigned short r_size = 0;
+
+	for (off = from->head; off < from->tail; off += r_size) {
+		trfs_ring_read(from, (char *)&r_size,
+				off+sizeof(unsigned int), sizeof(unsigned short));
+		if (r_size == 0)
+			break;
+		trfs_ring_read(from, rec, off, r_size);
+		if (to)
+			trfs_ring_put(to, rec, r_size);
+		else
+			trfs_page_append(rec, r_size);
 	}
-    	if (msg1) {
-    	   	kfree(msg1);
-		msg1 = NULL;
-    	}
-    	if (msg2) {
-    	   	kfree(msg2);
-		msg2 = NULL;
-    	}
+}
+
+/** Switches tracing to the configuration in t, for the parts named in
+ * what (TRFS_CONF_*). Whatever can fail is allocated or opened before
+ * anything is switched, so a failed remount leaves tracing as it was.
+ * Producers go on queueing meanwhile: the records queued before the
+ * switch are written to the new tfile, and records in the ring go to
+ * the tfile when the flight recorder is turned off.
+ */
+int trfs_log_write_reconf(trfs_log_write *t, unsigned int what)
+{
+	int err = 0;
+	int to_ring;
+	char *name = NULL;
+	char *page = NULL;
+	char *rec = NULL;
+	struct file *filp = NULL;
+	trfs_ring *ring = NULL, *old_ring = NULL;
+	trfsMqMsg_t *q_msg = NULL;
+	trfsMqAttr_t attr;
+
+	to_ring = (what & TRFS_CONF_RING) ? t->ring_size != 0 :
+							tlw.ring != NULL;
+	name = (what & TRFS_CONF_TFILE) ? t->tfile_name : tlw.tfile_name;
+
+	/* A new ring, or a new tfile unless the ring is kept */
+	if ((what & TRFS_CONF_RING) && to_ring) {
+		ring = trfs_ring_alloc(t->ring_size);
+		if (!ring) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+	if (!to_ring && ((what & TRFS_CONF_TFILE) || tlw.ring)) {
+		if (!name) {
+			printk("Output file is null \n");
+			err = -ENOENT;
+			goto out;
+		}
+		filp = filp_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0777);
+		err = trfs_file_verify(filp, TRFS_WRITE_PERM);
+		if (err < 0) {
+			filp = NULL;
+			goto out;
+		}
+	}
+	if (tlw.ring && (what & TRFS_CONF_RING)) {
+		rec = vmalloc(USHRT_MAX);
+		if (!rec) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+	if (what & TRFS_CONF_BUF) {
+		page = vmalloc(t->page_cap);
+		if (!page) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+	if (what & TRFS_CONF_DEPTH) {
+		q_msg = trfsMqMsgAlloc(t->q_depth);
+		if (!q_msg) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	mutex_lock(&tlw.page_lock);
+	if (filp || ring)
+		trfs_seg_close();
+	if (page) {
+		trfs_page_flush();
+		vfree(tlw.page);
+		tlw.page = page;
+		tlw.page_cap = t->page_cap;
+		page = NULL;
+	}
+	if (what & TRFS_CONF_SEG) {
+		tlw.seg_size = t->seg_size;
+		tlw.seg_time = t->seg_time;
+	}
+	if (name != tlw.tfile_name) {
+		kfree(tlw.tfile_name);
+		tlw.tfile_name = name;
+	}
+	if (filp) {
+		tlw.seg_no = 0;
+		trfs_seg_start(filp);
+	}
+	if (what & TRFS_CONF_RING) {
+		/* Producers still in the old ring are waited for */
+		old_ring = tlw.ring;
+		WRITE_ONCE(tlw.ring, ring);
+		if (old_ring) {
+			synchronize_rcu();
+			trfs_ring_move(old_ring, ring, rec);
+		}
+	}
+	mutex_unlock(&tlw.page_lock);
+
+	if (what & TRFS_CONF_FLUSH) {
+		trfsMqGetAttr(TRFS_LOG_QID, &attr);
+		attr.flushMs = t->flush_ms;
+		trfsMqSetAttr(TRFS_LOG_QID, &attr);
+		tlw.flush_ms = t->flush_ms;
+	}
+	if (what & TRFS_CONF_BATCH)
+		tlw.batch = t->batch;
+	if (what & TRFS_CONF_WAIT)
+		WRITE_ONCE(tlw.send_ms, t->send_ms);
+
+	/* The writer resizes the queue between two batches */
+	if (q_msg) {
+		tlw.q_depth = t->q_depth;
+		smp_wmb();
+		WRITE_ONCE(tlw.q_msg, q_msg);
+		q_msg = NULL;
+	}
+	trfs_mq_kick(TRFS_LOG_QID);
+	if (what & TRFS_CONF_DEPTH)
+		wait_event_interruptible(tlw.conf_wq,
+					READ_ONCE(tlw.q_msg) == NULL);
+	ring = NULL;
+out:
+	if (filp && err < 0)
+		filp_close(filp, NULL);
+	trfs_ring_free(ring);
+	trfs_ring_free(old_ring);
+	vfree(page);
+	vfree(rec);
+	vfree(q_msg);
 	return err;
 }
 
@@ -242,35 +1247,314 @@ out:
  */
 void trfs_log_write_close(void)
 {
-	trfs_file_close(tlw.tfile);
+	mutex_lock(&tlw.page_lock);
+	trfs_seg_close();
+	if (tlw.idx) {
+		kfree(tlw.idx);
+		tlw.idx = NULL;
+	}
+	if (tlw.page) {
+		vfree(tlw.page);
+		tlw.page = NULL;
+	}
+	if (tlw.ring) {
+		trfs_ring_free(tlw.ring);
+		tlw.ring = NULL;
+	}
+	mutex_unlock(&tlw.page_lock);
 	if (tlw.tfile_name) {
 		kfree(tlw.tfile_name);
 		tlw.tfile_name = NULL;
 	}
 }
 
+/** Gives thread the CPUs of s and SCHED_FIFO at s->rt_prio, or
+ * SCHED_NORMAL at s->nice
+ */
+int trfs_sched_apply(struct task_struct *thread, trfs_sched *s)
+{
+	int err = 0;
+	struct sched_param param = { .sched_priority = s->rt_prio };
+
+	if (!cpumask_empty(&s->cpus)) {
+		err = set_cpus_allowed_ptr(thread, &s->cpus);
+		if (err < 0) {
+			printk("trfs: %d setting the CPUs of %s\n", err,
+								thread->comm);
+			goto out;
+		}
+	}
+	err = sched_setscheduler_nocheck(thread,
+			s->rt_prio ? SCHED_FIFO : SCHED_NORMAL, &param);
+	if (err < 0) {
+		printk("trfs: %d setting the policy of %s\n", err,
+								thread->comm);
+		goto out;
+	}
+	if (!s->rt_prio)
+		set_user_nice(thread, s->nice);
+out:
+	return err;
+}
+
 /* kthread is initialized in this function
- * Async callback is started
+ * Async callback is started where s puts it
  */
-int trfs_kthread_create(struct task_struct *thread,
-				 char *thread_name, thread_cb_func cb_func)
+struct task_struct *trfs_kthread_create(char *thread_name,
+				thread_cb_func cb_func, trfs_sched *s)
 {
-	thread = kthread_create( cb_func, NULL, thread_name );
-	if (thread) {
-        	wake_up_process( thread );
-    	}
-    	return 0;
+	int err;
+	struct task_struct *thread;
+
+	thread = kthread_create(cb_func, NULL, "%s", thread_name);
+	if (IS_ERR(thread))
+		return thread;
+	err = trfs_sched_apply(thread, s);
+	if (err < 0) {
+		kthread_stop(thread);
+		return ERR_PTR(err);
+	}
+	wake_up_process(thread);
+	return thread;
+}
+
+/** Frees what is left in the queue once the writer is told to exit: the
+ * events hold dentries of the mount, which must be gone before its
+ * dcache is shrunk. Only a batch the writer is stuck on is left to it.
+ */
+static void trfs_log_release(void)
+{
+	int *msg = NULL;
+	int len = 0;
+
+	while (trfs_mq_take(TRFS_LOG_QID, &msg, &len) == 0)
+		trfs_rec_free((char *)msg, len);
+}
+
+/** Queues the marker the writer stops at. The send waits a while at a
+ * time for the writer to make room, and goes on waiting only as long as
+ * the queue drains. A writer that is gone or stuck gets the queue closed
+ * instead, so that it returns if it is still there and nothing waits on
+ * it, and what it left in the queue is freed. Returns 1 when the marker
+ * is queued, 0 otherwise.
+ */
+static int trfs_log_write_end(void)
+{
+	int ret = -ENOMEM;
+	int *p;
+	trfsMqAttr_t attr;
+	int left = INT_MAX;
+
+	memset(&attr, 0, sizeof(trfsMqAttr_t));
+	p = (int *)kmalloc(sizeof(int), GFP_KERNEL);
+	while (p) {
+		*p = TRFS_LOG_COMPLETE;
+		/* Past the ring, which the writer doesn't read */
+		trfs_mq_kick(TRFS_LOG_QID);
+		ret = trfsMqSend(TRFS_LOG_QID, (unsigned char *)p,
+				sizeof(int), TRFS_MQ_PRI_NS, TRFS_MQ_SEND_MS);
+		if (ret != TRFS_ERR_MQ_FULL)
+			break;
+		if (trfsMqGetAttr(TRFS_LOG_QID, &attr) < 0 ||
+						attr.counter >= left)
+			break;
+		left = attr.counter;
+	}
+	if (ret < 0) {
+		if (p)
+			pr_err("trfs: writer not draining, %d records left "
+					"untraced\n", attr.counter);
+		kfree(p);
+		trfs_set_exit_flag(TRFS_LOG_QID);
+		trfs_log_release();
+		return 0;
+	}
+	/* Don't leave the marker waiting for the watermark */
+	trfs_mq_kick(TRFS_LOG_QID);
+	return 1;
 }
 
 /** kthread exit handling while unmouting
  */
 int trfs_kthread_exit(struct task_struct *thread)
 {
-	char exit_msg = 0;
-	char *p;
-	
-	p = &exit_msg;
-
-        TRFS_WRITE(p, sizeof(char *));
+	trfs_log_write_end();
    	return kthread_stop(thread);
 }
+
+/** Queues the work of the writer in delay jiffies, on the first online
+ * CPU of its set if it has one. A run already queued for earlier stays,
+ * one for later is brought forward when delay is 0.
+ */
+static void trfs_wq_queue(unsigned long delay)
+{
+	int cpu = WORK_CPU_UNBOUND;
+
+	spin_lock(&tlw.wq_lock);
+	if (!tlw.wq || tlw.wq_stop)
+		goto out;
+	if (!cpumask_empty(&tlw.sched.cpus)) {
+		cpu = cpumask_first_and(&tlw.sched.cpus, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = WORK_CPU_UNBOUND;
+	}
+	if (delay == 0)
+		mod_delayed_work_on(cpu, tlw.wq, &tlw.work, 0);
+	else
+		queue_delayed_work_on(cpu, tlw.wq, &tlw.work, delay);
+out:
+	spin_unlock(&tlw.wq_lock);
+}
+
+/** Called by the queue when a record should be written in ms: at once
+ * when the watermark is reached or the writer is kicked, else after the
+ * flush time of the first record
+ */
+static void trfs_wq_notify(int ms)
+{
+	trfs_wq_queue(msecs_to_jiffies(ms));
+}
+
+/** A run of the workqueue writer: it writes the batches queued, up to
+ * TRFS_WQ_BATCHES of them so that it gives its worker back now and then,
+ * and returns. The queue queues it again when records come.
+ */
+static void trfs_log_write_work(struct work_struct *work)
+{
+	int i, n;
+
+	for (i = 0; i < TRFS_WQ_BATCHES; i++) {
+		if (tlw.batch != tlw.nr_msgs || READ_ONCE(tlw.q_msg))
+			trfs_log_writer_conf();
+		if (!tlw.msgs)
+			return;
+		n = trfsMqRecvBatch(TRFS_LOG_QID, tlw.msgs, tlw.lens,
+							tlw.nr_msgs, 0);
+		if (n < 0) {
+			mutex_lock(&tlw.page_lock);
+			trfs_seg_rotate_check();
+			mutex_unlock(&tlw.page_lock);
+			break;
+		}
+		if (trfs_log_write_batch(n)) {
+			WRITE_ONCE(tlw.wq_done, 1);
+			return;
+		}
+	}
+	if (i == TRFS_WQ_BATCHES)
+		trfs_wq_queue(0);
+	else if (tlw.seg_time)
+		trfs_wq_queue(msecs_to_jiffies(TRFS_SEG_POLL_MS));
+}
+
+/** The workqueue of the writer for s: bound to the CPUs when s has some
+ * (the work is queued on the first one), unbound otherwise, and of the
+ * high priority pool for a negative nice or a SCHED_FIFO priority, the
+ * closest a work item gets to them
+ */
+static struct workqueue_struct *trfs_wq_alloc(trfs_sched *s)
+{
+	unsigned int flags = 0;
+
+	if (cpumask_empty(&s->cpus))
+		flags |= WQ_UNBOUND | WQ_SYSFS;
+	if (s->rt_prio || s->nice < 0)
+		flags |= WQ_HIGHPRI;
+	return alloc_workqueue("trfs_log", flags, 1);
+}
+
+/** With s->use_wq the queue is drained by work items, see
+ * trfs_log_write_work()
+ */
+int trfs_writer_start(trfs_sched *s)
+{
+	int err = 0;
+
+	tlw.sched = *s;
+	if (!s->use_wq) {
+		tlw.writer = trfs_kthread_create("TRFS_LOG_THREAD",
+						&trfs_log_write_func, s);
+		if (IS_ERR(tlw.writer)) {
+			err = PTR_ERR(tlw.writer);
+			tlw.writer = NULL;
+		}
+		goto out;
+	}
+
+	err = trfs_writer_alloc();
+	if (err < 0)
+		goto out;
+	tlw.wq = trfs_wq_alloc(s);
+	if (!tlw.wq) {
+		err = -ENOMEM;
+		goto out;
+	}
+	spin_lock_init(&tlw.wq_lock);
+	tlw.wq_stop = 0;
+	tlw.wq_done = 0;
+	INIT_DELAYED_WORK(&tlw.work, trfs_log_write_work);
+	trfs_mq_set_notify(TRFS_LOG_QID, trfs_wq_notify);
+	trfs_wq_queue(0);
+out:
+	if (err < 0 && s->use_wq)
+		trfs_writer_free();
+	return err;
+}
+
+/** A kthread writer is moved, the work of a workqueue writer goes to a
+ * new workqueue once the running one is done
+ */
+int trfs_writer_resched(trfs_sched *s)
+{
+	int err;
+	struct workqueue_struct *wq = NULL;
+
+	if (tlw.wq) {
+		wq = trfs_wq_alloc(s);
+		if (!wq)
+			return -ENOMEM;
+		spin_lock(&tlw.wq_lock);
+		tlw.wq_stop = 1;
+		spin_unlock(&tlw.wq_lock);
+		cancel_delayed_work_sync(&tlw.work);
+		spin_lock(&tlw.wq_lock);
+		swap(wq, tlw.wq);
+		tlw.sched = *s;
+		tlw.wq_stop = 0;
+		spin_unlock(&tlw.wq_lock);
+		destroy_workqueue(wq);
+		trfs_wq_queue(0);
+		return 0;
+	}
+	if (!tlw.writer)
+		return -EINVAL;
+	err = trfs_sched_apply(tlw.writer, s);
+	if (err == 0)
+		tlw.sched = *s;
+	return err;
+}
+
+void trfs_writer_stop(void)
+{
+	if (tlw.writer) {
+		trfs_kthread_exit(tlw.writer);
+		tlw.writer = NULL;
+	}
+	if (tlw.wq) {
+		/* Runs until one takes the end marker, if it got queued */
+		if (trfs_log_write_end()) {
+			do {
+				trfs_wq_queue(0);
+				flush_delayed_work(&tlw.work);
+			} while (!READ_ONCE(tlw.wq_done) && tlw.msgs);
+		}
+		trfs_mq_set_notify(TRFS_LOG_QID, NULL);
+		spin_lock(&tlw.wq_lock);
+		tlw.wq_stop = 1;
+		spin_unlock(&tlw.wq_lock);
+		cancel_delayed_work_sync(&tlw.work);
+		destroy_workqueue(tlw.wq);
+		tlw.wq = NULL;
+		trfs_writer_free();
+	}
+}
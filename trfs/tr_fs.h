@@ -15,42 +15,168 @@
 
 #include <linux/kthread.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/uio.h>
 
+#include "structs.h"
+#include "trfs_msgq.h"
+
+/* Size of the writer buffer unless tbuf_size= says otherwise */
 #define TRFS_PAGE_SIZE 4096
+#define TRFS_MAX_BUF_SIZE	(64 << 20)
+#define TRFS_MAX_FLUSH_MS	10000
+
+/* Poll interval of the writer while it waits for a time based rotation */
+#define TRFS_SEG_POLL_MS	1000
+
+/* Records the writer takes from the queue at a time, unless tbatch=
+ * says otherwise */
+#define TRFS_LOG_BATCH		64
+
+/* Batches a work item of the twq writer writes before it queues itself
+ * again and gives its worker back */
+#define TRFS_WQ_BATCHES		16
 
-#define TRFS_WRITE(buf, size) \
-	if (trfsMqSend(TRFS_LOG_QID, (char *)buf, size, 0, -1) < 0) { \
-        	printk("Pushing the record into queue: Failed \n"); \
-        	if (buf) \
-                	kfree(buf); \
-        }
+/* Segments the writer gathers into one write to the tfile */
+#define TRFS_LOG_SG		64
+
+#define TRFS_WRITE(buf, size)	trfs_log_put((char *)buf, size)
+
+/* Parts of the configuration a remount changes */
+#define TRFS_CONF_TFILE		0x01	/* tfile */
+#define TRFS_CONF_SEG		0x02	/* seg_size and seg_time */
+#define TRFS_CONF_RING		0x04	/* ring_size, 0 back to the tfile */
+#define TRFS_CONF_DEPTH		0x08	/* q_depth */
+#define TRFS_CONF_BUF		0x10	/* page_cap */
+#define TRFS_CONF_BATCH		0x20	/* batch */
+#define TRFS_CONF_FLUSH		0x40	/* flush_ms */
+#define TRFS_CONF_WAIT		0x80	/* send_ms */
+
+/** Where and how the writer and helper threads run (tcpus=, tnice=,
+ * tprio= and twq)
+ */
+typedef struct trfs_sched_ {
+	struct cpumask cpus;		/* empty: where the scheduler wants */
+	int nice;			/* of SCHED_NORMAL */
+	int rt_prio;			/* SCHED_FIFO priority, 0 for normal */
+	int use_wq;			/* drain from work items */
+}trfs_sched;
+
+/** A segment of the next write to the tfile: bytes of the buffer, or the
+ * payload of a write record in a page of the lower page cache that the
+ * writer holds a reference to
+ */
+typedef struct trfs_sg_ {
+	struct page *page;		/* NULL for the buffer */
+	unsigned int off;		/* in the page or in the buffer */
+	unsigned int len;
+	struct trfs_wr_gen_ *wr_gen;	/* first page of a payload: its file, */
+	unsigned int wr_begun;		/* the writes begun on it by then */
+	int rec_off;			/* and its record in the buffer, or -1 */
+}trfs_sg;
 
 typedef enum trfs_rw_perm_ {
         TRFS_READ_PERM        = 0,
         TRFS_WRITE_PERM       = 1
 }trfs_rw_perm;
 
+/** Flight recorder: the latest records in a preallocated ring, the oldest
+ * ones are overwritten. Offsets grow forever, the ring position is the
+ * offset modulo the size.
+ */
+typedef struct trfs_ring_ {
+	char *buf;
+	size_t size;
+	uint64_t head;			/* offset of the oldest record */
+	uint64_t tail;			/* offset after the newest record */
+	uint64_t nr_lost;		/* records overwritten */
+	spinlock_t lock;
+	char *ev_rec;			/* record built from an event, */
+	char *ev_path;			/* its paths, under lock */
+}trfs_ring;
+
 typedef struct trfs_log_write_ {
 	char *tfile_name;
 	struct file *tfile;
 	char *page;
-	int page_size;
+	int page_size;			/* bytes in the page */
+	int page_cap;			/* size of the page */
+	trfs_sg sg[TRFS_LOG_SG];	/* the page cut by payloads */
+	struct iovec iov[TRFS_LOG_SG];
+	int nr_sg;
+	int sg_cut;			/* bytes of the page in sg */
+	int sg_size;			/* bytes of payload in sg */
+	int batch;			/* records per dequeue */
+	int q_depth;			/* records the queue holds */
+	int flush_ms;			/* longest a record waits in it */
+	int send_ms;			/* a file or namespace record waits
+					 * for room, 0 for never */
+	int **msgs;			/* batch of the writer */
+	int *lens;
+	int nr_msgs;			/* size of the batch arrays */
+	char *ev_rec;			/* record built from an event */
+	char *ev_path;			/* and the paths it takes */
+	trfsMqMsg_t *q_msg;		/* queue array the writer moves to */
+	wait_queue_head_t conf_wq;	/* a remount waits there for it */
 	int fthread_exit;
 	struct mutex q_lock;
-	struct mutex id_lock;
 	struct mutex page_lock;
+	struct mutex ev_lock;		/* paths of the events and ev_path */
+	unsigned int seg_no;		/* number of the open segment */
+	int seg_err;			/* it failed to open, was reported */
+	loff_t seg_size;		/* rotate after these many bytes */
+	unsigned int seg_time;		/* rotate after these many seconds */
+	unsigned long seg_start;	/* jiffies when the segment was opened */
+	atomic_t rotate_req;		/* rotation requested through ioctl */
+	trfs_seg_ftr seg_ftr;		/* running footer of the open segment */
+	trfs_idx_rec *idx;		/* index entries not yet written */
+	loff_t idx_prev;		/* offset of the last index record */
+	size_t ring_size;		/* flight recorder instead of tfile */
+	trfs_ring *ring;
+	trfs_sched sched;		/* placement of the writer */
+	struct task_struct *writer;	/* the writer kthread, or */
+	struct workqueue_struct *wq;	/* the workqueue of its work items */
+	struct delayed_work work;	/* drains the queue and returns */
+	spinlock_t wq_lock;		/* wq and wq_stop against queueing */
+	int wq_stop;			/* no more work is queued */
+	int wq_done;			/* the work took the end marker */
 }trfs_log_write;
 
 int trfs_log_write_init(trfs_log_write *t);
 
+/** Switches tracing to the parts of t named in what (TRFS_CONF_*) while
+ * it goes on, as asked for by a remount.
+ */
+int trfs_log_write_reconf(trfs_log_write *t, unsigned int what);
+
 typedef int (*thread_cb_func) (void *);
 
 void trfs_log_write_close(void);
 
 unsigned int get_next_record_id(void);
 
-int trfs_kthread_create(struct task_struct *thread,
-				 char *thread_name, thread_cb_func cb_func);
+/** Starts a kthread placed and scheduled as s says, or an ERR_PTR.
+ */
+struct task_struct *trfs_kthread_create(char *thread_name,
+				thread_cb_func cb_func, trfs_sched *s);
+
+/** Gives thread the CPUs and the scheduling class of s.
+ */
+int trfs_sched_apply(struct task_struct *thread, trfs_sched *s);
+
+/** Starts the writer as s says, as a kthread or as a work item.
+ */
+int trfs_writer_start(trfs_sched *s);
+
+/** Moves the running writer to the placement of s.
+ */
+int trfs_writer_resched(trfs_sched *s);
+
+/** Writes out what is queued and stops the writer.
+ */
+void trfs_writer_stop(void);
 
 int trfs_kthread_exit(struct task_struct *thread);
 
@@ -62,6 +188,29 @@ void trfs_log_write_flush_periodic(void);
 
 void trfs_log_write_flush(void);
 
+/** Hands a record over to the writer, or to the ring in flight recorder
+ * mode. The record is freed once written.
+ */
+void trfs_log_put(char *rec, int len);
+
+/** Tells a hook to drop a data record of type r_type before building it:
+ * the queue has no room for the class, the drop is counted.
+ */
+bool trfs_log_shed(int r_type);
+
+/** Gives the events not yet built that have a path through the
+ * directory dir the path they have now, before a rename moves dir.
+ */
+void trfs_log_rename_dir(struct dentry *dir);
+
+/** Writes the records in the ring as a tfile to filp.
+ */
+int trfs_ring_dump(struct file *filp);
+
+/** Asks the writer to close the current segment and start a new one.
+ */
+void trfs_log_rotate_request(void);
+
 void trfs_logthread_exit(void);
 
 void trfs_fthread_exit(void);
@@ -55,6 +55,7 @@ extern int trfs_init_dentry_cache(void);
 extern void trfs_destroy_dentry_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
+extern int trfs_remount_options(char *options);
 extern struct dentry *trfs_lookup(struct inode *dir, struct dentry *dentry,
 				    unsigned int flags);
 extern struct inode *trfs_iget(struct super_block *sb,
@@ -3,10 +3,13 @@
 #include <linux/fs.h> 
 #include <linux/semaphore.h>
 #include <linux/cdev.h> 
+#include <linux/file.h>
 #include <linux/version.h>
 #include "trfs.h"
 #include "trfs_ioct.h"
 #include "trfs_ops.h"
+#include "tr_fs.h"
+#include "trfs_msgq.h"
 
 /* Contains the major number of the character device. */
 static int Major;
@@ -22,6 +25,64 @@ int trfs_ioctl_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+/** Copies the level and the triggers from the user and sets them
+ */
+static int trfs_ioctl_set_level(unsigned long arg)
+{
+	int ret = 0;
+	trctl_level_args *largs = NULL;
+	trfs_trigger *trig = NULL;
+
+	largs = kmalloc(sizeof(trctl_level_args), GFP_KERNEL);
+	trig = kzalloc(sizeof(trfs_trigger), GFP_KERNEL);
+	if (!largs || !trig) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(largs, (void *)arg, sizeof(trctl_level_args))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	trig->err = largs->err;
+	trig->lat_ns = largs->lat_ns;
+	trig->window = largs->window;
+	memcpy(trig->prefix, largs->prefix, TRFS_TRIG_PREFIX_LEN);
+	ret = trfs_trigger_set(tld, largs->level, largs->sample, trig);
+out:
+	kfree(largs);
+	kfree(trig);
+	return ret;
+}
+
+/** Copies the op counters of the driver to the user
+ */
+static int trfs_ioctl_get_stats(unsigned long arg)
+{
+	int i;
+	int ret = 0;
+	unsigned long until;
+	trctl_stats *st = NULL;
+
+	st = kzalloc(sizeof(trctl_stats), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	for (i = 0; i < TRCTL_MAX_OPS && i < TRFS_MAX_OPS; i++) {
+		st->nr_ops[i] = atomic64_read(&tld->nr_ops[i]);
+		st->nr_err[i] = atomic64_read(&tld->nr_err[i]);
+	}
+	st->nr_traced = atomic64_read(&tld->nr_traced);
+	st->nr_fired = atomic64_read(&tld->nr_fired);
+	for (i = 0; i < TRCTL_NR_PRI; i++)
+		st->nr_dropped[i] = trfs_mq_dropped(TRFS_LOG_QID, i);
+	st->level = tld->level;
+	until = READ_ONCE(tld->full_until);
+	st->full = until && time_before(jiffies, until);
+	if (copy_to_user((void *)arg, st, sizeof(trctl_stats)))
+		ret = -EFAULT;
+	kfree(st);
+	return ret;
+}
+
 /** Gives ioctl support for bitmap set/get operations in the kernel
  * param[in] filp File pointer to the opened character device file
  * param[in] cmd Ioctl command to chooose which operation
@@ -32,6 +93,7 @@ long trfs_ioctl_bitmap_op(struct file *filp,
 {
 	int ret = 0;
 	int err = 0;
+	struct file *dump = NULL;
 	trctl_args *args = (trctl_args *)kmalloc(sizeof(trctl_args),GFP_KERNEL);
 	printk("ioctl called \n");
 	switch(cmd) {
@@ -47,6 +109,30 @@ long trfs_ioctl_bitmap_op(struct file *filp,
 			if (tld)
 				ret = tld->bitmap;
 			break;
+		case IOCTL_TRFS_ROTATE:
+			trfs_log_rotate_request();
+			printk("Trace segment rotation requested\n");
+			break;
+		case IOCTL_TRFS_DUMP:
+			/* arg is the fd of the file to dump the ring to */
+			dump = fget(arg);
+			if (!dump) {
+				ret = -EBADF;
+				break;
+			}
+			ret = trfs_ring_dump(dump);
+			fput(dump);
+			break;
+		case IOCTL_TRFS_SET_LEVEL:
+			ret = trfs_ioctl_set_level(arg);
+			break;
+		case IOCTL_TRFS_FIRE:
+			trfs_trigger_fire(tld);
+			printk("Full tracing triggered\n");
+			break;
+		case IOCTL_TRFS_GET_STATS:
+			ret = trfs_ioctl_get_stats(arg);
+			break;
 	} 
 	kfree(args);
  	return ret;
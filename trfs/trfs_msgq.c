@@ -3,24 +3,18 @@
 #include <linux/kernel.h>
 #include <linux/netdevice.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
 #include "trfs_msgq.h"
 #include "tr_fs.h"
-
-/** Max number of packets to be queued.
- *  */
-#define TRFS_MAX_TX_Q_MSGS         1024
+#include "trfs_ops.h"
 
 /** Max size of packet data.
  *  */
 #define TRFS_MAX_TX_Q_MSG_SIZE     100 
 
-/** Maximum tx queue nodes.
- *  */
-#define TRFS_TX_Q_MAX_NODES 10
-
 /** Message Queue List.
  *  */
-static trfs_mq_info_t  trfs_msg_queues_g_g[TRFS_MQ_MAX_NO_OF_Q];
+static trfs_mq_info_t  *trfs_mq_info_gp;
 static int   numAfdxQs ;
 
 extern trfs_log_write tlw;
@@ -39,40 +33,61 @@ static int  trfsMqGetMsg(trfs_mq_info_t *node, int **msg_p,
 
 trfsMqAttr_t tx_q_attr;
 
-/** Queue id to access the Tx queue.
+/** Queue id to access the log queue.
  *  */
-trfsQid_t    tx_q_id[TRFS_TX_Q_MAX_NODES];
+trfsQid_t    trfs_log_qid;
 
 /**
  * this function create queue to keep packets
+ * @param[in] depth Records the queue holds
+ * @param[in] flush_ms Longest a record waits for the watermark
  * @param[out] 0(0) : if q created successfully
  *             -1(-1): otherwise
  */
-int trfs_create_log_q(void)
+int trfs_create_log_q(int depth, int flush_ms)
 {
-	int i;
-
-	tx_q_attr.maxMsgs = TRFS_MAX_TX_Q_MSGS;
+	tx_q_attr.maxMsgs = depth;
 	tx_q_attr.msgSize = TRFS_MAX_TX_Q_MSG_SIZE;
 	strcpy(tx_q_attr.name,"TRFS LOG Q");
-	tx_q_attr.flags = TRFS_MQ_FIFO;
+	tx_q_attr.flags = TRFS_MQ_PRIORITY;
+	/* Well below the lowest class limit, so that the writer is woken
+	 * before any class is refused */
+	tx_q_attr.wmark = max(depth/8, 1);
+	tx_q_attr.flushMs = flush_ms;
 
-	for (i=0; i<TRFS_TX_Q_MAX_NODES; i++)
+	if (trfsMqOpen(&tx_q_attr, &trfs_log_qid) != 0)
 	{
-		if (trfsMqOpen(&tx_q_attr, &tx_q_id[i]) != 0)
-		{
-			printk("TRFS: Q create failed \n");
-			return -1;
-		}
+		printk("TRFS: Q create failed \n");
+		return -1;
 	}
 	return 0;
 }
 
+/** Sets the limits of the priority classes: data records are taken
+ * while the queue is less than half full, file records up to three
+ * quarters and namespace records as long as there is a free slot. The
+ * counters and the drops are left as they are. A FIFO queue has one
+ * class with all of it.
+ */
+static void trfs_mq_classes_init(trfs_mq_info_t *node)
+{
+	int max = node->attr.maxMsgs;
+
+	if (!(node->attr.flags & TRFS_MQ_PRIORITY) || max < TRFS_MQ_NR_PRI) {
+		node->nr_cls = 1;
+		node->cls[0].limit = max;
+		return;
+	}
+	node->nr_cls = TRFS_MQ_NR_PRI;
+	node->cls[TRFS_MQ_PRI_DATA].limit = max/2;
+	node->cls[TRFS_MQ_PRI_FILE].limit = max - max/4;
+	node->cls[TRFS_MQ_PRI_NS].limit = max;
+}
+
 /** Opens the Message Queue with given Attributes.
  */
 int trfsMqOpen(trfsMqAttr_t *mq, trfsQid_t *mqId)
 {
-	int jj;
 	trfs_mq_info_t  *node;
 	static trfsQid_t mqIdSeq = 1;
 	
@@ -84,13 +99,18 @@ int trfsMqOpen(trfsMqAttr_t *mq, trfsQid_t *mqId)
 	    			(mq->flags & TRFS_MQ_PRIORITY)) {
 	   return TRFS_ERR_INVALID_PARAM;
 	}
-	if ((mq->maxMsgs <= 0) || (mq->msgSize <= 0)) {
+	if ((mq->maxMsgs <= 0) || (mq->msgSize <= 0) ||
+	    (mq->maxMsgs > TRFS_MQ_MAX_NO_OF_MSGS)) {
 	   return TRFS_ERR_INVALID_PARAM;
 	}
 	
 	if (mq->msgSize > TRFS_MQ_MAX_MSG_SIZE) {
 	   return TRFS_ERR_INVALID_PARAM;
 	}
+	if ((mq->wmark < 0) || (mq->wmark > mq->maxMsgs) ||
+	    (mq->flushMs < 0)) {
+	   return TRFS_ERR_INVALID_PARAM;
+	}
 	
 	/* If flags not given, Set default flags */
 	if (mq->flags == 0) {
@@ -100,31 +120,34 @@ int trfsMqOpen(trfsMqAttr_t *mq, trfsQid_t *mqId)
 	/* Initialize the output */
 	*mqId = -1;
 	
-	/* Creating Message Queue */
+	/* Creating Message Queue, only the messages asked for are
+	 * allocated */
 	if (numAfdxQs >= TRFS_MQ_MAX_NO_OF_Q) 
 	   	return TRFS_ERR_INVALID_PARAM ;
 	
-	node = &trfs_msg_queues_g_g[numAfdxQs];
+	node = (trfs_mq_info_t *)kzalloc(sizeof(trfs_mq_info_t), GFP_KERNEL);
 	if (node == NULL) {
-	   return -1;
+	   return -ENOMEM;
+	}
+	node->msg = (trfsMqMsg_t *)vmalloc(mq->maxMsgs*sizeof(trfsMqMsg_t));
+	if (node->msg == NULL) {
+	   kfree(node);
+	   return -ENOMEM;
 	}
 	
 	memcpy(&node->attr, mq, sizeof(trfsMqAttr_t));
 	node->attr.counter = 0;
 	node->mqId = mqIdSeq++;
-	node->next = NULL;
 	
 	/* initializing the Wait Queue */
 	init_waitqueue_head(&node->wq);
+	init_waitqueue_head(&node->swq);
 	
-	if (numAfdxQs > 0) {
-	   	trfs_msg_queues_g_g[numAfdxQs-1].next = node;
-	}
+	node->next = trfs_mq_info_gp;
+	trfs_mq_info_gp = node;
 	numAfdxQs++;
-	for(jj=0;jj<=node->attr.maxMsgs;jj++) {
-	   	node->msg[jj].pri = 0;
-	   	node->msg[jj].len = 0;
-	}
+	memset(node->msg, 0, mq->maxMsgs*sizeof(trfsMqMsg_t));
+	trfs_mq_classes_init(node);
 	*mqId = node->mqId;
 	return 0;   
 }
@@ -134,7 +157,6 @@ int trfsMqOpen(trfsMqAttr_t *mq, trfsQid_t *mqId)
  */
 int trfsMqClose(trfsQid_t mqId)
 {
-	#if 0
 	trfs_mq_info_t  *tmp, *prev_p, *rmnode_p = NULL;
 	
 	if (trfs_mq_info_gp == NULL)
@@ -157,6 +179,7 @@ int trfsMqClose(trfsQid_t mqId)
 	         /* Queue Found */
 	         rmnode_p = tmp;
 	         prev_p->next = tmp->next;
+	         break;
 	      }
 	      prev_p = tmp;
 	   }
@@ -165,16 +188,29 @@ int trfsMqClose(trfsQid_t mqId)
 	{
 	   return -1;
 	}
-	trfsMqFree(rmnode_p);
-	#endif
+	numAfdxQs--;
+	vfree(rmnode_p->msg);
+	kfree(rmnode_p);
 	return 0;
 }
 
+/* A message of the priority class would be taken
+ */
+static int trfs_mq_admits(trfs_mq_info_t *node, int priority)
+{
+	if (priority < 0)
+		priority = 0;
+	if (priority >= node->nr_cls)
+		priority = node->nr_cls-1;
+	return node->attr.counter < node->cls[priority].limit;
+}
+
 /* Puts the message in given Message Queue 
  */
 int trfsMqSend(trfsQid_t mqId, unsigned char *msg_p, size_t msgLen,
       				unsigned int msgPriority, const int timeOut)
 {
+	int ret;
 	trfs_mq_info_t  *tmp;
 	
 	/* Validation */
@@ -195,11 +231,29 @@ int trfsMqSend(trfsQid_t mqId, unsigned char *msg_p, size_t msgLen,
 	}
 	
 	mutex_lock(&tlw.q_lock);
-	
-	/* Put the MSG in Message Queue */
-	if (trfsMqPutMsg(tmp, msg_p, msgLen, msgPriority) == -1) {
+
+	/* A timeOut waits that long for the receiver to make room for the
+	 * class, or for the queue to be closed */
+	if (timeOut > 0 && !trfs_mq_admits(tmp, msgPriority)) {
+		unsigned long end = jiffies + msecs_to_jiffies(timeOut);
+
+		tmp->nr_waiting++;
+		while (!trfs_mq_admits(tmp, msgPriority) &&
+		       !tmp->attr.exit_flag && !time_after_eq(jiffies, end)) {
+			mutex_unlock(&tlw.q_lock);
+			wait_event_interruptible_timeout(tmp->swq,
+				(trfs_mq_admits(tmp, msgPriority) ||
+					tmp->attr.exit_flag), end - jiffies);
+			mutex_lock(&tlw.q_lock);
+		}
+		tmp->nr_waiting--;
+	}
+
+	/* Put the MSG in Message Queue, a full queue refuses it */
+	ret = trfsMqPutMsg(tmp, msg_p, msgLen, msgPriority);
+	if (ret < 0) {
 		mutex_unlock(&tlw.q_lock);
-	     	return -1; 
+	     	return ret; 
 	}
 	mutex_unlock(&tlw.q_lock);
 	
@@ -207,13 +261,19 @@ int trfsMqSend(trfsQid_t mqId, unsigned char *msg_p, size_t msgLen,
 }
 
 
+/* A batch is ready once the queue reaches its watermark
+ */
+static int trfs_mq_ready(trfs_mq_info_t *node)
+{
+	return node->attr.counter >= max(node->attr.wmark, 1);
+}
+
 /* Gets the message form given Message Queue 
  */
 int trfsMqRecv (trfsQid_t mqId, int **msg_p, int *msgLen,
       				unsigned int  msg_priority, const int timeOut)
 {
 	trfs_mq_info_t  *tmp;
-	int flush_flag = 0;
 	
 	/* Validation */
 	if ((msg_p == NULL) || (msgLen == NULL)) {
@@ -228,16 +288,14 @@ int trfsMqRecv (trfsQid_t mqId, int **msg_p, int *msgLen,
 	   	return -1;
 	}
 	if (timeOut > 0) {
-	   	int64_t wqret;
-
-		flush_flag = 1;
-	   	
-	   	wqret = wait_event_interruptible_timeout(tmp->wq, 
-			(tmp->attr.counter != 0), msecs_to_jiffies(timeOut));
+	   	wait_event_interruptible_timeout(tmp->wq, 
+			((tmp->attr.kick_flag == 1)||
+				(tmp->attr.counter != 0)), msecs_to_jiffies(timeOut));
 	}
 	else if (timeOut == -1) {
 	   	wait_event_interruptible(tmp->wq,
 			(((trfs_get_exit_flag(mqId))==1)||
+				(tmp->attr.kick_flag == 1)||
 						(tmp->attr.counter != 0)));
 	}
 	if (trfs_get_exit_flag(mqId) == 1) {
@@ -246,6 +304,10 @@ int trfsMqRecv (trfsQid_t mqId, int **msg_p, int *msgLen,
 	}
 	
 	if (tmp->attr.counter == 0) {
+		if (tmp->attr.kick_flag == 1) {
+			tmp->attr.kick_flag = 0;
+			return TRFS_MQ_KICKED;
+		}
 	   	/* Time out. queue empty */
 		return TRFS_FLUSH_TIMEOUT;
 	}
@@ -263,6 +325,74 @@ int trfsMqRecv (trfsQid_t mqId, int **msg_p, int *msgLen,
 	return *msgLen;
 }
 
+/* Gets up to max messages from given Message Queue under one lock.
+ * The receiver sleeps until there is a message, then until the queue
+ * reaches its watermark or flushMs have passed, so that the producers
+ * wake it up once per batch rather than once per message. A kick ends
+ * the wait for the watermark, a timeOut of 0 takes what is there.
+ */
+int trfsMqRecvBatch(trfsQid_t mqId, int **msgs, int *lens, int max,
+						const int timeOut)
+{
+	int n = 0;
+	trfs_mq_info_t  *tmp;
+
+	/* Validation */
+	if ((msgs == NULL) || (lens == NULL) || (max <= 0)) {
+		return -1;
+	}
+
+	/* Get the Node */
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL) {
+	   	/* Message Queue Node not found */
+	   	printk("Message Queue Node not found \n");
+	   	return -1;
+	}
+	if (timeOut > 0) {
+	   	wait_event_interruptible_timeout(tmp->wq,
+			((tmp->attr.kick_flag == 1)||
+				(tmp->attr.counter != 0)), msecs_to_jiffies(timeOut));
+	}
+	else if (timeOut == -1) {
+	   	wait_event_interruptible(tmp->wq,
+			(((trfs_get_exit_flag(mqId))==1)||
+				(tmp->attr.kick_flag == 1)||
+						(tmp->attr.counter != 0)));
+	}
+	if ((timeOut != 0) && (tmp->attr.counter != 0) && !trfs_mq_ready(tmp)) {
+	   	wait_event_interruptible_timeout(tmp->wq,
+			(((trfs_get_exit_flag(mqId))==1)||
+				(tmp->attr.kick_flag == 1)||
+					trfs_mq_ready(tmp)),
+				msecs_to_jiffies(tmp->attr.flushMs));
+	}
+	if (trfs_get_exit_flag(mqId) == 1) {
+	  	printk("Exiting waiting queue \n");
+		return TRFS_EXIT_WAITING_QUEUE;
+	}
+
+	if (tmp->attr.kick_flag == 1) {
+		tmp->attr.kick_flag = 0;
+		if (tmp->attr.counter == 0)
+			return TRFS_MQ_KICKED;
+	}
+	if (tmp->attr.counter == 0) {
+	   	/* Time out. queue empty */
+		return TRFS_FLUSH_TIMEOUT;
+	}
+
+	mutex_lock(&tlw.q_lock);
+	while ((n < max) && (trfsMqGetMsg(tmp, &msgs[n], &lens[n], 0) == 0))
+		n++;
+	tmp->rx = msgs;
+	tmp->rx_lens = lens;
+	tmp->rx_nr = n;
+	mutex_unlock(&tlw.q_lock);
+
+	return n;
+}
+
 /* Gets the current Attributes of given Message Queue 
  */
 int trfsMqGetAttr(trfsQid_t  mqId, trfsMqAttr_t  *mqAttr)
@@ -283,17 +413,105 @@ int trfsMqGetAttr(trfsQid_t  mqId, trfsMqAttr_t  *mqAttr)
 	/* Filling the attributes of message Queue */
 	memcpy(mqAttr, &tmp->attr, sizeof(trfsMqAttr_t));
 	
-	return -1;
+	return 0;
 } /* trfsMqGetAttr */
 
 
 
 
-/* Sets the given Attributes to given Massage Queue 
+/* Sets the given Attributes to given Massage Queue, only the watermark
+ * and the flush time can change, the depth changes with trfsMqResize()
  */
 int trfsMqSetAttr(trfsQid_t  mqId, const trfsMqAttr_t  *mqAttr)
 {
-	return -1;
+	trfs_mq_info_t *tmp;
+
+	if (mqAttr == NULL) {
+	   	return TRFS_ERR_INVALID_PARAM;
+	}
+
+	/* Get the Node */
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL) {
+		/* Message Queue Node not found */
+	   	return -1;
+	}
+	if ((mqAttr->wmark < 0) || (mqAttr->wmark > tmp->attr.maxMsgs) ||
+	    (mqAttr->flushMs < 0)) {
+	   return TRFS_ERR_INVALID_PARAM;
+	}
+
+	mutex_lock(&tlw.q_lock);
+	tmp->attr.wmark = mqAttr->wmark;
+	tmp->attr.flushMs = mqAttr->flushMs;
+	mutex_unlock(&tlw.q_lock);
+	/* The receiver may be waiting on the old watermark */
+	wake_up_interruptible(&tmp->wq);
+	if (tmp->notify && tmp->attr.counter != 0)
+		tmp->notify(trfs_mq_ready(tmp) ? 0 : tmp->attr.flushMs);
+	return 0;
+}
+
+/* Allocates the messages of a queue of maxMsgs, for trfsMqResize()
+ */
+trfsMqMsg_t *trfsMqMsgAlloc(int maxMsgs)
+{
+	if ((maxMsgs <= 0) || (maxMsgs > TRFS_MQ_MAX_NO_OF_MSGS)) {
+	   return NULL;
+	}
+	return (trfsMqMsg_t *)vmalloc(maxMsgs*sizeof(trfsMqMsg_t));
+}
+
+/* Moves the queued messages to msg, an array of maxMsgs from
+ * trfsMqMsgAlloc(), and frees the old one. The messages keep their
+ * order and the watermark keeps its ratio to the depth. Fails with
+ * TRFS_ERR_MQ_FULL while the queue holds more than maxMsgs, msg is left
+ * to the caller then.
+ */
+int trfsMqResize(trfsQid_t mqId, trfsMqMsg_t *msg, int maxMsgs)
+{
+	int k;
+	trfs_mq_info_t  *tmp;
+	trfs_mq_info_t  node;	/* only its classes are used */
+	trfsMqMsg_t *old;
+
+	if (msg == NULL) {
+	   return TRFS_ERR_INVALID_PARAM;
+	}
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL) {
+	   return -1;
+	}
+
+	mutex_lock(&tlw.q_lock);
+	memcpy(&node.attr, &tmp->attr, sizeof(trfsMqAttr_t));
+	node.attr.maxMsgs = maxMsgs;
+	trfs_mq_classes_init(&node);
+	if (node.nr_cls != tmp->nr_cls) {
+		mutex_unlock(&tlw.q_lock);
+		return TRFS_ERR_INVALID_PARAM;
+	}
+	if (tmp->attr.counter > maxMsgs) {
+		mutex_unlock(&tlw.q_lock);
+		return TRFS_ERR_MQ_FULL;
+	}
+	for (k = 0; k < tmp->attr.counter; k++)
+		msg[k] = tmp->msg[(tmp->readIndex+k)%tmp->attr.maxMsgs];
+	tmp->readIndex = 0;
+	tmp->writeIndex = tmp->attr.counter%maxMsgs;
+	tmp->attr.wmark = max((int)((int64_t)tmp->attr.wmark*maxMsgs/
+					tmp->attr.maxMsgs), 1);
+	tmp->attr.maxMsgs = maxMsgs;
+	for (k = 0; k < tmp->nr_cls; k++)
+		tmp->cls[k].limit = node.cls[k].limit;
+	old = tmp->msg;
+	tmp->msg = msg;
+	if (tmp->nr_waiting)
+		wake_up_interruptible(&tmp->swq);
+	mutex_unlock(&tlw.q_lock);
+
+	vfree(old);
+	return 0;
 }
 
 
@@ -301,23 +519,13 @@ int trfsMqSetAttr(trfsQid_t  mqId, const trfsMqAttr_t  *mqAttr)
  */
 trfs_mq_info_t * trfs_mq_get_node_by_id(trfsQid_t mqId)
 {
-	#ifdef TRFS_MQ_ARRAY
-	int  i;
-	
-	for (i=0; i< TRFS_MQ_MAX_NO_OF_Q; i++) {
-	   	if (trfs_msg_queues_g_g[i].mqId == mqId) {
-	      		return &trfs_msg_queues_g_g[i];
-	   	}
-	} 
-	#else
 	trfs_mq_info_t *tmp;
-	for (tmp = &trfs_msg_queues_g_g[0]; tmp != NULL; tmp = tmp->next) {
+
+	for (tmp = trfs_mq_info_gp; tmp != NULL; tmp = tmp->next) {
 		if (tmp->mqId == mqId) {
 	      		return tmp;
 	   	}
 	}
-	
-	#endif
 	return NULL;
 }
 
@@ -327,17 +535,19 @@ static int  trfsMqPutMsg(trfs_mq_info_t *node, unsigned char *msg_p,
                         		 int64_t msgLen, int priority)
 {
 	int wIndex;
+	trfs_mq_class_t *cls;
 
-	/* Check Array is full or not */
-	#ifdef TRFS_MQ_CIRCULAR_Q
-	if (node->attr.counter == node->attr.maxMsgs) {
-	   return TRFS_ERR_MQ_FULL; 
-	}
-	#else
-	if (node->attr.counter == node->attr.maxMsgs) {
+	if (priority < 0)
+		priority = 0;
+	if (priority >= node->nr_cls)
+		priority = node->nr_cls-1;
+	cls = &node->cls[priority];
+
+	/* Check the queue is below the limit of the class or not */
+	if (node->attr.counter >= cls->limit) {
+	   atomic_inc(&cls->dropped);
 	   return TRFS_ERR_MQ_FULL; 
 	}
-	#endif
 	
 	#if defined TRFS_MQ_BUFFER
 	/* Put the Message in Buffer */
@@ -352,15 +562,24 @@ static int  trfsMqPutMsg(trfs_mq_info_t *node, unsigned char *msg_p,
 	node->msg[wIndex].pri =  priority;
 	node->msg[wIndex].data_p = msg_p;
 	
+	cls->counter++;
+	cls->nr_put++;
+	node->nr_put++;
 	node->attr.counter = node->attr.counter+1;
+	if (node->attr.counter > node->hwm)
+		node->hwm = node->attr.counter;
 	
 	#else
 	implement
 	/* Put the Message in linked list */
 	#endif
-	if (node->attr.counter >=1) {
-	   /* Wake up any waiting process on this Q */
+	/* Wake up the receiver when the Q stops being empty and when it
+	 * reaches the watermark, not for every message */
+	if ((node->attr.counter == 1) ||
+	    (node->attr.counter == node->attr.wmark)) {
 	   wake_up_interruptible(&node->wq);
+	   if (node->notify)
+		node->notify(trfs_mq_ready(node) ? 0 : node->attr.flushMs);
 	}
 	return 0;
 }
@@ -370,19 +589,27 @@ static int  trfsMqPutMsg(trfs_mq_info_t *node, unsigned char *msg_p,
 static int  trfsMqGetMsg(trfs_mq_info_t *node, int **msg_p, 
                        				int *msgLen, bool copy_only)
 {
+	int rIndex;
+	trfs_mq_class_t *cls = NULL;
+
 	/* check Array is empty or not */
 	if (node->attr.counter == 0) {
 	   return TRFS_ERR_MQ_EMPTY; 
 	}
+
+	/* The oldest message: the classes only decide what is refused,
+	 * the records keep their order. */
+	rIndex = node->readIndex;
+	cls = &node->cls[node->msg[rIndex].pri];
 	#ifdef TRFS_MQ_BUFFER
 	   /* Get the Message from Buffer */
 	#elif defined TRFS_MQ_ARRAY
 	 /* Get the Message from Array, decrement the current index. */
 	 {
-	     *msgLen = node->msg[node->readIndex].len;
+	     *msgLen = node->msg[rIndex].len;
 	 }
 	 
-	 *msg_p = (int *)node->msg[node->readIndex].data_p;
+	 *msg_p = (int *)node->msg[rIndex].data_p;
 	#else
 	  /* Get the Message from Linked List */
 	#endif
@@ -390,7 +617,10 @@ static int  trfsMqGetMsg(trfs_mq_info_t *node, int **msg_p,
 	if (copy_only == 0) {
 	   	/* delete the message from Queue */
 	   	node->attr.counter = node->attr.counter-1;
+		cls->counter--;
 	   	node->readIndex = (node->readIndex + 1) % (node->attr.maxMsgs);
+		if (node->nr_waiting)
+			wake_up_interruptible(&node->swq);
 	}
 	return 0;
 } /* trfsMqGetMsg */
@@ -418,19 +648,26 @@ int trfsMqIsMsgAvailable(trfsQid_t  mqId)
 } /* trfsMqIsMsgAvailable */
 
 /**
- * this function delete the created queue
+ * this function delete the created queue, the records still in it are
+ * freed
  * @param[out] 0(0) : if q deleted successfully
  *            -1(-1): otherwise
  */ 
 int trfs_delete_log_q(void)
 {
-	int i;
+	int len;
+	int *msg = NULL;
+	trfs_mq_info_t  *tmp;
 
-	for (i=0; i<TRFS_TX_Q_MAX_NODES; i++) {
-             if (tx_q_id[i]) {
-	         trfsMqClose(tx_q_id[i]);
-	     }
-	}
+	tmp = trfs_mq_get_node_by_id(trfs_log_qid);
+	if (tmp == NULL)
+		return -1;
+	mutex_lock(&tlw.q_lock);
+	while (trfsMqGetMsg(tmp, &msg, &len, 0) == 0)
+		trfs_rec_free((char *)msg, len);
+	mutex_unlock(&tlw.q_lock);
+	trfsMqClose(trfs_log_qid);
+	trfs_log_qid = 0;
 	return 0;
 }
 
@@ -447,6 +684,9 @@ void trfs_set_exit_flag(trfsQid_t mqId)
 	tmp = trfs_mq_get_node_by_id(mqId);
 	tmp->attr.exit_flag =1; 
 	wake_up_interruptible(&tmp->wq);
+	wake_up_interruptible(&tmp->swq);
+	if (tmp->notify)
+		tmp->notify(0);
 } 
 
 void trfs_clear_exit_flag(trfsQid_t mqId)
@@ -456,5 +696,112 @@ void trfs_clear_exit_flag(trfsQid_t mqId)
 	tmp->attr.exit_flag =0; 
 } 
 
+/* Wakes up the receiver of the queue even if there is no message, so
+ * that it can act on out of band requests (e.g. tfile rotation).
+ */
+void trfs_mq_kick(trfsQid_t mqId)
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL)
+		return;
+	tmp->attr.kick_flag =1; 
+	wake_up_interruptible(&tmp->wq);
+	if (tmp->notify)
+		tmp->notify(0);
+} 
+
+void trfs_mq_set_notify(trfsQid_t mqId, void (*fn)(int ms))
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL)
+		return;
+	mutex_lock(&tlw.q_lock);
+	tmp->notify = fn;
+	mutex_unlock(&tlw.q_lock);
+}
+
+unsigned int trfs_mq_dropped(trfsQid_t mqId, int pri)
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL || pri < 0 || pri >= tmp->nr_cls)
+		return 0;
+	return atomic_read(&tmp->cls[pri].dropped);
+}
+
+int trfs_mq_hwm(trfsQid_t mqId)
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL)
+		return 0;
+	return READ_ONCE(tmp->hwm);
+}
+
+unsigned long trfs_mq_class_puts(trfsQid_t mqId, int pri)
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL || pri < 0 || pri >= tmp->nr_cls)
+		return 0;
+	return READ_ONCE(tmp->cls[pri].nr_put);
+}
+
+bool trfs_mq_shed(trfsQid_t mqId, int pri)
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL || pri < 0 || pri >= tmp->nr_cls ||
+	    READ_ONCE(tmp->attr.counter) < READ_ONCE(tmp->cls[pri].limit))
+		return false;
+	atomic_inc(&tmp->cls[pri].dropped);
+	return true;
+}
+
+void trfs_mq_for_each(trfsQid_t mqId,
+		void (*fn)(unsigned char *msg, int len, void *arg), void *arg)
+{
+	int i, rIndex;
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL)
+		return;
+	mutex_lock(&tlw.q_lock);
+	for (i = 0; i < tmp->rx_nr; i++)
+		fn((unsigned char *)tmp->rx[i], tmp->rx_lens[i], arg);
+	rIndex = tmp->readIndex;
+	for (i = 0; i < tmp->attr.counter; i++) {
+		fn(tmp->msg[rIndex].data_p, tmp->msg[rIndex].len, arg);
+		rIndex = (rIndex + 1) % (tmp->attr.maxMsgs);
+	}
+	mutex_unlock(&tlw.q_lock);
+}
+
+void trfs_mq_rx_done(trfsQid_t mqId)
+{
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL)
+		return;
+	mutex_lock(&tlw.q_lock);
+	tmp->rx_nr = 0;
+	mutex_unlock(&tlw.q_lock);
+}
+
+int trfs_mq_take(trfsQid_t mqId, int **msg, int *len)
+{
+	int ret;
+	trfs_mq_info_t  *tmp;
+	tmp = trfs_mq_get_node_by_id(mqId);
+	if (tmp == NULL)
+		return TRFS_ERR_MQ_EMPTY;
+	mutex_lock(&tlw.q_lock);
+	ret = trfsMqGetMsg(tmp, msg, len, 0);
+	mutex_unlock(&tlw.q_lock);
+	return ret;
+}
+
 /* EOF */
 
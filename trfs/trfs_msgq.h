@@ -8,17 +8,29 @@
 #define TRFS_MQ_CIRCULAR_Q 
 
 #define TRFS_MQ_MAX_NO_OF_Q     12
-#define TRFS_MQ_MAX_NO_OF_MSGS  1024 //64
+#define TRFS_MQ_MAX_NO_OF_MSGS  (1 << 20)
+
+/* Depth of the log queue unless tq_depth= says otherwise */
+#define TRFS_MQ_DEFAULT_MSGS	1024
 
 #define trfsQid_t int64_t
 
 #define TRFS_FLUSH_TIME		50000
+
+/* Longest a message waits in the queue for the watermark, in ms */
+#define TRFS_MQ_FLUSH_MS	50
+
+/* Longest a file or namespace record waits for a free slot, in ms */
+#define TRFS_MQ_SEND_MS		1000
 #define TRFS_FLUSH_TIMEOUT	-99
 
 #define TRFS_MQ_MAX_MSG_SIZE  1024
 
 #define TRFS_EXIT_WAITING_QUEUE -2
 
+/* Receiver was woken up by trfs_mq_kick() without a message */
+#define TRFS_MQ_KICKED		-3
+
 /* Maximum size for the Message Queue name */
 #define TRFS_MAX_MQ_NAME_SIZE    30 /*16*/ /* Using Afdx port name as Queue name */    
 
@@ -33,15 +45,33 @@
 /* Error code to indicate Queue Empty */
 #define TRFS_ERR_MQ_EMPTY        -(TRFS_GEN_ERR_BASE + 3)
 
-#define TRFS_LOG_QID		2
+#define TRFS_LOG_QID		trfs_log_qid
 #define TRFS_LOG_COMPLETE	127
 
+/* Priority classes of TRFS_MQ_PRIORITY queues. A class is refused once
+ * the queue holds its limit, the higher classes have higher limits and
+ * take the slots the lower ones leave free, so that a flood of data
+ * records can't push out the records replay can't do without. */
+#define TRFS_MQ_PRI_DATA	0	/* read, write, get/listxattr */
+#define TRFS_MQ_PRI_FILE	1	/* open, close, set/removexattr */
+#define TRFS_MQ_PRI_NS		2	/* namespace changes */
+#define TRFS_MQ_NR_PRI		3
+
 typedef struct trfsMqMsg {
 	unsigned int  pri;   /* Priority variable */
 	int64_t   len;
 	unsigned char    *data_p;
 } trfsMqMsg_t;
 
+/** Admission of a priority class to the message array
+ */
+typedef struct trfs_mq_class {
+	int limit;		/* refused once the queue holds this many */
+	int counter;		/* messages of the class in the queue */
+	atomic_t dropped;	/* messages refused, the class was full */
+	unsigned long nr_put;	/* messages of the class ever queued */
+} trfs_mq_class_t;
+
 /* Flags are */
 typedef enum  trfsMqFlags {
 	TRFS_MQ_FIFO        = 0x00000001,
@@ -53,7 +83,10 @@ typedef struct trfsMqAttr {
 	int  maxMsgs;        /* maximum number of messages           */
 	int  msgSize;        /* maximum message size                 */
 	int  counter;        /* number of messages currently queued  */
+	int  wmark;          /* messages that wake up the receiver   */
+	int  flushMs;        /* the receiver waits no longer for them */
 	char  exit_flag;        /* number of messages currently queued  */
+	char  kick_flag;        /* receiver asked to wake up without a msg */
 	char   name[TRFS_MAX_MQ_NAME_SIZE]; /* message queue name */
 } trfsMqAttr_t;
 
@@ -62,11 +95,21 @@ typedef struct trfs_mq_info
    trfsQid_t     mqId;  /* message Queue id */
    trfsMqAttr_t  attr;  /* message Queue attributes */
    int     index;
+   int     hwm;	/* most messages queued at once */
+   unsigned long nr_put; /* messages ever queued */
    wait_queue_head_t  wq; /* waitQ for blocking implementation */
+   wait_queue_head_t  swq; /* senders waiting for a free slot */
+   int     nr_waiting;	/* senders on swq */
+   void (*notify)(int ms); /* a receiver without a thread, see trfs_mq_set_notify() */
+   int     **rx;	/* batch trfsMqRecvBatch() gave the receiver, */
+   int     *rx_lens;
+   int     rx_nr;	/* until trfs_mq_rx_done() */
 #ifdef TRFS_MQ_ARRAY
+   int     nr_cls;	/* 1 for FIFO queues */
+   trfs_mq_class_t cls[TRFS_MQ_NR_PRI];
    int     readIndex;
    int     writeIndex;
-   trfsMqMsg_t   msg[TRFS_MQ_MAX_NO_OF_MSGS]; /* message */
+   trfsMqMsg_t   *msg; /* maxMsgs messages, in the order they came */
 #endif /* TRFS_MQ_ARRAY */
    struct trfs_mq_info *next;
 } trfs_mq_info_t;
@@ -94,12 +137,71 @@ extern int trfsMqRecv(trfsQid_t   mqId,
                     unsigned int      msg_priority,
                     const int timeOut);
 
-int trfs_create_log_q(void);
+/* Gets and sets the watermark and the flush time of the Message Queue */
+extern int trfsMqGetAttr(trfsQid_t mqId, trfsMqAttr_t *mqAttr);
+extern int trfsMqSetAttr(trfsQid_t mqId, const trfsMqAttr_t *mqAttr);
+
+/* Changes the depth of the Message Queue, msg from trfsMqMsgAlloc() */
+extern trfsMqMsg_t *trfsMqMsgAlloc(int maxMsgs);
+extern int trfsMqResize(trfsQid_t mqId, trfsMqMsg_t *msg, int maxMsgs);
+
+/* Gets up to max messages from given Message Queue in one go. */
+extern int trfsMqRecvBatch(trfsQid_t   mqId,
+                    int        **msgs,
+                    int        *lens,
+                    int        max,
+                    const int timeOut);
+
+/* Queue id of the log queue */
+extern trfsQid_t trfs_log_qid;
+
+/* Creates the log queue with room for depth records */
+int trfs_create_log_q(int depth, int flush_ms);
 
 int trfs_delete_log_q(void);
 
 char trfs_get_exit_flag(trfsQid_t mqId);
 void trfs_set_exit_flag(trfsQid_t mqId);
 void trfs_clear_exit_flag(trfsQid_t mqId);
+void trfs_mq_kick(trfsQid_t mqId);
+
+/* Has fn called whenever the receiver would be woken up, with the ms
+ * it can still wait: 0 at the watermark, on a kick and at the exit, the
+ * flush time for the first message. For a receiver run from a
+ * workqueue, which doesn't sleep on the queue. NULL turns it off. */
+void trfs_mq_set_notify(trfsQid_t mqId, void (*fn)(int ms));
+
+/* Messages of priority class pri refused because its share was full */
+unsigned int trfs_mq_dropped(trfsQid_t mqId, int pri);
+
+/* Most messages the queue held at once */
+int trfs_mq_hwm(trfsQid_t mqId);
+
+/** Messages of the priority class pri ever queued
+ */
+unsigned long trfs_mq_class_puts(trfsQid_t mqId, int pri);
+
+/** Counts a message of the class pri as refused, without taking the
+ * lock, if the queue wouldn't take it now: the sender drops it before
+ * building it. One let through may still be refused by trfsMqSend.
+ */
+bool trfs_mq_shed(trfsQid_t mqId, int pri);
+
+/** Calls fn on each message in the queue and in the batch the receiver
+ * took last, in their order, under the lock of the queue: none of them
+ * is freed meanwhile.
+ */
+void trfs_mq_for_each(trfsQid_t mqId,
+		void (*fn)(unsigned char *msg, int len, void *arg), void *arg);
+
+/** The receiver is done with the batch of its last trfsMqRecvBatch()
+ * and frees it
+ */
+void trfs_mq_rx_done(trfsQid_t mqId);
+
+/** Takes the oldest message off the queue without waiting, also once the
+ * exit flag is set. Returns 0, or TRFS_ERR_MQ_EMPTY.
+ */
+int trfs_mq_take(trfsQid_t mqId, int **msg, int *len);
 
 #endif /*EndOf __TRFS_TDMA_MSGQ_H__ **/
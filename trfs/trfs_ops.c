@@ -1,3 +1,8 @@
+#include <linux/ktime.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
+
 #include "trfs.h"
 #include "tr_fs.h"
 #include "trfs_ops.h"
@@ -10,11 +15,574 @@ static int test_bit_set(unsigned int a, int n)
 	return ((1 << n)&a);
 }
 
-/* Check if the operation is enabled for tracing */
-#define IS_TRACE_ENABLED(a, n)	\
-		if (test_bit_set(a, n) == 0) \
+static trfs_wr_gen trfs_wr_gens[1 << TRFS_WR_GEN_BITS];
+
+static trfs_wr_gen *trfs_wr_gen_of(struct file *lower_file)
+{
+	return &trfs_wr_gens[hash_ptr(lower_file->f_mapping,
+						TRFS_WR_GEN_BITS)];
+}
+
+void trfs_wr_begin(struct file *lower_file)
+{
+	atomic_inc(&trfs_wr_gen_of(lower_file)->begun);
+}
+
+void trfs_wr_end(struct file *lower_file)
+{
+	atomic_inc(&trfs_wr_gen_of(lower_file)->done);
+}
+
+/* Default window of full tracing after a trigger, in seconds */
+#define TRFS_TRIG_WINDOW	10
+
+/** Matches the dentry against the trigger prefix by walking up its
+ * parents, so that no path has to be built for ops that aren't traced.
+ */
+static int trfs_trigger_path(struct trfs_log_driver *this,
+						struct dentry *dentry)
+{
+	int i, depth = 0;
+	int ret = 0;
+	int nr_comp = READ_ONCE(this->trig.nr_comp);
+	struct dentry *d = NULL;
+
+	if (nr_comp == 0 || !dentry)
+		return 0;
+	smp_rmb();
+
+	rcu_read_lock();
+	for (d = dentry; !IS_ROOT(d); d = d->d_parent)
+		depth++;
+	if (depth < nr_comp)
+		goto out;
+	for (d = dentry; depth > nr_comp; depth--)
+		d = d->d_parent;
+	for (i = nr_comp-1; i >= 0; i--, d = d->d_parent) {
+		if (d->d_name.len != this->trig.comp_len[i] ||
+		    memcmp(d->d_name.name, this->trig.prefix+
+			this->trig.comp_off[i], d->d_name.len))
+			goto out;
+	}
+	ret = 1;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+void trfs_trigger_fire(struct trfs_log_driver *this)
+{
+	unsigned int window = this->trig.window;
+
+	if (window == 0)
+		window = TRFS_TRIG_WINDOW;
+	WRITE_ONCE(this->full_until, jiffies + window*HZ);
+	atomic64_inc(&this->nr_fired);
+}
+
+/** Decides if an op gets a record: counts it, fires the triggers it
+ * matches, then follows the level unless a trigger window is open.
+ * Nothing is allocated or locked here.
+ */
+static bool trfs_trace_wanted(struct trfs_log_driver *this, int op,
+					struct dentry *dentry, int ret)
+{
+	unsigned long until;
+	int err = READ_ONCE(this->trig.err);
+
+	if (test_bit_set(this->bitmap, op) == 0)
+		return false;
+	atomic64_inc(&this->nr_ops[op]);
+	if (ret < 0)
+		atomic64_inc(&this->nr_err[op]);
+	if (this->level == TRFS_LEVEL_FULL)
+		goto traced;
+
+	if ((err && ret == -err) || trfs_trigger_path(this, dentry))
+		trfs_trigger_fire(this);
+	until = READ_ONCE(this->full_until);
+	if (until && time_before(jiffies, until))
+		goto traced;
+	if (this->level == TRFS_LEVEL_SAMPLE && this->sample &&
+	    atomic_inc_return(&this->sample_ctr) % this->sample == 0)
+		goto traced;
+	return false;
+traced:
+	atomic64_inc(&this->nr_traced);
+	return true;
+}
+
+/* Check if the operation is enabled for tracing. A data record the
+ * queue has no room for is dropped here, before it costs anything */
+#define IS_TRACE_ENABLED(this, n, dentry, ret)	\
+		if (!trfs_trace_wanted(this, n, dentry, ret) || \
+		    trfs_log_shed(n)) \
 			return;  
 
+/** Path of the dentry from the root of the trfs mount, so that the trace
+ * can be replayed under another root. Falls back to the name alone if the
+ * path can't be built. pbuf is released with trfs_path_put().
+ * @param[in] dentry Pointer to dentry
+ * @param[out] pbuf Buffer the path is built in
+ * @param[out] len Length of the path
+ */
+static const char *trfs_path_get(struct dentry *dentry, char **pbuf, int *len)
+{
+	char *path = NULL;
+
+	*pbuf = __getname();
+	if (*pbuf) {
+		path = dentry_path_raw(dentry, *pbuf, PATH_MAX);
+		if (!IS_ERR(path)) {
+			*len = strlen(path);
+			return path;
+		}
+		__putname(*pbuf);
+		*pbuf = NULL;
+	}
+	*len = dentry->d_name.len;
+	return (const char *)dentry->d_name.name;
+}
+
+static void trfs_path_put(char *pbuf)
+{
+	if (pbuf)
+		__putname(pbuf);
+}
+
+/* Hooks only capture their op as an event, the writer assembles the
+ * record. Events come from a cache of their own, created with the driver.
+ */
+static struct kmem_cache *trfs_event_cachep = NULL;
+
+/** Starts the event of an op with what all records have. The hook adds
+ * the paths and the fields of its record.
+ */
+static trfs_event *trfs_event_get(int r_type, int ret)
+{
+	trfs_event *ev = NULL;
+
+	ev = (trfs_event *)kmem_cache_alloc(trfs_event_cachep, GFP_KERNEL);
+	if (ev) {
+		ev->r_id = get_next_record_id();
+		ev->r_size = 0;
+		ev->r_type = r_type;
+		ev->ts = ktime_get_real_ns();
+		ev->pid = (int) task_pid_nr(current);
+		ev->ret = ret;
+		ev->nr_paths = 0;
+		ev->nr_pages = 0;
+		ev->wflags = 0;
+		ev->wr_gen = NULL;
+	}
+	return ev;
+}
+
+/** Adds the path dentry has now, as its parent and a copy of its name,
+ * so that a rename before the writer gets to it doesn't show. Returns
+ * -ENAMETOOLONG when the name doesn't fit in the event.
+ */
+static int trfs_ev_path_name(trfs_event *ev, struct dentry *dentry)
+{
+	trfs_ev_path *p = &ev->path[ev->nr_paths];
+	struct dentry *parent = dget_parent(dentry);
+
+	/* d_move() changes the parent and the name under d_lock */
+	spin_lock(&dentry->d_lock);
+	if (dentry->d_name.len >= TRFS_EV_NAME_LEN || IS_ROOT(dentry) ||
+	    dentry->d_parent != parent) {
+		spin_unlock(&dentry->d_lock);
+		dput(parent);
+		return -ENAMETOOLONG;
+	}
+	p->len = dentry->d_name.len;
+	memcpy(p->name, dentry->d_name.name, p->len);
+	spin_unlock(&dentry->d_lock);
+	p->dentry = parent;
+	p->path = NULL;
+	ev->nr_paths++;
+	return 0;
+}
+
+/** Adds the path of dentry, by its name when it fits or else by the
+ * dentry, whose path is taken by the writer
+ */
+static void trfs_ev_path_ref(trfs_event *ev, struct dentry *dentry)
+{
+	trfs_ev_path *p = &ev->path[ev->nr_paths];
+
+	if (trfs_ev_path_name(ev, dentry) == 0)
+		return;
+	p->dentry = dget(dentry);
+	p->len = 0;
+	p->path = NULL;
+	ev->nr_paths++;
+}
+
+/** The path of a dentry that can still be renamed has to be taken now
+ */
+static bool trfs_ev_path_late(trfs_ev_path *p)
+{
+	return p->len == 0 && !IS_ROOT(p->dentry);
+}
+
+/** Takes references to the pages of the lower page cache that hold the
+ * count bytes a write just put at pos, the writer copies them from there
+ * to the tfile. A write to the file before it does shows in them, the
+ * record is marked TRFS_WR_INEXACT then. Returns -ENODATA, with no
+ * reference kept, when the write went past the page cache or a page is
+ * already gone from it.
+ */
+static int trfs_ev_data_ref(trfs_event *ev, struct file *file, loff_t pos,
+								size_t count)
+{
+	int nr = 0;
+	struct file *lower_file = trfs_lower_file(file);
+
+	if (!lower_file || (lower_file->f_flags & O_DIRECT) ||
+	    IS_DAX(file_inode(lower_file)))
+		return -ENODATA;
+
+	nr = (offset_in_page(pos)+count+PAGE_SIZE-1) >> PAGE_SHIFT;
+	ev->nr_pages = find_get_pages_contig(lower_file->f_mapping,
+				pos >> PAGE_SHIFT, nr, ev->pages);
+	if (ev->nr_pages < nr) {
+		while (ev->nr_pages > 0)
+			put_page(ev->pages[--ev->nr_pages]);
+		return -ENODATA;
+	}
+	ev->pg_off = offset_in_page(pos);
+
+	/* A write still going on may be changing them already */
+	ev->wr_gen = trfs_wr_gen_of(lower_file);
+	ev->wr_begun = atomic_read(&ev->wr_gen->begun);
+	if (atomic_read(&ev->wr_gen->done) != ev->wr_begun)
+		ev->wflags |= TRFS_WR_INEXACT;
+	return 0;
+}
+
+/** Copies the payload ev holds in its pages to dst, without sleeping:
+ * the ring has it done under its lock
+ */
+static void trfs_ev_data_copy(trfs_event *ev, char *dst)
+{
+	int i;
+	char *src = NULL;
+	size_t n, left = ev->count;
+	unsigned int off = ev->pg_off;
+
+	for (i = 0; i < ev->nr_pages && left > 0; i++) {
+		n = min_t(size_t, left, PAGE_SIZE-off);
+		src = (char *)kmap_atomic(ev->pages[i]);
+		memcpy(dst, src+off, n);
+		kunmap_atomic(src);
+		dst += n;
+		left -= n;
+		off = 0;
+	}
+}
+
+/** Copies the path p stands for to dst and returns its length. Falls
+ * back to the name alone like trfs_path_get().
+ */
+static int trfs_ev_path_copy(trfs_ev_path *p, char *dst, char *scratch)
+{
+	int len = 0;
+	char *path = NULL;
+
+	if (p->path) {
+		len = strlen(p->path);
+		memcpy(dst, p->path, len);
+		return len;
+	}
+	path = dentry_path_raw(p->dentry, scratch, PATH_MAX-p->len-1);
+	if (IS_ERR(path)) {
+		if (p->len) {
+			memcpy(dst, p->name, p->len);
+			return p->len;
+		}
+		len = p->dentry->d_name.len;
+		memcpy(dst, p->dentry->d_name.name, len);
+		return len;
+	}
+	len = strlen(path);
+	memcpy(dst, path, len);
+	if (p->len) {
+		if (len > 1)
+			dst[len++] = '/';
+		memcpy(dst+len, p->name, p->len);
+		len += p->len;
+	}
+	return len;
+}
+
+/* What all records built from an event have */
+#define TRFS_EV_HDR(op, ev, size)	do {		\
+		(op)->r_id = (ev)->r_id;		\
+		(op)->r_size = (size);			\
+		(op)->r_type = (ev)->r_type;		\
+		(op)->ts = (ev)->ts;			\
+		(op)->pid = (ev)->pid;			\
+		(op)->ret = (ev)->ret;			\
+	} while (0)
+
+int trfs_event_build(trfs_event *ev, char *rec, char *scratch, bool data)
+{
+	int i;
+	int hdr = 0;
+	int off = 0;
+	int len[2] = { 0, 0 };
+	char *name = NULL;
+
+	/* The paths go right after the fields of the record */
+	switch (ev->r_type) {
+		case TRFS_OP_OPEN:
+			hdr = sizeof(trfs_open_op);
+			name = ((trfs_open_op *)rec)->pathname;
+			break;
+		case TRFS_OP_READ:
+			hdr = sizeof(trfs_read_op);
+			name = ((trfs_read_op *)rec)->pathname;
+			break;
+		case TRFS_OP_WRITE:
+			/* The payload follows the path, r_size ends with it */
+			hdr = offsetof(trfs_write_op, pathname);
+			name = ((trfs_write_op *)rec)->pathname;
+			break;
+		case TRFS_OP_CLOSE:
+			hdr = sizeof(trfs_close_op);
+			name = ((trfs_close_op *)rec)->pathname;
+			break;
+		case TRFS_OP_MKDIR:
+			hdr = sizeof(trfs_mkdir_op);
+			name = ((trfs_mkdir_op *)rec)->pathname;
+			break;
+		case TRFS_OP_RMDIR:
+			hdr = sizeof(trfs_rmdir_op);
+			name = ((trfs_rmdir_op *)rec)->pathname;
+			break;
+		case TRFS_OP_UNLINK:
+			hdr = sizeof(trfs_unlink_op);
+			name = ((trfs_unlink_op *)rec)->pathname;
+			break;
+		case TRFS_OP_LINK:
+			hdr = sizeof(trfs_link_op);
+			name = ((trfs_link_op *)rec)->pathname;
+			break;
+		case TRFS_OP_RENAME:
+			hdr = sizeof(trfs_rename_op);
+			name = ((trfs_rename_op *)rec)->pathname1;
+			break;
+		case TRFS_OP_MKNOD:
+			hdr = sizeof(trfs_mknod_op);
+			name = ((trfs_mknod_op *)rec)->pathname;
+			break;
+		case TRFS_OP_SETXATTR:
+		case TRFS_OP_GETXATTR:
+		case TRFS_OP_LISTXATTR:
+		case TRFS_OP_REMOVEXATTR:
+			/* The four xattr records are laid out alike */
+			hdr = sizeof(trfs_setxattr_op);
+			name = ((trfs_setxattr_op *)rec)->pathname;
+			break;
+		default:
+			return 0;
+	}
+	/* No stale bytes of the last record in the padding */
+	memset(rec, 0, hdr);
+	for (i = 0; i < ev->nr_paths; i++) {
+		len[i] = trfs_ev_path_copy(&ev->path[i], name+off, scratch);
+		off += len[i];
+	}
+	name[off] = '\0';
+
+	switch (ev->r_type) {
+		case TRFS_OP_OPEN: {
+			trfs_open_op *op = (trfs_open_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->flags = ev->flags;
+			op->mode = ev->mode;
+			op->addr = ev->addr;
+			op->len = len[0];
+			break;
+		}
+		case TRFS_OP_READ: {
+			trfs_read_op *op = (trfs_read_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->addr = ev->addr;
+			op->count = ev->count;
+			op->ppos = ev->ppos;
+			op->len = len[0];
+			break;
+		}
+		case TRFS_OP_WRITE: {
+			trfs_write_op *op = (trfs_write_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off+ev->count);
+			op->addr = ev->addr;
+			op->count = ev->count;
+			op->ppos = ev->ppos;
+			op->len = len[0];
+			op->wflags = ev->wflags;
+			if (data) {
+				trfs_ev_data_copy(ev, name+off);
+				if (trfs_wr_stale(ev->wr_gen, ev->wr_begun))
+					op->wflags |= TRFS_WR_INEXACT;
+			}
+			return hdr+off+ev->count;
+		}
+		case TRFS_OP_CLOSE: {
+			trfs_close_op *op = (trfs_close_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->addr = ev->addr;
+			op->len = len[0];
+			break;
+		}
+		case TRFS_OP_MKDIR: {
+			trfs_mkdir_op *op = (trfs_mkdir_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->mode = ev->mode;
+			op->len = len[0];
+			break;
+		}
+		case TRFS_OP_RMDIR: {
+			trfs_rmdir_op *op = (trfs_rmdir_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->len = len[0];
+			break;
+		}
+		case TRFS_OP_UNLINK: {
+			trfs_unlink_op *op = (trfs_unlink_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->len = len[0];
+			break;
+		}
+		case TRFS_OP_LINK: {
+			trfs_link_op *op = (trfs_link_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->plen = len[0];
+			op->hlen = len[1];
+			break;
+		}
+		case TRFS_OP_RENAME: {
+			trfs_rename_op *op = (trfs_rename_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->len1 = len[0];
+			op->len2 = len[1];
+			break;
+		}
+		case TRFS_OP_MKNOD: {
+			trfs_mknod_op *op = (trfs_mknod_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->len = len[0];
+			break;
+		}
+		default: {
+			trfs_setxattr_op *op = (trfs_setxattr_op *)rec;
+
+			TRFS_EV_HDR(op, ev, hdr+off);
+			op->addr = 0;
+			op->len = len[0];
+			break;
+		}
+	}
+	return hdr+off;
+}
+
+void trfs_event_put(trfs_event *ev)
+{
+	int i;
+
+	for (i = 0; i < ev->nr_paths; i++) {
+		dput(ev->path[i].dentry);
+		kfree(ev->path[i].path);
+	}
+	for (i = 0; i < ev->nr_pages; i++)
+		put_page(ev->pages[i]);
+	kmem_cache_free(trfs_event_cachep, ev);
+}
+
+/** Takes the path p stands for now in a buffer of its size, taking it
+ * in scratch of PATH_MAX bytes first. Without it the writer takes the
+ * path when it gets to the event, a rename may have changed it by then.
+ */
+static bool trfs_ev_path_take(trfs_ev_path *p, char *scratch)
+{
+	int len = 0;
+	char *path = NULL;
+
+	path = dentry_path_raw(p->dentry, scratch, PATH_MAX-p->len-1);
+	if (IS_ERR(path))
+		return false;
+	len = strlen(path);
+	p->path = (char *)kmalloc(len+1+p->len+1, GFP_KERNEL);
+	if (!p->path)
+		return false;
+	memcpy(p->path, path, len);
+	if (p->len) {
+		if (len > 1)
+			p->path[len++] = '/';
+		memcpy(p->path+len, p->name, p->len);
+		len += p->len;
+	}
+	p->path[len] = '\0';
+	return true;
+}
+
+bool trfs_event_pin(trfs_event *ev, struct dentry *dir, char *scratch)
+{
+	int i;
+	bool pinned = false;
+	trfs_ev_path *p = NULL;
+
+	for (i = 0; i < ev->nr_paths; i++) {
+		p = &ev->path[i];
+		if (!p->path && is_subdir(p->dentry, dir) &&
+		    trfs_ev_path_take(p, scratch))
+			pinned = true;
+	}
+	return pinned;
+}
+
+void trfs_rec_free(char *rec, int len)
+{
+	if (trfs_is_event(rec, len))
+		trfs_event_put((trfs_event *)rec);
+	else
+		kfree(rec);
+}
+
+/** Queues ev for the writer. The path of a dentry, only right until it
+ * is renamed, is taken right away, the rest of the record is still left
+ * to the writer.
+ */
+static void trfs_log_event(trfs_event *ev)
+{
+	int i;
+	char *scratch = NULL;
+
+	for (i = 0; i < ev->nr_paths; i++) {
+		if (!trfs_ev_path_late(&ev->path[i]))
+			continue;
+		if (!scratch)
+			scratch = __getname();
+		if (scratch)
+			trfs_ev_path_take(&ev->path[i], scratch);
+	}
+	if (scratch)
+		__putname(scratch);
+	TRFS_WRITE(ev, sizeof(trfs_event));
+}
+
 /* Tracing mkdir operation
  * @param[in] this structure of trace driver
  * @param[in] dir Pointer to inode
@@ -25,26 +593,16 @@ static int test_bit_set(unsigned int a, int n)
 static void trfs_log_mkdir_op(struct trfs_log_driver *this, 
 		struct inode *dir, struct dentry *dentry, int mode, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_mkdir_op *mop = NULL;
+	trfs_event *ev = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_MKDIR)
+	IS_TRACE_ENABLED(this, TRFS_OP_MKDIR, dentry, ret)
 
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_mkdir_op)+path_len;
-
-	mop = (trfs_mkdir_op *)kmalloc(size, GFP_KERNEL);
-	if (mop) {
-		mop->r_id = get_next_record_id();
-		mop->r_type = TRFS_OP_MKDIR;
-		mop->r_size = size;
-		mop->mode = mode;
-		mop->len = path_len;
-		mop->ret = ret;
-		strcpy(mop->pathname, dentry->d_name.name);
+	ev = trfs_event_get(TRFS_OP_MKDIR, ret);
+	if (ev) {
+		ev->mode = mode;
+		trfs_ev_path_ref(ev, dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(mop, size);
 }
 
 /* Tracing rmdir operation
@@ -56,25 +614,15 @@ static void trfs_log_mkdir_op(struct trfs_log_driver *this,
 static void trfs_log_rmdir_op(struct trfs_log_driver *this,
 			struct inode *dir, struct dentry *dentry, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_rmdir_op *rop = NULL;
+	trfs_event *ev = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_RMDIR)
+	IS_TRACE_ENABLED(this, TRFS_OP_RMDIR, dentry, ret)
 
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_rmdir_op)+path_len;
-
-	rop = (trfs_rmdir_op *)kmalloc(size, GFP_KERNEL);
-	if (rop) {
-		rop->r_id = get_next_record_id();
-		rop->r_type = TRFS_OP_RMDIR;
-		rop->r_size = size;
-		rop->len = path_len;
-		rop->ret = ret;
-		strcpy(rop->pathname, dentry->d_name.name);
+	ev = trfs_event_get(TRFS_OP_RMDIR, ret);
+	if (ev) {
+		trfs_ev_path_ref(ev, dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(rop, size);
 }
 
 /* Tracing unlink operation
@@ -86,25 +634,15 @@ static void trfs_log_rmdir_op(struct trfs_log_driver *this,
 static void trfs_log_unlink_op(struct trfs_log_driver *this, 
 			struct inode *dir, struct dentry *dentry, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_unlink_op *op = NULL;
-
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_UNLINK)
+	trfs_event *ev = NULL;
 
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_unlink_op)+path_len;
+	IS_TRACE_ENABLED(this, TRFS_OP_UNLINK, dentry, ret)
 
-	op = (trfs_unlink_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_UNLINK;
-		op->r_size = size;
-		op->len = path_len;
-		op->ret = ret;
-		strcpy(op->pathname, dentry->d_name.name);
+	ev = trfs_event_get(TRFS_OP_UNLINK, ret);
+	if (ev) {
+		trfs_ev_path_ref(ev, dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(op, size);
 }
 
 /* Tracing link operation
@@ -118,29 +656,16 @@ static void trfs_log_link_op(struct trfs_log_driver *this,
 		struct dentry *old_dentry, struct inode *dir,
 					struct dentry *new_dentry, int ret)
 {
-        int size = 0;
-        int path_len1 = 0;
-        int path_len2 = 0;
-        trfs_link_op *op = NULL;
+	trfs_event *ev = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_LINK)
+	IS_TRACE_ENABLED(this, TRFS_OP_LINK, new_dentry, ret)
 
-        path_len1 = old_dentry->d_name.len;
-        path_len2 = old_dentry->d_name.len;
-        size = sizeof(trfs_link_op)+path_len1+path_len2;
-
-        op = (trfs_link_op *)kmalloc(size, GFP_KERNEL);
-        if (op) {
-                op->r_id = get_next_record_id();
-                op->r_type = TRFS_OP_LINK;
-                op->r_size = size;
-                op->plen = path_len1;
-                op->hlen = path_len2;
-                op->ret = ret;
-                strcpy(op->pathname, old_dentry->d_name.name);
-                strcpy(op->pathname+path_len1, new_dentry->d_name.name);
-        }
-        TRFS_WRITE(op, size);
+	ev = trfs_event_get(TRFS_OP_LINK, ret);
+	if (ev) {
+		trfs_ev_path_ref(ev, old_dentry);
+		trfs_ev_path_ref(ev, new_dentry);
+		trfs_log_event(ev);
+	}
 }
 
 /* Tracing symlink operation
@@ -156,25 +681,30 @@ static void trfs_log_symlink_op(struct trfs_log_driver *this,
 {
         int size = 0;
         int path_len = 0;
+        const char *path = NULL;
+        char *pbuf = NULL;
         trfs_symlink_op *op = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_SYMLINK)
+	IS_TRACE_ENABLED(this, TRFS_OP_SYMLINK, dentry, ret)
 
-        path_len = dentry->d_name.len;
+        path = trfs_path_get(dentry, &pbuf, &path_len);
         size = sizeof(trfs_symlink_op)+path_len+strlen(sname);
 
         op = (trfs_symlink_op *)kmalloc(size, GFP_KERNEL);
         if (op) {
                 op->r_id = get_next_record_id();
+                op->ts = ktime_get_real_ns();
                 op->r_type = TRFS_OP_SYMLINK;
                 op->r_size = size;
                 op->plen = path_len;
                 op->slen = strlen(sname);
                 op->ret = ret;
-                strcpy(op->pathname, dentry->d_name.name);
+                memcpy(op->pathname, path, path_len);
+                op->pathname[path_len] = '\0';
                 strcpy(op->pathname+path_len, sname);
         }
         TRFS_WRITE(op, size);
+        trfs_path_put(pbuf);
 }
 
 /* Tracing rename operation
@@ -189,29 +719,18 @@ static void trfs_log_rename_op(struct trfs_log_driver *this,
 		struct inode *old_dir, struct dentry *old_dentry, 
 		struct inode *new_dir, struct dentry *new_dentry, int ret)
 {
-	int size = 0;
-	int path_len1 = 0;
-	int path_len2 = 0;
-	trfs_rename_op *rop = NULL;
+	trfs_event *ev = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_RENAME)
+	IS_TRACE_ENABLED(this, TRFS_OP_RENAME, old_dentry, ret)
 
-	path_len1 = old_dentry->d_name.len;
-	path_len2 = new_dentry->d_name.len;
-	size = sizeof(trfs_rename_op)+path_len1+path_len2;
-
-	rop = (trfs_rename_op *)kmalloc(size, GFP_KERNEL);
-	if (rop) {
-		rop->r_id = get_next_record_id();
-		rop->r_type = TRFS_OP_RENAME;
-		rop->r_size = size;
-		rop->len1 = path_len1;
-		rop->len2 = path_len2;
-		rop->ret = ret;
-		strcpy(rop->pathname1, old_dentry->d_name.name);
-		strcpy(rop->pathname1+path_len1, new_dentry->d_name.name);
+	/* The dentries are moved once we return, the paths are kept as
+	 * the parents and the names. Long names are taken now. */
+	ev = trfs_event_get(TRFS_OP_RENAME, ret);
+	if (ev) {
+		trfs_ev_path_ref(ev, old_dentry);
+		trfs_ev_path_ref(ev, new_dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(rop, size);
 }
 
 /* Tracing open operation
@@ -223,29 +742,18 @@ static void trfs_log_rename_op(struct trfs_log_driver *this,
 static void trfs_log_open_op(struct trfs_log_driver *this, 
 				struct inode *dir, struct file *file, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_open_op *op = NULL;
-
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_OPEN)
+	trfs_event *ev = NULL;
 
-	path_len = file->f_path.dentry->d_name.len;
-	size = sizeof(trfs_open_op)+path_len;
+	IS_TRACE_ENABLED(this, TRFS_OP_OPEN, file->f_path.dentry, ret)
 
-	op = (trfs_open_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_OPEN;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->flags = file->f_flags;
-		op->mode = file->f_mode;
-		op->len = path_len;
-		op->ret = ret;
-		memcpy((char *)&op->addr, (char *)&file, sizeof(struct file *));
-		strcpy(op->pathname, file->f_path.dentry->d_name.name);
+	ev = trfs_event_get(TRFS_OP_OPEN, ret);
+	if (ev) {
+		ev->flags = file->f_flags;
+		ev->mode = file->f_mode;
+		ev->addr = (uint64_t)(unsigned long)file;
+		trfs_ev_path_ref(ev, file->f_path.dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(op, size);
 }
 
 /* Tracing read operation
@@ -257,29 +765,18 @@ static void trfs_log_open_op(struct trfs_log_driver *this,
 static void trfs_log_read_op(struct trfs_log_driver *this, 
 			struct file *file, size_t count, loff_t *ppos, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_read_op *op = NULL;
-
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_READ)
+	trfs_event *ev = NULL;
 
-	path_len = file->f_path.dentry->d_name.len;
-	size = sizeof(trfs_read_op)+path_len;
+	IS_TRACE_ENABLED(this, TRFS_OP_READ, file->f_path.dentry, ret)
 
-	op = (trfs_read_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_READ;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->count = count;
-		op->ppos = *ppos;
-		op->ret = ret;
-		memcpy((char *)&op->addr, (char *)&file, sizeof(struct file *));
-		strcpy(op->pathname, file->f_path.dentry->d_name.name);
+	ev = trfs_event_get(TRFS_OP_READ, ret);
+	if (ev) {
+		ev->addr = (uint64_t)(unsigned long)file;
+		ev->count = count;
+		ev->ppos = *ppos;
+		trfs_ev_path_ref(ev, file->f_path.dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(op, size)
 }
 
 /* Tracing write operation
@@ -293,16 +790,51 @@ static void trfs_log_write_op(struct trfs_log_driver *this,
 {
 	int size = 0;
 	int path_len = 0;
+	unsigned short wflags = 0;
+	const char *path = NULL;
+	char *pbuf = NULL;
 	trfs_write_op *op = NULL;
+	trfs_event *ev = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_WRITE)
+	IS_TRACE_ENABLED(this, TRFS_OP_WRITE, file->f_path.dentry, ret)
 
-	path_len = file->f_path.dentry->d_name.len;
-	size = sizeof(trfs_write_op)+path_len+count;
+	/* The payload is what the write put in the file, what it was
+	 * given when it failed */
+	if (ret > 0)
+		count = ret;
+	if (count > TRFS_WR_DATA_MAX) {
+		count = TRFS_WR_DATA_MAX;
+		wflags = TRFS_WR_CUT;
+	}
+
+	/* A large one is taken by the writer from the lower page cache,
+	 * where the write just put it */
+	if (ret > 0 && count > TRFS_WR_INLINE) {
+		ev = trfs_event_get(TRFS_OP_WRITE, ret);
+		if (!ev)
+			return;
+		ev->addr = (uint64_t)(unsigned long)file;
+		ev->count = count;
+		ev->ppos = *ppos;
+		ev->wflags = wflags;
+		if (trfs_ev_data_ref(ev, file, *ppos-ret, count) == 0) {
+			trfs_ev_path_ref(ev, file->f_path.dentry);
+			trfs_log_event(ev);
+			return;
+		}
+		trfs_event_put(ev);
+	}
+
+	/* Laid out like the records built from an event: the payload
+	 * follows the path, r_size ends with it */
+	path = trfs_path_get(file->f_path.dentry, &pbuf, &path_len);
+	size = offsetof(trfs_write_op, pathname)+path_len+count;
 
 	op = (trfs_write_op *)kmalloc(size, GFP_KERNEL);
 	if (op) {
+		memset(op, 0, offsetof(trfs_write_op, pathname));
 		op->r_id = get_next_record_id();
+		op->ts = ktime_get_real_ns();
 		op->r_type = TRFS_OP_WRITE;
 		op->r_size = size;
 		op->pid = (int) task_pid_nr(current);
@@ -310,11 +842,20 @@ static void trfs_log_write_op(struct trfs_log_driver *this,
 		op->count = count;
 		op->ppos = *ppos;
 		op->ret = ret;
+		op->wflags = wflags;
 		memcpy((char *)&op->addr, (char *)&file, sizeof(struct file *));
-		memcpy(op->pathname, file->f_path.dentry->d_name.name, path_len);
-		memcpy(op->pathname+path_len, buf, count);
+		memcpy(op->pathname, path, path_len);
+		/* A buffer that faults leaves no payload, the write failed */
+		if (copy_from_user(op->pathname+path_len,
+					(const char __user *)buf, count)) {
+			op->count = 0;
+			op->wflags |= TRFS_WR_CUT;
+			size -= count;
+			op->r_size = size;
+		}
 	}
-	TRFS_WRITE(op, size)
+	TRFS_WRITE(op, size);
+	trfs_path_put(pbuf);
 }
 
 /* Tracing close operation
@@ -326,27 +867,17 @@ static void trfs_log_write_op(struct trfs_log_driver *this,
 static void trfs_log_close_op(struct trfs_log_driver *this, 
 				struct inode *dir, struct file *file, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_close_op *op = NULL;
-
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_CLOSE)
+	trfs_event *ev = NULL;
 
-	path_len = file->f_path.dentry->d_name.len;
-	size = sizeof(trfs_close_op)+path_len;
+	IS_TRACE_ENABLED(this, TRFS_OP_CLOSE, file->f_path.dentry, ret)
 
-	op = (trfs_close_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_CLOSE;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->ret = ret;
-		memcpy((char *)&op->addr, (char *)&file, sizeof(struct file *));
-		memcpy(op->pathname, file->f_path.dentry->d_name.name, op->len);
+	/* Called from release, only the dentry outlives the file */
+	ev = trfs_event_get(TRFS_OP_CLOSE, ret);
+	if (ev) {
+		ev->addr = (uint64_t)(unsigned long)file;
+		trfs_ev_path_ref(ev, file->f_path.dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(op, size);
 }
 
 /* Tracing mknod operation
@@ -358,26 +889,28 @@ static void trfs_log_close_op(struct trfs_log_driver *this,
 static void trfs_log_mknod_op(struct trfs_log_driver *this, struct inode *dir, 
 		struct dentry *dentry, mode_t mode, dev_t dev, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_mknod_op *op = NULL;
+	trfs_event *ev = NULL;
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_CLOSE)
+	IS_TRACE_ENABLED(this, TRFS_OP_MKNOD, dentry, ret)
 
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_mknod_op)+path_len;
+	ev = trfs_event_get(TRFS_OP_MKNOD, ret);
+	if (ev) {
+		trfs_ev_path_ref(ev, dentry);
+		trfs_log_event(ev);
+	}
+}
 
-	op = (trfs_mknod_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_CLOSE;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->ret = ret;
-		memcpy(op->pathname, dentry->d_name.name, op->len);
+/** The four xattr ops have the same record, of their dentry
+ */
+static void trfs_log_xattr_op(int r_type, struct dentry *dentry, int ret)
+{
+	trfs_event *ev = NULL;
+
+	ev = trfs_event_get(r_type, ret);
+	if (ev) {
+		trfs_ev_path_ref(ev, dentry);
+		trfs_log_event(ev);
 	}
-	TRFS_WRITE(op, size);
 }
 
 /* Tracing setxattr operation
@@ -389,26 +922,9 @@ static void trfs_log_setxattr_op(struct trfs_log_driver *this,
 		struct dentry *dentry, const char *name, const void *value,
 					size_t size1, int flags, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_setxattr_op *op = NULL;
-
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_SETXATTR)
+	IS_TRACE_ENABLED(this, TRFS_OP_SETXATTR, dentry, ret)
 
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_setxattr_op)+path_len;
-
-	op = (trfs_setxattr_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_SETXATTR;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->ret = ret;
-		memcpy(op->pathname, dentry->d_name.name, op->len);
-	}
-	TRFS_WRITE(op, size);
+	trfs_log_xattr_op(TRFS_OP_SETXATTR, dentry, ret);
 }
 
 /* Tracing getxattr operation
@@ -420,26 +936,9 @@ static void trfs_log_getxattr_op(struct trfs_log_driver *this,
 		struct dentry *dentry, const char *name, void *buffer,
 							size_t size1, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_getxattr_op *op = NULL;
+	IS_TRACE_ENABLED(this, TRFS_OP_GETXATTR, dentry, ret)
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_GETXATTR)
-
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_getxattr_op)+path_len;
-
-	op = (trfs_getxattr_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_GETXATTR;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->ret = ret;
-		memcpy(op->pathname, dentry->d_name.name, op->len);
-	}
-	TRFS_WRITE(op, size);
+	trfs_log_xattr_op(TRFS_OP_GETXATTR, dentry, ret);
 }
 
 /* Tracing listxattr operation
@@ -451,26 +950,9 @@ static void trfs_log_listxattr_op(struct trfs_log_driver *this,
 			struct dentry *dentry,
  				char *buffer, size_t buffer_size, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_listxattr_op *op = NULL;
+	IS_TRACE_ENABLED(this, TRFS_OP_LISTXATTR, dentry, ret)
 
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_LISTXATTR)
-
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_listxattr_op)+path_len;
-
-	op = (trfs_listxattr_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_LISTXATTR;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->ret = ret;
-		memcpy(op->pathname, dentry->d_name.name, op->len);
-	}
-	TRFS_WRITE(op, size);
+	trfs_log_xattr_op(TRFS_OP_LISTXATTR, dentry, ret);
 }
 
 /* Tracing removexattr operation
@@ -481,26 +963,9 @@ static void trfs_log_listxattr_op(struct trfs_log_driver *this,
 static void trfs_log_removexattr_op(struct trfs_log_driver *this,
 			struct dentry *dentry, const char *name, int ret)
 {
-	int size = 0;
-	int path_len = 0;
-	trfs_removexattr_op *op = NULL;
-
-	IS_TRACE_ENABLED(this->bitmap, TRFS_OP_REMOVEXATTR)
+	IS_TRACE_ENABLED(this, TRFS_OP_REMOVEXATTR, dentry, ret)
 
-	path_len = dentry->d_name.len;
-	size = sizeof(trfs_removexattr_op)+path_len;
-
-	op = (trfs_removexattr_op *)kmalloc(size, GFP_KERNEL);
-	if (op) {
-		op->r_id = get_next_record_id();
-		op->r_type = TRFS_OP_REMOVEXATTR;
-		op->r_size = size;
-		op->pid = (int) task_pid_nr(current);
-		op->len = path_len;
-		op->ret = ret;
-		memcpy(op->pathname, dentry->d_name.name, op->len);
-	}
-	TRFS_WRITE(op, size);
+	trfs_log_xattr_op(TRFS_OP_REMOVEXATTR, dentry, ret);
 }
 
 /** Structure for file trace operations
@@ -529,19 +994,95 @@ struct trfs_log_driver *trfs_log_driver_init(void)
 {
 	struct trfs_log_driver *tld = NULL;
 
-	tld = (struct trfs_log_driver *)kmalloc(
+	trfs_event_cachep = kmem_cache_create("trfs_event",
+				sizeof(trfs_event), 0, 0, NULL);
+	if (!trfs_event_cachep)
+		return NULL;
+	tld = (struct trfs_log_driver *)kzalloc(
 				sizeof(struct trfs_log_driver), GFP_KERNEL);
 	if (tld) {
 		tld->ops = &log_ops;
 		tld->bitmap = ~(tld->bitmap&0);
+		tld->level = TRFS_LEVEL_FULL;
+	}
+	else {
+		kmem_cache_destroy(trfs_event_cachep);
+		trfs_event_cachep = NULL;
 	}
 	return tld;
 }
 
+int trfs_trigger_set(struct trfs_log_driver *this, int level,
+		unsigned int sample, const trfs_trigger *trig)
+{
+	int nr_comp = 0;
+	int len = 0, off = 0;
+	const char *p = trig->prefix;
+	trfs_trigger t;
+
+	if (level < TRFS_LEVEL_FULL || level > TRFS_LEVEL_COUNT ||
+	    (level == TRFS_LEVEL_SAMPLE && sample == 0))
+		return -EINVAL;
+
+	memcpy(&t, trig, sizeof(trfs_trigger));
+	t.prefix[TRFS_TRIG_PREFIX_LEN-1] = '\0';
+	for (off = 0; p[off]; off += len) {
+		while (p[off] == '/')
+			off++;
+		for (len = 0; p[off+len] && p[off+len] != '/'; len++)
+			;
+		if (len == 0)
+			break;
+		if (nr_comp == TRFS_TRIG_MAX_COMP)
+			return -EINVAL;
+		t.comp_off[nr_comp] = off;
+		t.comp_len[nr_comp++] = len;
+	}
+
+	/* The hooks read the trigger without a lock: the prefix is hidden
+	 * while it changes and shown again once it is complete */
+	WRITE_ONCE(this->trig.nr_comp, 0);
+	smp_wmb();
+	memcpy(this->trig.comp_off, t.comp_off, sizeof(t.comp_off));
+	memcpy(this->trig.comp_len, t.comp_len, sizeof(t.comp_len));
+	memcpy(this->trig.prefix, t.prefix, sizeof(t.prefix));
+	WRITE_ONCE(this->trig.err, t.err);
+	WRITE_ONCE(this->trig.lat_ns, t.lat_ns);
+	WRITE_ONCE(this->trig.window, t.window);
+	WRITE_ONCE(this->sample, sample);
+	WRITE_ONCE(this->level, level);
+	smp_wmb();
+	WRITE_ONCE(this->trig.nr_comp, nr_comp);
+	return 0;
+}
+
+int trfs_op_pri(int r_type)
+{
+	switch (r_type) {
+		case TRFS_OP_READ:
+		case TRFS_OP_WRITE:
+		case TRFS_OP_GETXATTR:
+		case TRFS_OP_LISTXATTR:
+			return TRFS_MQ_PRI_DATA;
+		case TRFS_OP_OPEN:
+		case TRFS_OP_CLOSE:
+		case TRFS_OP_TRUNCATE:
+		case TRFS_OP_SETXATTR:
+		case TRFS_OP_REMOVEXATTR:
+			return TRFS_MQ_PRI_FILE;
+	}
+	/* Namespace changes, and the end marker that stops the writer */
+	return TRFS_MQ_PRI_NS;
+}
+
 /** Uninitializes the output ops structure
  */
 void trfs_log_driver_exit(struct trfs_log_driver *tld) 
 {
 	if (tld)
 		kfree(tld);	
+	/* Nothing is queued any more */
+	if (trfs_event_cachep)
+		kmem_cache_destroy(trfs_event_cachep);
+	trfs_event_cachep = NULL;
 }
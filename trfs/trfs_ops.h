@@ -14,6 +14,7 @@
 #define _TRFS_OPS_H_
 
 #include <linux/sched.h>
+#include <linux/ktime.h>
 
 #include "structs.h"
 
@@ -55,6 +56,99 @@ typedef enum trfs_arg_id_ {
 	TRFS_UID	= 1
 }trfs_arg_id;
 
+/** Tracing levels, a trigger switches to full tracing for its window
+ */
+typedef enum trfs_level_ {
+	TRFS_LEVEL_FULL		= 0,	/* a record for every op */
+	TRFS_LEVEL_SAMPLE	= 1,	/* a record for one op in sample */
+	TRFS_LEVEL_COUNT	= 2	/* op and error counters only */
+}trfs_level;
+
+#define TRFS_TRIG_MAX_COMP	16	/* components of the trigger prefix */
+#define TRFS_TRIG_PREFIX_LEN	256
+
+/** Conditions that escalate to full tracing. The prefix is kept split
+ * into path components so that it can be matched against the dentry
+ * names without building the path.
+ */
+typedef struct trfs_trigger_ {
+	int err;			/* an op failing with -err, 0 for none */
+	uint64_t lat_ns;		/* an op slower than this, 0 for none */
+	unsigned int window;		/* seconds of full tracing */
+	int nr_comp;			/* components of the prefix, 0 for none */
+	unsigned short comp_off[TRFS_TRIG_MAX_COMP];
+	unsigned short comp_len[TRFS_TRIG_MAX_COMP];
+	char prefix[TRFS_TRIG_PREFIX_LEN];
+}trfs_trigger;
+
+/* Longest name an event keeps a copy of, see trfs_ev_path */
+#define TRFS_EV_NAME_LEN	64
+
+/* Largest record built from an event: two paths */
+#define TRFS_EV_REC_MAX		(sizeof(trfs_rename_op)+2*PATH_MAX)
+
+/* Largest write payload a record keeps, so that with its path the record
+ * stays within r_size. Longer writes keep their first bytes and are
+ * marked TRFS_WR_CUT. */
+#define TRFS_WR_DATA_MAX	(56 << 10)
+
+/* Pages of the lower page cache such a payload spans */
+#define TRFS_EV_PAGES	((TRFS_WR_DATA_MAX+PAGE_SIZE-1)/PAGE_SIZE+1)
+
+/* Payloads up to this many bytes are copied by the hook, for less than
+ * the page cache lookup costs */
+#define TRFS_WR_INLINE		256
+
+/* Slots of trfs_wr_gens, files hash to them by their page cache */
+#define TRFS_WR_GEN_BITS	8
+
+/** Writes to the lower files of one slot: begun and done. A payload left
+ * in the page cache is exact as long as no write began on its file since
+ * the write it is of, files that share the slot only make it look less
+ * so.
+ */
+typedef struct trfs_wr_gen_ {
+	atomic_t begun;
+	atomic_t done;
+}trfs_wr_gen;
+
+/** A path of an event: a reference to the parent of the dentry and a
+ * copy of its name, or for the root a reference to the dentry, whose
+ * path is taken by the writer. A rename of one of the directories on the
+ * way takes it before the writer, see trfs_event_pin().
+ */
+typedef struct trfs_ev_path_ {
+	struct dentry *dentry;
+	unsigned short len;		/* of name, 0 for the path of dentry */
+	char name[TRFS_EV_NAME_LEN];
+	char *path;			/* whole path when taken early */
+}trfs_ev_path;
+
+/** What a hook captures of an op, the writer turns it into the record.
+ * It starts like the records, with an r_size of 0 that no record has.
+ */
+typedef struct trfs_event_ {
+	unsigned int r_id;
+	unsigned short r_size;
+	uint8_t r_type;
+	uint64_t ts;
+	unsigned int pid;
+	int ret;
+	int flags;
+	int mode;
+	uint64_t addr;
+	size_t count;
+	loff_t ppos;
+	int nr_paths;
+	trfs_ev_path path[2];
+	int nr_pages;			/* holding the payload of a write */
+	unsigned int pg_off;		/* of the payload in the first one */
+	unsigned short wflags;		/* of the write record */
+	trfs_wr_gen *wr_gen;		/* of the file the pages are of */
+	unsigned int wr_begun;		/* writes begun on it before ours */
+	struct page *pages[TRFS_EV_PAGES];
+}trfs_event;
+
 struct trfs_log_driver;
 
 struct trfs_log_ops {
@@ -99,10 +193,102 @@ struct trfs_log_driver {
 	int pid;
 	unsigned int bitmap;
 	struct trfs_log_ops *ops;
+	int level;			/* trfs_level */
+	unsigned int sample;		/* one op in sample is traced */
+	unsigned long full_until;	/* jiffies, full tracing till then */
+	trfs_trigger trig;
+	atomic_t sample_ctr;
+	atomic64_t nr_ops[TRFS_MAX_OPS];
+	atomic64_t nr_err[TRFS_MAX_OPS];
+	atomic64_t nr_traced;
+	atomic64_t nr_fired;
 };
 
 struct trfs_log_driver* trfs_log_driver_init(void);
 
+/** Sets the level and the triggers, the prefix is split here so that
+ * the hooks only compare names.
+ */
+int trfs_trigger_set(struct trfs_log_driver *this, int level,
+		unsigned int sample, const trfs_trigger *trig);
+
+/** Switches to full tracing for the window of the trigger.
+ */
+void trfs_trigger_fire(struct trfs_log_driver *this);
+
+/** The time an op begins at for the latency trigger, read only when the
+ * trigger is set and can change the level: 0 otherwise.
+ */
+static inline uint64_t trfs_trigger_start(struct trfs_log_driver *this)
+{
+	if (this->level == TRFS_LEVEL_FULL || !READ_ONCE(this->trig.lat_ns))
+		return 0;
+	return ktime_get_ns();
+}
+
+/** Fires the latency trigger if the op that began at start (from
+ * trfs_trigger_start) took too long. Called by the VFS ops right before
+ * their trace hook.
+ */
+static inline void trfs_trigger_latency(struct trfs_log_driver *this,
+							uint64_t start)
+{
+	uint64_t lat_ns;
+
+	if (!start)
+		return;
+	lat_ns = READ_ONCE(this->trig.lat_ns);
+	if (this->level != TRFS_LEVEL_FULL && lat_ns &&
+	    ktime_get_ns()-start > lat_ns)
+		trfs_trigger_fire(this);
+}
+
 void trfs_log_driver_exit(struct trfs_log_driver*);
 
+/** Queue priority class of a record of type r_type, see TRFS_MQ_PRI_*
+ */
+int trfs_op_pri(int r_type);
+
+/** Tells an event from a record or the end marker.
+ */
+static inline bool trfs_is_event(const char *rec, int len)
+{
+	return len == sizeof(trfs_event) && rec &&
+			((const trfs_event *)rec)->r_size == 0;
+}
+
+/** Builds the record of ev in rec, of TRFS_EV_REC_MAX bytes and the
+ * payload of a write, taking the paths in scratch, of PATH_MAX bytes.
+ * Returns the size of the record. Without data the payload is left in
+ * the pages of ev: it is counted in the size, not copied to rec.
+ */
+int trfs_event_build(trfs_event *ev, char *rec, char *scratch, bool data);
+
+/** Takes the paths of ev that go through the directory dir, before a
+ * rename moves it, in scratch of PATH_MAX bytes. Returns whether it took
+ * one. Caller holds the lock the writer builds ev under.
+ */
+bool trfs_event_pin(trfs_event *ev, struct dentry *dir, char *scratch);
+
+/** Drops the references of ev and frees it.
+ */
+void trfs_event_put(trfs_event *ev);
+
+/** Frees what was queued: a record or an event.
+ */
+void trfs_rec_free(char *rec, int len);
+
+/** Count a write to the page cache of lower_file, called around it.
+ */
+void trfs_wr_begin(struct file *lower_file);
+void trfs_wr_end(struct file *lower_file);
+
+/** Tells whether a write began on the file of a payload since begun was
+ * read: what its pages hold now may not be what the write put there.
+ */
+static inline bool trfs_wr_stale(trfs_wr_gen *gen, unsigned int begun)
+{
+	return gen && (unsigned int)atomic_read(&gen->begun) != begun;
+}
+
 #endif	/* End of _TRFS_OPS_H_ */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+
+#include "trfs.h"
+#include "tr_fs.h"
+#include "trfs_msgq.h"
+#include "trfs_stat.h"
+
+trfs_stat __percpu *trfs_stats = NULL;
+
+bool trfs_stat_hook_ns = false;
+module_param_named(hook_ns, trfs_stat_hook_ns, bool, 0644);
+MODULE_PARM_DESC(hook_ns, "Time the write hook and the lower writes");
+
+static struct dentry *trfs_stat_dir = NULL;
+
+static const char *trfs_stat_names[TRFS_ST_NR] = {
+	[TRFS_ST_EVENTS_IN]	=	"events in",
+	[TRFS_ST_RECS_IN]	=	"records in",
+	[TRFS_ST_BYTES_IN]	=	"bytes in",
+	[TRFS_ST_DATA_IN]	=	"payload in",
+	[TRFS_ST_ENQ_FULL]	=	"queue full",
+	[TRFS_ST_ENQ_ERR]	=	"queue errors",
+	[TRFS_ST_RING_RECS]	=	"ring records",
+	[TRFS_ST_RING_BYTES]	=	"ring bytes",
+	[TRFS_ST_BATCHES]	=	"batches",
+	[TRFS_ST_EVENTS_OUT]	=	"events built",
+	[TRFS_ST_RECS_OUT]	=	"records out",
+	[TRFS_ST_BYTES_OUT]	=	"bytes out",
+	[TRFS_ST_DATA_OUT]	=	"payload out",
+	[TRFS_ST_FLUSHES]	=	"tfile writes",
+	[TRFS_ST_FLUSH_BYTES]	=	"tfile bytes",
+	[TRFS_ST_FLUSH_ERR]	=	"tfile errors",
+	[TRFS_ST_LOWER_WRITES]	=	"lower writes",
+	[TRFS_ST_LOWER_BYTES]	=	"lower bytes",
+	[TRFS_ST_DATA_INEXACT]	=	"payload inexact",
+	[TRFS_ST_SEG_LOST]	=	"no segment",
+	[TRFS_ST_EV_PINNED]	=	"events pinned",
+};
+
+static const char *trfs_hist_names[TRFS_HI_NR] = {
+	[TRFS_HI_WRITE_HOOK]	=	"write hook ns",
+	[TRFS_HI_QUEUE_WAIT]	=	"queue wait ns",
+	[TRFS_HI_BATCH]		=	"batch records",
+	[TRFS_HI_BATCH_NS]	=	"batch ns",
+	[TRFS_HI_FLUSH]		=	"tfile write ns",
+	[TRFS_HI_LOWER_WRITE]	=	"lower write ns",
+};
+
+/** Sums the counters of all the CPUs in sum
+ */
+static void trfs_stat_sum(trfs_stat *sum)
+{
+	int cpu, i, b;
+	trfs_stat *st = NULL;
+
+	memset(sum, 0, sizeof(trfs_stat));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(trfs_stats, cpu);
+		for (i = 0; i < TRFS_ST_NR; i++)
+			sum->ctr[i] += st->ctr[i];
+		for (i = 0; i < TRFS_HI_NR; i++)
+			for (b = 0; b < TRFS_HIST_BUCKETS; b++)
+				sum->hist[i][b] += st->hist[i][b];
+	}
+}
+
+/** Prints the buckets of a histogram that have counts, by the largest
+ * value each one takes
+ */
+static void trfs_stat_show_hist(struct seq_file *m, const char *name,
+							const u64 *hist)
+{
+	int b;
+	u64 n = 0;
+
+	for (b = 0; b < TRFS_HIST_BUCKETS; b++)
+		n += hist[b];
+	seq_printf(m, "%s, %llu\n", name, (unsigned long long)n);
+	for (b = 0; b < TRFS_HIST_BUCKETS; b++) {
+		if (hist[b] == 0)
+			continue;
+		if (b == TRFS_HIST_BUCKETS-1)
+			seq_printf(m, "  %16s", "more");
+		else
+			seq_printf(m, "  <= %13llu",
+					(unsigned long long)(1ULL << b)-1);
+		seq_printf(m, " %14llu\n", (unsigned long long)hist[b]);
+	}
+}
+
+int trfs_stat_show(struct seq_file *m, void *v)
+{
+	int i;
+	trfsMqAttr_t attr;
+	trfs_stat *sum = NULL;
+
+	if (!trfs_stats)
+		return 0;
+	sum = kmalloc(sizeof(trfs_stat), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	trfs_stat_sum(sum);
+
+	for (i = 0; i < TRFS_ST_NR; i++)
+		seq_printf(m, "%-16s %14llu\n", trfs_stat_names[i],
+					(unsigned long long)sum->ctr[i]);
+	memset(&attr, 0, sizeof(trfsMqAttr_t));
+	if (trfs_log_qid)
+		trfsMqGetAttr(TRFS_LOG_QID, &attr);
+	seq_printf(m, "%-16s %14d\n", "queue depth", attr.maxMsgs);
+	seq_printf(m, "%-16s %14d\n", "queued", attr.counter);
+	seq_printf(m, "%-16s %14d\n", "queue hwm",
+					trfs_mq_hwm(TRFS_LOG_QID));
+	for (i = 0; i < TRFS_HI_NR; i++)
+		trfs_stat_show_hist(m, trfs_hist_names[i], sum->hist[i]);
+
+	kfree(sum);
+	return 0;
+}
+
+static int trfs_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, trfs_stat_show, NULL);
+}
+
+static const struct file_operations trfs_stat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= trfs_stat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/** Counting goes on without debugfs, only the file is missing then
+ */
+int trfs_stat_init(void)
+{
+	if (trfs_stats)
+		return 0;
+	trfs_stats = alloc_percpu(trfs_stat);
+	if (!trfs_stats)
+		return -ENOMEM;
+
+	trfs_stat_dir = debugfs_create_dir("trfs", NULL);
+	if (IS_ERR_OR_NULL(trfs_stat_dir)) {
+		trfs_stat_dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("pipeline", 0444, trfs_stat_dir, NULL,
+							&trfs_stat_fops);
+	return 0;
+}
+
+void trfs_stat_exit(void)
+{
+	debugfs_remove_recursive(trfs_stat_dir);
+	trfs_stat_dir = NULL;
+	free_percpu(trfs_stats);
+	trfs_stats = NULL;
+}
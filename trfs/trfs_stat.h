@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016	   Mallesham Dasari
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _TRFS_STAT_H_
+#define _TRFS_STAT_H_
+
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/seq_file.h>
+
+/** Counters of the stages of the record pipeline, from the hooks through
+ * the queue and the writer to the tfile
+ */
+typedef enum trfs_stat_ctr_id_ {
+	TRFS_ST_EVENTS_IN	= 0,	/* events queued by the hooks */
+	TRFS_ST_RECS_IN		= 1,	/* records built and queued by them */
+	TRFS_ST_BYTES_IN	= 2,	/* bytes of both */
+	TRFS_ST_DATA_IN		= 3,	/* payload left in the page cache */
+	TRFS_ST_ENQ_FULL	= 4,	/* refused by a full queue */
+	TRFS_ST_ENQ_ERR		= 5,	/* failed to queue otherwise */
+	TRFS_ST_RING_RECS	= 6,	/* put in the flight recorder */
+	TRFS_ST_RING_BYTES	= 7,
+	TRFS_ST_BATCHES		= 8,	/* taken from the queue by the writer */
+	TRFS_ST_EVENTS_OUT	= 9,	/* events it built records of */
+	TRFS_ST_RECS_OUT	= 10,	/* records appended to the tfile */
+	TRFS_ST_BYTES_OUT	= 11,
+	TRFS_ST_DATA_OUT	= 12,	/* payload written from the page cache */
+	TRFS_ST_FLUSHES		= 13,	/* writes to the tfile */
+	TRFS_ST_FLUSH_BYTES	= 14,
+	TRFS_ST_FLUSH_ERR	= 15,
+	TRFS_ST_LOWER_WRITES	= 16,	/* writes to the lower file system */
+	TRFS_ST_LOWER_BYTES	= 17,
+	TRFS_ST_DATA_INEXACT	= 18,	/* of it, after a later write began */
+	TRFS_ST_SEG_LOST	= 19,	/* records with no segment to go to */
+	TRFS_ST_EV_PINNED	= 20,	/* events whose path a rename took */
+	TRFS_ST_NR		= 21
+}trfs_stat_ctr_id;
+
+/** Histograms of the pipeline, in ns unless said otherwise
+ */
+typedef enum trfs_stat_hist_id_ {
+	TRFS_HI_WRITE_HOOK	= 0,	/* the trace hook of a write */
+	TRFS_HI_QUEUE_WAIT	= 1,	/* from the op to the writer */
+	TRFS_HI_BATCH		= 2,	/* records per batch */
+	TRFS_HI_BATCH_NS	= 3,	/* writing out a batch */
+	TRFS_HI_FLUSH		= 4,	/* a write to the tfile */
+	TRFS_HI_LOWER_WRITE	= 5,	/* the vfs_write of the lower file */
+	TRFS_HI_NR		= 6
+}trfs_stat_hist_id;
+
+/* Bucket b counts the values of b bits, up to 2^b-1. The last one takes
+ * the larger values too. */
+#define TRFS_HIST_BUCKETS	40
+
+typedef struct trfs_stat_ {
+	u64 ctr[TRFS_ST_NR];
+	u64 hist[TRFS_HI_NR][TRFS_HIST_BUCKETS];
+}trfs_stat;
+
+/* Per CPU, from the module load to its unload */
+extern trfs_stat __percpu *trfs_stats;
+
+/* The hooks read the clock for their histograms only when this is set,
+ * by the hook_ns module parameter */
+extern bool trfs_stat_hook_ns;
+
+static inline bool trfs_stat_timed(void)
+{
+	return trfs_stats && READ_ONCE(trfs_stat_hook_ns);
+}
+
+static inline void trfs_stat_add(int ctr, u64 n)
+{
+	if (trfs_stats)
+		this_cpu_add(trfs_stats->ctr[ctr], n);
+}
+
+static inline void trfs_stat_hist(int hist, u64 v)
+{
+	int b = fls64(v);
+
+	if (b >= TRFS_HIST_BUCKETS)
+		b = TRFS_HIST_BUCKETS-1;
+	if (trfs_stats)
+		this_cpu_inc(trfs_stats->hist[hist][b]);
+}
+
+/** Allocates the counters and shows them in debugfs, as trfs/pipeline.
+ */
+int trfs_stat_init(void);
+
+void trfs_stat_exit(void);
+
+/** Prints the counters summed over the CPUs, the queue and the histograms
+ */
+int trfs_stat_show(struct seq_file *m, void *v);
+
+#endif	/* End of _TRFS_STAT_H_ */